@@ -0,0 +1,77 @@
+#include "admin.h"
+
+#include <string>
+
+#include "metrics.h"
+#include "spdlog/fmt/fmt.h"
+
+namespace tl {
+
+// longest request kept waiting for its end.
+static const std::size_t kMaxRequest = 8192;
+
+static void reply(buffer& out, const std::string& body) {
+  out.push(body.data(), body.size());
+}
+
+static void replyHttp(buffer& out, int status, const std::string& body) {
+  std::string head = fmt::format(
+      "HTTP/1.1 {} {}\r\n"
+      "Content-Type: text/plain; version=0.0.4\r\n"
+      "Content-Length: {}\r\n\r\n",
+      status, status == 200 ? "OK" : "Not Found", body.size());
+  reply(out, head);
+  reply(out, body);
+}
+
+int AdminProtocol::onRead(Handler*, buffer& in, buffer& out) {
+  for (;;) {
+    std::size_t len = in.size() < kMaxRequest ? in.size() : kMaxRequest;
+    std::string req = BufferView(&in, 0, len).toString();
+    std::size_t eol = req.find('\n');
+    if (eol == std::string::npos) {
+      return in.size() < kMaxRequest ? 0 : -1;
+    }
+
+    if (req.compare(0, 4, "GET ") == 0) {
+      // wait for the end of the headers.
+      std::size_t end = req.find("\r\n\r\n");
+      std::size_t end_len = 4;
+      if (end == std::string::npos) {
+        end = req.find("\n\n");
+        end_len = 2;
+      }
+      if (end == std::string::npos) {
+        return in.size() < kMaxRequest ? 0 : -1;
+      }
+      std::size_t sp = req.find(' ', 4);
+      std::string path = req.substr(4, (sp < eol ? sp : eol) - 4);
+      if (path == "/metrics") {
+        replyHttp(out, 200, formatPrometheus(disps_));
+      } else if (path == "/stalls") {
+        replyHttp(out, 200, formatStalls(disps_));
+      } else if (path == "/" || path == "/stats") {
+        replyHttp(out, 200, formatText(disps_));
+      } else {
+        replyHttp(out, 404, "not found\n");
+      }
+      in.drain(end + end_len);
+      continue;
+    }
+
+    std::string line = req.substr(0, eol);
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (line == "metrics") {
+      reply(out, formatPrometheus(disps_));
+    } else if (line == "stalls") {
+      reply(out, formatStalls(disps_));
+    } else if (!line.empty()) {
+      reply(out, formatText(disps_));
+    }
+    in.drain(eol + 1);
+  }
+}
+
+}  // namespace tl
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <vector>
+
+#include "buffer.h"
+#include "dispatcher.h"
+#include "protocol.h"
+
+namespace tl {
+
+// Metrics of "disps" for connections of a dispatcher of its own, so a scrape
+// never runs on an I/O loop. The counters are read while the loops update
+// them, without stopping them.
+//
+// HTTP "GET /metrics" gets the Prometheus text format, "GET /stalls" the
+// recent loop stalls, "GET /" the plain text dump. Without HTTP, a "metrics"
+// or "stalls" line gets the same and any other line the plain text dump.
+class AdminProtocol : public Protocol {
+ public:
+  explicit AdminProtocol(std::vector<Dispatcher*> disps)
+      : disps_(std::move(disps)) {}
+
+  int onRead(Handler* h, buffer& in, buffer& out) override;
+
+ private:
+  std::vector<Dispatcher*> disps_;
+};
+
+}  // namespace tl
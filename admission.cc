@@ -0,0 +1,68 @@
+#include "admission.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "connection_table.h"
+#include "log.h"
+#include "spdlog/spdlog.h"
+
+namespace tl {
+
+bool AdmissionControl::admit(Dispatcher* disp, bool paused) const {
+  double share = paused ? limits_.resume : 1.0;
+  auto under = [share](uint64_t used, std::size_t limit) {
+    return limit == 0 || used < limit * share;
+  };
+  const DispatcherMetrics& m = disp->metrics();
+  if (!under(m.connections.value(), limits_.conns) ||
+      !under(m.buffered_bytes.value(), limits_.buffered)) {
+    return false;
+  }
+  if (limits_.total_conns == 0 && limits_.total_buffered == 0) {
+    return true;
+  }
+  uint64_t conns = 0;
+  uint64_t buffered = 0;
+  for (Dispatcher* d : disps_) {
+    conns += d->metrics().connections.value();
+    buffered += d->metrics().buffered_bytes.value();
+  }
+  return under(conns, limits_.total_conns) &&
+         under(buffered, limits_.total_buffered);
+}
+
+std::size_t AdmissionControl::shed(Dispatcher* disp) {
+  if (limits_.shed_idle_ms == 0) {
+    return 0;
+  }
+  int64_t idle_since = disp->loopTimeUs() - limits_.shed_idle_ms * 1000LL;
+  ConnectionTable* conns = disp->connections();
+  std::vector<std::pair<int64_t, ConnId> > idle;
+  conns->forEach([&](Handler* h) {
+    // not one with output pending or a request in progress.
+    if (h->activeUs() <= idle_since && h->idle()) {
+      idle.emplace_back(h->activeUs(), conns->id(h));
+    }
+  });
+  std::sort(idle.begin(), idle.end());
+
+  std::size_t n = 0;
+  for (const auto& e : idle) {
+    if (admit(disp, true)) {
+      break;
+    }
+    if (Handler* h = conns->get(e.second)) {
+      h->close();
+      n++;
+    }
+  }
+  if (n) {
+    disp->metrics().shed.add(n);
+    TL_WARN_RL(0, "over the admission limits, closed {} idle connections",
+               n);
+  }
+  return n;
+}
+
+}  // namespace tl
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "dispatcher.h"
+
+namespace tl {
+
+// Limits on the connections of the I/O dispatchers and the bytes they
+// buffer, per dispatcher and over all of them, checked by each Listener
+// before it accepts. A listener at a limit stops accepting, new clients wait
+// in the kernel backlog, and starts again only once usage is back under
+// "resume" of every limit, so it does not flap at the edge. While stopped,
+// it can close the connections idle longest to make room.
+//
+// Only connections of the ConnectionTables count, not proxied ones.
+class AdmissionControl {
+ public:
+  struct Limits {
+    // 0 for no limit.
+    std::size_t conns = 0;
+    std::size_t buffered = 0;
+    std::size_t total_conns = 0;
+    std::size_t total_buffered = 0;
+    // accept again under this share of each limit.
+    double resume = 0.9;
+    // while stopped, close connections idle longer than this, 0 never.
+    uint32_t shed_idle_ms = 0;
+  };
+
+  AdmissionControl(std::vector<Dispatcher*> disps, const Limits& limits)
+      : disps_(std::move(disps)), limits_(limits) {}
+
+  const Limits& limits() const { return limits_; }
+
+  // Whether "disp" is under the limits, or under the resume levels when
+  // "paused". From any dispatcher's loop.
+  bool admit(Dispatcher* disp, bool paused) const;
+  // Close idle connections of "disp" (see Handler::idle()), oldest first,
+  // until admit(disp, true). Inside its loop. Return how many.
+  std::size_t shed(Dispatcher* disp);
+
+ private:
+  std::vector<Dispatcher*> disps_;
+  Limits limits_;
+};
+
+}  // namespace tl
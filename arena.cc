@@ -0,0 +1,172 @@
+#include "arena.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <new>
+
+#include "spdlog/spdlog.h"
+
+namespace tl {
+
+Arena::Arena(const Options& opts) : opts_(opts) {
+  size_ = (opts.budget + kSpanSize - 1) / kSpanSize * kSpanSize;
+  if (size_ == 0) {
+    return;
+  }
+  void* p = MAP_FAILED;
+  if (opts.hugetlb) {
+    p = mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+      backing_ = kHugeTlb;
+    } else {
+      SPDLOG_DEBUG("MAP_HUGETLB of {} bytes errno={} {}, using THP", size_,
+                   errno, strerror(errno));
+    }
+  }
+  if (p == MAP_FAILED) {
+    // over-map to align the region to a huge page, then trim.
+    std::size_t len = size_ + kSpanSize;
+    char* raw = (char*)mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+      SPDLOG_ERROR("arena mmap of {} bytes errno={} {}", len, errno,
+                   strerror(errno));
+      size_ = 0;
+      return;
+    }
+    char* aligned =
+        (char*)(((uintptr_t)raw + kSpanSize - 1) & ~(uintptr_t)(kSpanSize - 1));
+    if (aligned > raw) {
+      munmap(raw, aligned - raw);
+    }
+    if (raw + len > aligned + size_) {
+      munmap(aligned + size_, raw + len - (aligned + size_));
+    }
+    p = aligned;
+    backing_ = madvise(p, size_, MADV_HUGEPAGE) == 0 ? kTransparentHuge
+                                                      : kPages;
+  }
+  base_ = (char*)p;
+  spans_.resize(size_ / kSpanSize);
+  partial_.resize(sizeClass(kSpanSize) + 1);
+  SPDLOG_INFO("arena of {} MB on {}", size_ >> 20, backingName(backing_));
+}
+
+Arena::~Arena() {
+  if (base_) {
+    munmap(base_, size_);
+  }
+}
+
+const char* Arena::backingName(Backing b) {
+  switch (b) {
+    case kHugeTlb:
+      return "hugetlb";
+    case kTransparentHuge:
+      return "thp";
+    case kPages:
+      return "pages";
+    case kNone:
+      break;
+  }
+  return "none";
+}
+
+int Arena::sizeClass(std::size_t len) {
+  if (len <= kMinBlock) {
+    return 0;
+  }
+  return 64 - __builtin_clzll(len - 1) - __builtin_ctzll(kMinBlock);
+}
+
+std::size_t Arena::resident() const {
+  std::size_t spans = next_span_ - retained_.size() - released_.size();
+  return (spans + retained_.size()) * kSpanSize;
+}
+
+void* Arena::allocate(std::size_t len) {
+  if (len <= kSpanSize && base_) {
+    int cls = sizeClass(len);
+    if (!partial_[cls].empty() || takeSpan(cls) >= 0) {
+      uint32_t i = partial_[cls].back();
+      Span& s = spans_[i];
+      void* p;
+      if (s.free) {
+        p = s.free;
+        s.free = *(void**)p;
+      } else {
+        p = spanBase(i) + (std::size_t)s.carved++ * classSize(cls);
+      }
+      if (++s.used == blocksPerSpan(cls)) {
+        partial_[cls].pop_back();
+      }
+      used_ += classSize(cls);
+      return p;
+    }
+  }
+  void* p = ::operator new(len);
+  overflow_ += len;
+  return p;
+}
+
+void Arena::deallocate(void* p, std::size_t len) {
+  char* c = (char*)p;
+  if (c < base_ || c >= base_ + size_) {
+    ::operator delete(p);
+    overflow_ -= len;
+    return;
+  }
+  uint32_t i = (uint32_t)((c - base_) / kSpanSize);
+  Span& s = spans_[i];
+  int cls = s.cls;
+  used_ -= classSize(cls);
+  if (s.used-- == blocksPerSpan(cls)) {
+    partial_[cls].push_back(i);
+  }
+  if (s.used == 0) {
+    auto& partial = partial_[cls];
+    partial.erase(std::find(partial.begin(), partial.end(), i));
+    freeSpan(i);
+    return;
+  }
+  *(void**)p = s.free;
+  s.free = p;
+}
+
+int64_t Arena::takeSpan(int cls) {
+  int64_t i = -1;
+  if (!retained_.empty()) {
+    i = retained_.back();
+    retained_.pop_back();
+  } else if (!released_.empty()) {
+    i = released_.back();
+    released_.pop_back();
+  } else if (next_span_ < spans_.size()) {
+    i = next_span_++;
+  } else {
+    return -1;
+  }
+  spans_[i] = Span();
+  spans_[i].cls = cls;
+  partial_[cls].push_back((uint32_t)i);
+  return i;
+}
+
+void Arena::freeSpan(uint32_t i) {
+  spans_[i] = Span();
+  if (retained_.size() * kSpanSize < opts_.retain) {
+    retained_.push_back(i);
+    return;
+  }
+  if (madvise(spanBase(i), kSpanSize, MADV_DONTNEED) < 0) {
+    SPDLOG_WARN("madvise(MADV_DONTNEED) errno={} {}", errno, strerror(errno));
+  }
+  released_.push_back(i);
+  releases_++;
+}
+
+}  // namespace tl
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "chunk_allocator.h"
+
+namespace tl {
+
+// Memory of one dispatcher's buffer chunks and Handler slots in one mmap()ed
+// region, on huge pages when it can get them, so the loop's working set
+// takes few TLB entries and days of churn do not fragment the global heap.
+//
+// The region is cut into 2 MB spans. A span serves blocks of one power of
+// two size class, 4 KB to 2 MB. A span whose blocks are all freed goes back
+// to the OS with madvise(MADV_DONTNEED), once "retain" bytes of empty spans
+// are kept already. Larger blocks, or blocks once the region is full, come
+// from operator new and count as overflow.
+//
+// "budget" caps the bytes in use, overflow included: a Handler over it stops
+// reading until its loop frees memory. Output is never refused, so usage can
+// go over the budget by what the connections are sending. Only use it
+// inside the loop of its dispatcher.
+class Arena : public ChunkAllocator {
+ public:
+  static constexpr std::size_t kSpanSize = 2 << 20;
+  static constexpr std::size_t kMinBlock = 4096;
+
+  struct Options {
+    // bytes in use before reads stop, also the size of the region.
+    std::size_t budget = 256 << 20;
+    // try MAP_HUGETLB first, which needs pages reserved in
+    // /proc/sys/vm/nr_hugepages, then transparent huge pages.
+    bool hugetlb = true;
+    // bytes of empty spans kept mapped for reuse.
+    std::size_t retain = 8 << 20;
+  };
+
+  // How the region is backed.
+  enum Backing { kNone, kHugeTlb, kTransparentHuge, kPages };
+
+  explicit Arena(const Options& opts);
+  ~Arena();
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  // Never fails over the budget, see overBudget().
+  void* allocate(std::size_t len) override;
+  void deallocate(void* p, std::size_t len) override;
+
+  bool overBudget() const { return used() >= opts_.budget; }
+
+  Backing backing() const { return backing_; }
+  static const char* backingName(Backing b);
+  // Bytes of blocks handed out, rounded up to their size class, overflow
+  // included.
+  std::size_t used() const { return used_ + overflow_; }
+  std::size_t overflow() const { return overflow_; }
+  // Bytes of spans that may hold memory: in use or retained.
+  std::size_t resident() const;
+  // Spans returned to the OS so far.
+  uint64_t releases() const { return releases_; }
+
+ private:
+  struct Span {
+    // size class, -1 when the span is empty.
+    int cls = -1;
+    // blocks handed out, and carved from the span so far.
+    uint32_t used = 0;
+    uint32_t carved = 0;
+    // freed blocks, linked through their first word.
+    void* free = nullptr;
+  };
+
+  static int sizeClass(std::size_t len);
+  static std::size_t classSize(int cls) { return kMinBlock << cls; }
+  static uint32_t blocksPerSpan(int cls) {
+    return (uint32_t)(kSpanSize / classSize(cls));
+  }
+  char* spanBase(uint32_t i) const { return base_ + i * kSpanSize; }
+  // An empty span for "cls", -1 if the region is full.
+  int64_t takeSpan(int cls);
+  void freeSpan(uint32_t i);
+
+  Options opts_;
+  Backing backing_ = kNone;
+  char* base_ = nullptr;
+  std::size_t size_ = 0;
+  std::vector<Span> spans_;
+  // spans never used so far start from here.
+  uint32_t next_span_ = 0;
+  // per class, spans with free blocks.
+  std::vector<std::vector<uint32_t> > partial_;
+  // empty spans still mapped, and returned to the OS.
+  std::vector<uint32_t> retained_;
+  std::vector<uint32_t> released_;
+  std::size_t used_ = 0;
+  std::size_t overflow_ = 0;
+  uint64_t releases_ = 0;
+};
+
+}  // namespace tl
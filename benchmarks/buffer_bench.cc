@@ -0,0 +1,63 @@
+#include "buffer.h"
+
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+// Args: chunk size, bytes per push.
+static void chunkArgs(benchmark::internal::Benchmark* b) {
+  for (int chunk : {512, 4096, 65536}) {
+    for (int msg : {64, 1024, 16384}) {
+      b->Args({chunk, msg});
+    }
+  }
+}
+
+static void BM_BufferPushDrain(benchmark::State& state) {
+  tl::buffer b;
+  b.default_chunk_size(state.range(0));
+  std::vector<char> data(state.range(1), 'x');
+  for (auto _ : state) {
+    b.push(data.data(), data.size());
+    b.drain(data.size());
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_BufferPushDrain)->Apply(chunkArgs);
+
+// data() makes bytes pushed in small pieces continuous, moving them if they
+// span chunks.
+static void BM_BufferData(benchmark::State& state) {
+  tl::buffer b;
+  b.default_chunk_size(state.range(0));
+  std::size_t len = state.range(1);
+  char piece[64] = {0};
+  for (auto _ : state) {
+    for (std::size_t n = 0; n < len; n += sizeof(piece)) {
+      b.push(piece, sizeof(piece));
+    }
+    const void* p;
+    b.data(p, len);
+    benchmark::DoNotOptimize(p);
+    b.drain(b.size());
+  }
+  state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(BM_BufferData)->Apply(chunkArgs);
+
+// operator[] walks the chunk list from the tail on every call.
+static void BM_BufferIndex(benchmark::State& state) {
+  tl::buffer b;
+  b.default_chunk_size(state.range(0));
+  std::vector<char> data(state.range(1), 'x');
+  b.push(data.data(), data.size());
+  for (auto _ : state) {
+    unsigned int sum = 0;
+    for (std::size_t i = 0; i < data.size(); i++) {
+      sum += b[i];
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_BufferIndex)->Apply(chunkArgs);
@@ -0,0 +1,205 @@
+// Echo rate and server CPU per message of a callback Protocol against
+// coroutines of CoroProtocol:
+//
+//   callback  EchoProtocol
+//   coro      read() whatever came, write() it back
+//   coro-msg  read(size) one message at a time and echo it from a Task
+//             co_await-ed per message, so one frame per message
+//   no-pool   coro-msg with FramePool disabled, frames from malloc
+//
+// The server runs on one dispatcher. "-c" client threads each keep "-D"
+// messages of "-s" bytes in flight on a connection for "-d" seconds.
+//
+//   coro_bench [-d seconds] [-s size] [-c connections] [-D depth]
+
+#include <getopt.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include "connection_table.h"
+#include "coro.h"
+#include "dispatcher.h"
+#include "event2/thread.h"
+#include "listener.h"
+#include "spdlog/spdlog.h"
+
+namespace {
+
+const int kPort = 2321;
+
+double threadCpu() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double loopCpu(tl::Dispatcher* disp) {
+  std::promise<double> p;
+  disp->post([&p] { p.set_value(threadCpu()); });
+  return p.get_future().get();
+}
+
+int connectTo(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sa.sin_port = htons(port);
+  if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+tl::Task echo(tl::Conn& c) {
+  for (;;) {
+    tl::BufferView in = co_await c.read();
+    co_await c.write(in);
+  }
+}
+
+tl::Task echoOne(tl::Conn& c, tl::BufferView msg) {
+  co_await c.write(msg);
+}
+
+std::size_t msg_size = 64;
+
+tl::Task echoMessages(tl::Conn& c) {
+  for (;;) {
+    tl::BufferView msg = co_await c.read(msg_size);
+    co_await echoOne(c, msg);
+  }
+}
+
+// Send "depth" messages, read them back, until "stop". Return the messages
+// echoed.
+uint64_t client(int port, std::size_t size, int depth,
+                const std::atomic<bool>* stop) {
+  int fd = connectTo(port);
+  if (fd < 0) {
+    return 0;
+  }
+  std::vector<char> out(size * depth, 'x');
+  std::vector<char> in(out.size());
+  uint64_t msgs = 0;
+  while (!stop->load(std::memory_order_relaxed)) {
+    if (write(fd, out.data(), out.size()) != (ssize_t)out.size()) {
+      break;
+    }
+    std::size_t got = 0;
+    while (got < in.size()) {
+      ssize_t n = read(fd, in.data() + got, in.size() - got);
+      if (n <= 0) {
+        close(fd);
+        return msgs;
+      }
+      got += n;
+    }
+    msgs += depth;
+  }
+  close(fd);
+  return msgs;
+}
+
+void run(const char* mode, tl::Protocol* proto, bool pool, double secs,
+         int conns, int depth) {
+  tl::Dispatcher disp;
+  disp.profiler().setThreshold(0);
+  if (proto) {
+    disp.connections()->setProtocol(proto);
+  }
+  tl::Listener ls("127.0.0.1", kPort);
+  if (ls.open(&disp, [](tl::Dispatcher* d, int fd) {
+        d->connections()->open(fd);
+      }) != 0) {
+    fprintf(stderr, "listen on %d failed\n", kPort);
+    exit(1);
+  }
+  disp.post([pool] { tl::FramePool::setEnabled(pool); });
+  std::thread loop([&disp] { disp.dispatch(); });
+
+  std::atomic<bool> stop{false};
+  double cpu0 = loopCpu(&disp);
+  auto t0 = std::chrono::steady_clock::now();
+  std::vector<std::future<uint64_t> > clients;
+  for (int i = 0; i < conns; i++) {
+    clients.push_back(std::async(std::launch::async, client, kPort, msg_size,
+                                 depth, &stop));
+  }
+  std::this_thread::sleep_for(std::chrono::duration<double>(secs));
+  stop = true;
+  uint64_t msgs = 0;
+  for (auto& c : clients) {
+    msgs += c.get();
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  double cpu1 = loopCpu(&disp);
+  disp.post([] { tl::FramePool::setEnabled(true); });
+  disp.stop();
+  loop.join();
+
+  double wall = std::chrono::duration<double>(t1 - t0).count();
+  double cpu = cpu1 - cpu0;
+  printf("%-9s msgs=%lu msgs/s=%.0f server_cpu=%.3fs ns/msg=%.0f\n", mode,
+         (unsigned long)msgs, msgs / wall, cpu, msgs ? cpu * 1e9 / msgs : 0);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  signal(SIGPIPE, SIG_IGN);
+  evthread_use_pthreads();
+  spdlog::set_level(spdlog::level::warn);
+
+  double secs = 3;
+  int conns = 4;
+  int depth = 16;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:s:c:D:")) != -1) {
+    switch (opt) {
+      case 'd':
+        secs = atof(optarg);
+        break;
+      case 's':
+        msg_size = strtoul(optarg, nullptr, 10);
+        break;
+      case 'c':
+        conns = atoi(optarg);
+        break;
+      case 'D':
+        depth = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr,
+                "usage: %s [-d seconds] [-s size] [-c connections] "
+                "[-D depth]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if (msg_size == 0) {
+    msg_size = 1;
+  }
+
+  // the protocols outlive the dispatchers of run().
+  tl::CoroProtocol coro(echo);
+  tl::CoroProtocol coro_msg(echoMessages);
+  run("callback", nullptr, true, secs, conns, depth);
+  run("coro", &coro, true, secs, conns, depth);
+  run("coro-msg", &coro_msg, true, secs, conns, depth);
+  run("no-pool", &coro_msg, false, secs, conns, depth);
+  return 0;
+}
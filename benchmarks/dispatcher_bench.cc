@@ -0,0 +1,64 @@
+#include "dispatcher.h"
+
+#include <atomic>
+#include <thread>
+
+#include "benchmark/benchmark.h"
+#include "event2/thread.h"
+
+namespace {
+
+// A dispatcher looping in its own thread for the whole run.
+struct Loop {
+  Loop() {
+    evthread_use_pthreads();
+    disp.reset(new tl::Dispatcher());
+    thread = std::thread([this] { disp->dispatch(); });
+  }
+  ~Loop() {
+    disp->stop();
+    thread.join();
+  }
+  std::unique_ptr<tl::Dispatcher> disp;
+  std::thread thread;
+};
+
+tl::Dispatcher* loop() {
+  static Loop l;
+  return l.disp.get();
+}
+
+}  // namespace
+
+// post() from another thread until the callback has run, the latency of
+// handing work to a dispatcher.
+static void BM_DispatcherPostRoundTrip(benchmark::State& state) {
+  tl::Dispatcher* disp = loop();
+  std::atomic<bool> done(false);
+  for (auto _ : state) {
+    done.store(false, std::memory_order_relaxed);
+    disp->post([&done] { done.store(true, std::memory_order_release); });
+    while (!done.load(std::memory_order_acquire)) {
+      std::this_thread::yield();
+    }
+  }
+}
+BENCHMARK(BM_DispatcherPostRoundTrip)->UseRealTime();
+
+// Batches of posts, callbacks run per second.
+static void BM_DispatcherPostBatch(benchmark::State& state) {
+  tl::Dispatcher* disp = loop();
+  int batch = state.range(0);
+  std::atomic<int> ran(0);
+  for (auto _ : state) {
+    ran.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < batch; i++) {
+      disp->post([&ran] { ran.fetch_add(1, std::memory_order_release); });
+    }
+    while (ran.load(std::memory_order_acquire) != batch) {
+      std::this_thread::yield();
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * batch);
+}
+BENCHMARK(BM_DispatcherPostBatch)->Arg(16)->Arg(256)->UseRealTime();
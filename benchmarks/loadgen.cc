@@ -0,0 +1,606 @@
+// Echo load generator: N connections over M dispatcher threads.
+//
+// Closed loop (default): each connection keeps "-d" messages in flight and
+// sends the next one when a response completes. Open loop ("-r" msgs/s in
+// total): messages are queued on a fixed schedule whatever the responses do,
+// so a server stall is charged to every message sent during it (no
+// coordinated omission). Latency is measured from when a message is queued.
+// Sends are made on a loop tick, max_lag_us is how far behind the schedule
+// the generator itself fell.
+//
+// With "-n count" a connection is closed after "count" responses and a new
+// one opened, to keep connects going, e.g. across a server restart.
+//
+// With "-k keys" the messages are memcached text get/set commands instead of
+// echo payloads, for the server's "-k" cache: keys drawn from a Zipfian
+// distribution of skew "-z", a "-g" fraction of gets, "-s" byte values.
+//
+// "-F" connects with TCP Fast Open, for the server's "-O short" profile.
+//
+//   loadgen [-a addr] [-p port] [-c connections] [-t threads] [-s size]
+//           [-d depth] [-r rate] [-D seconds] [-w warmup seconds]
+//           [-n reconnect] [-k keys [-z theta] [-g get ratio]] [-F]
+//
+// Prints one line of key=value pairs, latencies in microseconds.
+
+#include <getopt.h>
+#include <signal.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <deque>
+#include <future>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "connection_table.h"
+#include "connector.h"
+#include "dispatcher.h"
+#include "event2/thread.h"
+#include "handler.h"
+#include "histogram.h"
+#include "protocol.h"
+
+namespace {
+
+struct Options {
+  std::string addr = "127.0.0.1";
+  int port = 2200;
+  int conns = 16;
+  int threads = 2;
+  std::size_t size = 64;
+  std::size_t depth = 1;
+  double rate = 0;
+  double duration = 10;
+  double warmup = 1;
+  // closed loop, responses per connection before reconnecting, 0 never.
+  uint64_t reconnect = 0;
+  bool fastopen = false;
+  // cache mode.
+  uint64_t keys = 0;
+  double theta = 0.99;
+  double get_ratio = 0.9;
+};
+
+int64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Zipfian ranks in [0, n) of skew "theta" < 1, rank 0 the most frequent,
+// by the method of Gray et al. "Quickly generating billion-record synthetic
+// databases" as YCSB does it.
+class Zipf {
+ public:
+  Zipf(uint64_t n, double theta) : n_(n), theta_(theta) {
+    double zeta2 = zeta(2);
+    zetan_ = zeta(n);
+    alpha_ = 1 / (1 - theta);
+    eta_ = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan_);
+  }
+
+  uint64_t next(std::mt19937_64& rng) const {
+    double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    double uz = u * zetan_;
+    if (uz < 1) {
+      return 0;
+    }
+    if (uz < 1 + std::pow(0.5, theta_)) {
+      return 1;
+    }
+    uint64_t r = (uint64_t)(n_ * std::pow(eta_ * u - eta_ + 1, alpha_));
+    return r < n_ ? r : n_ - 1;
+  }
+
+ private:
+  double zeta(uint64_t n) const {
+    double sum = 0;
+    for (uint64_t i = 1; i <= n; i++) {
+      sum += 1 / std::pow((double)i, theta_);
+    }
+    return sum;
+  }
+
+  uint64_t n_;
+  double theta_;
+  double zetan_;
+  double alpha_;
+  double eta_;
+};
+
+extern "C" void loadgen_tick_cb(evutil_socket_t, short, void* ptr);
+
+// The connections of one dispatcher thread.
+class Worker : public tl::Protocol {
+ public:
+  Worker(const Options& opts, const Zipf* zipf, int conns, int seed)
+      : opts_(opts),
+        zipf_(zipf),
+        conns_(conns),
+        payload_(opts.size, 'x'),
+        rng_(seed) {
+    if (opts.rate > 0) {
+      interval_ns_ = (int64_t)(1e9 * opts.conns / opts.rate);
+    }
+  }
+
+  // Run in the loop. "connected" is set when all connects are done.
+  void start(tl::Dispatcher* disp, std::promise<int>* connected) {
+    disp_ = disp;
+    connector_.reset(new tl::Connector(disp));
+    connector_->setFastOpen(opts_.fastopen);
+    connected_ = connected;
+    for (int i = 0; i < conns_; i++) {
+      connect(true);
+    }
+    if (opts_.rate > 0) {
+      struct timeval tv = {0, 1000};
+      event_assign(&tick_, disp->ev_base(), -1, EV_PERSIST, loadgen_tick_cb,
+                   this);
+      event_add(&tick_, &tv);
+    }
+  }
+
+  int onRead(tl::Handler* h, tl::buffer& in, tl::buffer& out) override {
+    auto it = state_.find(disp_->connections()->id(h));
+    if (it == state_.end()) {
+      return -1;
+    }
+    Conn& c = it->second;
+    std::size_t done = zipf_ ? cacheResponses(c, in) : echoResponses(c, in);
+    int64_t now = nowNs();
+    for (; done > 0 && !c.sent.empty(); done--) {
+      if (measuring_) {
+        hist_.record(now - c.sent.front());
+      }
+      c.sent.pop_front();
+      c.responses++;
+      // with reconnects, stop sending when the last response is in flight.
+      bool last = opts_.reconnect &&
+                  c.responses + c.sent.size() >= opts_.reconnect;
+      if (opts_.rate == 0 && !last) {
+        const std::string& req = request();
+        out.push(req.data(), req.size());
+        c.sent.push_back(now);
+      }
+    }
+    if (opts_.reconnect && opts_.rate == 0 && c.sent.empty() &&
+        c.responses >= opts_.reconnect) {
+      // not inside its own read callback.
+      tl::ConnId cid = it->first;
+      state_.erase(it);
+      disp_->post([this, cid] {
+        if (tl::Handler* old = disp_->connections()->get(cid)) {
+          old->close();
+        }
+        if (!measured_) {
+          connect(false);
+        }
+      });
+    }
+    return 0;
+  }
+
+  // Open loop: send what is due on every connection.
+  void tick() {
+    int64_t now = nowNs();
+    for (auto it = state_.begin(); it != state_.end();) {
+      tl::Handler* h = disp_->connections()->get(it->first);
+      if (h == nullptr) {
+        closed_++;
+        it = state_.erase(it);
+        continue;
+      }
+      Conn& c = it->second;
+      while (c.next_ns <= now) {
+        if (measuring_ && now - c.next_ns > max_lag_ns_) {
+          max_lag_ns_ = now - c.next_ns;
+        }
+        const std::string& req = request();
+        h->write(req.data(), req.size());
+        c.sent.push_back(now);
+        c.next_ns += interval_ns_;
+      }
+      ++it;
+    }
+  }
+
+  // Run in the loop before it stops.
+  void finish() {
+    if (opts_.rate > 0) {
+      event_del(&tick_);
+    }
+  }
+
+  void measure(bool on) {
+    measuring_ = on;
+    if (on) {
+      hist_.reset();
+      max_lag_ns_ = 0;
+      gets_ = 0;
+      hits_ = 0;
+      reconnects_ = 0;
+      reconnect_failed_ = 0;
+    } else {
+      // no new connects, so none is in flight when the loop stops.
+      measured_ = true;
+      for (auto it = state_.begin(); it != state_.end();) {
+        if (disp_->connections()->get(it->first) == nullptr) {
+          closed_++;
+          it = state_.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+  }
+
+  const tl::Histogram& histogram() const { return hist_; }
+  int64_t maxLagNs() const { return max_lag_ns_; }
+  uint64_t gets() const { return gets_; }
+  uint64_t hits() const { return hits_; }
+  int failed() const { return failed_; }
+  int closed() const { return closed_; }
+  uint64_t reconnects() const { return reconnects_; }
+  uint64_t reconnectFailed() const { return reconnect_failed_; }
+
+ private:
+  struct Conn {
+    // send time of each message in flight, oldest first.
+    std::deque<int64_t> sent;
+    // bytes of the oldest message received so far.
+    std::size_t received = 0;
+    uint64_t responses = 0;
+    // cache mode, bytes left of the value being received.
+    std::size_t value_left = 0;
+    // open loop, next scheduled send.
+    int64_t next_ns = 0;
+  };
+
+  // The next message to send.
+  const std::string& request() {
+    if (zipf_ == nullptr) {
+      return payload_;
+    }
+    // scatter the ranks, so hot keys do not all land on one shard.
+    uint64_t key = zipf_->next(rng_) * 0x9e3779b97f4a7c15ULL % opts_.keys;
+    char cmd[64];
+    if (std::uniform_real_distribution<double>(0, 1)(rng_) < opts_.get_ratio) {
+      snprintf(cmd, sizeof(cmd), "get key:%llu\r\n", (unsigned long long)key);
+      req_ = cmd;
+      if (measuring_) {
+        gets_++;
+      }
+    } else {
+      snprintf(cmd, sizeof(cmd), "set key:%llu 0 0 %zu\r\n",
+               (unsigned long long)key, payload_.size());
+      req_ = cmd;
+      req_ += payload_;
+      req_ += "\r\n";
+    }
+    return req_;
+  }
+
+  // Echo mode: responses completed by "in".
+  std::size_t echoResponses(Conn& c, tl::buffer& in) {
+    c.received += in.size();
+    in.drain(in.size());
+    std::size_t n = c.received / opts_.size;
+    c.received -= n * opts_.size;
+    return n;
+  }
+
+  // Cache mode: responses completed by "in". A get response ends with "END",
+  // after a "VALUE" line and value for a hit, a set response is one line.
+  std::size_t cacheResponses(Conn& c, tl::buffer& in) {
+    std::size_t n = 0;
+    for (;;) {
+      if (c.value_left) {
+        std::size_t skip = std::min(c.value_left, in.size());
+        in.drain(skip);
+        c.value_left -= skip;
+        if (c.value_left) {
+          break;
+        }
+      }
+      std::size_t eol = 0;
+      bool found = false;
+      in.forEachSegment(0, in.size(),
+                        [&](const unsigned char* p, std::size_t len) {
+                          if (!found) {
+                            auto q = (const unsigned char*)memchr(p, '\n', len);
+                            found = q != nullptr;
+                            eol += found ? q - p : len;
+                          }
+                        });
+      if (!found) {
+        break;
+      }
+      std::string line = tl::BufferView(&in, 0, eol + 1).toString();
+      in.drain(eol + 1);
+      if (line.compare(0, 6, "VALUE ") == 0) {
+        // VALUE <key> <flags> <bytes>
+        c.value_left = strtoull(line.c_str() + line.rfind(' ') + 1, nullptr,
+                                10) +
+                       2;
+        if (measuring_) {
+          hits_++;
+        }
+      } else {
+        n++;
+      }
+    }
+    return n;
+  }
+
+  // "initial" for the connects of start().
+  void connect(bool initial) {
+    int r = connector_->connect(
+        opts_.addr, opts_.port,
+        [this, initial](int fd) { onConnect(fd, initial); });
+    if (r < 0) {
+      onConnect(-1, initial);
+    }
+  }
+
+  void onConnect(int fd, bool initial) {
+    if (!initial) {
+      if (fd < 0) {
+        reconnect_failed_++;
+        return;
+      }
+      reconnects_++;
+    }
+    if (fd < 0) {
+      failed_++;
+    } else {
+      tl::Handler* h = disp_->connections()->open(fd, this);
+      if (h != nullptr) {
+        Conn& c = state_[disp_->connections()->id(h)];
+        int64_t now = nowNs();
+        if (opts_.rate > 0) {
+          // spread the connections over one interval.
+          c.next_ns = now + interval_ns_ * (int64_t)state_.size() / conns_;
+        } else {
+          for (std::size_t i = 0; i < opts_.depth; i++) {
+            const std::string& req = request();
+            h->write(req.data(), req.size());
+            c.sent.push_back(now);
+          }
+        }
+      } else {
+        failed_++;
+      }
+    }
+    if (initial && ++done_ == conns_) {
+      connected_->set_value(failed_);
+    }
+  }
+
+  const Options& opts_;
+  const Zipf* zipf_;
+  int conns_;
+  std::string payload_;
+  std::mt19937_64 rng_;
+  std::string req_;
+  uint64_t gets_ = 0;
+  uint64_t hits_ = 0;
+  int64_t interval_ns_ = 0;
+  tl::Dispatcher* disp_ = nullptr;
+  std::unique_ptr<tl::Connector> connector_;
+  std::promise<int>* connected_ = nullptr;
+  std::unordered_map<tl::ConnId, Conn> state_;
+  struct event tick_;
+  bool measuring_ = false;
+  bool measured_ = false;
+  tl::Histogram hist_;
+  int64_t max_lag_ns_ = 0;
+  int done_ = 0;
+  int failed_ = 0;
+  int closed_ = 0;
+  uint64_t reconnects_ = 0;
+  uint64_t reconnect_failed_ = 0;
+};
+
+extern "C" void loadgen_tick_cb(evutil_socket_t, short, void* ptr) {
+  ((Worker*)ptr)->tick();
+}
+
+// Run "f" in each worker's loop and wait for all of them.
+template <class F>
+void onAll(std::vector<tl::Dispatcher>& disps,
+           std::vector<std::unique_ptr<Worker> >& workers, F f) {
+  std::vector<std::promise<void> > done(workers.size());
+  for (std::size_t i = 0; i < workers.size(); i++) {
+    Worker* w = workers[i].get();
+    std::promise<void>* p = &done[i];
+    disps[i].post([w, p, &f] {
+      f(w);
+      p->set_value();
+    });
+  }
+  for (auto& p : done) {
+    p.get_future().wait();
+  }
+}
+
+void usage(const char* prog) {
+  fprintf(stderr,
+          "usage: %s [-a addr] [-p port] [-c connections] [-t threads]\n"
+          "          [-s size] [-d depth] [-r rate] [-D seconds] "
+          "[-w seconds]\n"
+          "          [-n reconnect] [-k keys [-z theta] [-g get ratio]] "
+          "[-F]\n"
+          "  -d  messages in flight per connection, closed loop\n"
+          "  -n  reconnect after this many responses, closed loop\n"
+          "  -r  messages per second in total, open loop\n"
+          "  -k  memcached get/set of Zipfian keys instead of echo\n"
+          "  -z  Zipf skew, < 1, default 0.99\n"
+          "  -g  fraction of gets, default 0.9\n"
+          "  -F  connect with TCP Fast Open\n",
+          prog);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Options opts;
+  int opt;
+  while ((opt = getopt(argc, argv, "a:p:c:t:s:d:r:D:w:n:k:z:g:F")) != -1) {
+    switch (opt) {
+      case 'a':
+        opts.addr = optarg;
+        break;
+      case 'p':
+        opts.port = atoi(optarg);
+        break;
+      case 'c':
+        opts.conns = atoi(optarg);
+        break;
+      case 't':
+        opts.threads = atoi(optarg);
+        break;
+      case 's':
+        opts.size = strtoull(optarg, nullptr, 10);
+        break;
+      case 'd':
+        opts.depth = strtoull(optarg, nullptr, 10);
+        break;
+      case 'r':
+        opts.rate = atof(optarg);
+        break;
+      case 'D':
+        opts.duration = atof(optarg);
+        break;
+      case 'w':
+        opts.warmup = atof(optarg);
+        break;
+      case 'n':
+        opts.reconnect = strtoull(optarg, nullptr, 10);
+        break;
+      case 'k':
+        opts.keys = strtoull(optarg, nullptr, 10);
+        break;
+      case 'z':
+        opts.theta = atof(optarg);
+        break;
+      case 'g':
+        opts.get_ratio = atof(optarg);
+        break;
+      case 'F':
+        opts.fastopen = true;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (opts.conns <= 0 || opts.threads <= 0 || opts.size == 0 ||
+      opts.depth == 0 || opts.duration <= 0 || opts.theta < 0 ||
+      opts.theta >= 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (opts.threads > opts.conns) {
+    opts.threads = opts.conns;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  evthread_use_pthreads();
+  spdlog::set_level(spdlog::level::warn);
+
+  std::unique_ptr<Zipf> zipf;
+  if (opts.keys) {
+    zipf.reset(new Zipf(opts.keys, opts.theta));
+  }
+  std::vector<tl::Dispatcher> disps(opts.threads);
+  std::vector<std::unique_ptr<Worker> > workers;
+  std::vector<std::promise<int> > connected(opts.threads);
+  std::vector<std::thread> loops;
+  for (int i = 0; i < opts.threads; i++) {
+    int n = opts.conns / opts.threads + (i < opts.conns % opts.threads);
+    workers.emplace_back(new Worker(opts, zipf.get(), n, i));
+    loops.emplace_back([&disps, i] { disps[i].dispatch(); });
+    Worker* w = workers.back().get();
+    tl::Dispatcher* d = &disps[i];
+    std::promise<int>* p = &connected[i];
+    d->post([w, d, p] { w->start(d, p); });
+  }
+  int failed = 0;
+  for (auto& p : connected) {
+    failed += p.get_future().get();
+  }
+
+  auto sleep = [](double s) {
+    std::this_thread::sleep_for(std::chrono::duration<double>(s));
+  };
+  if (failed < opts.conns) {
+    sleep(opts.warmup);
+    onAll(disps, workers, [](Worker* w) { w->measure(true); });
+    auto t0 = std::chrono::steady_clock::now();
+    sleep(opts.duration);
+    onAll(disps, workers, [](Worker* w) { w->measure(false); });
+    double secs = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - t0)
+                      .count();
+
+    tl::Histogram h;
+    int closed = 0;
+    int64_t lag = 0;
+    uint64_t gets = 0;
+    uint64_t hits = 0;
+    uint64_t reconnects = 0;
+    uint64_t reconnect_failed = 0;
+    for (auto& w : workers) {
+      h.merge(w->histogram());
+      closed += w->closed();
+      lag = std::max(lag, w->maxLagNs());
+      gets += w->gets();
+      hits += w->hits();
+      reconnects += w->reconnects();
+      reconnect_failed += w->reconnectFailed();
+    }
+    printf("mode=%s conns=%d threads=%d size=%zu depth=%zu rate=%.0f "
+           "secs=%.2f msgs=%llu rps=%.0f MBps=%.2f mean_us=%.1f p50_us=%.1f "
+           "p90_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f max_lag_us=%.1f "
+           "failed=%d closed=%d",
+           opts.rate > 0 ? "open" : "closed", opts.conns, opts.threads,
+           opts.size, opts.depth, opts.rate, secs,
+           (unsigned long long)h.count(), h.count() / secs,
+           h.count() * opts.size / secs / 1e6, h.mean() / 1e3,
+           h.percentile(50) / 1e3, h.percentile(90) / 1e3,
+           h.percentile(99) / 1e3, h.percentile(99.9) / 1e3, h.max() / 1e3,
+           lag / 1e3, failed, closed);
+    if (opts.reconnect) {
+      printf(" reconnects=%llu reconnect_failed=%llu",
+             (unsigned long long)reconnects,
+             (unsigned long long)reconnect_failed);
+    }
+    if (opts.keys) {
+      printf(" keys=%llu theta=%.2f get_ratio=%.2f hit_ratio=%.3f",
+             (unsigned long long)opts.keys, opts.theta, opts.get_ratio,
+             gets ? (double)hits / gets : 0.0);
+    }
+    printf("\n");
+  } else {
+    fprintf(stderr, "cannot connect to %s:%d\n", opts.addr.c_str(),
+            opts.port);
+  }
+
+  onAll(disps, workers, [](Worker* w) { w->finish(); });
+  for (int i = 0; i < opts.threads; i++) {
+    disps[i].stop();
+    loops[i].join();
+  }
+  // connections go with the dispatchers, before their protocols.
+  disps.clear();
+  workers.clear();
+  return failed < opts.conns ? 0 : 1;
+}
@@ -0,0 +1,63 @@
+#!/bin/bash
+# Start the echo server, run a fixed set of loadgen cases against it and print
+# one result line per case, with the CPU time the server used during it. Given
+# the output of an earlier run as "baseline", also print the throughput and
+# p99 change of each case to stderr.
+#
+#   benchmarks/loadgen.sh BUILD_DIR [baseline] > results.txt
+#
+# PORT, DURATION (seconds per case) and SERVER_ARGS, e.g. "-b 50" for busy
+# polling, can be set in the environment.
+
+set -e
+
+build=${1:?usage: $0 BUILD_DIR [baseline]}
+baseline=$2
+port=${PORT:-2290}
+duration=${DURATION:-5}
+
+# shellcheck disable=SC2086
+"$build/multithread-libevent-example" -p "$port" $SERVER_ARGS >/dev/null 2>&1 &
+server=$!
+trap 'kill $server 2>/dev/null; wait $server 2>/dev/null || true' EXIT
+sleep 0.5
+
+# user + system clock ticks of the server.
+cpu_ticks() {
+  awk '{ print $14 + $15 }' "/proc/$server/stat"
+}
+
+run() {
+  local before line
+  before=$(cpu_ticks)
+  line=$("$build/benchmarks/loadgen" -p "$port" -D "$duration" -w 1 "$@")
+  echo "$line server_cpu_ms=$((($(cpu_ticks) - before) * 1000 / $(getconf CLK_TCK)))"
+}
+
+results=$(mktemp)
+{
+  run -c 16 -t 2 -s 64 -d 1
+  run -c 16 -t 2 -s 64 -d 16
+  run -c 64 -t 2 -s 4096 -d 1
+  run -c 16 -t 2 -s 64 -r 20000
+} | tee "$results"
+
+if [ -n "$baseline" ]; then
+  # cases are matched on the parameters before "secs=".
+  awk '
+    function field(line, key,    m) {
+      if (match(line, " " key "=[^ ]*")) {
+        return substr(line, RSTART + length(key) + 2, RLENGTH - length(key) - 2)
+      }
+      return ""
+    }
+    { key = $0; sub(/ secs=.*/, "", key) }
+    FNR == NR { rps[key] = field($0, "rps"); p99[key] = field($0, "p99_us"); next }
+    key in rps && rps[key] > 0 && p99[key] > 0 {
+      printf "%s rps %+.1f%% p99 %+.1f%%\n", key,
+        (field($0, "rps") / rps[key] - 1) * 100,
+        (field($0, "p99_us") / p99[key] - 1) * 100
+    }
+  ' "$baseline" "$results" >&2
+fi
+rm -f "$results"
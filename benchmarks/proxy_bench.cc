@@ -0,0 +1,171 @@
+// Relay throughput and proxy CPU time, splice() versus buffer copy.
+//
+// An echo server runs on one dispatcher, a Proxy in front of it on another.
+// Clients stream "-m" MB each through the proxy and read the echo back.
+//
+//   proxy_bench [-m MB per connection] [-c connections]
+
+#include <getopt.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include "connection_table.h"
+#include "dispatcher.h"
+#include "event2/thread.h"
+#include "listener.h"
+#include "proxy.h"
+
+namespace {
+
+const int kUpstreamPort = 2311;
+
+double threadCpu() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double loopCpu(tl::Dispatcher* disp) {
+  std::promise<double> p;
+  disp->post([&p] { p.set_value(threadCpu()); });
+  return p.get_future().get();
+}
+
+int connectTo(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sa.sin_port = htons(port);
+  if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Write "total" bytes and read them back on one connection.
+bool stream(int port, std::size_t total) {
+  int fd = connectTo(port);
+  if (fd < 0) {
+    return false;
+  }
+  std::thread writer([fd, total] {
+    static char src[256 << 10];
+    for (std::size_t sent = 0; sent < total;) {
+      std::size_t len = total - sent;
+      if (len > sizeof(src)) {
+        len = sizeof(src);
+      }
+      ssize_t n = write(fd, src, len);
+      if (n <= 0) {
+        break;
+      }
+      sent += n;
+    }
+  });
+  std::vector<char> sink(256 << 10);
+  std::size_t got = 0;
+  // no shutdown(SHUT_WR), the echo server closes on EOF and drops what it
+  // has not written back yet.
+  while (got < total) {
+    ssize_t n = read(fd, sink.data(), sink.size());
+    if (n <= 0) {
+      break;
+    }
+    got += n;
+  }
+  writer.join();
+  close(fd);
+  return got == total;
+}
+
+void run(const char* mode, int port, bool splice, std::size_t total,
+         int conns) {
+  tl::Dispatcher disp;
+  tl::Proxy proxy(&disp, "127.0.0.1", kUpstreamPort, splice);
+  tl::Listener ls("127.0.0.1", port);
+  if (ls.open(&disp, [&proxy](tl::Dispatcher*, int fd) {
+        proxy.accept(fd);
+      }) != 0) {
+    fprintf(stderr, "listen on %d failed\n", port);
+    exit(1);
+  }
+  std::thread loop([&disp] { disp.dispatch(); });
+
+  double cpu0 = loopCpu(&disp);
+  auto t0 = std::chrono::steady_clock::now();
+  std::vector<std::future<bool> > clients;
+  for (int i = 0; i < conns; i++) {
+    clients.push_back(std::async(std::launch::async, stream, port, total));
+  }
+  bool ok = true;
+  for (auto& c : clients) {
+    ok = c.get() && ok;
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  double cpu1 = loopCpu(&disp);
+  disp.stop();
+  loop.join();
+
+  // each byte crosses the proxy twice, out and back.
+  double gb = 2.0 * total * conns / 1e9;
+  double wall = std::chrono::duration<double>(t1 - t0).count();
+  printf("%-7s ok=%d relayed=%.2fGB wall=%.3fs GB/s=%.2f proxy_cpu=%.3fs "
+         "cpu/GB=%.3fs\n",
+         mode, ok, gb, wall, gb / wall, cpu1 - cpu0, (cpu1 - cpu0) / gb);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  signal(SIGPIPE, SIG_IGN);
+  evthread_use_pthreads();
+  spdlog::set_level(spdlog::level::warn);
+
+  std::size_t mb = 256;
+  int conns = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:c:")) != -1) {
+    switch (opt) {
+      case 'm':
+        mb = strtoull(optarg, nullptr, 10);
+        break;
+      case 'c':
+        conns = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-m MB] [-c connections]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  // loopback echo upstream.
+  tl::Dispatcher upstream;
+  tl::Listener upstream_ls("127.0.0.1", kUpstreamPort);
+  if (upstream_ls.open(&upstream, [](tl::Dispatcher* d, int fd) {
+        d->connections()->open(fd);
+      }) != 0) {
+    fprintf(stderr, "listen on %d failed\n", kUpstreamPort);
+    return 1;
+  }
+  std::thread upstream_loop([&upstream] { upstream.dispatch(); });
+
+  run("splice", 2312, true, mb << 20, conns);
+  run("copy", 2313, false, mb << 20, conns);
+
+  upstream.stop();
+  upstream_loop.join();
+  return 0;
+}
@@ -0,0 +1,371 @@
+// Replays trace files captured with the server's "-t" against a server. Each
+// traced connection is opened, sent the bytes its client sent at the times
+// it sent them, and closed, the connections spread over N dispatcher
+// threads. Responses are read and counted. Files of several loops are merged
+// on their capture start times.
+//
+//   replay [-a addr] [-p port] [-t threads] [-x speed] trace...
+//
+// "-x 2" replays twice as fast, "-x 0" as fast as possible. Sends are made
+// on a 1ms loop tick, max_late_us is how far behind the trace the replay
+// fell. Prints one line of key=value pairs.
+
+#include <getopt.h>
+#include <signal.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "connection_table.h"
+#include "connector.h"
+#include "dispatcher.h"
+#include "event2/thread.h"
+#include "handler.h"
+#include "protocol.h"
+#include "trace.h"
+
+namespace {
+
+struct Options {
+  std::string addr = "127.0.0.1";
+  int port = 2200;
+  int threads = 2;
+  double speed = 1;
+};
+
+int64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+struct Event {
+  // since the earliest capture start.
+  int64_t at_ns;
+  // replayed connection, index over all files.
+  uint32_t conn;
+  uint16_t type;
+  uint32_t len;
+  const char* data;
+};
+
+extern "C" void replay_tick_cb(evutil_socket_t, short, void* ptr);
+
+// The connections of one dispatcher thread.
+class Worker : public tl::Protocol {
+ public:
+  explicit Worker(const Options& opts) : opts_(opts) {}
+
+  // Time ordered, filled before start().
+  std::vector<Event>& events() { return events_; }
+
+  // Run in the loop. The trace starts at "start_ns", "done" is set when all
+  // its connections are closed.
+  void start(tl::Dispatcher* disp, int64_t start_ns,
+             std::promise<void>* done) {
+    disp_ = disp;
+    connector_.reset(new tl::Connector(disp));
+    start_ns_ = start_ns;
+    done_ = done;
+    struct timeval tv = {0, 1000};
+    event_assign(&tick_, disp->ev_base(), -1, EV_PERSIST, replay_tick_cb,
+                 this);
+    event_add(&tick_, &tv);
+  }
+
+  int onRead(tl::Handler*, tl::buffer& in, tl::buffer&) override {
+    received_ += in.size();
+    in.drain(in.size());
+    return 0;
+  }
+
+  void tick() {
+    int64_t now = nowNs();
+    for (; next_ < events_.size(); next_++) {
+      const Event& e = events_[next_];
+      int64_t due = start_ns_;
+      if (opts_.speed > 0) {
+        due += (int64_t)(e.at_ns / opts_.speed);
+      }
+      if (due > now) {
+        break;
+      }
+      max_late_ns_ = std::max(max_late_ns_, now - due);
+      apply(e);
+    }
+    if (next_ == events_.size()) {
+      // connections still open when the capture stopped.
+      for (auto& it : conns_) {
+        close(it.first);
+      }
+    }
+
+    // close connections once what they were sent is written.
+    for (std::size_t i = 0; i < closing_.size();) {
+      auto it = conns_.find(closing_[i]);
+      if (it != conns_.end()) {
+        if (it->second.connecting) {
+          i++;
+          continue;
+        }
+        tl::Handler* h = disp_->connections()->get(it->second.id);
+        if (h && h->pendingWrite()) {
+          i++;
+          continue;
+        }
+        if (h) {
+          h->close();
+        }
+        conns_.erase(it);
+      }
+      closing_[i] = closing_.back();
+      closing_.pop_back();
+    }
+
+    if (next_ == events_.size() && conns_.empty() && done_) {
+      event_del(&tick_);
+      done_->set_value();
+      done_ = nullptr;
+    }
+  }
+
+  uint64_t sent() const { return sent_; }
+  uint64_t received() const { return received_; }
+  uint64_t lost() const { return lost_; }
+  int opened() const { return opened_; }
+  int failed() const { return failed_; }
+  int64_t maxLateNs() const { return max_late_ns_; }
+
+ private:
+  struct Conn {
+    tl::ConnId id = 0;
+    bool connecting = true;
+    bool closing = false;
+    // sent before the connect completed.
+    std::string pending;
+  };
+
+  void apply(const Event& e) {
+    switch (e.type) {
+      case tl::kTraceOpen:
+        open(e.conn);
+        break;
+      case tl::kTraceData: {
+        auto it = conns_.find(e.conn);
+        if (it == conns_.end()) {
+          lost_ += e.len;  // failed, or closed by the server
+          break;
+        }
+        Conn& c = it->second;
+        if (c.connecting) {
+          c.pending.append(e.data, e.len);
+          break;
+        }
+        tl::Handler* h = disp_->connections()->get(c.id);
+        if (h == nullptr) {
+          conns_.erase(it);
+          lost_ += e.len;
+          break;
+        }
+        h->write(e.data, e.len);
+        sent_ += e.len;
+        break;
+      }
+      case tl::kTraceClose:
+        close(e.conn);
+        break;
+    }
+  }
+
+  void open(uint32_t conn) {
+    if (conns_.count(conn)) {
+      return;
+    }
+    conns_[conn];
+    int r = connector_->connect(opts_.addr, opts_.port, [this, conn](int fd) {
+      onConnect(conn, fd);
+    });
+    if (r < 0) {
+      onConnect(conn, -1);
+    }
+  }
+
+  void onConnect(uint32_t conn, int fd) {
+    auto it = conns_.find(conn);
+    tl::Handler* h = fd < 0 ? nullptr : disp_->connections()->open(fd, this);
+    if (h == nullptr) {
+      failed_++;
+      lost_ += it->second.pending.size();
+      conns_.erase(it);
+      return;
+    }
+    opened_++;
+    Conn& c = it->second;
+    c.id = disp_->connections()->id(h);
+    c.connecting = false;
+    if (!c.pending.empty()) {
+      h->write(c.pending.data(), c.pending.size());
+      sent_ += c.pending.size();
+      c.pending.clear();
+    }
+  }
+
+  void close(uint32_t conn) {
+    auto it = conns_.find(conn);
+    if (it != conns_.end() && !it->second.closing) {
+      it->second.closing = true;
+      closing_.push_back(conn);
+    }
+  }
+
+  const Options& opts_;
+  std::vector<Event> events_;
+  std::size_t next_ = 0;
+  tl::Dispatcher* disp_ = nullptr;
+  std::unique_ptr<tl::Connector> connector_;
+  int64_t start_ns_ = 0;
+  std::promise<void>* done_ = nullptr;
+  struct event tick_;
+  std::unordered_map<uint32_t, Conn> conns_;
+  std::vector<uint32_t> closing_;
+  uint64_t sent_ = 0;
+  uint64_t received_ = 0;
+  // bytes not sent, their connection failed or was closed.
+  uint64_t lost_ = 0;
+  int opened_ = 0;
+  int failed_ = 0;
+  int64_t max_late_ns_ = 0;
+};
+
+extern "C" void replay_tick_cb(evutil_socket_t, short, void* ptr) {
+  ((Worker*)ptr)->tick();
+}
+
+void usage(const char* prog) {
+  fprintf(stderr,
+          "usage: %s [-a addr] [-p port] [-t threads] [-x speed] trace...\n"
+          "  -x  speed up factor, 0 for as fast as possible, default 1\n",
+          prog);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Options opts;
+  int opt;
+  while ((opt = getopt(argc, argv, "a:p:t:x:")) != -1) {
+    switch (opt) {
+      case 'a':
+        opts.addr = optarg;
+        break;
+      case 'p':
+        opts.port = atoi(optarg);
+        break;
+      case 't':
+        opts.threads = atoi(optarg);
+        break;
+      case 'x':
+        opts.speed = atof(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind == argc || opts.threads <= 0 || opts.speed < 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::vector<std::unique_ptr<tl::TraceReader> > readers;
+  int64_t first_start = INT64_MAX;
+  for (int i = optind; i < argc; i++) {
+    readers.emplace_back(new tl::TraceReader());
+    if (readers.back()->open(argv[i]) < 0) {
+      fprintf(stderr, "cannot read trace %s: %s\n", argv[i], strerror(errno));
+      return 1;
+    }
+    first_start = std::min(first_start, readers.back()->header().start_ns);
+  }
+
+  std::vector<std::unique_ptr<Worker> > workers;
+  for (int i = 0; i < opts.threads; i++) {
+    workers.emplace_back(new Worker(opts));
+  }
+  uint32_t conns = 0;
+  uint64_t records = 0;
+  for (auto& r : readers) {
+    int64_t offset = r->header().start_ns - first_start;
+    // trace connection -> replayed connection.
+    std::unordered_map<uint64_t, uint32_t> ids;
+    tl::TraceRecord rec;
+    const char* data;
+    while (r->next(&rec, &data)) {
+      auto it = ids.find(rec.conn);
+      if (it == ids.end()) {
+        it = ids.emplace(rec.conn, conns++).first;
+      }
+      Event e = {rec.ts_ns + offset, it->second, rec.type, rec.len, data};
+      workers[e.conn % opts.threads]->events().push_back(e);
+      records++;
+    }
+  }
+  for (auto& w : workers) {
+    std::stable_sort(
+        w->events().begin(), w->events().end(),
+        [](const Event& a, const Event& b) { return a.at_ns < b.at_ns; });
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  evthread_use_pthreads();
+  spdlog::set_level(spdlog::level::warn);
+
+  std::vector<tl::Dispatcher> disps(opts.threads);
+  std::vector<std::promise<void> > done(opts.threads);
+  std::vector<std::thread> loops;
+  int64_t start_ns = nowNs() + 10000000;
+  for (int i = 0; i < opts.threads; i++) {
+    loops.emplace_back([&disps, i] { disps[i].dispatch(); });
+    Worker* w = workers[i].get();
+    tl::Dispatcher* d = &disps[i];
+    std::promise<void>* p = &done[i];
+    d->post([w, d, start_ns, p] { w->start(d, start_ns, p); });
+  }
+  for (auto& p : done) {
+    p.get_future().wait();
+  }
+  double secs = (nowNs() - start_ns) / 1e9;
+
+  uint64_t sent = 0, received = 0, lost = 0;
+  int opened = 0, failed = 0;
+  int64_t late = 0;
+  for (auto& w : workers) {
+    sent += w->sent();
+    received += w->received();
+    lost += w->lost();
+    opened += w->opened();
+    failed += w->failed();
+    late = std::max(late, w->maxLateNs());
+  }
+  printf("records=%llu conns=%u opened=%d failed=%d secs=%.2f sent=%llu "
+         "received=%llu lost=%llu max_late_us=%.1f\n",
+         (unsigned long long)records, conns, opened, failed, secs,
+         (unsigned long long)sent, (unsigned long long)received,
+         (unsigned long long)lost, late / 1e3);
+
+  for (int i = 0; i < opts.threads; i++) {
+    disps[i].stop();
+    loops[i].join();
+  }
+  // connections go with the dispatchers, before their protocols.
+  disps.clear();
+  workers.clear();
+  return failed ? 1 : 0;
+}
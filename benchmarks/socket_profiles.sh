@@ -0,0 +1,59 @@
+#!/bin/bash
+# Compare the socket option profiles of the server's "-O": for each one,
+# start the echo server with it and run short-lived connections (one request
+# each) and long-lived ones (small requests, then bulk), printing one result
+# line per case with the profile and the CPU time the server used.
+#
+#   benchmarks/socket_profiles.sh BUILD_DIR > results.txt
+#
+# PORT, DURATION (seconds per case), PROFILES (default "default short long",
+# each an "-O" spec) and LOADGEN_ARGS (default "-F", Fast Open connects) can
+# be set in the environment. Fast Open is only accepted by the server when
+# net.ipv4.tcp_fastopen has bit 2 set, e.g. 3.
+
+set -e
+
+build=${1:?usage: $0 BUILD_DIR}
+port=${PORT:-2290}
+duration=${DURATION:-5}
+profiles=${PROFILES:-default short long}
+loadgen_args=${LOADGEN_ARGS--F}
+
+server=
+stop() {
+  if [ -n "$server" ]; then
+    kill "$server" 2>/dev/null
+    wait "$server" 2>/dev/null || true
+    server=
+  fi
+}
+trap stop EXIT
+
+# user + system clock ticks of the server.
+cpu_ticks() {
+  awk '{ print $14 + $15 }' "/proc/$server/stat"
+}
+
+run() {
+  local before line
+  before=$(cpu_ticks)
+  # the result is the last line, after any warnings of loadgen itself.
+  # shellcheck disable=SC2086
+  line=$("$build/benchmarks/loadgen" -p "$port" -D "$duration" -w 1 \
+    $loadgen_args "$@" | tail -n 1)
+  echo "profile=$profile $line" \
+    "server_cpu_ms=$((($(cpu_ticks) - before) * 1000 / $(getconf CLK_TCK)))"
+}
+
+for profile in $profiles; do
+  "$build/multithread-libevent-example" -p "$port" -a 0 -O "$profile" \
+    >/dev/null 2>&1 &
+  server=$!
+  sleep 0.5
+  # short-lived: a connect per request.
+  run -c 32 -t 2 -s 64 -d 1 -n 1
+  # long-lived: request/response, then streaming.
+  run -c 16 -t 2 -s 64 -d 1
+  run -c 16 -t 2 -s 16384 -d 16
+  stop
+done
@@ -0,0 +1,36 @@
+#include "thread_pool.h"
+
+#include <atomic>
+#include <thread>
+
+#include "benchmark/benchmark.h"
+
+// Batches of empty tasks, tasks run per second. Arg: threads.
+static void BM_ThreadPoolThroughput(benchmark::State& state) {
+  tl::ThreadPool pool(state.range(0));
+  const int batch = 1024;
+  std::atomic<int> ran(0);
+  for (auto _ : state) {
+    ran.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < batch; i++) {
+      pool.post([&ran] { ran.fetch_add(1, std::memory_order_release); });
+    }
+    while (ran.load(std::memory_order_acquire) != batch) {
+      std::this_thread::yield();
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * batch);
+}
+BENCHMARK(BM_ThreadPoolThroughput)->RangeMultiplier(2)->Range(1, 8)
+    ->UseRealTime();
+
+// One task to an idle pool and wait for its future: the latency of waking a
+// worker up. Arg: threads.
+static void BM_ThreadPoolWakeup(benchmark::State& state) {
+  tl::ThreadPool pool(state.range(0));
+  for (auto _ : state) {
+    pool.post([] {}).wait();
+  }
+}
+BENCHMARK(BM_ThreadPoolWakeup)->RangeMultiplier(2)->Range(1, 8)
+    ->UseRealTime();
@@ -0,0 +1,184 @@
+// UDP echo rate and server CPU per datagram over loopback: a system call per
+// datagram, recvmmsg()/sendmmsg() batches, and batches with GSO and GRO.
+//
+// An echo UdpEndpoint runs on one dispatcher, a client endpoint on another
+// keeps "-w" datagrams of "-s" bytes in flight for "-d" seconds, sending one
+// more for each echo. Both ends use the same mode.
+//
+//   udp_bench [-d seconds] [-s size] [-w window] [-b batch]
+
+#include <getopt.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include "dispatcher.h"
+#include "event2/thread.h"
+#include "spdlog/spdlog.h"
+#include "udp_endpoint.h"
+
+namespace {
+
+double threadCpu() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double loopCpu(tl::Dispatcher* disp) {
+  std::promise<double> p;
+  disp->post([&p] { p.set_value(threadCpu()); });
+  return p.get_future().get();
+}
+
+// Keeps "window" datagrams in flight. Lives in its loop, but for received_.
+class Client {
+ public:
+  Client(const tl::UdpEndpoint::Options& opts, int server_port,
+         std::size_t size, int window)
+      : ep_("127.0.0.1", 0, opts), payload_(size, 'u'), window_(window) {
+    memset(&server_, 0, sizeof(server_));
+    server_.sin_family = AF_INET;
+    server_.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server_.sin_port = htons(server_port);
+  }
+
+  int open(tl::Dispatcher* disp) {
+    return ep_.open(disp, [this](tl::UdpEndpoint* ep, const tl::Datagram*,
+                                 int n) {
+      received_.add(n);
+      for (int i = 0; i < n; i++) {
+        ep->send(payload_.data(), payload_.size(), server_);
+      }
+      sent_ += n;
+    });
+  }
+
+  // Top the window up, after a stall too: what is missing since the last
+  // check is taken as lost.
+  void check() {
+    int64_t received = received_.value();
+    if (received == checked_) {
+      lost_ = sent_ - received;
+    }
+    checked_ = received;
+    for (; sent_ - received - lost_ < window_; sent_++) {
+      ep_.send(payload_.data(), payload_.size(), server_);
+    }
+    ep_.flush();
+  }
+
+  uint64_t received() const { return received_.value(); }
+
+ private:
+  tl::UdpEndpoint ep_;
+  sockaddr_in server_;
+  std::vector<char> payload_;
+  int64_t window_;
+  tl::Counter received_;
+  int64_t sent_ = 0;
+  int64_t lost_ = 0;
+  int64_t checked_ = -1;
+};
+
+void run(const char* mode, const tl::UdpEndpoint::Options& opts, double secs,
+         std::size_t size, int window) {
+  tl::Dispatcher server_disp;
+  tl::UdpEndpoint server("127.0.0.1", 0, opts);
+  if (server.open(&server_disp, [](tl::UdpEndpoint* ep,
+                                   const tl::Datagram* dgrams, int n) {
+        for (int i = 0; i < n; i++) {
+          ep->send(dgrams[i].data, dgrams[i].len, *dgrams[i].peer);
+        }
+      }) != 0) {
+    fprintf(stderr, "udp open failed\n");
+    exit(1);
+  }
+  tl::Dispatcher client_disp;
+  // the two loops share the CPUs, their waits are no stalls.
+  server_disp.profiler().setThreshold(0);
+  client_disp.profiler().setThreshold(0);
+  Client client(opts, server.port(), size, window);
+  if (client.open(&client_disp) != 0) {
+    fprintf(stderr, "udp open failed\n");
+    exit(1);
+  }
+  std::thread server_loop([&server_disp] { server_disp.dispatch(); });
+  std::thread client_loop([&client_disp] { client_disp.dispatch(); });
+
+  double cpu0 = loopCpu(&server_disp);
+  uint64_t got0 = client.received();
+  auto t0 = std::chrono::steady_clock::now();
+  double wall = 0;
+  while (wall < secs) {
+    client_disp.post([&client] { client.check(); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0)
+               .count();
+  }
+  uint64_t got = client.received() - got0;
+  double cpu = loopCpu(&server_disp) - cpu0;
+  const tl::DispatcherMetrics& m = server_disp.metrics();
+  client_disp.stop();
+  client_loop.join();
+  server_disp.stop();
+  server_loop.join();
+
+  printf("%-9s batch=%-3d gso=%d gro=%d echoed=%llu rate=%.0f/s "
+         "server_drops=%llu server_cpu=%.3fs cpu/dgram=%.3fus\n",
+         mode, opts.batch, server.gso(), server.gro(), (unsigned long long)got,
+         got / wall, (unsigned long long)m.datagrams_dropped.value(), cpu,
+         got ? cpu * 1e6 / got : 0.0);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  signal(SIGPIPE, SIG_IGN);
+  evthread_use_pthreads();
+  spdlog::set_level(spdlog::level::warn);
+
+  double secs = 3;
+  std::size_t size = 64;
+  int window = 256;
+  int batch = 64;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:s:w:b:")) != -1) {
+    switch (opt) {
+      case 'd':
+        secs = atof(optarg);
+        break;
+      case 's':
+        size = strtoul(optarg, nullptr, 10);
+        break;
+      case 'w':
+        window = atoi(optarg);
+        break;
+      case 'b':
+        batch = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr,
+                "usage: %s [-d seconds] [-s size] [-w window] [-b batch]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+
+  tl::UdpEndpoint::Options opts;
+  opts.batch = 1;
+  run("per-dgram", opts, secs, size, window);
+  opts.batch = batch;
+  run("batch", opts, secs, size, window);
+  opts.gso = true;
+  opts.gro = true;
+  run("gso+gro", opts, secs, size, window);
+  return 0;
+}
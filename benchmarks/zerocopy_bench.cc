@@ -0,0 +1,189 @@
+// Server CPU time per GB sent, with and without MSG_ZEROCOPY.
+//
+// A dispatcher serves length-prefixed requests asking for N bytes, a client
+// thread pulls "-g" GB through one connection. The CPU time of the dispatcher
+// thread is measured for each mode.
+//
+//   zerocopy_bench [-g GB] [-r response bytes] [-t zerocopy threshold]
+//
+// On loopback the kernel copies zero copy sends anyway (reported as
+// "copied"), use a real NIC to see the saving.
+
+#include <getopt.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <thread>
+
+#include "codec.h"
+#include "connection_table.h"
+#include "dispatcher.h"
+#include "listener.h"
+#include "protocol.h"
+
+namespace {
+
+using Codec = tl::LengthPrefixCodec<uint32_t>;
+
+// Request payload: 8 bytes big endian response size.
+struct BlobApp {
+  int onMessage(tl::Handler* h, const tl::Frame&, const tl::BufferView& payload,
+                tl::buffer& out) {
+    unsigned char n[8];
+    if (payload.copyTo(n, sizeof(n)) != sizeof(n)) {
+      return -1;
+    }
+    std::size_t left = tl::loadInt<uint64_t, true>(n);
+    out.default_chunk_size(1 << 20);
+    while (left > 0) {
+      void* p;
+      std::size_t len;
+      out.spaceChunk(p, len);
+      if (len > left) {
+        len = left;
+      }
+      memset(p, 'x', len);
+      out.spaceHaveSeted(len);
+      left -= len;
+    }
+    h->markDirty();
+    return 0;
+  }
+};
+
+double threadCpu() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// CPU time of the dispatch loop thread of "disp".
+double loopCpu(tl::Dispatcher* disp) {
+  std::promise<double> p;
+  disp->post([&p] { p.set_value(threadCpu()); });
+  return p.get_future().get();
+}
+
+int connectTo(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sa.sin_port = htons(port);
+  if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Pull "total" bytes with requests of "resp" bytes.
+bool pull(int fd, std::size_t total, std::size_t resp) {
+  static char sink[1 << 20];
+  unsigned char req[4 + 8];
+  tl::storeInt<uint32_t, true>(req, 8);
+  tl::storeInt<uint64_t, true>(req + 4, resp);
+  for (std::size_t got = 0; got < total;) {
+    if (write(fd, req, sizeof(req)) != (ssize_t)sizeof(req)) {
+      return false;
+    }
+    for (std::size_t left = resp; left > 0;) {
+      ssize_t n = read(fd, sink, left < sizeof(sink) ? left : sizeof(sink));
+      if (n <= 0) {
+        return false;
+      }
+      left -= n;
+    }
+    got += resp;
+  }
+  return true;
+}
+
+void run(const char* mode, int port, std::size_t threshold, std::size_t total,
+         std::size_t resp) {
+  tl::Dispatcher disp;
+  tl::FramedProtocol<Codec, BlobApp> proto;
+  disp.connections()->setProtocol(&proto);
+  disp.connections()->setZeroCopy(threshold);
+  tl::Listener ls("127.0.0.1", port);
+  if (ls.open(&disp, [](tl::Dispatcher* d, int fd) {
+        d->connections()->open(fd);
+      }) != 0) {
+    fprintf(stderr, "listen on %d failed\n", port);
+    exit(1);
+  }
+  std::thread loop([&disp] { disp.dispatch(); });
+
+  int fd = connectTo(port);
+  if (fd < 0) {
+    fprintf(stderr, "connect failed\n");
+    exit(1);
+  }
+  pull(fd, resp, resp);  // warm up
+  double cpu0 = loopCpu(&disp);
+  auto t0 = std::chrono::steady_clock::now();
+  bool ok = pull(fd, total, resp);
+  auto t1 = std::chrono::steady_clock::now();
+  double cpu1 = loopCpu(&disp);
+  close(fd);
+
+  std::size_t sends = 0, copied = 0;
+  std::promise<void> done;
+  disp.post([&] {
+    sends = disp.connections()->zeroCopySends();
+    copied = disp.connections()->zeroCopyCopied();
+    done.set_value();
+  });
+  done.get_future().wait();
+  disp.stop();
+  loop.join();
+
+  double gb = total / 1e9;
+  double wall = std::chrono::duration<double>(t1 - t0).count();
+  printf("%-9s ok=%d GB=%.2f wall=%.3fs GB/s=%.2f cpu=%.3fs cpu/GB=%.3fs "
+         "zc_sends=%zu copied=%zu\n",
+         mode, ok, gb, wall, gb / wall, cpu1 - cpu0, (cpu1 - cpu0) / gb, sends,
+         copied);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  signal(SIGPIPE, SIG_IGN);
+  spdlog::set_level(spdlog::level::warn);
+
+  double gb = 2;
+  std::size_t resp = 1 << 20;
+  std::size_t threshold = 256 << 10;
+  int opt;
+  while ((opt = getopt(argc, argv, "g:r:t:")) != -1) {
+    switch (opt) {
+      case 'g':
+        gb = atof(optarg);
+        break;
+      case 'r':
+        resp = strtoull(optarg, nullptr, 10);
+        break;
+      case 't':
+        threshold = strtoull(optarg, nullptr, 10);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-g GB] [-r bytes] [-t threshold]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+
+  std::size_t total = (std::size_t)(gb * 1e9);
+  run("copy", 2301, 0, total, resp);
+  run("zerocopy", 2302, threshold, total, resp);
+  return 0;
+}
@@ -1,5 +1,6 @@
 #include "buffer.h"
 #include <algorithm>
+#include <iterator>
 
 namespace tl {
 
@@ -31,7 +32,7 @@ std::size_t buffer::push(const void *data, const std::size_t len) {
   if (left_len > default_chunk_size_) {
     chunk_size = left_len;
   }
-  Chunk_ new_chunk(chunk_size);
+  Chunk_ new_chunk(chunk_size, allocator_);
   if (new_chunk.p == nullptr) {
     return len - left_len;
   }
@@ -50,7 +51,7 @@ std::size_t buffer::drain(const std::size_t len) {
     auto &ch = chunk_list_.back();
     if (len - drain_len >= ch.end - ch.offset) {
       drain_len += ch.end - ch.offset;
-      chunk_list_.pop_back();
+      popBack();
     } else {
       ch.offset += len - drain_len;
       size_ -= len;
@@ -74,7 +75,7 @@ void buffer::data(const void *&data, const std::size_t len) {
     return;
   }
 
-  Chunk_ new_chunk(len);
+  Chunk_ new_chunk(len, allocator_);
   if (new_chunk.p == nullptr) {
     data = nullptr;
     return;
@@ -90,7 +91,7 @@ void buffer::data(const void *&data, const std::size_t len) {
                 new_chunk.p + copied);
       copied += to_copy;
       if (to_copy >= ch.end - ch.offset) {
-        chunk_list_.pop_back();
+        popBack();
       } else {
         ch.offset += to_copy;
       }
@@ -107,6 +108,20 @@ void buffer::dataChunk(const void *&data, std::size_t &len) {
   len = ch.end - ch.offset;
 }
 
+std::size_t buffer::peek(struct iovec *iov, const std::size_t n) {
+  std::size_t i = 0;
+  for (auto it = chunk_list_.rbegin(); it != chunk_list_.rend() && i < n;
+       ++it) {
+    if (it->end == it->offset) {
+      continue;
+    }
+    iov[i].iov_base = it->p + it->offset;
+    iov[i].iov_len = it->end - it->offset;
+    i++;
+  }
+  return i;
+}
+
 void buffer::space(void *&buf, const std::size_t len) {
   if (!chunk_list_.empty()) {
     auto &ch = chunk_list_.front();
@@ -122,7 +137,7 @@ void buffer::space(void *&buf, const std::size_t len) {
   }
 
   auto newlen = std::max(len, default_chunk_size_);
-  Chunk_ new_chunk(newlen);
+  Chunk_ new_chunk(newlen, allocator_);
   buf = new_chunk.p;
   new_chunk.cap = newlen;
   chunk_list_.push_front(new_chunk);
@@ -138,7 +153,7 @@ void buffer::spaceChunk(void *&buf, std::size_t &len) {
       return;
     }
   }
-  Chunk_ new_chunk(default_chunk_size_);
+  Chunk_ new_chunk(default_chunk_size_, allocator_);
   new_chunk.cap = default_chunk_size_;
   buf = new_chunk.p;
   if (buf != nullptr) {
@@ -182,6 +197,47 @@ void buffer::swap(buffer &x) {
   std::swap(x.size_, size_);
   std::swap(x.default_chunk_size_, default_chunk_size_);
   std::swap(x.chunk_list_, chunk_list_);
+  std::swap(x.pinned_list_, pinned_list_);
+}
+
+void buffer::popBack() {
+  if (chunk_list_.back().pinned) {
+    pinned_list_.splice(pinned_list_.end(), chunk_list_,
+                        std::prev(chunk_list_.end()));
+  } else {
+    chunk_list_.pop_back();
+  }
+}
+
+// Whether "tag" is "done" or before it, with wrap around.
+static bool tagDone(uint32_t tag, uint32_t done) {
+  return (int32_t)(tag - done) <= 0;
+}
+
+void buffer::pin(const std::size_t len, const uint32_t tag) {
+  std::size_t cur = 0;
+  for (auto it = chunk_list_.rbegin(); it != chunk_list_.rend() && cur < len;
+       ++it) {
+    if (it->end == it->offset) {
+      continue;
+    }
+    it->pinned = true;
+    it->pin_tag = tag;
+    cur += it->end - it->offset;
+  }
 }
 
+void buffer::unpin(const uint32_t tag) {
+  while (!pinned_list_.empty() && tagDone(pinned_list_.front().pin_tag, tag)) {
+    pinned_list_.pop_front();
+  }
+  for (auto &ch : chunk_list_) {
+    if (ch.pinned && tagDone(ch.pin_tag, tag)) {
+      ch.pinned = false;
+    }
+  }
+}
+
+std::size_t buffer::pinnedChunks() { return pinned_list_.size(); }
+
 } // namespace tl
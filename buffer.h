@@ -1,8 +1,13 @@
 #pragma once
 
+#include <sys/uio.h>
+
 #include <cstddef>
+#include <cstdint>
 #include <list>
 
+#include "chunk_allocator.h"
+
 namespace tl {
 
 // buffer queue of bytes
@@ -26,6 +31,9 @@ public:
   // Get pointer to the first chunk's first data location. The output variable
   // "len" depends on the size of data of the last chunk.
   void dataChunk(const void *&data, std::size_t &len);
+  // Fill at most "n" iovecs with the data chunks from tail, for writev().
+  // Return the number of iovecs filled.
+  std::size_t peek(struct iovec *iov, const std::size_t n);
   // Get a pointer to a "len" bytes' size of free buffer chunk to set data.
   // "buf" be nullptr if EOM.
   void space(void *&buf, const std::size_t len);
@@ -42,19 +50,40 @@ public:
   std::size_t default_chunk_size();
   void default_chunk_size(const std::size_t size);
 
+  // Allocator of the chunks added from now on, nullptr for new[]. Each chunk
+  // goes back to the allocator it came from. Not swapped by swap().
+  ChunkAllocator *allocator() { return allocator_; }
+  void allocator(ChunkAllocator *alloc) { allocator_ = alloc; }
+
   // Reference to the ”i“'th element of data from tail.
   unsigned char &operator[](const std::size_t i);
 
   // Exchanges the contents of the container by the content of x.
   void swap(buffer&x);
 
+  // Keep the chunks holding the first "len" bytes of data from tail alive
+  // after they are drained, until unpin() with a tag not before "tag". For
+  // MSG_ZEROCOPY, the kernel reads the memory after send() returns.
+  void pin(const std::size_t len, const uint32_t tag);
+  // Release chunks pinned with tags up to "tag", in serial number order.
+  void unpin(const uint32_t tag);
+  // Number of drained chunks still pinned.
+  std::size_t pinnedChunks();
+
+  // Call "f(const unsigned char *p, std::size_t n)" on each continuous piece
+  // of the "len" bytes of data starting at "offset" from tail, in order. Data
+  // is not moved, unlike data().
+  template <class F>
+  void forEachSegment(std::size_t offset, std::size_t len, F &&f);
+
 
 private:
   using ElemType_ = unsigned char;
   struct Chunk_ {
-    Chunk_(std::size_t len) {
-      p = new ElemType_[len];
+    Chunk_(std::size_t len, ChunkAllocator *a) {
+      p = a ? static_cast<ElemType_ *>(a->allocate(len)) : new ElemType_[len];
       cap = len;
+      alloc = a;
     }
     // !!! IMPORTANT: ch.p = nullptr after copy.
     Chunk_(const Chunk_ &ch) {
@@ -62,24 +91,59 @@ private:
       offset = ch.offset;
       end = ch.end;
       cap = ch.cap;
+      pinned = ch.pinned;
+      pin_tag = ch.pin_tag;
+      alloc = ch.alloc;
     }
     ~Chunk_() {
-      if (p)
+      if (p && alloc)
+        alloc->deallocate(p, cap);
+      else if (p)
         delete[] p;
     }
     ElemType_ *p = nullptr;
     std::size_t offset = 0;
     std::size_t end = 0;
     std::size_t cap = 0;
+    // see pin().
+    bool pinned = false;
+    uint32_t pin_tag = 0;
+    // nullptr for new[].
+    ChunkAllocator *alloc = nullptr;
   };
 
+  // Remove the last chunk, keep it in pinned_list_ if pinned.
+  void popBack();
+
   // total data size
   std::size_t size_ = 0;
   // default chunk size
   std::size_t default_chunk_size_ = 4096;
+  ChunkAllocator *allocator_ = nullptr;
   // a list containing all chunks.
   // add data --> front .. chunk .. chunk .. end --> drain data
   std::list<Chunk_> chunk_list_;
+  // drained chunks waiting for unpin(), in drain order.
+  std::list<Chunk_> pinned_list_;
 };
 
+template <class F>
+void buffer::forEachSegment(std::size_t offset, std::size_t len, F &&f) {
+  for (auto it = chunk_list_.rbegin(); it != chunk_list_.rend() && len > 0;
+       ++it) {
+    std::size_t n = it->end - it->offset;
+    if (offset >= n) {
+      offset -= n;
+      continue;
+    }
+    n -= offset;
+    if (n > len) {
+      n = len;
+    }
+    f(static_cast<const unsigned char *>(it->p + it->offset + offset), n);
+    len -= n;
+    offset = 0;
+  }
+}
+
 } // namespace tl
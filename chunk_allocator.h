@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+
+namespace tl {
+
+// Where a buffer gets its chunks and a Slab its blocks, operator new when
+// none is set. Not thread safe unless an implementation says so.
+class ChunkAllocator {
+ public:
+  virtual ~ChunkAllocator() {}
+  // Like operator new: never nullptr, throws std::bad_alloc.
+  virtual void* allocate(std::size_t len) = 0;
+  // "len" is what "p" was allocated with.
+  virtual void deallocate(void* p, std::size_t len) = 0;
+};
+
+}  // namespace tl
@@ -0,0 +1,337 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "buffer.h"
+
+namespace tl {
+
+// Bytes [offset, offset + len) of the data of a buffer, may span several
+// chunks. Valid until the buffer is modified.
+class BufferView {
+ public:
+  BufferView(buffer* buf, std::size_t offset, std::size_t len)
+      : buf_(buf), offset_(offset), len_(len) {}
+
+  std::size_t size() const { return len_; }
+  bool empty() const { return len_ == 0; }
+
+  // Reference to the "i"'th byte of the view, walks chunks, so prefer
+  // forEachSegment() to scan.
+  unsigned char operator[](std::size_t i) const {
+    return (*buf_)[offset_ + i];
+  }
+
+  BufferView sub(std::size_t offset, std::size_t len) const {
+    if (offset > len_) {
+      offset = len_;
+    }
+    if (len > len_ - offset) {
+      len = len_ - offset;
+    }
+    return BufferView(buf_, offset_ + offset, len);
+  }
+
+  // Call "f(const unsigned char *p, std::size_t n)" on each continuous piece.
+  template <class F>
+  void forEachSegment(F&& f) const {
+    // an empty view may have no buffer, e.g. a failed upstream request.
+    if (len_ > 0) {
+      buf_->forEachSegment(offset_, len_, f);
+    }
+  }
+
+  // Copy the first "len" bytes to "dst", return the copied size.
+  std::size_t copyTo(void* dst, std::size_t len) const {
+    auto d = static_cast<unsigned char*>(dst);
+    std::size_t copied = 0;
+    sub(0, len).forEachSegment([&](const unsigned char* p, std::size_t n) {
+      memcpy(d + copied, p, n);
+      copied += n;
+    });
+    return copied;
+  }
+
+  bool equals(const void* data, std::size_t len) const {
+    if (len != len_) {
+      return false;
+    }
+    auto d = static_cast<const unsigned char*>(data);
+    bool eq = true;
+    forEachSegment([&](const unsigned char* p, std::size_t n) {
+      if (eq) {
+        eq = memcmp(p, d, n) == 0;
+      }
+      d += n;
+    });
+    return eq;
+  }
+
+  std::string toString() const {
+    std::string s(len_, '\0');
+    copyTo(&s[0], len_);
+    return s;
+  }
+
+ private:
+  buffer* buf_;
+  std::size_t offset_;
+  std::size_t len_;
+};
+
+// Copy "len" bytes to the free space of "out" with spaceChunk(), instead of
+// allocating a chunk for them like push() does.
+inline void writeSpace(buffer& out, const void* data, std::size_t len) {
+  auto p = static_cast<const unsigned char*>(data);
+  while (len > 0) {
+    void* space;
+    std::size_t n;
+    out.spaceChunk(space, n);
+    if (space == nullptr || n == 0) {
+      return;
+    }
+    if (n > len) {
+      n = len;
+    }
+    memcpy(space, p, n);
+    out.spaceHaveSeted(n);
+    p += n;
+    len -= n;
+  }
+}
+
+// "v" must not be a view of "out".
+inline void writeSpace(buffer& out, const BufferView& v) {
+  v.forEachSegment(
+      [&out](const unsigned char* p, std::size_t n) { writeSpace(out, p, n); });
+}
+
+// Return values of Codec::decode().
+constexpr int kDecodeError = -1;
+constexpr int kDecodeMore = 0;
+constexpr int kDecodeFrame = 1;
+
+// Layout of a frame in the input buffer: header, payload, trailer.
+struct Frame {
+  std::size_t header_len = 0;
+  std::size_t payload_len = 0;
+  std::size_t trailer_len = 0;
+  // message type and flags, 0 for codecs without them.
+  uint8_t type = 0;
+  uint8_t flags = 0;
+
+  std::size_t size() const { return header_len + payload_len + trailer_len; }
+};
+
+// Decoder state kept per connection between reads.
+struct CodecState {
+  // bytes already searched for a delimiter.
+  std::size_t scanned = 0;
+};
+
+// A codec is a class with static members:
+//
+//   // Find a frame at the tail of "in". Return kDecodeFrame and fill "f",
+//   // the caller must drain f.size() bytes before the next call. Return
+//   // kDecodeMore if data is not enough, kDecodeError if malformed.
+//   static int decode(buffer& in, CodecState& st, Frame& f);
+//   // Write the header/trailer of frame "f" into the free space of "out".
+//   static void writeHeader(buffer& out, const Frame& f);
+//   static void writeTrailer(buffer& out, const Frame& f);
+//
+// They are template parameters of FramedProtocol and encode(), so the byte
+// level code is specialized for each codec at compile time.
+
+template <class T, bool kBigEndian>
+inline T loadInt(const unsigned char* p) {
+  T v = 0;
+  for (std::size_t i = 0; i < sizeof(T); i++) {
+    std::size_t shift = kBigEndian ? (sizeof(T) - 1 - i) * 8 : i * 8;
+    v |= (T)((T)p[i] << shift);
+  }
+  return v;
+}
+
+template <class T, bool kBigEndian>
+inline void storeInt(unsigned char* p, T v) {
+  for (std::size_t i = 0; i < sizeof(T); i++) {
+    std::size_t shift = kBigEndian ? (sizeof(T) - 1 - i) * 8 : i * 8;
+    p[i] = (unsigned char)(v >> shift);
+  }
+}
+
+// | payload length (LenT) | payload |
+template <class LenT = uint32_t, bool kBigEndian = true,
+          std::size_t kMaxPayload = 16 << 20>
+struct LengthPrefixCodec {
+  static constexpr std::size_t kHeaderLen = sizeof(LenT);
+
+  static int decode(buffer& in, CodecState&, Frame& f) {
+    if (in.size() < kHeaderLen) {
+      return kDecodeMore;
+    }
+    unsigned char hdr[kHeaderLen];
+    BufferView(&in, 0, kHeaderLen).copyTo(hdr, kHeaderLen);
+    std::size_t len = loadInt<LenT, kBigEndian>(hdr);
+    if (len > kMaxPayload) {
+      return kDecodeError;
+    }
+    if (in.size() < kHeaderLen + len) {
+      return kDecodeMore;
+    }
+    f = Frame();
+    f.header_len = kHeaderLen;
+    f.payload_len = len;
+    return kDecodeFrame;
+  }
+
+  static void writeHeader(buffer& out, const Frame& f) {
+    unsigned char hdr[kHeaderLen];
+    storeInt<LenT, kBigEndian>(hdr, (LenT)f.payload_len);
+    writeSpace(out, hdr, kHeaderLen);
+  }
+
+  static void writeTrailer(buffer&, const Frame&) {}
+};
+
+// | payload | delimiter |, e.g. DelimiterCodec<4096, '\r', '\n'> for lines.
+template <std::size_t kMaxPayload, char... kDelim>
+struct DelimiterCodec {
+  static_assert(sizeof...(kDelim) > 0, "empty delimiter");
+  static constexpr std::size_t kDelimLen = sizeof...(kDelim);
+  static constexpr char kDelimBytes[kDelimLen] = {kDelim...};
+
+  static int decode(buffer& in, CodecState& st, Frame& f) {
+    const std::size_t size = in.size();
+    const std::size_t npos = (std::size_t)-1;
+    std::size_t found = npos;
+    std::size_t pos = st.scanned;
+
+    // memchr for the first delimiter byte, then check the rest.
+    in.forEachSegment(
+        st.scanned, size - st.scanned,
+        [&](const unsigned char* p, std::size_t n) {
+          const unsigned char* q = p;
+          const unsigned char* e = p + n;
+          while (found == npos && q < e) {
+            auto c = static_cast<const unsigned char*>(
+                memchr(q, (unsigned char)kDelimBytes[0], e - q));
+            if (c == nullptr) {
+              break;
+            }
+            std::size_t at = pos + (c - p);
+            if (matchRest(in, at, size)) {
+              found = at;
+            }
+            q = c + 1;
+          }
+          pos += n;
+        });
+
+    if (found == npos) {
+      // a partial delimiter can only be in the last kDelimLen - 1 bytes.
+      st.scanned = size >= kDelimLen - 1 ? size - (kDelimLen - 1) : 0;
+      return size > kMaxPayload + kDelimLen ? kDecodeError : kDecodeMore;
+    }
+    if (found > kMaxPayload) {
+      return kDecodeError;
+    }
+    st.scanned = 0;
+    f = Frame();
+    f.payload_len = found;
+    f.trailer_len = kDelimLen;
+    return kDecodeFrame;
+  }
+
+  static void writeHeader(buffer&, const Frame&) {}
+
+  static void writeTrailer(buffer& out, const Frame&) {
+    writeSpace(out, kDelimBytes, kDelimLen);
+  }
+
+ private:
+  static bool matchRest(buffer& in, std::size_t at, std::size_t size) {
+    if (at + kDelimLen > size) {
+      return false;
+    }
+    for (std::size_t i = 1; i < kDelimLen; i++) {
+      if (in[at + i] != (unsigned char)kDelimBytes[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+// | magic (2) | type (1) | flags (1) | payload length (4) | payload |
+// integers in network byte order.
+template <uint16_t kMagic = 0x544c, std::size_t kMaxPayload = 16 << 20>
+struct BinaryHeaderCodec {
+  static constexpr std::size_t kHeaderLen = 8;
+
+  static int decode(buffer& in, CodecState&, Frame& f) {
+    if (in.size() < kHeaderLen) {
+      return kDecodeMore;
+    }
+    unsigned char hdr[kHeaderLen];
+    BufferView(&in, 0, kHeaderLen).copyTo(hdr, kHeaderLen);
+    if (loadInt<uint16_t, true>(hdr) != kMagic) {
+      return kDecodeError;
+    }
+    std::size_t len = loadInt<uint32_t, true>(hdr + 4);
+    if (len > kMaxPayload) {
+      return kDecodeError;
+    }
+    if (in.size() < kHeaderLen + len) {
+      return kDecodeMore;
+    }
+    f = Frame();
+    f.header_len = kHeaderLen;
+    f.payload_len = len;
+    f.type = hdr[2];
+    f.flags = hdr[3];
+    return kDecodeFrame;
+  }
+
+  static void writeHeader(buffer& out, const Frame& f) {
+    unsigned char hdr[kHeaderLen];
+    storeInt<uint16_t, true>(hdr, kMagic);
+    hdr[2] = f.type;
+    hdr[3] = f.flags;
+    storeInt<uint32_t, true>(hdr + 4, (uint32_t)f.payload_len);
+    writeSpace(out, hdr, kHeaderLen);
+  }
+
+  static void writeTrailer(buffer&, const Frame&) {}
+};
+
+// Encode a frame of "len" bytes of "data" into "out".
+template <class Codec>
+void encode(buffer& out, const void* data, std::size_t len, uint8_t type = 0,
+            uint8_t flags = 0) {
+  Frame f;
+  f.payload_len = len;
+  f.type = type;
+  f.flags = flags;
+  Codec::writeHeader(out, f);
+  writeSpace(out, data, len);
+  Codec::writeTrailer(out, f);
+}
+
+// Encode a frame whose payload is "payload", without linearizing it.
+template <class Codec>
+void encode(buffer& out, const BufferView& payload, uint8_t type = 0,
+            uint8_t flags = 0) {
+  Frame f;
+  f.payload_len = payload.size();
+  f.type = type;
+  f.flags = flags;
+  Codec::writeHeader(out, f);
+  writeSpace(out, payload);
+  Codec::writeTrailer(out, f);
+}
+
+}  // namespace tl
@@ -0,0 +1,232 @@
+#include "connection_table.h"
+
+#include "log.h"
+#include "spdlog/spdlog.h"
+#include "trace.h"
+
+namespace tl {
+
+// how often a lingering socket polls its error queue, and for how long.
+static const int64_t kLingerPollUs = 1000;
+static const int64_t kLingerTimeoutUs = 10000000;
+
+extern "C" void linger_event_cb(evutil_socket_t, short, void* ptr) {
+  auto l = (ConnectionTable::Linger*)ptr;
+  l->table->reapLinger(l);
+}
+
+ConnectionTable::ConnectionTable(Dispatcher* disp) : disp_(disp) {
+  proto_ = &echo_;
+}
+
+ConnectionTable::~ConnectionTable() {
+  while (!live_.empty()) {
+    close(live_.back());
+  }
+  while (!lingering_.empty()) {
+    freeLinger(lingering_.back(), true);
+  }
+}
+
+Handler* ConnectionTable::open(int fd, Protocol* proto) {
+  Handler* h = nullptr;
+  try {
+    h = slab_.create(disp_, fd, proto ? proto : proto_);
+  } catch (const std::exception& e) {
+    SPDLOG_ERROR("fd={}, create handler failed: {}", fd, e.what());
+    return nullptr;
+  }
+
+  if ((std::size_t)fd >= by_fd_.size()) {
+    by_fd_.resize(fd + 1, nullptr);
+  }
+  by_fd_[fd] = h;
+  h->table_pos_ = live_.size();
+  live_.push_back(h);
+  if (TraceWriter* trace = disp_->trace()) {
+    trace->record(kTraceOpen, id(h), nullptr, 0);
+  }
+  disp_->metrics().conns_opened.add();
+  disp_->metrics().connections.set(live_.size());
+  if (h->proto_->onOpen(h) < 0) {
+    close(h);
+    return nullptr;
+  }
+  return h;
+}
+
+void ConnectionTable::close(Handler* h) {
+  h->proto_->onClose(h);
+  if (TraceWriter* trace = disp_->trace()) {
+    trace->record(kTraceClose, id(h), nullptr, 0);
+  }
+  // swap-remove from the dense array.
+  Handler* last = live_.back();
+  live_[h->table_pos_] = last;
+  last->table_pos_ = h->table_pos_;
+  live_.pop_back();
+
+  by_fd_[h->fd()] = nullptr;
+  buffered_ -= h->buffered_;
+  disp_->metrics().buffered_bytes.set(buffered_);
+  if (h->zeroCopyInflight()) {
+    linger(h);
+  }
+  slab_.destroy(h);
+  disp_->metrics().conns_closed.add();
+  disp_->metrics().connections.set(live_.size());
+}
+
+void ConnectionTable::account(Handler* h) {
+  std::size_t now = h->read_buf_.size() + h->write_buf_.size();
+  buffered_ += now - h->buffered_;
+  h->buffered_ = now;
+  disp_->metrics().buffered_bytes.set(buffered_);
+}
+
+int ConnectionTable::detach(Handler* h, std::string* in) {
+  // the completions would go to the new owner.
+  if (h->zeroCopyInflight()) {
+    errno = EBUSY;
+    return -1;
+  }
+  int fd = dup(h->fd());
+  if (fd < 0) {
+    return -1;
+  }
+  *in = BufferView(&h->read_buf_, 0, h->read_buf_.size()).toString();
+  close(h);
+  return fd;
+}
+
+void ConnectionTable::linger(Handler* h) {
+  auto l = new Linger;
+  l->table = this;
+  l->fd = h->fd_;
+  l->pinned.swap(h->write_buf_);
+  l->seq = h->zc_seq_;
+  l->acked = h->zc_acked_;
+  l->deadline_us = disp_->loopTimeUs() + kLingerTimeoutUs;
+  h->fd_ = -1;
+  // the peer gets no more reads, nothing more is sent.
+  shutdown(l->fd, SHUT_RD);
+  evtimer_assign(&l->ev, disp_->ev_base(), linger_event_cb, l);
+  lingering_.push_back(l);
+  reapLinger(l);
+}
+
+void ConnectionTable::reapLinger(Linger* l) {
+  if (Handler::reapCompletions(l->fd, l->pinned, l->seq, &l->acked,
+                               &zc_copied_) != 0) {
+    TL_ERROR_RL(errno, "fd={}, error queue, errno={} {}", l->fd, errno,
+                strerror(errno));
+    freeLinger(l, true);
+    return;
+  }
+  if (l->seq == l->acked) {
+    freeLinger(l, false);
+    return;
+  }
+  if (disp_->loopTimeUs() >= l->deadline_us) {
+    TL_WARN_RL(ETIMEDOUT, "fd={}, {} zero copy sends not completed, reset",
+               l->fd, l->seq - l->acked);
+    freeLinger(l, true);
+    return;
+  }
+  timeval tv;
+  tv.tv_sec = 0;
+  tv.tv_usec = kLingerPollUs;
+  evtimer_add(&l->ev, &tv);
+}
+
+void ConnectionTable::freeLinger(Linger* l, bool reset) {
+  evtimer_del(&l->ev);
+  if (reset) {
+    // drop the send queue at once, so the kernel is done with the chunks
+    // before they are freed.
+    struct linger lg;
+    lg.l_onoff = 1;
+    lg.l_linger = 0;
+    setsockopt(l->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+  }
+  ::close(l->fd);
+  for (std::size_t i = 0; i < lingering_.size(); i++) {
+    if (lingering_[i] == l) {
+      lingering_[i] = lingering_.back();
+      lingering_.pop_back();
+      break;
+    }
+  }
+  delete l;
+}
+
+Handler* ConnectionTable::find(int fd) const {
+  if (fd < 0 || (std::size_t)fd >= by_fd_.size()) {
+    return nullptr;
+  }
+  return by_fd_[fd];
+}
+
+void ConnectionTable::markDirty(Handler* h) {
+  if (dirty_.empty()) {
+    disp_->scheduleFlush();
+  }
+  dirty_.push_back(id(h));
+}
+
+void ConnectionTable::flush() {
+  // handlers may mark themselves dirty again while flushing.
+  flushing_.swap(dirty_);
+  for (auto cid : flushing_) {
+    Handler* h = get(cid);
+    if (h == nullptr) {
+      continue;  // closed after marked
+    }
+    h->dirty_ = false;
+    if (h->handleWrite() != 0) {
+      TL_ERROR_RL(errno, "fd={}, write error, errno={} {}", h->fd(), errno,
+                  strerror(errno));
+      h->close();
+    }
+  }
+  flushing_.clear();
+}
+
+void ConnectionTable::markReady(Handler* h) {
+  if (h->ready_) {
+    return;
+  }
+  h->ready_ = true;
+  if (ready_.empty()) {
+    disp_->scheduleReady();
+  }
+  ready_.push_back(id(h));
+}
+
+void ConnectionTable::serveReady() {
+  // connections still backlogged queue themselves again, at the end.
+  serving_.swap(ready_);
+  for (auto cid : serving_) {
+    Handler* h = get(cid);
+    if (h == nullptr) {
+      continue;
+    }
+    h->ready_ = false;
+    if (h->pendingWrite()) {
+      continue;  // reads again after the write buffer is flushed
+    }
+    if (h->handleRead() != 0) {
+      if (errno == 0) {
+        SPDLOG_DEBUG("fd={}, closed by peer", h->fd());
+      } else {
+        TL_ERROR_RL(errno, "fd={}, read error, errno={} {}", h->fd(), errno,
+                    strerror(errno));
+        disp_->metrics().errors.add();
+      }
+      h->close();
+    }
+  }
+  serving_.clear();
+}
+
+}  // namespace tl
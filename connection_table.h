@@ -0,0 +1,189 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "dispatcher.h"
+#include "handler.h"
+#include "protocol.h"
+#include "slab.h"
+
+namespace tl {
+
+extern "C" void linger_event_cb(evutil_socket_t, short what, void* ptr);
+
+// Identify a connection across threads and callbacks, stale ids are detected.
+using ConnId = Slab<Handler>::Handle;
+
+// Per-dispatcher set of connections. Handlers live in a slab owned by the
+// table, indexed by fd for lookup and packed in a dense array for iteration.
+// Not thread safe, only use it inside the dispatch loop of its dispatcher.
+class ConnectionTable {
+ public:
+  explicit ConnectionTable(Dispatcher* disp);
+  ~ConnectionTable();
+  ConnectionTable(const ConnectionTable&) = delete;
+  ConnectionTable& operator=(const ConnectionTable&) = delete;
+
+  // Create a handler for accepted socket "fd" speaking "proto", or the
+  // default protocol if nullptr. Return nullptr on failure or if
+  // Protocol::onOpen() refuses it, "fd" is closed in that case.
+  Handler* open(int fd, Protocol* proto = nullptr);
+  // Destroy "h", closing its socket. With zero copy sends in flight, the
+  // socket and the chunks they pinned linger until the kernel completes
+  // them, see lingering().
+  void close(Handler* h);
+  // Destroy "h" but keep the connection open for another process: return a
+  // dup of its socket and its unconsumed input in "in". -1 if dup() fails or
+  // zero copy sends are in flight, "h" is left alone then.
+  int detach(Handler* h, std::string* in);
+
+  // Return nullptr if no connection on "fd".
+  Handler* find(int fd) const;
+  // Return nullptr if the connection of "id" has been closed.
+  Handler* get(ConnId id) const { return slab_.get(id); }
+  ConnId id(const Handler* h) const { return slab_.handle(h); }
+
+  std::size_t size() const { return live_.size(); }
+  // Bytes in the read and write buffers of all connections.
+  std::size_t buffered() const { return buffered_; }
+  // Update buffered() after the buffers of "h" changed.
+  void account(Handler* h);
+
+  // Allocate the Handlers and their buffers from "alloc", before the first
+  // open(). Not owned.
+  void setAllocator(ChunkAllocator* alloc) {
+    alloc_ = alloc;
+    slab_.setAllocator(alloc);
+  }
+  ChunkAllocator* allocator() const { return alloc_; }
+
+  // Protocol of connections opened without one, echo by default. Not owned.
+  void setProtocol(Protocol* proto) { proto_ = proto; }
+
+  // Queue "h" to be flushed once the I/O callbacks of this loop iteration
+  // have run.
+  void markDirty(Handler* h);
+  // Write out all dirty connections, called by the dispatcher.
+  void flush();
+
+  // Send with MSG_MORE while a flush needs more than one sendmsg(), so the
+  // kernel does not push partial segments.
+  void setCork(bool cork) { cork_ = cork; }
+  bool cork() const { return cork_; }
+
+  // Bytes a connection may read per turn, 0 for unlimited. A connection that
+  // uses up its budget is queued in the ready list, served round robin once
+  // per loop iteration with deficit round robin, so a bulk sender cannot
+  // delay the small requests of other connections on the same loop.
+  void setReadBudget(std::size_t bytes) { read_budget_ = bytes; }
+  std::size_t readBudget() const { return read_budget_; }
+  // Limit reads of connections opened after this call to "rate" bytes per
+  // second with bursts of "burst" bytes, one second of "rate" if 0. "rate"
+  // 0 for no limit.
+  void setRateLimit(std::size_t rate, std::size_t burst) {
+    rate_ = rate;
+    burst_ = burst ? burst : rate;
+  }
+  std::size_t rateLimit() const { return rate_; }
+  std::size_t rateBurst() const { return burst_; }
+
+  // Queue "h", which has data left to read, to read again in the next loop
+  // iteration.
+  void markReady(Handler* h);
+  // Let each connection in the ready list read once, called by the
+  // dispatcher.
+  void serveReady();
+
+  // Send batches of at least "threshold" bytes with MSG_ZEROCOPY on
+  // connections opened after this call, 0 to disable. Worth it for hundreds
+  // of KB, below that page pinning and completions cost more than the copy.
+  void setZeroCopy(std::size_t threshold) { zc_threshold_ = threshold; }
+  std::size_t zeroCopyThreshold() const { return zc_threshold_; }
+  // Zero copy sends, and those the kernel ended up copying (e.g. loopback).
+  std::size_t zeroCopySends() const { return zc_sends_; }
+  std::size_t zeroCopyCopied() const { return zc_copied_; }
+  // Closed connections waiting for their zero copy sends to complete. Their
+  // input is shut down, and they are reset after 10 seconds.
+  std::size_t lingering() const { return lingering_.size(); }
+
+  // Set SO_BUSY_POLL to "us" on sockets opened after this call, so a read
+  // finding the socket empty polls the device queue that long. Raising it
+  // above net.core.busy_read needs CAP_NET_ADMIN. 0 to leave it unset.
+  void setBusyPoll(int us) { busy_poll_us_ = us; }
+  int busyPoll() const { return busy_poll_us_; }
+  // Set TCP_QUICKACK after every read that got data, so requests are ACKed
+  // at once. The kernel leaves quick ACK mode by itself, and accepted
+  // sockets do not inherit it, see SocketOptions.
+  void setQuickAck(bool on) { quickack_ = on; }
+  bool quickAck() const { return quickack_; }
+
+  // Call "f(Handler*)" on every connection. "f" may close the handler it is
+  // called with, but no other one.
+  template <class F>
+  void forEach(F&& f);
+
+ private:
+  friend class Handler;
+  friend void linger_event_cb(evutil_socket_t, short what, void* ptr);
+
+  // The socket and write buffer of a connection closed with zero copy sends
+  // in flight, see Handler::reapCompletions().
+  struct Linger {
+    ConnectionTable* table;
+    int fd;
+    buffer pinned;
+    uint32_t seq;
+    uint32_t acked;
+    int64_t deadline_us;
+    // timer polling the error queue: the socket itself is always readable
+    // once shut down.
+    struct event ev;
+  };
+  // Take the socket and write buffer of "h" into a Linger.
+  void linger(Handler* h);
+  // Reap the completions of "l", close and free it when done or late.
+  void reapLinger(Linger* l);
+  void freeLinger(Linger* l, bool reset);
+
+  Dispatcher* disp_;
+  Protocol* proto_;
+  EchoProtocol echo_;
+  ChunkAllocator* alloc_ = nullptr;
+  Slab<Handler> slab_;
+  // fd -> handler, nullptr if none.
+  std::vector<Handler*> by_fd_;
+  // live handlers, Handler::table_pos_ is the index of itself.
+  std::vector<Handler*> live_;
+  // connections to flush, and the list being flushed.
+  std::vector<ConnId> dirty_;
+  std::vector<ConnId> flushing_;
+  // connections with data left to read, and the list being served.
+  std::vector<ConnId> ready_;
+  std::vector<ConnId> serving_;
+  std::size_t read_budget_ = 64 << 10;
+  std::size_t rate_ = 0;
+  std::size_t burst_ = 0;
+  bool cork_ = false;
+  std::size_t buffered_ = 0;
+  std::size_t zc_threshold_ = 0;
+  std::size_t zc_sends_ = 0;
+  std::size_t zc_copied_ = 0;
+  std::vector<Linger*> lingering_;
+  int busy_poll_us_ = 0;
+  bool quickack_ = false;
+};
+
+template <class F>
+void ConnectionTable::forEach(F&& f) {
+  // backward, so closing the current one only moves a visited handler.
+  for (std::size_t i = live_.size(); i > 0; i--) {
+    if (i - 1 < live_.size()) {
+      f(live_[i - 1]);
+    }
+  }
+}
+
+}  // namespace tl
@@ -0,0 +1,116 @@
+#include "connector.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "event2/event.h"
+#include "event2/util.h"
+#include "spdlog/spdlog.h"
+
+namespace tl {
+
+struct PendingConnect {
+  Connector* connector;
+  int fd;
+  struct event* ev;
+  Connector::Callback cb;
+};
+
+extern "C" void connector_event_cb(evutil_socket_t fd, short what,
+                                   void* ptr) {
+  auto pc = (PendingConnect*)ptr;
+  pc->connector->pending_.erase(pc);
+  event_free(pc->ev);
+  int err = 0;
+  if (what & EV_TIMEOUT) {
+    err = ETIMEDOUT;
+  } else {
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+      err = errno;
+    }
+  }
+  if (err != 0) {
+    close(fd);
+    errno = err;
+    pc->cb(-1);
+  } else {
+    pc->cb(fd);
+  }
+  delete pc;
+}
+
+Connector::~Connector() {
+  for (PendingConnect* pc : pending_) {
+    event_free(pc->ev);
+    close(pc->fd);
+    delete pc;
+  }
+}
+
+void Connector::cancel() {
+  std::unordered_set<PendingConnect*> pending;
+  pending.swap(pending_);
+  for (PendingConnect* pc : pending) {
+    event_free(pc->ev);
+    close(pc->fd);
+    errno = ECANCELED;
+    pc->cb(-1);
+    delete pc;
+  }
+}
+
+int Connector::connect(const std::string& addr, int port, Callback cb,
+                       int timeout_ms) {
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons((unsigned short)port);
+  if (inet_pton(AF_INET, addr.c_str(), &sa.sin_addr) != 1) {
+    SPDLOG_ERROR("bad address {}", addr);
+    errno = EINVAL;
+    return -1;
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    SPDLOG_ERROR("socket() failed, errno={}, {}", errno, strerror(errno));
+    return -1;
+  }
+  int one = 1;
+  if (fastopen_ && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one,
+                              sizeof(one)) < 0) {
+    SPDLOG_WARN("TCP_FASTOPEN_CONNECT errno={} {}", errno, strerror(errno));
+  }
+  if (::connect(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0 &&
+      errno != EINPROGRESS) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+
+  // writable when connected or failed, even if connect() finished at once.
+  auto pc = new PendingConnect{this, fd, nullptr, std::move(cb)};
+  pc->ev = event_new(disp_->ev_base(), fd, EV_WRITE, connector_event_cb, pc);
+  struct timeval tv;
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+  if (pc->ev == nullptr || event_add(pc->ev, &tv) < 0) {
+    if (pc->ev) {
+      event_free(pc->ev);
+    }
+    close(fd);
+    delete pc;
+    return -1;
+  }
+  pending_.insert(pc);
+  return 0;
+}
+
+}  // namespace tl
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <unordered_set>
+
+#include "dispatcher.h"
+#include "event2/util.h"
+
+namespace tl {
+
+struct PendingConnect;
+
+extern "C" void connector_event_cb(evutil_socket_t fd, short what,
+                                   void* ptr);
+
+// Nonblocking outbound TCP connect on a dispatcher.
+class Connector {
+ public:
+  using Callback = std::function<void(int fd)>;
+
+  explicit Connector(Dispatcher* disp) : disp_(disp) {}
+  // Drop the connects in progress, their callbacks are not called.
+  ~Connector();
+  Connector(const Connector&) = delete;
+  Connector& operator=(const Connector&) = delete;
+
+  // Start connecting to "addr:port". "cb" is called inside the dispatch loop
+  // with the connected nonblocking socket, or with -1 and errno set if the
+  // connect failed or did not finish in "timeout_ms". Return -1 if the
+  // connect cannot be started, "cb" is not called in that case.
+  // Only call it inside the dispatch loop.
+  int connect(const std::string& addr, int port, Callback cb,
+              int timeout_ms = 10000);
+
+  // Connect with TCP_FASTOPEN_CONNECT: connect() returns at once and the
+  // first write goes out in the SYN, once the server has given this host a
+  // cookie. Needs bit 1 of net.ipv4.tcp_fastopen.
+  void setFastOpen(bool on) { fastopen_ = on; }
+
+  // Stop the connects in progress, calling their callbacks with -1 and errno
+  // ECANCELED. They must not connect again. Inside the dispatch loop.
+  void cancel();
+
+  Dispatcher* dispatcher() { return disp_; }
+
+ private:
+  friend void connector_event_cb(evutil_socket_t fd, short what, void* ptr);
+
+  Dispatcher* disp_;
+  bool fastopen_ = false;
+  std::unordered_set<PendingConnect*> pending_;
+};
+
+}  // namespace tl
@@ -0,0 +1,306 @@
+#include "coro.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <cstdint>
+#include <new>
+
+#include "connection_table.h"
+#include "log.h"
+#include "spdlog/spdlog.h"
+
+namespace tl {
+
+namespace {
+
+// A freed frame, linked through its own memory.
+struct FreeFrame {
+  FreeFrame* next;
+};
+
+struct FreeLists {
+  ~FreeLists() {
+    for (auto& l : lists) {
+      while (l.head) {
+        FreeFrame* f = l.head;
+        l.head = f->next;
+        ::operator delete(f);
+      }
+    }
+    // frames freed later on this thread go to operator delete.
+    enabled = false;
+  }
+
+  struct List {
+    FreeFrame* head = nullptr;
+    std::size_t size = 0;
+  };
+  List lists[FramePool::kMaxSize / FramePool::kClassSize];
+  bool enabled = true;
+};
+
+thread_local FreeLists free_lists;
+
+// Offset of "delim" in "in" at or after "from", SIZE_MAX if none.
+std::size_t find(buffer& in, std::size_t from, std::string_view delim) {
+  std::size_t size = in.size();
+  std::size_t found = SIZE_MAX;
+  std::size_t pos = from;
+  in.forEachSegment(from, size - from, [&](const unsigned char* p,
+                                           std::size_t n) {
+    for (std::size_t i = 0; found == SIZE_MAX && i < n; i++) {
+      const void* hit = memchr(p + i, (unsigned char)delim[0], n - i);
+      if (!hit) {
+        break;
+      }
+      i = (const unsigned char*)hit - p;
+      if (pos + i + delim.size() <= size &&
+          BufferView(&in, pos + i, delim.size())
+              .equals(delim.data(), delim.size())) {
+        found = pos + i;
+      }
+    }
+    pos += n;
+  });
+  return found;
+}
+
+}  // namespace
+
+void* FramePool::allocate(std::size_t n) {
+  if (n == 0 || n > kMaxSize) {
+    return ::operator new(n);
+  }
+  std::size_t c = (n - 1) / kClassSize;
+  FreeLists::List& l = free_lists.lists[c];
+  if (l.head && free_lists.enabled) {
+    FreeFrame* f = l.head;
+    l.head = f->next;
+    l.size--;
+    return f;
+  }
+  // the whole class, the frame may be reused for a bigger one of it.
+  return ::operator new((c + 1) * kClassSize);
+}
+
+void FramePool::deallocate(void* p, std::size_t n) noexcept {
+  if (n == 0 || n > kMaxSize) {
+    ::operator delete(p);
+    return;
+  }
+  FreeLists::List& l = free_lists.lists[(n - 1) / kClassSize];
+  if (!free_lists.enabled || l.size >= kMaxFree) {
+    ::operator delete(p);
+    return;
+  }
+  FreeFrame* f = static_cast<FreeFrame*>(p);
+  f->next = l.head;
+  l.head = f;
+  l.size++;
+}
+
+void FramePool::setEnabled(bool on) { free_lists.enabled = on; }
+
+extern "C" void conn_event_cb(evutil_socket_t, short, void* ptr) {
+  Conn* c = (Conn*)ptr;
+  Handler* h = c->h_;
+  LoopProfiler::Scope prof(h->dispatcher()->profiler(),
+                           LoopProfiler::kHandler, h->fd());
+  if (c->closing_) {
+    h->close();
+    return;
+  }
+  if (c->wait_ == Conn::kWrite && !c->ready()) {
+    return;
+  }
+  if (c->proto_->resume(c) < 0) {
+    h->close();
+    return;
+  }
+  h->dispatcher()->connections()->account(h);
+}
+
+Conn::Conn(CoroProtocol* proto, Handler* h) : proto_(proto), h_(h) {
+  event_assign(&ev_, h->dispatcher()->ev_base(), -1, 0, conn_event_cb, this);
+}
+
+Conn::~Conn() { event_del(&ev_); }
+
+Conn::Awaiter<BufferView> Conn::read(std::size_t n) {
+  consume();
+  wait_ = kRead;
+  want_ = n;
+  return {this};
+}
+
+Conn::Awaiter<BufferView> Conn::readUntil(std::string_view delim,
+                                          std::size_t max) {
+  consume();
+  wait_ = kReadUntil;
+  delim_ = delim;
+  max_ = max;
+  scanned_ = 0;
+  return {this};
+}
+
+Conn::Awaiter<void> Conn::write(const void* data, std::size_t len) {
+  push(data, len);
+  consume();
+  wait_ = kWrite;
+  return {this};
+}
+
+Conn::Awaiter<void> Conn::write(const BufferView& v) {
+  // "v" may be a view of the input, consumed after it is copied.
+  v.forEachSegment(
+      [this](const unsigned char* p, std::size_t n) { push(p, n); });
+  consume();
+  wait_ = kWrite;
+  return {this};
+}
+
+Conn::Awaiter<void> Conn::sleep(std::chrono::microseconds d) {
+  consume();
+  wait_ = kSleep;
+  int64_t us = d.count() > 0 ? d.count() : 0;
+  timeval tv;
+  tv.tv_sec = us / 1000000;
+  tv.tv_usec = us % 1000000;
+  event_add(&ev_, &tv);
+  return {this};
+}
+
+void Conn::consume() {
+  if (consume_) {
+    in_->drain(consume_);
+    consume_ = 0;
+  }
+}
+
+void Conn::push(const void* data, std::size_t len) {
+  if (out_) {
+    // inside onRead(), the handler flushes and accounts after it.
+    out_->push(data, len);
+  } else {
+    h_->write(data, len);
+  }
+}
+
+bool Conn::ready() {
+  switch (wait_) {
+    case kRead: {
+      std::size_t size = in_ ? in_->size() : 0;
+      if (size == 0 || size < want_) {
+        return false;
+      }
+      result_ = want_ ? want_ : size;
+      return true;
+    }
+    case kReadUntil: {
+      if (!in_ || delim_.empty()) {
+        result_ = 0;
+        return delim_.empty();
+      }
+      std::size_t at = find(*in_, scanned_, delim_);
+      if (at != SIZE_MAX && at + delim_.size() <= max_) {
+        result_ = at + delim_.size();
+        return true;
+      }
+      if (in_->size() >= max_) {
+        result_ = 0;
+        return true;
+      }
+      // a delimiter may start in the last bytes.
+      std::size_t size = in_->size();
+      scanned_ = size >= delim_.size() ? size - delim_.size() + 1 : 0;
+      return false;
+    }
+    case kWrite:
+      return h_->pendingWrite() <= kHighWater;
+    case kSleep:
+      return false;
+    case kNone:
+      break;
+  }
+  return true;
+}
+
+int CoroProtocol::onOpen(Handler* h) {
+  Conn* c = conns_.create(this, h);
+  if ((std::size_t)h->fd() >= by_fd_.size()) {
+    by_fd_.resize(h->fd() + 1, nullptr);
+  }
+  by_fd_[h->fd()] = c;
+  c->task_ = serve_(*c);
+  c->waiter_ = c->task_.h_;
+  return resume(c);
+}
+
+void CoroProtocol::onClose(Handler* h) {
+  Conn* c = find(h);
+  if (c) {
+    by_fd_[h->fd()] = nullptr;
+    conns_.destroy(c);
+  }
+}
+
+int CoroProtocol::onRead(Handler* h, buffer& in, buffer& out) {
+  Conn* c = find(h);
+  if (c->closing_) {
+    in.drain(in.size());
+    return 0;
+  }
+  c->in_ = &in;
+  if (!c->waitsInput() || !c->ready()) {
+    return 0;
+  }
+  c->out_ = &out;
+  int r = resume(c);
+  c->out_ = nullptr;
+  return r;
+}
+
+void CoroProtocol::onWritten(Handler* h) {
+  Conn* c = find(h);
+  if ((c->closing_ && h->pendingWrite() == 0) ||
+      (c->wait_ == Conn::kWrite && c->ready())) {
+    // resume outside the handler, which may close it.
+    event_active(&c->ev_, EV_TIMEOUT, 0);
+  }
+}
+
+int CoroProtocol::resume(Conn* c) {
+  c->waiter_.resume();
+  if (!c->task_.done()) {
+    return 0;
+  }
+  return finish(c);
+}
+
+int CoroProtocol::finish(Conn* c) {
+  Handler* h = c->h_;
+  if (std::exception_ptr e = c->task_.h_.promise().error) {
+    try {
+      std::rethrow_exception(e);
+    } catch (const std::exception& ex) {
+      TL_ERROR_RL(0, "fd={}, coroutine threw: {}", h->fd(), ex.what());
+    } catch (...) {
+      TL_ERROR_RL(0, "fd={}, coroutine threw", h->fd());
+    }
+    h->dispatcher()->metrics().errors.add();
+    return -1;
+  }
+  if (h->pendingWrite() == 0) {
+    return -1;
+  }
+  c->closing_ = true;
+  return 0;
+}
+
+Conn* CoroProtocol::find(Handler* h) const {
+  std::size_t fd = h->fd();
+  return fd < by_fd_.size() ? by_fd_[fd] : nullptr;
+}
+
+}  // namespace tl
@@ -0,0 +1,252 @@
+#pragma once
+
+// C++20, built as the tl_coro library so the rest stays C++17.
+
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "buffer.h"
+#include "codec.h"
+#include "dispatcher.h"
+#include "event2/event.h"
+#include "event2/event_struct.h"
+#include "handler.h"
+#include "protocol.h"
+#include "slab.h"
+
+namespace tl {
+
+// Coroutine frames from per-thread free lists, one per 64 byte size class up
+// to kMaxSize, so a connection or a co_await-ed Task does not go to malloc
+// once the loop has warmed up. Larger frames use operator new.
+class FramePool {
+ public:
+  static constexpr std::size_t kClassSize = 64;
+  static constexpr std::size_t kMaxSize = 4096;
+  // frames kept per class and thread, the rest are freed.
+  static constexpr std::size_t kMaxFree = 1024;
+
+  static void* allocate(std::size_t n);
+  static void deallocate(void* p, std::size_t n) noexcept;
+  // Off: allocate() and deallocate() go to operator new and delete on this
+  // thread, to measure what the pool saves.
+  static void setEnabled(bool on);
+};
+
+// A coroutine returning nothing. It starts suspended and runs when
+// co_await-ed, its frame is destroyed with the Task. An exception thrown in
+// it is rethrown to the coroutine awaiting it.
+class Task {
+ public:
+  struct promise_type;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    // back to the awaiting coroutine, if any.
+    std::coroutine_handle<> await_suspend(Handle h) noexcept {
+      std::coroutine_handle<> next = h.promise().continuation;
+      return next ? next : std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+
+  struct promise_type {
+    Task get_return_object() { return Task(Handle::from_promise(*this)); }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { error = std::current_exception(); }
+
+    static void* operator new(std::size_t n) {
+      return FramePool::allocate(n);
+    }
+    static void operator delete(void* p, std::size_t n) {
+      FramePool::deallocate(p, n);
+    }
+
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+  };
+
+  Task() {}
+  Task(Task&& t) : h_(std::exchange(t.h_, nullptr)) {}
+  Task& operator=(Task&& t) {
+    if (this != &t) {
+      reset();
+      h_ = std::exchange(t.h_, nullptr);
+    }
+    return *this;
+  }
+  ~Task() { reset(); }
+
+  bool done() const { return !h_ || h_.done(); }
+
+  bool await_ready() const noexcept { return done(); }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept {
+    h_.promise().continuation = c;
+    return h_;
+  }
+  void await_resume() {
+    if (h_ && h_.promise().error) {
+      std::rethrow_exception(h_.promise().error);
+    }
+  }
+
+ private:
+  friend class CoroProtocol;
+
+  explicit Task(Handle h) : h_(h) {}
+  void reset() {
+    if (h_) {
+      h_.destroy();
+      h_ = nullptr;
+    }
+  }
+
+  Handle h_;
+};
+
+class CoroProtocol;
+
+extern "C" void conn_event_cb(evutil_socket_t, short what, void* ptr);
+
+// The connection a coroutine of CoroProtocol serves, with awaitable reads,
+// writes and sleeps. Only use it from that coroutine.
+//
+// The bytes read are a view into the read buffer, valid until the next
+// co_await on the connection, which consumes them. There is no end of file:
+// when the connection closes, the coroutine is destroyed where it waits.
+class Conn {
+ public:
+  template <class T>
+  struct [[nodiscard]] Awaiter {
+    Conn* c;
+    bool await_ready() { return c->ready(); }
+    void await_suspend(std::coroutine_handle<> h) { c->waiter_ = h; }
+    T await_resume() { return c->resumed<T>(); }
+  };
+
+  Conn(CoroProtocol* proto, Handler* h);
+  ~Conn();
+  Conn(const Conn&) = delete;
+  Conn& operator=(const Conn&) = delete;
+
+  Handler* handler() { return h_; }
+  Dispatcher* dispatcher() { return h_->dispatcher(); }
+
+  // Wait for at least "n" bytes and resolve to the first "n", or to all
+  // there are for 0.
+  Awaiter<BufferView> read(std::size_t n = 0);
+  // Resolve to the bytes up to and including "delim", or to an empty view
+  // if "max" bytes come without it. "delim" must live until resumed.
+  Awaiter<BufferView> readUntil(std::string_view delim,
+                                std::size_t max = 64 << 10);
+
+  // Queue bytes to send at the end of this loop iteration, then wait while
+  // more than kHighWater bytes are not sent yet.
+  Awaiter<void> write(const void* data, std::size_t len);
+  Awaiter<void> write(std::string_view s) { return write(s.data(), s.size()); }
+  Awaiter<void> write(const BufferView& v);
+
+  // Resume after "d", on the loop of the connection. The connection timeout
+  // of Handler still runs meanwhile.
+  Awaiter<void> sleep(std::chrono::microseconds d);
+
+  static constexpr std::size_t kHighWater = 1 << 20;
+
+ private:
+  friend class CoroProtocol;
+  friend void conn_event_cb(evutil_socket_t, short what, void* ptr);
+
+  enum Wait { kNone, kRead, kReadUntil, kWrite, kSleep };
+
+  // Drop the bytes of the last read.
+  void consume();
+  void push(const void* data, std::size_t len);
+  bool ready();
+  template <class T>
+  T resumed() {
+    wait_ = kNone;
+    if constexpr (!std::is_void_v<T>) {
+      consume_ = result_;
+      return BufferView(in_, 0, result_);
+    }
+  }
+  bool waitsInput() const { return wait_ == kRead || wait_ == kReadUntil; }
+
+  CoroProtocol* proto_;
+  Handler* h_;
+  Task task_;
+  // the innermost coroutine waiting, wait_ tells on what.
+  std::coroutine_handle<> waiter_;
+  Wait wait_ = kNone;
+  // the read buffer of h_, known from the first Protocol::onRead(), and its
+  // write buffer during onRead().
+  buffer* in_ = nullptr;
+  buffer* out_ = nullptr;
+  std::size_t want_ = 0;
+  std::string_view delim_;
+  std::size_t max_ = 0;
+  // bytes searched for delim_ already.
+  std::size_t scanned_ = 0;
+  // size of the view resolved to, consumed by the next wait.
+  std::size_t result_ = 0;
+  std::size_t consume_ = 0;
+  // the coroutine returned, close once the output is sent.
+  bool closing_ = false;
+  // timer of sleep(), activated to resume after the output drained.
+  struct event ev_;
+};
+
+// Serve each connection with a coroutine, "serve(conn)" called when it
+// opens:
+//
+//   tl::Task echo(tl::Conn& c) {
+//     for (;;) {
+//       tl::BufferView in = co_await c.read();
+//       co_await c.write(in);
+//     }
+//   }
+//
+// The connection closes when the coroutine returns, once what it wrote is
+// sent, or at once if it throws; do not close the Handler from the
+// coroutine. One CoroProtocol per dispatcher, it keeps its connections'
+// coroutines. The state of a coroutine cannot move to another process, its
+// connection is drained at a hot restart.
+class CoroProtocol : public Protocol {
+ public:
+  using Serve = std::function<Task(Conn&)>;
+
+  explicit CoroProtocol(Serve serve) : serve_(std::move(serve)) {}
+
+  int onOpen(Handler* h) override;
+  void onClose(Handler* h) override;
+  int onRead(Handler* h, buffer& in, buffer& out) override;
+  void onWritten(Handler* h) override;
+  bool busy(Handler*) override { return true; }
+
+ private:
+  friend void conn_event_cb(evutil_socket_t, short what, void* ptr);
+
+  // Resume the coroutine of "c" and return -1 if the connection is to close
+  // now.
+  int resume(Conn* c);
+  // The coroutine returned or threw.
+  int finish(Conn* c);
+  Conn* find(Handler* h) const;
+
+  Serve serve_;
+  Slab<Conn> conns_;
+  // fd -> Conn, nullptr if none.
+  std::vector<Conn*> by_fd_;
+};
+
+}  // namespace tl
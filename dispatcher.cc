@@ -1,6 +1,10 @@
 #include "dispatcher.h"
+#include "connection_table.h"
 #include "spdlog/spdlog.h"
+#include "trace.h"
 #include <cassert>
+#include <chrono>
+#include <time.h>
 
 namespace tl {
 
@@ -9,29 +13,135 @@ extern "C" void dispatcherTimerCB(int, short, void* ptr) {
   dispather->timerCB();
 }
 
+extern "C" void dispatcherFlushCB(int, short, void* ptr) {
+  auto dispather = (Dispatcher*)ptr;
+  dispather->flushCB();
+}
+
+extern "C" void dispatcherReadyCB(int, short, void* ptr) {
+  auto dispather = (Dispatcher*)ptr;
+  dispather->readyCB();
+}
+
+extern "C" void dispatcherLagCB(int, short, void* ptr) {
+  auto dispather = (Dispatcher*)ptr;
+  dispather->lagCB();
+}
+
+// All events have the one default priority. libevent runs the events active
+// in an iteration in order, and one activated from a callback goes to the
+// end of that queue: ev_flush_, activated by the first callback to queue
+// output, runs once after the I/O callbacks, timers and readyCB() of the
+// iteration. Not a less urgent priority: libevent runs one only in an
+// iteration where no more urgent event fired, never while readyCB() keeps
+// coming back for a backlogged connection.
+
+// period of the loop lag probe.
+static const int64_t kLagProbeUs = 100000;
+
+static int64_t steadyUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
 Dispatcher::Dispatcher() {
   stop_ = true;
-  ev_base_ = event_base_new();
+  // the coarse clock libevent uses by default runs timers up to a tick (4ms
+  // at HZ=250) late, which the lag probe would report as loop lag.
+  struct event_config* cfg = event_config_new();
+  event_config_set_flag(cfg, EVENT_BASE_FLAG_PRECISE_TIMER);
+  ev_base_ = event_base_new_with_config(cfg);
+  event_config_free(cfg);
   ev_timer_ = event_new(ev_base_, -1, EV_PERSIST, dispatcherTimerCB, this);
+  ev_flush_ = event_new(ev_base_, -1, 0, dispatcherFlushCB, this);
+  ev_ready_ = evtimer_new(ev_base_, dispatcherReadyCB, this);
+  ev_lag_ = event_new(ev_base_, -1, EV_PERSIST, dispatcherLagCB, this);
+  conns_.reset(new ConnectionTable(this));
 }
 
 Dispatcher::~Dispatcher() {
+  // handlers delete their events from ev_base_.
+  conns_.reset();
+  stopCapture();
+  event_free(ev_lag_);
+  event_free(ev_ready_);
+  event_free(ev_flush_);
   event_free(ev_timer_);
   event_base_free(ev_base_);
 }
 
+int Dispatcher::startCapture(const std::string& path, std::size_t max_bytes) {
+  std::unique_ptr<TraceWriter> trace(new TraceWriter());
+  if (trace->open(path, max_bytes) < 0) {
+    return -1;
+  }
+  trace_ = std::move(trace);
+  return 0;
+}
+
+void Dispatcher::stopCapture() {
+  if (trace_ && trace_->dropped()) {
+    SPDLOG_WARN("trace full, {} records dropped", trace_->dropped());
+  }
+  trace_.reset();
+}
+
 void Dispatcher::dispatch() {
   {
     std::unique_lock<std::mutex> lock(mu_);
     stop_ = false;
   }
 
-  event_base_loop(ev_base_, EVLOOP_NO_EXIT_ON_EMPTY);
+  struct timeval tv = {0, kLagProbeUs};
+  lag_due_us_ = steadyUs() + kLagProbeUs;
+  event_add(ev_lag_, &tv);
+
+  if (max_spin_us_) {
+    spinLoop();
+  } else {
+    event_base_loop(ev_base_, EVLOOP_NO_EXIT_ON_EMPTY);
+  }
 
   // notify join().
   cond_.notify_all();
 }
 
+void Dispatcher::spinLoop() {
+  const double ticks_per_us = cpuTicksPerUs();
+  // recent gap between iterations that ran callbacks, microseconds.
+  double gap_us = max_spin_us_ / 2.0;
+  uint64_t last_busy = cpuTicks();
+  for (;;) {
+    uint64_t before = profiler_.callbacks();
+    uint64_t spin_end = last_busy;
+    if (gap_us * 2 <= max_spin_us_) {
+      spin_end += (uint64_t)(gap_us * 2 * ticks_per_us);
+    }
+    if (cpuTicks() < spin_end) {
+      event_base_loop(ev_base_, EVLOOP_NONBLOCK);
+      metrics_.spins.add();
+    } else {
+      event_base_loop(ev_base_, EVLOOP_ONCE);
+      metrics_.sleeps.add();
+    }
+    if (event_base_got_break(ev_base_)) {
+      return;
+    }
+    if (profiler_.callbacks() != before) {
+      uint64_t now = cpuTicks();
+      // a long idle gap counts as a few spins' worth, so one burst after a
+      // pause makes the loop spin again soon.
+      double gap = (now - last_busy) / ticks_per_us;
+      if (gap > 4.0 * max_spin_us_) {
+        gap = 4.0 * max_spin_us_;
+      }
+      gap_us += (gap - gap_us) / 8;
+      last_busy = now;
+    }
+  }
+}
+
 void Dispatcher::stop() {
   post([&] { event_base_loopbreak(ev_base_); });
 }
@@ -42,6 +152,7 @@ void Dispatcher::join() {
 }
 
 void Dispatcher::timerCB() {
+  LoopProfiler::Scope prof(profiler_, LoopProfiler::kPost, -1);
   std::queue<std::function<void()> > cbs;
 
   {
@@ -50,10 +161,64 @@ void Dispatcher::timerCB() {
     assert(post_callbacks_.empty());
   }
 
+  metrics_.posts.add(cbs.size());
+  metrics_.post_queue_depth.set(cbs.size());
   while (!cbs.empty()) {
     cbs.front()();
     cbs.pop();
   }
 }
 
+void Dispatcher::flushCB() {
+  LoopProfiler::Scope prof(profiler_, LoopProfiler::kFlush, -1);
+  metrics_.flushes.add();
+  conns_->flush();
+}
+
+void Dispatcher::scheduleReady() {
+  // an event activated from a callback of the same priority would run in
+  // the same pass, a timer waits for the next iteration.
+  struct timeval tv = {0, 0};
+  event_add(ev_ready_, &tv);
+}
+
+void Dispatcher::readyCB() {
+  LoopProfiler::Scope prof(profiler_, LoopProfiler::kReady, -1);
+  conns_->serveReady();
+}
+
+void Dispatcher::setArena(const Arena::Options& opts) {
+  arena_.reset(new Arena(opts));
+  conns_->setAllocator(arena_.get());
+}
+
+void Dispatcher::lagCB() {
+  if (arena_) {
+    metrics_.arena_bytes.set(arena_->used());
+    metrics_.arena_overflow_bytes.set(arena_->overflow());
+    metrics_.arena_resident_bytes.set(arena_->resident());
+    metrics_.arena_releases.set(arena_->releases());
+  }
+  if (trace_) {
+    trace_->reserve();
+  }
+  struct timespec cpu;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu) == 0) {
+    metrics_.cpu_us.set((uint64_t)cpu.tv_sec * 1000000 + cpu.tv_nsec / 1000);
+  }
+  int64_t now = steadyUs();
+  int64_t lag = now > lag_due_us_ ? now - lag_due_us_ : 0;
+  metrics_.loop_lag_us.record(lag);
+  uint32_t threshold = profiler_.threshold();
+  if (threshold && lag > threshold) {
+    profiler_.recordStall(LoopProfiler::kLag, -1, lag);
+  }
+  // EV_PERSIST reschedules from the previous due time, or from now if the
+  // loop is a whole period behind.
+  lag_due_us_ += kLagProbeUs;
+  if (lag_due_us_ < now) {
+    lag_due_us_ = now + kLagProbeUs;
+  }
+}
+
 }  // namespace tl
@@ -4,11 +4,22 @@
 #include <event2/thread.h>
 
 #include <condition_variable>
+#include <cstdint>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <queue>
+#include <string>
+
+#include "arena.h"
+#include "loop_profiler.h"
+#include "metrics.h"
 
 namespace tl {
 
+class ConnectionTable;
+class TraceWriter;
+
 // event_base_dispatch wrapper
 // accept callbacks to run inside the dispatch loop.
 class Dispatcher {
@@ -23,6 +34,20 @@ class Dispatcher {
   // wait dispatch loop to exit after call stop().
   void join();
 
+  // Before dispatch(): after a loop iteration that ran callbacks, poll for
+  // more without blocking for up to "max_spin_us" before waiting in epoll.
+  // The spin is sized to twice the recent gap between busy iterations, and
+  // skipped when that is over "max_spin_us", so an idle loop still sleeps.
+  // 0, the default, always blocks.
+  void setBusyPoll(uint32_t max_spin_us) { max_spin_us_ = max_spin_us; }
+
+  // Before any connection opens: put the buffers and Handlers of the
+  // connections in an Arena of "opts.budget" bytes, and stop reading while
+  // it is over that. Its usage goes to metrics() with the lag probe.
+  void setArena(const Arena::Options& opts);
+  // nullptr if none.
+  Arena* arena() { return arena_.get(); }
+
   // Commit a function to be called inside the dispatch loop.
   // It will be called in the callback of "ev_timer_".
   template <class F, class... Args>
@@ -30,15 +55,67 @@ class Dispatcher {
 
   void timerCB();
 
+  // Run flushCB() once after the callbacks of the current loop iteration
+  // that are already due. Only call it inside the dispatch loop.
+  void scheduleFlush() { event_active(ev_flush_, 0, 0); }
+  void flushCB();
+
+  // Run readyCB() once in the next loop iteration, together with the I/O
+  // callbacks of it. Only call it inside the dispatch loop.
+  void scheduleReady();
+  void readyCB();
+
+  // Measure how late the loop runs a periodic timer, and sample the CPU
+  // time of the loop thread.
+  void lagCB();
+
   event_base* ev_base() { return ev_base_; }
+  // System clock microseconds when the current loop iteration began,
+  // without a clock read. Only call it inside the dispatch loop.
+  int64_t loopTimeUs() {
+    struct timeval tv;
+    event_base_gettimeofday_cached(ev_base_, &tv);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+  }
+  // Connections served by this dispatcher.
+  ConnectionTable* connections() { return conns_.get(); }
+  // Update only inside the dispatch loop, read from anywhere.
+  DispatcherMetrics& metrics() { return metrics_; }
+  // Callback durations and stalls of the loop.
+  LoopProfiler& profiler() { return profiler_; }
+
+  // Record what connections of this loop open, read and close to trace file
+  // "path", at most "max_bytes" of it. Call it inside the dispatch loop, or
+  // before dispatch().
+  int startCapture(const std::string& path, std::size_t max_bytes);
+  void stopCapture();
+  // nullptr when not capturing.
+  TraceWriter* trace() { return trace_.get(); }
 
  private:
+  // dispatch() with setBusyPoll().
+  void spinLoop();
+
   struct event_base* ev_base_ = nullptr;
   struct event* ev_timer_ = nullptr;
+  // write out what connections queued in this iteration.
+  struct event* ev_flush_ = nullptr;
+  // serve connections with data left to read, a 0 timeout timer so it runs
+  // once per iteration.
+  struct event* ev_ready_ = nullptr;
+  struct event* ev_lag_ = nullptr;
+  // when lagCB() is due, steady clock microseconds.
+  int64_t lag_due_us_ = 0;
+  uint32_t max_spin_us_ = 0;
   std::queue<std::function<void()> > post_callbacks_;
   bool stop_ = false;
   std::mutex mu_;
   std::condition_variable cond_;
+  std::unique_ptr<Arena> arena_;
+  std::unique_ptr<ConnectionTable> conns_;
+  std::unique_ptr<TraceWriter> trace_;
+  DispatcherMetrics metrics_;
+  LoopProfiler profiler_;
 };
 
 template <class F, class... Args>
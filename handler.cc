@@ -1,108 +1,457 @@
 #include "handler.h"
 
+#include <linux/errqueue.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include "connection_table.h"
+#include "log.h"
+#include "protocol.h"
+#include "socket_options.h"
 #include "spdlog/spdlog.h"
+#include "trace.h"
 
 namespace tl {
 
+// iovecs per sendmsg().
+static const std::size_t kMaxIov = 64;
+// recv() calls per read event.
+static const int kMaxReadCalls = 16;
+// a rate limited connection waits for this many tokens before reading.
+static const std::size_t kMinReadTokens = 4096;
+// over the arena budget, try reading again after this long.
+static const int64_t kBudgetWaitUs = 10000;
+
 extern "C" void handler_event_cb(evutil_socket_t, short what, void* ptr) {
   Handler* h = (Handler*)ptr;
+  LoopProfiler::Scope prof(h->dispatcher()->profiler(),
+                           LoopProfiler::kHandler, h->fd());
   int r = 0;
-  if (what & EV_TIMEOUT) {
-    SPDLOG_ERROR("fd={}, timeout", h->fd());
-    delete h;
+  // completions raise EPOLLERR, reported as EV_READ|EV_WRITE.
+  if (h->zeroCopyInflight() && h->reapZeroCopy() != 0) {
+    TL_ERROR_RL(errno, "fd={}, error queue, errno={} {}", h->fd(), errno,
+                strerror(errno));
+    h->close();
     return;
   }
+  if (what & EV_TIMEOUT) {
+    if (!h->throttled_) {
+      TL_WARN_RL(ETIMEDOUT, "fd={}, timeout", h->fd());
+      h->dispatcher()->metrics().timeouts.add();
+      h->close();
+      return;
+    }
+    // pauseReads() is over.
+    h->throttled_ = false;
+    what |= EV_READ;
+  }
 
   if (what & EV_READ) {
     r = h->handleRead();
   }
   if (r != 0) {
-    SPDLOG_ERROR("fd={}, read error, errno={} {}", h->fd(), errno,
-                 strerror(errno));
-    delete h;
+    if (errno == 0) {
+      SPDLOG_DEBUG("fd={}, closed by peer", h->fd());
+    } else {
+      TL_ERROR_RL(errno, "fd={}, read error, errno={} {}", h->fd(), errno,
+                  strerror(errno));
+      h->dispatcher()->metrics().errors.add();
+    }
+    h->close();
     return;
   }
   if (what & EV_WRITE) {
     r = h->handleWrite();
   }
   if (r != 0) {
-    SPDLOG_ERROR("fd={}, write error, errno={} {}", h->fd(), errno,
-                 strerror(errno));
-    delete h;
+    TL_ERROR_RL(errno, "fd={}, write error, errno={} {}", h->fd(), errno,
+                strerror(errno));
+    h->dispatcher()->metrics().errors.add();
+    h->close();
     return;
   }
 }
 
-Handler::Handler(Dispatcher* disp, int fd) {
+Handler::Handler(Dispatcher* disp, int fd, Protocol* proto) {
   disp_ = disp;
   fd_ = fd;
+  proto_ = proto;
   if (evutil_make_socket_nonblocking(fd_) < 0) {
     SPDLOG_ERROR("evutil_make_socket_nonblocking errno={} {}", errno,
                  strerror(errno));
-    close(fd);
+    ::close(fd);
     throw std::runtime_error("evutil_make_socket_nonblocking");
   }
-  ev_ = event_new(disp->ev_base(), fd_, EV_READ, handler_event_cb, this);
+  rate_ = disp->connections()->rateLimit();
+  burst_ = disp->connections()->rateBurst();
+  tokens_ = burst_;
+  active_us_ = disp->loopTimeUs();
+  if (ChunkAllocator* alloc = disp->connections()->allocator()) {
+    read_buf_.allocator(alloc);
+    write_buf_.allocator(alloc);
+  }
+  zc_threshold_ = disp->connections()->zeroCopyThreshold();
+  if (zc_threshold_) {
+    int one = 1;
+    if (setsockopt(fd_, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+      SPDLOG_DEBUG("fd={}, SO_ZEROCOPY errno={} {}", fd_, errno,
+                   strerror(errno));
+      zc_threshold_ = 0;
+    }
+  }
+  int busy_poll = disp->connections()->busyPoll();
+  if (busy_poll &&
+      setsockopt(fd_, SOL_SOCKET, SO_BUSY_POLL, &busy_poll,
+                 sizeof(busy_poll)) < 0) {
+    TL_WARN_RL(errno, "fd={}, SO_BUSY_POLL errno={} {}", fd_, errno,
+               strerror(errno));
+  }
+  event_assign(&ev_, disp->ev_base(), fd_, EV_READ, handler_event_cb, this);
   timeval tv;
   tv.tv_sec = 60;  // 超时
   tv.tv_usec = 0;
-  event_add(ev_, &tv);
+  event_add(&ev_, &tv);
 }
 
 Handler::~Handler() {
-  if (ev_) {
-    event_del(ev_);
-    event_free(ev_);
-    ev_ = NULL;
+  event_del(&ev_);
+  for (auto& f : files_) {
+    if (f.own) {
+      ::close(f.fd);
+    }
   }
   if (fd_ >= 0) {
-    close(fd_);
+    ::close(fd_);
     fd_ = -1;
   }
 }
 
-int Handler::handleWrite() {
-  ssize_t n = 0;
+void Handler::close() { disp_->connections()->close(this); }
 
-  while (write_buf_.size()) {
-    const void* buf;
-    std::size_t len;
-    write_buf_.dataChunk(buf, len);
-    n = write(fd_, buf, len);
-    if (n <= 0) {
-      if (errno == EAGAIN || errno == EINTR) {
+void Handler::markDirty() {
+  if (!dirty_) {
+    dirty_ = true;
+    disp_->connections()->markDirty(this);
+  }
+}
+
+void Handler::write(const void* data, std::size_t len) {
+  write_buf_.push(data, len);
+  disp_->connections()->account(this);
+  markDirty();
+}
+
+void Handler::arm(short what) {
+  struct timeval tv;
+  tv.tv_sec = 10;
+  tv.tv_usec = 0;
+  throttled_ = false;
+  event_del(&ev_);
+  event_assign(&ev_, disp_->ev_base(), fd_, what, handler_event_cb, this);
+  event_add(&ev_, &tv);
+}
+
+int Handler::sendFile(int file_fd, off_t offset, std::size_t len, bool own) {
+  struct stat st;
+  if (fstat(file_fd, &st) < 0) {
+    return -1;
+  }
+  if (!S_ISREG(st.st_mode) && !S_ISFIFO(st.st_mode)) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (len == 0) {
+    if (own) {
+      ::close(file_fd);
+    }
+    return 0;
+  }
+
+  FileRange f;
+  f.fd = file_fd;
+  f.offset = offset;
+  f.len = len;
+  f.before = write_buf_.size() - files_before_;
+  f.own = own;
+  f.pipe = S_ISFIFO(st.st_mode);
+  files_.push_back(f);
+  files_before_ += f.before;
+  files_len_ += len;
+  markDirty();
+  return 0;
+}
+
+std::size_t Handler::pendingWrite() { return write_buf_.size() + files_len_; }
+
+bool Handler::idle() {
+  return pendingWrite() == 0 && zeroCopyInflight() == 0 && !throttled_ &&
+         !proto_->busy(this);
+}
+
+void Handler::holdReads() { held_ = true; }
+
+void Handler::resumeReads() {
+  if (!held_) {
+    return;
+  }
+  held_ = false;
+  if (pendingWrite()) {
+    // handleWrite() does it, the write event stays.
+    resumed_ = true;
+    return;
+  }
+  event_del(&ev_);
+  disp_->connections()->markReady(this);
+}
+
+void Handler::restore(std::string_view in) {
+  if (!in.empty()) {
+    read_buf_.push(in.data(), in.size());
+    disp_->connections()->account(this);
+    // let the protocol see it, with whatever the socket has now.
+    event_del(&ev_);
+    disp_->connections()->markReady(this);
+  }
+}
+
+// Return 1 if sent something, 0 if it would block.
+int Handler::sendFileRange(FileRange& f) {
+  ssize_t n;
+  if (f.pipe) {
+    unsigned int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+    if (f.len < pendingWrite()) {
+      flags |= SPLICE_F_MORE;
+    }
+    n = splice(f.fd, nullptr, fd_, nullptr, f.len, flags);
+  } else {
+    n = sendfile(fd_, f.fd, &f.offset, f.len);
+  }
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      return 0;
+    }
+    return -1;
+  }
+  if (n == 0) {
+    errno = ENODATA;  // shorter than queued
+    return -1;
+  }
+
+  f.len -= n;
+  files_len_ -= n;
+  disp_->metrics().bytes_written.add(n);
+  if (f.len == 0) {
+    if (f.own) {
+      ::close(f.fd);
+    }
+    files_.pop_front();
+  }
+  return 1;
+}
+
+int Handler::reapZeroCopy() {
+  return reapCompletions(fd_, write_buf_, zc_seq_, &zc_acked_,
+                         &disp_->connections()->zc_copied_);
+}
+
+int Handler::reapCompletions(int fd, buffer& buf, uint32_t seq,
+                             uint32_t* acked, std::size_t* copied) {
+  while (seq != *acked) {
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
         return 0;
       }
       return -1;
     }
+    for (auto cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+          !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+        continue;
+      }
+      auto ee = (struct sock_extended_err*)CMSG_DATA(cm);
+      if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+      // sends [ee_info, ee_data] completed.
+      if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        *copied += ee->ee_data - ee->ee_info + 1;
+      }
+      buf.unpin(ee->ee_data);
+      *acked = ee->ee_data + 1;
+    }
+  }
+  return 0;
+}
+
+int Handler::handleWrite() {
+  struct iovec iov[kMaxIov];
+  bool cork = disp_->connections()->cork();
+
+  while (pendingWrite()) {
+    // bytes of write_buf_ before the next file range.
+    std::size_t limit =
+        files_.empty() ? write_buf_.size() : files_.front().before;
+    if (limit == 0) {
+      int r = sendFileRange(files_.front());
+      if (r < 0) {
+        return -1;
+      }
+      if (r == 0) {
+        break;
+      }
+      continue;
+    }
+
+    std::size_t n_iov = write_buf_.peek(iov, kMaxIov);
+    std::size_t batch = 0;
+    for (std::size_t i = 0; i < n_iov; i++) {
+      if (batch + iov[i].iov_len >= limit) {
+        iov[i].iov_len = limit - batch;
+        n_iov = i + 1;
+        batch = limit;
+        break;
+      }
+      batch += iov[i].iov_len;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n_iov;
+    int flags = MSG_NOSIGNAL;
+    // always hold a header back for the file range after it.
+    if (batch < pendingWrite() && (cork || !files_.empty())) {
+      flags |= MSG_MORE;
+    }
+    if (zc_threshold_ && batch >= zc_threshold_) {
+      flags |= MSG_ZEROCOPY;
+    }
+    ssize_t n = sendmsg(fd_, &msg, flags);
+    if (n < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+      // out of optmem for notifications, copy this time.
+      flags &= ~MSG_ZEROCOPY;
+      n = sendmsg(fd_, &msg, flags);
+    }
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        break;
+      }
+      return -1;
+    }
+    if (flags & MSG_ZEROCOPY) {
+      write_buf_.pin(n, zc_seq_++);
+      disp_->connections()->zc_sends_++;
+    }
     write_buf_.drain(n);
+    disp_->metrics().bytes_written.add(n);
+    if (!files_.empty()) {
+      files_.front().before -= n;
+      files_before_ -= n;
+    }
+    if ((std::size_t)n < batch) {
+      break;  // socket buffer is full
+    }
   }
 
-  struct timeval tv;
-  tv.tv_sec = 10;
-  tv.tv_usec = 0;
-  short what = 0;
-  if (write_buf_.size()) {
-    what = EV_WRITE;
+  disp_->connections()->account(this);
+  if (pendingWrite()) {
+    arm(EV_WRITE);
+  } else if (held_) {
+    event_del(&ev_);
+  } else if (resumed_) {
+    resumed_ = false;
+    event_del(&ev_);
+    disp_->connections()->markReady(this);
   } else {
-    what = EV_READ;
+    arm(EV_READ);
   }
-  event_assign(ev_, disp_->ev_base(), fd_, what, handler_event_cb, this);
-  event_add(ev_, &tv);
-
+  proto_->onWritten(this);
   return 0;
 }
 
+void Handler::refillTokens() {
+  int64_t now = disp_->loopTimeUs();
+  if (now <= refill_us_) {
+    return;
+  }
+  std::size_t add = (now - refill_us_) * rate_ / 1000000;
+  if (add == 0) {
+    return;  // keep the fraction for the next refill
+  }
+  tokens_ = tokens_ + add > burst_ ? burst_ : tokens_ + add;
+  refill_us_ = now;
+}
+
+void Handler::throttle() {
+  std::size_t need = burst_ < kMinReadTokens ? burst_ : kMinReadTokens;
+  pauseReads((int64_t)(need - tokens_) * 1000000 / rate_ + 1);
+}
+
+void Handler::pauseReads(int64_t usec) {
+  struct timeval tv;
+  tv.tv_sec = usec / 1000000;
+  tv.tv_usec = usec % 1000000;
+  throttled_ = true;
+  event_del(&ev_);
+  event_assign(&ev_, disp_->ev_base(), -1, 0, handler_event_cb, this);
+  event_add(&ev_, &tv);
+}
+
 int Handler::handleRead() {
-  ssize_t n = 0;
+  ConnectionTable* conns = disp_->connections();
+  if (held_) {
+    event_del(&ev_);
+    return 0;
+  }
+  if (Arena* arena = disp_->arena()) {
+    if (arena->overBudget()) {
+      // the socket buffer holds the input until memory is freed, sending
+      // what is queued frees some.
+      disp_->metrics().budget_waits.add();
+      if (pendingWrite()) {
+        arm(EV_WRITE);
+      } else {
+        pauseReads(kBudgetWaitUs);
+      }
+      return 0;
+    }
+  }
+  std::size_t quantum = conns->readBudget();
+  std::size_t allowance = SIZE_MAX;
+  if (quantum) {
+    deficit_ += quantum;
+    allowance = deficit_;
+  }
+  if (rate_) {
+    refillTokens();
+    if (tokens_ < allowance) {
+      allowance = tokens_;
+    }
+  }
 
-  // read
-  while (true) {
+  TraceWriter* trace = disp_->trace();
+  // read until EAGAIN or a short read, or the budget is used up.
+  ssize_t n = 0;
+  std::size_t total = 0;
+  bool more = false;
+  for (int calls = 0;; calls++) {
+    if (allowance == 0 || calls == kMaxReadCalls) {
+      more = true;  // the socket may have more
+      break;
+    }
     void* buf;
     std::size_t len;
     read_buf_.spaceChunk(buf, len);
+    if (len > allowance) {
+      len = allowance;
+    }
     n = recv(fd_, buf, len, 0);
     if (n == 0) {
+      errno = 0;
       return -1;  // closed
     }
     if (n < 0) {
@@ -115,30 +464,52 @@ int Handler::handleRead() {
     }
 
     read_buf_.spaceHaveSeted(n);
+    if (trace) {
+      trace->record(kTraceData, conns->id(this), buf, n);
+    }
+    allowance -= n;
+    total += n;
     if (n < (ssize_t)len) {
       break;
-    }    
+    }
+  }
+  disp_->metrics().bytes_read.add(total);
+  if (total) {
+    active_us_ = disp_->loopTimeUs();
+    if (conns->quickAck() && setQuickAck(fd_) < 0) {
+      TL_WARN_RL(errno, "fd={}, TCP_QUICKACK errno={} {}", fd_, errno,
+                 strerror(errno));
+    }
+  }
+  if (quantum) {
+    // deficit round robin, the deficit is kept only while backlogged.
+    deficit_ = more ? deficit_ - total : 0;
+  }
+  if (rate_) {
+    tokens_ -= total;
   }
 
-  // echo back
-  while (read_buf_.size()) {
-    const void* buf;
-    std::size_t len;
-    read_buf_.dataChunk(buf, len);
-    write_buf_.push(buf, len);
-    read_buf_.drain(len);
+  if (proto_->onRead(this, read_buf_, write_buf_) < 0) {
+    errno = 0;
+    return -1;  // closed by the protocol
   }
-  struct timeval tv;
-  tv.tv_sec = 10;
-  tv.tv_usec = 0;
-  short what = 0;
-  if (write_buf_.size()) {
-    what = EV_WRITE;
+  conns->account(this);
+  // responses are written by the dispatcher at the end of this iteration,
+  // together with what other callbacks queue.
+  if (pendingWrite()) {
+    markDirty();
+  }
+  if (held_) {
+    event_del(&ev_);
+  } else if (!more) {
+    arm(EV_READ);
+  } else if (rate_ && tokens_ < kMinReadTokens && tokens_ < burst_) {
+    throttle();
   } else {
-    what = EV_READ;
+    // let other connections of this loop read before reading again.
+    event_del(&ev_);
+    conns->markReady(this);
   }
-  event_assign(ev_, disp_->ev_base(), fd_, what, handler_event_cb, this);
-  event_add(ev_, &tv);
   return 0;
 }
 
@@ -15,31 +15,157 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include "spdlog/spdlog.h"
+#include <deque>
 #include <string>
+#include <string_view>
 
 #include "buffer.h"
+#include "codec.h"
 #include "dispatcher.h"
 #include "event2/event.h"
+#include "event2/event_struct.h"
 #include "event2/util.h"
 
 namespace tl {
 
+class Protocol;
+
+extern "C" void handler_event_cb(evutil_socket_t, short what, void* ptr);
+
+// A connection. Created and destroyed by the ConnectionTable of its
+// dispatcher, never new/delete it directly.
 class Handler {
  public:
-  Handler(Dispatcher* disp, int fd);
+  Handler(Dispatcher* disp, int fd, Protocol* proto);
   ~Handler();
 
+  // Read at most the read budget of ConnectionTable (and the rate limit
+  // tokens), then pass the data to the protocol. If the budget is used up,
+  // the connection goes to the ready list of the table instead of waiting
+  // for EV_READ, so other connections of the loop read first. Return -1 on
+  // error, or with errno 0 if the peer or the protocol closed it.
   int handleRead();
+  // Write out write_buf_ as much as possible with one sendmsg() per batch of
+  // chunks, then wait for EV_WRITE if anything is left, or EV_READ.
   int handleWrite();
 
+  // Flush write_buf_ once the I/O callbacks of this loop iteration have run,
+  // so responses queued by several callbacks go out together.
+  void markDirty();
+  // Queue "len" bytes after the write buffer and flush them like markDirty().
+  // For output made outside Protocol::onRead(), e.g. on a timer.
+  void write(const void* data, std::size_t len);
+
+  // Queue "len" bytes of "file_fd" from "offset" after what is in write_buf_
+  // now. They are sent with sendfile() for regular files, splice() for pipes,
+  // the pipe must already hold "len" bytes. Close "file_fd" when done if
+  // "own". Return -1 if "file_fd" is neither.
+  int sendFile(int file_fd, off_t offset, std::size_t len, bool own = true);
+  // Bytes queued and not sent yet.
+  std::size_t pendingWrite();
+  // Bytes read and not consumed by the protocol yet.
+  std::size_t pendingRead() { return read_buf_.size(); }
+
+  // Zero copy sends not completed by the kernel yet.
+  uint32_t zeroCopyInflight() { return zc_seq_ - zc_acked_; }
+  // Read zero copy completions from the socket error queue and release the
+  // write_buf_ chunks they pinned.
+  int reapZeroCopy();
+
+  // Close the connection and release this handler, "this" is invalid after.
+  void close();
+
+  // Stop reading, e.g. while the protocol has too many requests in progress:
+  // the socket buffer holds the input. Output is still sent.
+  void holdReads();
+  // Read again, and pass the input read before holdReads() to the protocol.
+  void resumeReads();
+
+  // Nothing to write, nothing in flight: the connection is only its socket
+  // and its unconsumed input, and can move to another process.
+  bool idle();
+  // Continue a connection of another process, "in" is what it read and did
+  // not consume yet.
+  void restore(std::string_view in);
+
   int fd() { return fd_; }
+  Dispatcher* dispatcher() { return disp_; }
+  // Dispatcher::loopTimeUs() of the last read, or of the open.
+  int64_t activeUs() const { return active_us_; }
+  // Decoder state of the protocol's codec.
+  CodecState& codecState() { return codec_state_; }
 
  private:
+  friend class ConnectionTable;
+  friend void handler_event_cb(evutil_socket_t, short what, void* ptr);
+
+  // A file range in the write queue.
+  struct FileRange {
+    int fd;
+    off_t offset;
+    std::size_t len;
+    // bytes of write_buf_ to send before this range, counted after the
+    // previous range.
+    std::size_t before;
+    bool own;
+    bool pipe;
+  };
+  int sendFileRange(FileRange& f);
+  // reapZeroCopy() of socket "fd" and its write buffer "buf": "*acked" is
+  // the first send not completed, "seq" the next one. Completions the kernel
+  // copied are added to "*copied".
+  static int reapCompletions(int fd, buffer& buf, uint32_t seq,
+                             uint32_t* acked, std::size_t* copied);
+  void refillTokens();
+  // wait for rate limit tokens.
+  void throttle();
+  // read again in "usec", with a timer on ev_.
+  void pauseReads(int64_t usec);
+
+  // (re)start waiting for "what" with timeout.
+  void arm(short what);
+
   int fd_ = -1;
-  event* ev_ = nullptr;
+  // embedded to avoid event_new() per connection.
+  struct event ev_;
   Dispatcher* disp_;
+  // index in ConnectionTable::live_.
+  std::size_t table_pos_ = 0;
+  Protocol* proto_;
+  CodecState codec_state_;
+  // buffered bytes counted in ConnectionTable::buffered().
+  std::size_t buffered_ = 0;
+  int64_t active_us_ = 0;
+  // in ConnectionTable::dirty_.
+  bool dirty_ = false;
+  // in ConnectionTable::ready_.
+  bool ready_ = false;
+  // read budget left over from the last rounds.
+  std::size_t deficit_ = 0;
+  // token bucket rate limit of reads, bytes per second, 0 for none.
+  std::size_t rate_ = 0;
+  std::size_t burst_ = 0;
+  std::size_t tokens_ = 0;
+  int64_t refill_us_ = 0;
+  // ev_ is a timer of pauseReads().
+  bool throttled_ = false;
+  // no reads until resumeReads().
+  bool held_ = false;
+  // resumeReads() came with output pending: read once it is sent.
+  bool resumed_ = false;
   buffer read_buf_;
   buffer write_buf_;
+  // send batches of at least this size with MSG_ZEROCOPY, 0 for never.
+  std::size_t zc_threshold_ = 0;
+  // id of the next zero copy send, and of the first one not completed.
+  uint32_t zc_seq_ = 0;
+  uint32_t zc_acked_ = 0;
+  // file ranges interleaved with write_buf_, in order.
+  std::deque<FileRange> files_;
+  // sum of FileRange::before of files_.
+  std::size_t files_before_ = 0;
+  // sum of FileRange::len of files_.
+  std::size_t files_len_ = 0;
 };
 
 }  // namespace tl
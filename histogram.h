@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace tl {
+
+// Histogram of non-negative integers, e.g. latencies in nanoseconds, in the
+// style of HdrHistogram: values are grouped by power of two, and each power of
+// two is split into 2^kSubBits linear buckets. Any value is counted within
+// 1/2^kSubBits (< 1%) of itself, with a fixed ~60 KB of counters and no
+// allocation in record().
+class Histogram {
+ public:
+  static const int kSubBits = 7;
+
+  Histogram() : counts_(kBuckets, 0) {}
+
+  void record(uint64_t v, uint64_t n = 1) {
+    counts_[index(v)] += n;
+    count_ += n;
+    sum_ += v * n;
+    if (v < min_) {
+      min_ = v;
+    }
+    if (v > max_) {
+      max_ = v;
+    }
+  }
+
+  void merge(const Histogram& o) {
+    for (std::size_t i = 0; i < kBuckets; i++) {
+      counts_[i] += o.counts_[i];
+    }
+    count_ += o.count_;
+    sum_ += o.sum_;
+    if (o.min_ < min_) {
+      min_ = o.min_;
+    }
+    if (o.max_ > max_) {
+      max_ = o.max_;
+    }
+  }
+
+  void reset() {
+    counts_.assign(kBuckets, 0);
+    count_ = sum_ = max_ = 0;
+    min_ = UINT64_MAX;
+  }
+
+  uint64_t count() const { return count_; }
+  uint64_t min() const { return count_ ? min_ : 0; }
+  uint64_t max() const { return max_; }
+  double mean() const { return count_ ? (double)sum_ / count_ : 0; }
+
+  // Smallest value that "p" percent of the values are not above, rounded up
+  // to the top of its bucket. 0 if empty.
+  uint64_t percentile(double p) const {
+    if (count_ == 0) {
+      return 0;
+    }
+    uint64_t rank = (uint64_t)(p / 100 * count_ + 0.5);
+    if (rank == 0) {
+      rank = 1;
+    }
+    if (rank > count_) {
+      rank = count_;
+    }
+    uint64_t seen = 0;
+    for (std::size_t i = 0; i < kBuckets; i++) {
+      seen += counts_[i];
+      if (seen >= rank) {
+        uint64_t v = highest(i);
+        return v < max_ ? v : max_;
+      }
+    }
+    return max_;
+  }
+
+  // Call "f(uint64_t upper, uint64_t n)" for each non-empty bucket in value
+  // order, "upper" being the largest value counted in it.
+  template <class F>
+  void forEachBucket(F&& f) const {
+    for (std::size_t i = 0; i < kBuckets; i++) {
+      if (counts_[i]) {
+        f(highest(i), counts_[i]);
+      }
+    }
+  }
+
+ private:
+  static const uint64_t kSub = 1ULL << kSubBits;
+  // values below kSub, then one group of kSub buckets per shift.
+  static const std::size_t kBuckets = (64 - kSubBits + 1) * kSub;
+
+  static std::size_t index(uint64_t v) {
+    if (v < kSub) {
+      return (std::size_t)v;
+    }
+    int shift = 63 - __builtin_clzll(v) - kSubBits;
+    return (std::size_t)((shift + 1) * kSub + ((v >> shift) - kSub));
+  }
+
+  static uint64_t highest(std::size_t i) {
+    if (i < kSub) {
+      return i;
+    }
+    int shift = (int)(i / kSub) - 1;
+    uint64_t sub = kSub + i % kSub;
+    return ((sub + 1) << shift) - 1;
+  }
+
+  std::vector<uint64_t> counts_;
+  uint64_t count_ = 0;
+  uint64_t sum_ = 0;
+  uint64_t min_ = UINT64_MAX;
+  uint64_t max_ = 0;
+};
+
+}  // namespace tl
@@ -0,0 +1,430 @@
+#include "hot_restart.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+
+#include "connection_table.h"
+#include "spdlog/spdlog.h"
+
+namespace tl {
+
+namespace {
+
+// messages, one per SOCK_SEQPACKET packet: a uint32_t type and a payload.
+enum MessageType : uint32_t {
+  // old to new: the open listening sockets as SCM_RIGHTS, the payload is
+  // the uint32_t loop index of each. The last batch of kMaxFds of them,
+  // after any kMoreListeners.
+  kListeners = 1,
+  // new to old: serving them.
+  kReady = 2,
+  // old to new: one connection, the payload is its unconsumed input.
+  kConn = 3,
+  // old to new: nothing more to pass.
+  kDone = 4,
+  // old to new: like kListeners, with more to follow.
+  kMoreListeners = 5,
+};
+
+// connections with more input than this are drained, not passed.
+const std::size_t kMaxInput = 64 << 10;
+const std::size_t kMaxFds = 64;
+// loop indices of listeners past this are not ours.
+const uint32_t kMaxLoops = 1 << 16;
+const int kDrainCheckMs = 10;
+
+int sendMessage(int s, uint32_t type, const void* data, std::size_t len,
+                const std::vector<int>& fds) {
+  if (fds.size() > kMaxFds) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  union {
+    cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * kMaxFds)];
+  } ctrl;
+  iovec iov[2] = {{&type, sizeof(type)}, {(void*)data, len}};
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  if (!fds.empty()) {
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+    cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(c), fds.data(), sizeof(int) * fds.size());
+  }
+  ssize_t n;
+  do {
+    n = sendmsg(s, &msg, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+  return n < 0 ? -1 : 0;
+}
+
+// Return 1 for a message, 0 at EOF, -1 on error.
+int recvMessage(int s, uint32_t* type, std::string* payload,
+                std::vector<int>* fds) {
+  union {
+    cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * kMaxFds)];
+  } ctrl;
+  std::vector<char> buf(sizeof(*type) + kMaxInput);
+  iovec iov = {buf.data(), buf.size()};
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl.buf;
+  msg.msg_controllen = sizeof(ctrl.buf);
+  ssize_t n;
+  do {
+    n = recvmsg(s, &msg, MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) {
+    return (int)n;
+  }
+  fds->clear();
+  for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+      std::size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      fds->resize(count);
+      memcpy(fds->data(), CMSG_DATA(c), sizeof(int) * count);
+    }
+  }
+  if ((std::size_t)n < sizeof(*type) ||
+      (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+    for (int fd : *fds) {
+      close(fd);
+    }
+    errno = EPROTO;
+    return -1;
+  }
+  memcpy(type, buf.data(), sizeof(*type));
+  payload->assign(buf.data() + sizeof(*type), n - sizeof(*type));
+  return 1;
+}
+
+int pathAddress(const std::string& path, sockaddr_un* sa) {
+  memset(sa, 0, sizeof(*sa));
+  sa->sun_family = AF_UNIX;
+  if (path.size() >= sizeof(sa->sun_path)) {
+    SPDLOG_ERROR("hot restart path too long: {}", path);
+    return -1;
+  }
+  memcpy(sa->sun_path, path.data(), path.size());
+  return 0;
+}
+
+// Run "f" in the loop of "disp" and wait for it.
+void runIn(Dispatcher* disp, const std::function<void()>& f) {
+  std::promise<void> p;
+  disp->post([&] {
+    f();
+    p.set_value();
+  });
+  p.get_future().wait();
+}
+
+}  // namespace
+
+HotRestart::HotRestart(const std::string& path,
+                       std::vector<Dispatcher*> disps, const Options& opts)
+    : path_(path), disps_(std::move(disps)), opts_(opts) {}
+
+HotRestart::~HotRestart() {
+  // wakes up accept().
+  int fd = fd_.load();
+  if (fd >= 0) {
+    shutdown(fd, SHUT_RDWR);
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+  if (peer_ >= 0) {
+    close(peer_);
+  }
+}
+
+int HotRestart::takeover(std::vector<int>* fds) {
+  fds->clear();
+  sockaddr_un sa;
+  if (pathAddress(path_, &sa) < 0) {
+    return -1;
+  }
+  int s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (s < 0) {
+    SPDLOG_ERROR("socket() failed, errno={}, {}", errno, strerror(errno));
+    return -1;
+  }
+  if (connect(s, (sockaddr*)&sa, sizeof(sa)) < 0) {
+    int err = errno;
+    close(s);
+    if (err == ENOENT || err == ECONNREFUSED) {
+      SPDLOG_INFO("hot restart: nothing serves {}, cold start", path_);
+      return 0;
+    }
+    SPDLOG_ERROR("connect({}) errno={}, {}", path_, err, strerror(err));
+    return -1;
+  }
+  // the sockets and the loop of each, in batches of at most kMaxFds.
+  std::vector<int> got;
+  std::vector<uint32_t> loops;
+  for (;;) {
+    uint32_t type = 0;
+    std::string payload;
+    std::vector<int> batch;
+    int r = recvMessage(s, &type, &payload, &batch);
+    got.insert(got.end(), batch.begin(), batch.end());
+    if (r <= 0 || (type != kListeners && type != kMoreListeners) ||
+        (!payload.empty() &&
+         payload.size() != batch.size() * sizeof(uint32_t))) {
+      SPDLOG_ERROR("hot restart: no listeners from {}, errno={}, {}", path_,
+                   errno, strerror(errno));
+      for (int fd : got) {
+        close(fd);
+      }
+      close(s);
+      return -1;
+    }
+    for (std::size_t i = 0; i < batch.size(); i++) {
+      // without the loops, in order.
+      uint32_t loop = (uint32_t)loops.size();
+      if (!payload.empty()) {
+        memcpy(&loop, payload.data() + i * sizeof(loop), sizeof(loop));
+      }
+      loops.push_back(loop);
+    }
+    if (type == kListeners) {
+      break;
+    }
+  }
+  for (std::size_t i = 0; i < got.size(); i++) {
+    uint32_t loop = loops[i];
+    if (loop >= kMaxLoops) {
+      close(got[i]);
+      continue;
+    }
+    if (loop >= fds->size()) {
+      fds->resize(loop + 1, -1);
+    }
+    if ((*fds)[loop] >= 0) {
+      close(got[i]);
+      continue;
+    }
+    (*fds)[loop] = got[i];
+  }
+  SPDLOG_INFO("hot restart: took {} listeners from {}", got.size(), path_);
+  peer_ = s;
+  return 0;
+}
+
+void HotRestart::serve(std::vector<Listener*> listeners,
+                       std::function<void()> done) {
+  listeners_ = std::move(listeners);
+  done_ = std::move(done);
+  thread_ = std::thread([this] { run(); });
+}
+
+void HotRestart::run() {
+  if (peer_ >= 0) {
+    if (sendMessage(peer_, kReady, nullptr, 0, {}) == 0) {
+      receiveConnections();
+    }
+    close(peer_);
+    peer_ = -1;
+  }
+  if (listenPath() < 0) {
+    return;
+  }
+  for (;;) {
+    int peer = accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (peer < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      return;  // shut down
+    }
+    if (handOff(peer) == 0) {
+      return;
+    }
+  }
+}
+
+void HotRestart::receiveConnections() {
+  std::size_t n = 0;
+  for (;;) {
+    uint32_t type = 0;
+    std::string in;
+    std::vector<int> fds;
+    if (recvMessage(peer_, &type, &in, &fds) <= 0 || type == kDone) {
+      break;
+    }
+    if (type != kConn || fds.size() != 1) {
+      for (int fd : fds) {
+        close(fd);
+      }
+      continue;
+    }
+    Dispatcher* disp = disps_[n++ % disps_.size()];
+    int fd = fds[0];
+    disp->post([disp, fd, in] {
+      if (Handler* h = disp->connections()->open(fd)) {
+        h->restore(in);
+      }
+    });
+  }
+  SPDLOG_INFO("hot restart: took {} connections", n);
+}
+
+int HotRestart::listenPath() {
+  sockaddr_un sa;
+  if (pathAddress(path_, &sa) < 0) {
+    return -1;
+  }
+  int s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (s < 0) {
+    SPDLOG_ERROR("socket() failed, errno={}, {}", errno, strerror(errno));
+    return -1;
+  }
+  // the old process is done with it, or gone.
+  unlink(path_.c_str());
+  if (bind(s, (sockaddr*)&sa, sizeof(sa)) < 0 || listen(s, 1) < 0) {
+    SPDLOG_ERROR("hot restart: listen on {} errno={}, {}", path_, errno,
+                 strerror(errno));
+    close(s);
+    return -1;
+  }
+  fd_ = s;
+  return 0;
+}
+
+int HotRestart::handOff(int peer) {
+  if (scaler_) {
+    scaler_->stop();
+  }
+  // not those of the loops a LoopScaler retired, or never opened.
+  std::vector<int> fds;
+  std::vector<uint32_t> loops;
+  for (std::size_t i = 0; i < listeners_.size(); i++) {
+    if (listeners_[i]->fd() >= 0) {
+      fds.push_back(listeners_[i]->fd());
+      loops.push_back((uint32_t)i);
+    }
+  }
+  // in batches of kMaxFds, the last one, maybe empty, as kListeners.
+  int r;
+  std::size_t i = 0;
+  do {
+    std::size_t n = std::min(kMaxFds, fds.size() - i);
+    uint32_t type = i + n < fds.size() ? kMoreListeners : kListeners;
+    r = sendMessage(peer, type, loops.data() + i, n * sizeof(uint32_t),
+                    std::vector<int>(fds.begin() + i, fds.begin() + i + n));
+    i += n;
+  } while (r == 0 && i < fds.size());
+  uint32_t type = 0;
+  std::string payload;
+  std::vector<int> none;
+  if (r < 0 ||
+      recvMessage(peer, &type, &payload, &none) <= 0 || type != kReady) {
+    SPDLOG_ERROR("hot restart: the new process did not take over");
+    close(peer);
+    if (scaler_) {
+      scaler_->start();
+    }
+    return -1;
+  }
+  SPDLOG_INFO("hot restart: listeners handed over, draining");
+  // no more restarts to this process.
+  shutdown(fd_, SHUT_RDWR);
+  for (Listener* ls : listeners_) {
+    if (ls->fd() >= 0) {
+      runIn(ls->dispatcher(), [ls] { ls->stop(); });
+    }
+  }
+  drain(peer, opts_.pass_connections);
+  sendMessage(peer, kDone, nullptr, 0, {});
+  close(peer);
+  SPDLOG_INFO("hot restart: drained");
+  done_();
+  return 0;
+}
+
+void HotRestart::drain(int peer, bool pass) {
+  struct Passed {
+    int fd;
+    std::string in;
+  };
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(opts_.drain_ms);
+  std::size_t passed = 0;
+  for (;;) {
+    std::size_t open = 0;
+    for (Dispatcher* disp : disps_) {
+      std::vector<Passed> idle;
+      runIn(disp, [&] {
+        ConnectionTable* conns = disp->connections();
+        if (pass) {
+          conns->forEach([&](Handler* h) {
+            if (h->idle() && h->pendingRead() <= kMaxInput) {
+              Passed p;
+              p.fd = conns->detach(h, &p.in);
+              if (p.fd >= 0) {
+                idle.push_back(std::move(p));
+              }
+            }
+          });
+        }
+        open += conns->size();
+      });
+      for (auto& p : idle) {
+        if (pass && sendMessage(peer, kConn, p.in.data(), p.in.size(),
+                                {p.fd}) < 0) {
+          // this one and the rest are drained here.
+          SPDLOG_ERROR("hot restart: passing fd {} failed, errno={}, {}",
+                       p.fd, errno, strerror(errno));
+          pass = false;
+        }
+        if (pass) {
+          passed++;
+          close(p.fd);
+          continue;
+        }
+        runIn(disp, [&] {
+          if (Handler* h = disp->connections()->open(p.fd)) {
+            h->restore(p.in);
+          }
+        });
+      }
+    }
+    if (open == 0) {
+      break;
+    }
+    if (std::chrono::steady_clock::now() > deadline) {
+      SPDLOG_WARN("hot restart: closing {} connections not drained", open);
+      for (Dispatcher* disp : disps_) {
+        runIn(disp, [disp] {
+          ConnectionTable* conns = disp->connections();
+          conns->forEach([](Handler* h) { h->close(); });
+        });
+      }
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(kDrainCheckMs));
+  }
+  SPDLOG_INFO("hot restart: passed {} connections", passed);
+}
+
+}  // namespace tl
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dispatcher.h"
+#include "listener.h"
+#include "loop_scaler.h"
+
+namespace tl {
+
+// Restart without dropping clients: the running server hands its listening
+// sockets, and optionally its idle connections, to its replacement over a
+// Unix socket at "path" with SCM_RIGHTS.
+//
+// The new process connects to "path", takes the listeners and serves them,
+// then acks. The old process stops accepting and drains: a connection is
+// passed with the input it has not consumed once it is idle (see
+// Handler::idle()), or with "pass_connections" off served until the client
+// closes it. What is still open after "drain_ms" is closed, the old process
+// exits and the new one serves "path" for the next restart.
+class HotRestart {
+ public:
+  struct Options {
+    bool pass_connections = false;
+    uint32_t drain_ms = 30000;
+  };
+
+  HotRestart(const std::string& path, std::vector<Dispatcher*> disps,
+             const Options& opts);
+  ~HotRestart();
+  HotRestart(const HotRestart&) = delete;
+  HotRestart& operator=(const HotRestart&) = delete;
+
+  // Before opening the listeners: if a process serves "path", take its
+  // listening sockets into "fds", indexed by the loop that served them, -1
+  // for a loop that did not listen. "fds" is left empty if none does.
+  // Return -1 on error.
+  int takeover(std::vector<int>* fds);
+  // Stop "scaler" while handing over, so the listeners sent are the ones
+  // open, and start it again if the new process does not take over. Not
+  // owned, call it before serve().
+  void setScaler(LoopScaler* scaler) { scaler_ = scaler; }
+  // Once the listeners and loops run: take the connections the old process
+  // passes, if any, then serve "path" in a thread. At a restart "listeners"
+  // and the connections of the dispatchers are handed over, then "done" is
+  // called to stop the loops.
+  void serve(std::vector<Listener*> listeners, std::function<void()> done);
+
+ private:
+  void run();
+  void receiveConnections();
+  int listenPath();
+  // Return -1 if the new process did not take over, this one goes on then.
+  int handOff(int peer);
+  // Drain the connections, passing them to "peer" if "pass".
+  void drain(int peer, bool pass);
+
+  std::string path_;
+  std::vector<Dispatcher*> disps_;
+  Options opts_;
+  // the old process while taking over.
+  int peer_ = -1;
+  // listening on path_.
+  std::atomic<int> fd_{-1};
+  std::vector<Listener*> listeners_;
+  LoopScaler* scaler_ = nullptr;
+  std::function<void()> done_;
+  std::thread thread_;
+};
+
+}  // namespace tl
@@ -0,0 +1,400 @@
+#include "kv_protocol.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "handler.h"
+
+namespace tl {
+
+namespace {
+
+// longest text command line.
+const std::size_t kMaxLine = 2048;
+const std::size_t kMaxKey = 250;
+
+// memcached binary protocol.
+const unsigned char kBinaryRequest = 0x80;
+const unsigned char kBinaryResponse = 0x81;
+const std::size_t kBinaryHeader = 24;
+const uint8_t kOpGet = 0x00;
+const uint8_t kOpSet = 0x01;
+const uint8_t kOpDelete = 0x04;
+const uint16_t kStatusOk = 0x0000;
+const uint16_t kStatusNotFound = 0x0001;
+const uint16_t kStatusTooLarge = 0x0003;
+const uint16_t kStatusUnknown = 0x0081;
+
+void append(buffer& out, const void* data, std::size_t len) {
+  writeSpace(out, data, len);
+}
+
+void append(std::string& out, const void* data, std::size_t len) {
+  out.append((const char*)data, len);
+}
+
+template <class Out>
+void append(Out& out, std::string_view s) {
+  append(out, s.data(), s.size());
+}
+
+template <class Out>
+void binaryResponse(Out& out, uint8_t opcode, uint16_t status,
+                    uint32_t opaque, const void* extras, uint8_t extras_len,
+                    std::string_view value) {
+  unsigned char hdr[kBinaryHeader] = {0};
+  hdr[0] = kBinaryResponse;
+  hdr[1] = opcode;
+  hdr[4] = extras_len;
+  storeInt<uint16_t, true>(hdr + 6, status);
+  storeInt<uint32_t, true>(hdr + 8, (uint32_t)(extras_len + value.size()));
+  storeInt<uint32_t, true>(hdr + 12, opaque);
+  append(out, hdr, sizeof(hdr));
+  append(out, extras, extras_len);
+  append(out, value);
+}
+
+// Offset of the first '\n' in the first "limit" bytes of "in", or -1.
+long findNewline(buffer& in, std::size_t limit) {
+  long found = -1;
+  std::size_t pos = 0;
+  in.forEachSegment(0, limit, [&](const unsigned char* p, std::size_t n) {
+    if (found < 0) {
+      auto c = (const unsigned char*)memchr(p, '\n', n);
+      if (c) {
+        found = (long)(pos + (c - p));
+      }
+    }
+    pos += n;
+  });
+  return found;
+}
+
+std::vector<std::string_view> split(std::string_view line) {
+  std::vector<std::string_view> tokens;
+  std::size_t i = 0;
+  while (i < line.size()) {
+    std::size_t sp = line.find(' ', i);
+    if (sp == std::string_view::npos) {
+      sp = line.size();
+    }
+    if (sp > i) {
+      tokens.push_back(line.substr(i, sp - i));
+    }
+    i = sp + 1;
+  }
+  return tokens;
+}
+
+}  // namespace
+
+KvService::KvService(std::vector<Dispatcher*> disps, std::size_t max_bytes)
+    : disps_(std::move(disps)) {
+  for (std::size_t i = 0; i < disps_.size(); i++) {
+    stores_.emplace_back(new KvStore(max_bytes / disps_.size()));
+    protocols_.emplace_back(new KvProtocol(this, i));
+  }
+}
+
+KvService::~KvService() {}
+
+template <class Value, class Out>
+void KvProtocol::execute(KvStore& store, const Request& req,
+                         std::string_view key, const Value& value, Out& out) {
+  switch (req.op) {
+    case kGet: {
+      const KvStore::Item* item = store.get(key);
+      if (req.binary) {
+        if (item == nullptr) {
+          binaryResponse(out, req.opcode, kStatusNotFound, req.opaque, nullptr,
+                         0, std::string_view());
+        } else {
+          unsigned char flags[4];
+          storeInt<uint32_t, true>(flags, item->flags);
+          binaryResponse(out, req.opcode, kStatusOk, req.opaque, flags, 4,
+                         item->value());
+        }
+      } else if (item) {
+        char hdr[kMaxKey + 64];
+        int n = snprintf(hdr, sizeof(hdr), "VALUE %.*s %u %u\r\n",
+                         (int)key.size(), key.data(), item->flags,
+                         item->value_len);
+        append(out, hdr, n);
+        append(out, item->value());
+        append(out, "\r\n", 2);
+      }
+      break;
+    }
+    case kSet: {
+      bool stored = store.set(key, value, req.flags);
+      if (req.binary) {
+        binaryResponse(out, req.opcode, stored ? kStatusOk : kStatusTooLarge,
+                       req.opaque, nullptr, 0, std::string_view());
+      } else if (!req.noreply) {
+        append(out, stored ? std::string_view("STORED\r\n")
+                           : std::string_view("SERVER_ERROR object too large "
+                                              "for cache\r\n"));
+      }
+      break;
+    }
+    case kDel: {
+      bool deleted = store.del(key);
+      if (req.binary) {
+        binaryResponse(out, req.opcode,
+                       deleted ? kStatusOk : kStatusNotFound, req.opaque,
+                       nullptr, 0, std::string_view());
+      } else if (!req.noreply) {
+        append(out, deleted ? std::string_view("DELETED\r\n")
+                            : std::string_view("NOT_FOUND\r\n"));
+      }
+      break;
+    }
+  }
+}
+
+int KvProtocol::onRead(Handler* h, buffer& in, buffer& out) {
+  ConnId cid = h->dispatcher()->connections()->id(h);
+  auto sk = skip_.find(cid);
+  if (sk != skip_.end()) {
+    std::size_t n = sk->second < in.size() ? sk->second : in.size();
+    in.drain(n);
+    sk->second -= n;
+    if (sk->second) {
+      return 0;
+    }
+    skip_.erase(sk);
+  }
+  while (in.size()) {
+    auto it = conns_.find(cid);
+    if (it != conns_.end() && it->second.pending.size() >= kMaxPending) {
+      // the rest waits in the socket, complete() reads on.
+      it->second.held = true;
+      h->holdReads();
+      break;
+    }
+    long n = in[0] == kBinaryRequest ? binaryRequest(h, in, out)
+                                     : textRequest(h, in, out);
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    if ((std::size_t)n > in.size()) {
+      skip_[cid] = n - in.size();
+      in.drain(in.size());
+      break;
+    }
+    in.drain(n);
+  }
+  return 0;
+}
+
+void KvProtocol::onClose(Handler* h) {
+  skip_.erase(h->dispatcher()->connections()->id(h));
+}
+
+bool KvProtocol::busy(Handler* h) {
+  return conns_.count(h->dispatcher()->connections()->id(h)) != 0;
+}
+
+long KvProtocol::textRequest(Handler* h, buffer& in, buffer& out) {
+  std::size_t limit = in.size() < kMaxLine ? in.size() : kMaxLine;
+  long eol = findNewline(in, limit);
+  if (eol < 0) {
+    return in.size() < kMaxLine ? 0 : -1;
+  }
+  std::string line = BufferView(&in, 0, eol).toString();
+  if (!line.empty() && line.back() == '\r') {
+    line.pop_back();
+  }
+  std::vector<std::string_view> tokens = split(line);
+  long used = eol + 1;
+  BufferView none(&in, 0, 0);
+  Request req = {kGet, false, 0, false, 0, 0};
+  for (std::size_t i = 1; i < tokens.size(); i++) {
+    if (tokens[i].size() > kMaxKey) {
+      writeOrdered(h, out, "CLIENT_ERROR bad command line format\r\n");
+      return used;
+    }
+  }
+
+  if ((tokens.size() >= 2 && tokens[0] == "get") ||
+      (tokens.size() >= 2 && tokens[0] == "gets")) {
+    for (std::size_t i = 1; i < tokens.size(); i++) {
+      dispatch(h, out, req, tokens[i], none);
+    }
+    writeOrdered(h, out, "END\r\n");
+  } else if ((tokens.size() == 5 || tokens.size() == 6) &&
+             tokens[0] == "set") {
+    std::string flags(tokens[2]);
+    std::string bytes(tokens[4]);
+    // under 10^9, so skipping the value cannot overflow.
+    if (bytes.size() > 9 ||
+        bytes.find_first_not_of("0123456789") != std::string::npos) {
+      writeOrdered(h, out, "CLIENT_ERROR bad command line format\r\n");
+      return used;
+    }
+    std::size_t len = strtoul(bytes.c_str(), nullptr, 10);
+    if (len > KvStore::kMaxItem) {
+      // like memcached: refuse it, noreply or not, and skip the value.
+      writeOrdered(h, out, "SERVER_ERROR object too large for cache\r\n");
+      return used + len + 2;
+    }
+    if (in.size() < used + len + 2) {
+      return 0;
+    }
+    if (in[used + len] != '\r' || in[used + len + 1] != '\n') {
+      return -1;
+    }
+    req.op = kSet;
+    req.flags = (uint32_t)strtoul(flags.c_str(), nullptr, 10);
+    req.noreply = tokens.size() == 6 && tokens[5] == "noreply";
+    dispatch(h, out, req, tokens[1], BufferView(&in, used, len));
+    used += len + 2;
+  } else if ((tokens.size() == 2 || tokens.size() == 3) &&
+             tokens[0] == "delete") {
+    req.op = kDel;
+    req.noreply = tokens.size() == 3 && tokens[2] == "noreply";
+    dispatch(h, out, req, tokens[1], none);
+  } else {
+    writeOrdered(h, out, "ERROR\r\n");
+  }
+  return used;
+}
+
+long KvProtocol::binaryRequest(Handler* h, buffer& in, buffer& out) {
+  if (in.size() < kBinaryHeader) {
+    return 0;
+  }
+  unsigned char hdr[kBinaryHeader];
+  BufferView(&in, 0, kBinaryHeader).copyTo(hdr, kBinaryHeader);
+  std::size_t key_len = loadInt<uint16_t, true>(hdr + 2);
+  std::size_t extras_len = hdr[4];
+  std::size_t body_len = loadInt<uint32_t, true>(hdr + 8);
+  if (key_len + extras_len > body_len) {
+    return -1;
+  }
+  Request req = {kGet, true, hdr[1], false, 0,
+                 loadInt<uint32_t, true>(hdr + 12)};
+  if (body_len > KvStore::kMaxItem) {
+    if (req.opcode != kOpSet) {
+      return -1;
+    }
+    // like the text protocol: refuse it and skip the value.
+    std::string resp;
+    binaryResponse(resp, req.opcode, kStatusTooLarge, req.opaque, nullptr, 0,
+                   std::string_view());
+    writeOrdered(h, out, resp);
+    return kBinaryHeader + body_len;
+  }
+  if (in.size() < kBinaryHeader + body_len) {
+    return 0;
+  }
+  std::string key =
+      BufferView(&in, kBinaryHeader + extras_len, key_len).toString();
+  std::size_t value_at = kBinaryHeader + extras_len + key_len;
+  BufferView value(&in, value_at, kBinaryHeader + body_len - value_at);
+
+  switch (req.opcode) {
+    case kOpGet:
+      dispatch(h, out, req, key, BufferView(&in, 0, 0));
+      break;
+    case kOpSet: {
+      if (extras_len != 8) {
+        return -1;
+      }
+      unsigned char flags[4];
+      BufferView(&in, kBinaryHeader, 4).copyTo(flags, 4);
+      req.op = kSet;
+      req.flags = loadInt<uint32_t, true>(flags);
+      dispatch(h, out, req, key, value);
+      break;
+    }
+    case kOpDelete:
+      req.op = kDel;
+      dispatch(h, out, req, key, BufferView(&in, 0, 0));
+      break;
+    default: {
+      std::string resp;
+      binaryResponse(resp, req.opcode, kStatusUnknown, req.opaque, nullptr, 0,
+                     std::string_view());
+      writeOrdered(h, out, resp);
+      break;
+    }
+  }
+  return kBinaryHeader + body_len;
+}
+
+void KvProtocol::dispatch(Handler* h, buffer& out, const Request& req,
+                          std::string_view key, const BufferView& value) {
+  std::size_t shard = svc_->shardOf(key);
+  ConnId cid = h->dispatcher()->connections()->id(h);
+  if (shard == shard_) {
+    if (conns_.find(cid) == conns_.end()) {
+      execute(svc_->store(shard), req, key, value, out);
+    } else {
+      std::string resp;
+      execute(svc_->store(shard), req, key, value, resp);
+      complete(cid, reserve(cid), std::move(resp));
+    }
+    return;
+  }
+
+  uint64_t seq = reserve(cid);
+  KvService* svc = svc_;
+  KvProtocol* self = this;
+  Dispatcher* origin = h->dispatcher();
+  std::string k(key);
+  std::string v = req.op == kSet ? value.toString() : std::string();
+  svc->dispatcher(shard)->post([=] {
+    std::string resp;
+    execute(svc->store(shard), req, k, std::string_view(v), resp);
+    origin->post([=] { self->complete(cid, seq, resp); });
+  });
+}
+
+void KvProtocol::writeOrdered(Handler* h, buffer& out, std::string_view resp) {
+  ConnId cid = h->dispatcher()->connections()->id(h);
+  if (conns_.find(cid) == conns_.end()) {
+    append(out, resp);
+  } else {
+    complete(cid, reserve(cid), std::string(resp));
+  }
+}
+
+uint64_t KvProtocol::reserve(ConnId cid) {
+  Conn& c = conns_[cid];
+  c.pending.emplace_back(false, std::string());
+  return c.head + c.pending.size() - 1;
+}
+
+void KvProtocol::complete(ConnId cid, uint64_t seq, std::string resp) {
+  auto it = conns_.find(cid);
+  if (it == conns_.end()) {
+    return;
+  }
+  Conn& c = it->second;
+  c.pending[seq - c.head] = std::make_pair(true, std::move(resp));
+  // the connection may be gone, the responses are dropped then.
+  Handler* h = svc_->dispatcher(shard_)->connections()->get(cid);
+  while (!c.pending.empty() && c.pending.front().first) {
+    const std::string& r = c.pending.front().second;
+    if (h && !r.empty()) {
+      h->write(r.data(), r.size());
+    }
+    c.pending.pop_front();
+    c.head++;
+  }
+  if (c.held && c.pending.size() <= kMaxPending / 2) {
+    c.held = false;
+    if (h) {
+      h->resumeReads();
+    }
+  }
+  if (c.pending.empty()) {
+    conns_.erase(it);
+  }
+}
+
+}  // namespace tl
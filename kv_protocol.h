@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "connection_table.h"
+#include "dispatcher.h"
+#include "kv_store.h"
+#include "protocol.h"
+
+namespace tl {
+
+class KvProtocol;
+
+// A memcached style cache sharded over dispatchers, shared nothing: each
+// dispatcher owns the keys hashing to it in a KvStore only its loop touches.
+// A connection is served by the protocol of its own dispatcher, requests for
+// keys of another shard are run there with Dispatcher::post() and the
+// response posted back.
+class KvService {
+ public:
+  // "max_bytes" of items in total, split evenly over the shards.
+  KvService(std::vector<Dispatcher*> disps, std::size_t max_bytes);
+  ~KvService();
+
+  std::size_t shards() const { return disps_.size(); }
+  std::size_t shardOf(std::string_view key) const {
+    return (KvStore::hash(key) >> 32) % disps_.size();
+  }
+  Dispatcher* dispatcher(std::size_t shard) { return disps_[shard]; }
+  // Only use it inside the loop of dispatcher(shard).
+  KvStore& store(std::size_t shard) { return *stores_[shard]; }
+  // The protocol for connections of dispatcher(shard).
+  KvProtocol* protocol(std::size_t shard) { return protocols_[shard].get(); }
+
+ private:
+  std::vector<Dispatcher*> disps_;
+  std::vector<std::unique_ptr<KvStore> > stores_;
+  std::vector<std::unique_ptr<KvProtocol> > protocols_;
+};
+
+// Memcached text commands "get <key>*", "set <key> <flags> <exptime>
+// <bytes> [noreply]" and "delete <key> [noreply]", and the GET, SET and
+// DELETE opcodes of the memcached binary protocol, chosen per request by
+// its first byte. Expiration times are ignored.
+//
+// Responses go out in request order: a connection with a request forwarded
+// to another shard queues the responses after it until it is answered. At
+// kMaxPending queued responses it stops reading, until half of them went.
+class KvProtocol : public Protocol {
+ public:
+  // queued responses of a connection, checked between requests.
+  static constexpr std::size_t kMaxPending = 1024;
+
+  KvProtocol(KvService* svc, std::size_t shard) : svc_(svc), shard_(shard) {}
+
+  int onRead(Handler* h, buffer& in, buffer& out) override;
+  void onClose(Handler* h) override;
+  // A request of "h" is forwarded to another shard.
+  bool busy(Handler* h) override;
+
+ private:
+  enum Op : uint8_t { kGet, kSet, kDel };
+  struct Request {
+    Op op;
+    // binary protocol, the opcode and opaque are echoed in the response.
+    bool binary;
+    uint8_t opcode;
+    bool noreply;
+    uint32_t flags;
+    uint32_t opaque;
+  };
+  struct Conn {
+    // sequence number of pending.front().
+    uint64_t head = 0;
+    // responses not written yet, in request order, "done" when answered.
+    std::deque<std::pair<bool, std::string> > pending;
+    // reads held at kMaxPending.
+    bool held = false;
+  };
+
+  // Parse and run one request at the head of "in". Return the bytes it took,
+  // more than "in" holds for a value to skip, 0 if incomplete, -1 if
+  // malformed.
+  long textRequest(Handler* h, buffer& in, buffer& out);
+  long binaryRequest(Handler* h, buffer& in, buffer& out);
+  // Run "req" on "key" here or on its shard, and write the response in
+  // order. "value" is the value of a set.
+  void dispatch(Handler* h, buffer& out, const Request& req,
+                std::string_view key, const BufferView& value);
+  // Run "req" on "store" and append the response to "out", a buffer or a
+  // std::string. "value" is a BufferView or a std::string_view.
+  template <class Value, class Out>
+  static void execute(KvStore& store, const Request& req, std::string_view key,
+                      const Value& value, Out& out);
+  // Write a response made here in order.
+  void writeOrdered(Handler* h, buffer& out, std::string_view resp);
+  // Queue a response slot, return its sequence number.
+  uint64_t reserve(ConnId cid);
+  // Fill slot "seq" and write out the responses now in order.
+  void complete(ConnId cid, uint64_t seq, std::string resp);
+
+  KvService* svc_;
+  std::size_t shard_;
+  // connections waiting for a forwarded request.
+  std::unordered_map<ConnId, Conn> conns_;
+  // bytes still to skip of a value refused before it was read.
+  std::unordered_map<ConnId, std::size_t> skip_;
+};
+
+}  // namespace tl
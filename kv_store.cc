@@ -0,0 +1,222 @@
+#include "kv_store.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+#include "codec.h"
+
+namespace tl {
+
+namespace {
+
+const std::size_t kMinChunk = 64;
+const std::size_t kInitialSlots = 1024;
+
+// Chunk sizes growing by 1.25, 8 byte aligned, the last one kMaxItem.
+const std::vector<std::size_t>& sizeClasses() {
+  static const std::vector<std::size_t> classes = [] {
+    std::vector<std::size_t> v;
+    for (double s = kMinChunk; s < KvStore::kMaxItem; s *= 1.25) {
+      v.push_back(((std::size_t)s + 7) & ~(std::size_t)7);
+    }
+    v.push_back(KvStore::kMaxItem);
+    return v;
+  }();
+  return classes;
+}
+
+}  // namespace
+
+KvStore::KvStore(std::size_t max_bytes)
+    : max_bytes_(max_bytes),
+      slots_(kInitialSlots, Slot{0, nullptr}),
+      mask_(kInitialSlots - 1),
+      free_(sizeClasses().size()) {}
+
+KvStore::~KvStore() {
+  for (auto& s : slots_) {
+    if (s.item) {
+      delete[](char*) s.item;
+    }
+  }
+  for (auto& list : free_) {
+    for (char* p : list) {
+      delete[] p;
+    }
+  }
+}
+
+uint64_t KvStore::hash(std::string_view key) {
+  return std::hash<std::string_view>()(key);
+}
+
+std::size_t KvStore::find(std::string_view key, uint64_t h) const {
+  for (std::size_t i = h & mask_;; i = (i + 1) & mask_) {
+    const Slot& s = slots_[i];
+    if (s.item == nullptr || (s.hash == h && s.item->key() == key)) {
+      return i;
+    }
+  }
+}
+
+const KvStore::Item* KvStore::get(std::string_view key) {
+  Slot& s = slots_[find(key, hash(key))];
+  if (s.item == nullptr) {
+    misses_++;
+    return nullptr;
+  }
+  hits_++;
+  s.item->referenced = true;
+  return s.item;
+}
+
+bool KvStore::set(std::string_view key, const BufferView& value,
+                  uint32_t flags) {
+  Item* item = allocate(key, value.size(), flags);
+  if (item == nullptr) {
+    return false;
+  }
+  value.copyTo((char*)(item + 1) + key.size(), value.size());
+  insert(item);
+  return true;
+}
+
+bool KvStore::set(std::string_view key, std::string_view value,
+                  uint32_t flags) {
+  Item* item = allocate(key, value.size(), flags);
+  if (item == nullptr) {
+    return false;
+  }
+  memcpy((char*)(item + 1) + key.size(), value.data(), value.size());
+  insert(item);
+  return true;
+}
+
+bool KvStore::del(std::string_view key) {
+  std::size_t i = find(key, hash(key));
+  if (slots_[i].item == nullptr) {
+    return false;
+  }
+  erase(i);
+  return true;
+}
+
+KvStore::Item* KvStore::allocate(std::string_view key, std::size_t value_len,
+                                 uint32_t flags) {
+  std::size_t size = sizeof(Item) + key.size() + value_len;
+  if (size > kMaxItem || size > max_bytes_) {
+    return nullptr;
+  }
+  const auto& classes = sizeClasses();
+  std::size_t cls =
+      std::lower_bound(classes.begin(), classes.end(), size) - classes.begin();
+
+  char* chunk = nullptr;
+  while (chunk == nullptr) {
+    if (!free_[cls].empty()) {
+      chunk = free_[cls].back();
+      free_[cls].pop_back();
+      break;
+    }
+    if (bytes_ + classes[cls] <= max_bytes_) {
+      chunk = new char[classes[cls]];
+      bytes_ += classes[cls];
+      break;
+    }
+    // make room: free chunks of other classes first, then evict.
+    bool released = false;
+    for (std::size_t c = 0; c < free_.size() && !released; c++) {
+      if (!free_[c].empty()) {
+        delete[] free_[c].back();
+        free_[c].pop_back();
+        bytes_ -= classes[c];
+        released = true;
+      }
+    }
+    if (!released && !evictOne()) {
+      return nullptr;
+    }
+  }
+
+  Item* item = (Item*)chunk;
+  item->key_len = (uint32_t)key.size();
+  item->value_len = (uint32_t)value_len;
+  item->flags = flags;
+  item->referenced = false;
+  item->size_class = (uint8_t)cls;
+  memcpy(item + 1, key.data(), key.size());
+  return item;
+}
+
+void KvStore::insert(Item* item) {
+  uint64_t h = hash(item->key());
+  std::size_t i = find(item->key(), h);
+  if (slots_[i].item) {
+    release(slots_[i].item);
+    slots_[i].item = item;
+    return;
+  }
+  // keep the load under 0.7.
+  if ((items_ + 1) * 10 > slots_.size() * 7) {
+    grow();
+    i = find(item->key(), h);
+  }
+  slots_[i] = Slot{h, item};
+  items_++;
+}
+
+void KvStore::release(Item* item) {
+  free_[item->size_class].push_back((char*)item);
+}
+
+void KvStore::erase(std::size_t i) {
+  release(slots_[i].item);
+  items_--;
+  // shift back the entries after "i" that may no longer be found past the
+  // hole, instead of leaving a tombstone.
+  for (std::size_t j = (i + 1) & mask_; slots_[j].item; j = (j + 1) & mask_) {
+    std::size_t home = slots_[j].hash & mask_;
+    bool movable = i <= j ? (home <= i || home > j) : (home <= i && home > j);
+    if (movable) {
+      slots_[i] = slots_[j];
+      i = j;
+    }
+  }
+  slots_[i] = Slot{0, nullptr};
+}
+
+bool KvStore::evictOne() {
+  // two passes clear every referenced bit.
+  for (std::size_t n = 0; items_ && n < 2 * slots_.size(); n++) {
+    Slot& s = slots_[hand_];
+    if (s.item) {
+      if (!s.item->referenced) {
+        erase(hand_);
+        evictions_++;
+        return true;
+      }
+      s.item->referenced = false;
+    }
+    hand_ = (hand_ + 1) & mask_;
+  }
+  return false;
+}
+
+void KvStore::grow() {
+  std::vector<Slot> old(slots_.size() * 2, Slot{0, nullptr});
+  old.swap(slots_);
+  mask_ = slots_.size() - 1;
+  hand_ = 0;
+  for (auto& s : old) {
+    if (s.item) {
+      std::size_t i = s.hash & mask_;
+      while (slots_[i].item) {
+        i = (i + 1) & mask_;
+      }
+      slots_[i] = s;
+    }
+  }
+}
+
+}  // namespace tl
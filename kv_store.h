@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace tl {
+
+class BufferView;
+
+// One shard of the key-value cache, used by one thread only.
+//
+// Keys map to items through an open addressing table with linear probing and
+// backward shift deletion. An item (header, key, value) lives in a chunk of
+// the smallest size class that fits it; chunks of freed items are kept on a
+// free list per class for reuse. Total chunk memory stays under "max_bytes":
+// past it, free chunks of other classes are released first, then items are
+// evicted by CLOCK, the hand sweeping the table and sparing items read since
+// its last pass.
+class KvStore {
+ public:
+  struct Item {
+    uint32_t key_len;
+    uint32_t value_len;
+    uint32_t flags;
+    // read since the clock hand last passed.
+    bool referenced;
+    uint8_t size_class;
+
+    std::string_view key() const {
+      return std::string_view((const char*)(this + 1), key_len);
+    }
+    std::string_view value() const {
+      return std::string_view((const char*)(this + 1) + key_len, value_len);
+    }
+  };
+
+  // Largest item, header and key included.
+  static constexpr std::size_t kMaxItem = 1 << 20;
+
+  explicit KvStore(std::size_t max_bytes);
+  ~KvStore();
+  KvStore(const KvStore&) = delete;
+  KvStore& operator=(const KvStore&) = delete;
+
+  static uint64_t hash(std::string_view key);
+
+  // nullptr if missing. Valid until the next set() or del().
+  const Item* get(std::string_view key);
+  // Copy "value" into the item of "key". Return false if it is larger than
+  // kMaxItem or the cap.
+  bool set(std::string_view key, const BufferView& value, uint32_t flags);
+  bool set(std::string_view key, std::string_view value, uint32_t flags);
+  // Return false if missing.
+  bool del(std::string_view key);
+
+  std::size_t items() const { return items_; }
+  // Chunk memory, in use and on the free lists.
+  std::size_t bytes() const { return bytes_; }
+  uint64_t evictions() const { return evictions_; }
+  uint64_t hits() const { return hits_; }
+  uint64_t misses() const { return misses_; }
+
+ private:
+  struct Slot {
+    uint64_t hash;
+    Item* item;
+  };
+
+  // Slot of "key", or the empty slot where it would go.
+  std::size_t find(std::string_view key, uint64_t h) const;
+  // An item with "key" copied in and room for the value, not in the table
+  // yet. nullptr if too large.
+  Item* allocate(std::string_view key, std::size_t value_len, uint32_t flags);
+  // Put "item" in the table, replacing the item of its key.
+  void insert(Item* item);
+  void release(Item* item);
+  // Remove the item of slot "i" from the table and free it.
+  void erase(std::size_t i);
+  // Evict one item, return false if there is none.
+  bool evictOne();
+  void grow();
+
+  std::size_t max_bytes_;
+  std::size_t bytes_ = 0;
+  std::vector<Slot> slots_;
+  std::size_t mask_;
+  std::size_t items_ = 0;
+  std::size_t hand_ = 0;
+  // free chunks per size class.
+  std::vector<std::vector<char*> > free_;
+  uint64_t evictions_ = 0;
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+};
+
+}  // namespace tl
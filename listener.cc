@@ -2,84 +2,213 @@
 
 namespace tl {
 
+// how often a paused listener checks the limits.
+static const int kResumeCheckUs = 10000;
+
 extern "C" void listener_event_cb(evutil_socket_t fd, short what, void* ptr) {
-  SPDLOG_INFO("get fd {}", fd);
-  (void)fd;
+  SPDLOG_TRACE("get fd {}", fd);
   Listener* ls = (Listener*)ptr;
+  LoopProfiler::Scope prof(ls->dispatcher()->profiler(),
+                           LoopProfiler::kListener, fd);
   if (what & EV_READ) {
     ls->doAccept();
   }
 }
 
+extern "C" void listener_resume_cb(evutil_socket_t, short, void* ptr) {
+  Listener* ls = (Listener*)ptr;
+  LoopProfiler::Scope prof(ls->dispatcher()->profiler(),
+                           LoopProfiler::kListener, -1);
+  ls->checkResume();
+}
+
 Listener::~Listener() {
   if (ev_) {
     event_free(ev_);
   }
+  if (ev_resume_) {
+    event_free(ev_resume_);
+  }
   if (fd_ >= 0) {
-    close(fd_);
+    ::close(fd_);
     fd_ = -1;
   }
 }
 
+void Listener::close() {
+  if (fd_ < 0) {
+    return;
+  }
+  for (;;) {
+    int s = accept(fd_, nullptr, nullptr);
+    if (s == -1) {
+      break;
+    }
+    disp_->metrics().accepts.add();
+    handle_(disp_, s);
+  }
+  stop();
+}
+
+void Listener::stop() {
+  if (fd_ < 0) {
+    return;
+  }
+  if (ev_) {
+    event_free(ev_);
+    ev_ = NULL;
+  }
+  if (ev_resume_) {
+    event_free(ev_resume_);
+    ev_resume_ = NULL;
+  }
+  if (paused_) {
+    paused_ = false;
+    disp_->metrics().accept_paused.set(0);
+  }
+  ::close(fd_);
+  fd_ = -1;
+  disp_->metrics().listening.set(0);
+  SPDLOG_INFO("closed {}:{}", addr_, port_);
+}
+
 int Listener::open(Dispatcher* disp,
                    std::function<void(Dispatcher* disp, int fd)> handle) {
+  if (fd_ >= 0) {
+    SPDLOG_ERROR("{}:{} already listening on fd {}", addr_, port_, fd_);
+    return -1;
+  }
   struct sockaddr_in sockaddr;
   socklen_t socklen = sizeof(sockaddr);
   int opt = SO_REUSEADDR | SO_REUSEPORT;
   int one = 1;
-  disp_ = disp;
-  handle_ = handle;
 
-  fd_ = socket(AF_INET, SOCK_STREAM, 0);
-  if (fd_ < 0) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
     SPDLOG_ERROR("socket() failed, errno={}, {}", errno, strerror(errno));
     return -1;
   }
-  int r = setsockopt(fd_, SOL_SOCKET, opt, (const void*)&one, sizeof(one));
+  int r = setsockopt(fd, SOL_SOCKET, opt, (const void*)&one, sizeof(one));
   if (r < 0) {
-    SPDLOG_ERROR("setsockopt, errno=%d, %s", errno, strerror(errno));
+    SPDLOG_ERROR("setsockopt, errno={}, {}", errno, strerror(errno));
+    ::close(fd);
     return -1;
   }
-  if (evutil_make_socket_nonblocking(fd_) < 0) {
+  if (evutil_make_socket_nonblocking(fd) < 0) {
     SPDLOG_ERROR("evutil_make_socket_nonblocking errno={}, {}", errno,
                  strerror(errno));
+    ::close(fd);
     return -1;
   }
   memset(&sockaddr, 0, sizeof(sockaddr));
   sockaddr.sin_family = AF_INET;
   sockaddr.sin_addr.s_addr = inet_addr(addr_.c_str());
   sockaddr.sin_port = htons((unsigned short)port_);
-  r = bind(fd_, (struct sockaddr*)&sockaddr, socklen);
+  r = bind(fd, (struct sockaddr*)&sockaddr, socklen);
   if (r < 0) {
     SPDLOG_ERROR("bind() errno={}, {}", errno, strerror(errno));
+    ::close(fd);
+    return -1;
+  }
+  if (opts_.applyListen(fd) < 0) {
+    ::close(fd);
     return -1;
   }
-  r = listen(fd_, 512);
+  r = listen(fd, opts_.backlog);
   if (r < 0) {
     SPDLOG_ERROR("listen() errno={}, {}", errno, strerror(errno));
+    ::close(fd);
     return -1;
   }
   SPDLOG_INFO("listening {}:{}", addr_, port_);
-  ev_ = event_new(disp->ev_base(), fd_, EV_READ | EV_PERSIST, listener_event_cb,
-                  this);
-  event_add(ev_, nullptr);
+  disp_ = disp;
+  handle_ = handle;
+  fd_ = fd;
+  watch();
+  return 0;
+}
+
+int Listener::adopt(Dispatcher* disp, int fd,
+                    std::function<void(Dispatcher* disp, int fd)> handle) {
+  if (fd_ >= 0) {
+    SPDLOG_ERROR("{}:{} already listening on fd {}", addr_, port_, fd_);
+    ::close(fd);
+    return -1;
+  }
+  disp_ = disp;
+  handle_ = handle;
+  fd_ = fd;
+  if (evutil_make_socket_nonblocking(fd_) < 0) {
+    SPDLOG_ERROR("evutil_make_socket_nonblocking errno={}, {}", errno,
+                 strerror(errno));
+    return -1;
+  }
+  SPDLOG_INFO("listening {}:{} on inherited fd {}", addr_, port_, fd_);
+  watch();
   return 0;
 }
 
+void Listener::watch() {
+  ev_ = event_new(disp_->ev_base(), fd_, EV_READ | EV_PERSIST,
+                  listener_event_cb, this);
+  event_add(ev_, nullptr);
+  disp_->metrics().listening.set(1);
+  if (ac_) {
+    ev_resume_ = event_new(disp_->ev_base(), -1, EV_PERSIST,
+                           listener_resume_cb, this);
+  }
+}
+
 int Listener::doAccept() {
   int s;
   struct sockaddr_in sa;
   socklen_t slen = sizeof(sa);
 
   for (;;) {
+    if (ac_ && !ac_->admit(disp_, false)) {
+      pause();
+      return 0;
+    }
     s = accept(fd_, (struct sockaddr*)&sa, &slen);
     if (s == -1) {
       return 0;
     }
     SPDLOG_DEBUG("accept %d", s);
+    disp_->metrics().accepts.add();
     handle_(disp_, s);
   }
   return 0;
 }
 
+void Listener::pause() {
+  SPDLOG_DEBUG("{}:{} not accepting", addr_, port_);
+  event_del(ev_);
+  paused_ = true;
+  disp_->metrics().accept_pauses.add();
+  disp_->metrics().accept_paused.set(1);
+  if (ev_resume_) {
+    struct timeval tv = {0, kResumeCheckUs};
+    event_add(ev_resume_, &tv);
+  }
+}
+
+void Listener::resume() {
+  SPDLOG_DEBUG("{}:{} accepting again", addr_, port_);
+  if (ev_resume_) {
+    event_del(ev_resume_);
+  }
+  paused_ = false;
+  disp_->metrics().accept_paused.set(0);
+  event_add(ev_, nullptr);
+}
+
+void Listener::checkResume() {
+  if (!ac_->admit(disp_, true)) {
+    ac_->shed(disp_);
+  }
+  if (ac_->admit(disp_, true)) {
+    resume();
+  }
+}
+
 }  // namespace tl
@@ -17,10 +17,12 @@
 #include "spdlog/spdlog.h"
 #include <string>
 
+#include "admission.h"
 #include "dispatcher.h"
 #include "event2/event.h"
 #include "event2/util.h"
 #include "handler.h"
+#include "socket_options.h"
 
 namespace tl {
 
@@ -29,17 +31,60 @@ class Listener {
   Listener(const std::string& addr, int port) : addr_(addr), port_(port) {}
   ~Listener();
 
+  // Listen on addr:port in the loop of "disp", calling "handle" with each
+  // connection accepted. Return -1 on error, or if already listening.
   int open(Dispatcher* disp,
            std::function<void(Dispatcher* disp, int fd)> handle);
 
+  // Serve "fd", a socket already listening on addr:port, e.g. one passed by
+  // the process this one replaces. Owned after the call, closed if already
+  // listening.
+  int adopt(Dispatcher* disp, int fd,
+            std::function<void(Dispatcher* disp, int fd)> handle);
+
+  // Stop accepting and close the socket, leaving its SO_REUSEPORT group.
+  // The connections queued on it are accepted first. One arriving in
+  // between is reset, unless net.ipv4.tcp_migrate_req moves it to another
+  // socket of the group. open() may be called again after.
+  void close();
+  // Like close() without accepting the queued connections, for a socket
+  // another process serves now (see HotRestart). The admission limits do
+  // not resume it.
+  void stop();
+
   int doAccept();
+  // Stop and start accepting, for the admission limits.
+  void pause();
+  void resume();
+
+  // Stop accepting while "ac" does not admit the dispatcher, checking again
+  // every few milliseconds, and shed idle connections meanwhile. Not owned,
+  // nullptr for no limits. Call it before open().
+  void setAdmission(AdmissionControl* ac) { ac_ = ac; }
+  bool paused() const { return paused_; }
+  // Options of the listening socket and the connections it accepts, call
+  // it before open(). An adopted socket keeps those it was opened with.
+  void setSocketOptions(const SocketOptions& opts) { opts_ = opts; }
+  // Called by the resume timer while paused.
+  void checkResume();
+
+  Dispatcher* dispatcher() { return disp_; }
+  int fd() const { return fd_; }
 
  private:
+  // Start the accept event.
+  void watch();
+
   std::string addr_;
   int port_;
   int fd_ = -1;
   event* ev_ = NULL;
-  Dispatcher* disp_;
+  // checks the limits while paused.
+  event* ev_resume_ = NULL;
+  AdmissionControl* ac_ = nullptr;
+  SocketOptions opts_;
+  bool paused_ = false;
+  Dispatcher* disp_ = nullptr;
   std::function<void(Dispatcher* disp, int fd)> handle_;
 };
 
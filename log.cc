@@ -0,0 +1,253 @@
+#include "log.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "spdlog/sinks/stdout_sinks.h"
+
+namespace tl {
+
+namespace {
+
+// Longer messages are cut.
+const std::size_t kMaxText = 240;
+const std::size_t kRingSlots = 512;
+// writer sleep when the rings are empty.
+const auto kWriterIdle = std::chrono::milliseconds(5);
+
+struct Record {
+  spdlog::log_clock::time_point time;
+  spdlog::source_loc source;
+  spdlog::level::level_enum level;
+  std::size_t thread_id;
+  uint32_t len;
+  char text[kMaxText];
+};
+
+// Single producer (the owner thread), single consumer (the writer).
+class Ring {
+ public:
+  bool push(const spdlog::details::log_msg& msg) {
+    std::size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == kRingSlots) {
+      return false;
+    }
+    Record& r = slots_[head % kRingSlots];
+    r.time = msg.time;
+    r.source = msg.source;
+    r.level = msg.level;
+    r.thread_id = msg.thread_id;
+    r.len = (uint32_t)std::min(msg.payload.size(), kMaxText);
+    memcpy(r.text, msg.payload.data(), r.len);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Call "f(const Record&)" for each record, oldest first.
+  template <class F>
+  std::size_t drain(F&& f) {
+    std::size_t tail = tail_.load(std::memory_order_relaxed);
+    std::size_t head = head_.load(std::memory_order_acquire);
+    for (std::size_t i = tail; i != head; i++) {
+      f(slots_[i % kRingSlots]);
+    }
+    tail_.store(head, std::memory_order_release);
+    return head - tail;
+  }
+
+ private:
+  Record slots_[kRingSlots];
+  alignas(64) std::atomic<std::size_t> head_{0};
+  alignas(64) std::atomic<std::size_t> tail_{0};
+};
+
+std::atomic<uint64_t> g_dropped{0};
+// RingSink ids, never reused unlike their addresses.
+std::atomic<uint64_t> g_sinks{0};
+
+class RingSink : public spdlog::sinks::sink {
+ public:
+  explicit RingSink(std::shared_ptr<spdlog::sinks::sink> out)
+      : out_(std::move(out)), id_(++g_sinks), writer_([this] { run(); }) {}
+
+  ~RingSink() override {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      stop_ = true;
+    }
+    cond_.notify_all();
+    writer_.join();
+  }
+
+  void log(const spdlog::details::log_msg& msg) override {
+    if (!ring()->push(msg)) {
+      g_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  void flush() override {}
+
+  void set_pattern(const std::string& pattern) override {
+    out_->set_pattern(pattern);
+  }
+
+  void set_formatter(std::unique_ptr<spdlog::formatter> f) override {
+    out_->set_formatter(std::move(f));
+  }
+
+ private:
+  // The ring of the calling thread, registered on first use. Rings stay
+  // registered after their thread exits, until the writer drained them.
+  // Keyed by id_: a sink made at the address of a destroyed one gets rings
+  // of its own.
+  Ring* ring() {
+    thread_local uint64_t owner = 0;
+    thread_local std::shared_ptr<Ring> ring;
+    if (owner != id_) {
+      ring = std::make_shared<Ring>();
+      owner = id_;
+      std::lock_guard<std::mutex> lock(mu_);
+      rings_.push_back(ring);
+    }
+    return ring.get();
+  }
+
+  std::size_t drainAll() {
+    std::vector<std::shared_ptr<Ring> > rings;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      rings = rings_;
+    }
+    std::size_t n = 0;
+    for (auto& r : rings) {
+      n += r->drain([this](const Record& rec) {
+        spdlog::details::log_msg msg(
+            rec.time, rec.source, spdlog::string_view_t(), rec.level,
+            spdlog::string_view_t(rec.text, rec.len));
+        msg.thread_id = rec.thread_id;
+        out_->log(msg);
+      });
+    }
+    {
+      // forget rings of exited threads, now empty.
+      std::lock_guard<std::mutex> lock(mu_);
+      rings.clear();
+      rings_.erase(std::remove_if(rings_.begin(), rings_.end(),
+                                  [](const std::shared_ptr<Ring>& r) {
+                                    return r.use_count() == 1;
+                                  }),
+                   rings_.end());
+    }
+    return n;
+  }
+
+  void run() {
+    uint64_t reported = 0;
+    for (;;) {
+      bool stop;
+      {
+        std::unique_lock<std::mutex> lock(mu_);
+        cond_.wait_for(lock, kWriterIdle);
+        stop = stop_;
+      }
+      std::size_t n = drainAll();
+      uint64_t dropped = g_dropped.load(std::memory_order_relaxed);
+      if (dropped != reported) {
+        std::string text =
+            fmt::format("{} log messages dropped", dropped - reported);
+        spdlog::details::log_msg msg(spdlog::source_loc(),
+                                     spdlog::string_view_t(),
+                                     spdlog::level::warn, text);
+        out_->log(msg);
+        reported = dropped;
+        n++;
+      }
+      if (n) {
+        out_->flush();
+      }
+      if (stop) {
+        return;
+      }
+    }
+  }
+
+  std::shared_ptr<spdlog::sinks::sink> out_;
+  std::mutex mu_;
+  std::condition_variable cond_;
+  bool stop_ = false;
+  std::vector<std::shared_ptr<Ring> > rings_;
+  uint64_t id_;
+  // last member, run() uses the others.
+  std::thread writer_;
+};
+
+struct Limit {
+  int64_t window_ms = 0;
+  uint32_t count = 0;
+  uint64_t suppressed = 0;
+};
+
+struct SiteKind {
+  const void* site;
+  int kind;
+  bool operator==(const SiteKind& o) const {
+    return site == o.site && kind == o.kind;
+  }
+};
+
+struct SiteKindHash {
+  std::size_t operator()(const SiteKind& k) const {
+    return std::hash<const void*>()(k.site) * 31 + (std::size_t)k.kind;
+  }
+};
+
+}  // namespace
+
+void startAsyncLogging(std::shared_ptr<spdlog::sinks::sink> out) {
+  if (!out) {
+    out = std::make_shared<spdlog::sinks::stdout_sink_mt>();
+  }
+  auto logger = spdlog::default_logger();
+  auto sink = std::make_shared<RingSink>(std::move(out));
+  logger->sinks().clear();
+  logger->sinks().push_back(sink);
+}
+
+void stopAsyncLogging() {
+  // the sink's destructor drains the rings and joins the writer.
+  spdlog::default_logger()->sinks().clear();
+}
+
+uint64_t droppedLogs() { return g_dropped.load(std::memory_order_relaxed); }
+
+bool logAllowed(const void* site, int kind, uint64_t* suppressed) {
+  thread_local std::unordered_map<SiteKind, Limit, SiteKindHash> limits;
+  int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch())
+                    .count();
+  Limit& l = limits[SiteKind{site, kind}];
+  if (now - l.window_ms >= 1000) {
+    l.window_ms = now;
+    l.count = 0;
+  }
+  if (l.count >= kLogBurst) {
+    l.suppressed++;
+    return false;
+  }
+  l.count++;
+  *suppressed = l.suppressed;
+  l.suppressed = 0;
+  return true;
+}
+
+}  // namespace tl
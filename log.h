@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include "spdlog/sinks/sink.h"
+#include "spdlog/spdlog.h"
+
+namespace tl {
+
+// Route the default spdlog logger through per-thread lock-free rings drained
+// by a background writer thread into "out", stdout by default. A log call
+// then copies the message into the ring of its thread and returns: the
+// pattern is formatted and written by the writer, and a full ring drops the
+// message and counts it instead of blocking the loop. Messages of different
+// threads may come out of order with each other.
+void startAsyncLogging(std::shared_ptr<spdlog::sinks::sink> out = nullptr);
+// Write out what the rings hold and stop the writer.
+void stopAsyncLogging();
+
+// Messages dropped because a ring was full.
+uint64_t droppedLogs();
+
+// Whether a message of "kind" from call site "site" may be logged now: at
+// most kLogBurst per kind and site each second. Otherwise it is counted,
+// and "*suppressed" is set to the count skipped before the next one allowed.
+// The state is per thread, no locking.
+static const uint32_t kLogBurst = 5;
+bool logAllowed(const void* site, int kind, uint64_t* suppressed);
+
+}  // namespace tl
+
+// SPDLOG_ERROR/SPDLOG_WARN for messages that come in storms, e.g. one per
+// failing connection. "kind" groups messages of the site, e.g. errno. The
+// arguments are only evaluated for the messages logged.
+#define TL_LOG_RATE_LIMITED(LOG, kind, ...)                                \
+  do {                                                                     \
+    static char tl_log_site_;                                              \
+    uint64_t tl_log_suppressed_ = 0;                                       \
+    if (tl::logAllowed(&tl_log_site_, (kind), &tl_log_suppressed_)) {      \
+      if (tl_log_suppressed_) {                                            \
+        LOG("{} similar messages suppressed", tl_log_suppressed_);         \
+      }                                                                    \
+      LOG(__VA_ARGS__);                                                    \
+    }                                                                      \
+  } while (0)
+
+// Compiled out with the level, like the SPDLOG_ macros: no logAllowed()
+// call then.
+#if SPDLOG_ACTIVE_LEVEL <= SPDLOG_LEVEL_ERROR
+#define TL_ERROR_RL(kind, ...) \
+  TL_LOG_RATE_LIMITED(SPDLOG_ERROR, kind, __VA_ARGS__)
+#else
+#define TL_ERROR_RL(kind, ...) \
+  do {                         \
+  } while (0)
+#endif
+
+#if SPDLOG_ACTIVE_LEVEL <= SPDLOG_LEVEL_WARN
+#define TL_WARN_RL(kind, ...) \
+  TL_LOG_RATE_LIMITED(SPDLOG_WARN, kind, __VA_ARGS__)
+#else
+#define TL_WARN_RL(kind, ...) \
+  do {                        \
+  } while (0)
+#endif
@@ -0,0 +1,62 @@
+#include "loop_profiler.h"
+
+#include <chrono>
+#include <thread>
+
+#include "log.h"
+
+namespace tl {
+
+double cpuTicksPerUs() {
+  static const double ticks_per_us = [] {
+#if defined(__x86_64__) || defined(__i386__)
+    auto t0 = std::chrono::steady_clock::now();
+    uint64_t c0 = cpuTicks();
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    uint64_t c1 = cpuTicks();
+    double us = std::chrono::duration<double, std::micro>(
+                    std::chrono::steady_clock::now() - t0)
+                    .count();
+    return c1 > c0 && us > 0 ? (c1 - c0) / us : 1000.0;
+#else
+    return 1000.0;
+#endif
+  }();
+  return ticks_per_us;
+}
+
+const char* LoopProfiler::typeName(int type) {
+  static const char* kNames[kTypes] = {"handler", "listener", "post", "flush",
+                                       "ready",   "udp",      "lag"};
+  return type >= 0 && type < kTypes ? kNames[type] : "unknown";
+}
+
+void LoopProfiler::recordStall(Type type, int fd, uint64_t us) {
+  int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::system_clock::now().time_since_epoch())
+                    .count();
+  uint64_t n = stalls_.load(std::memory_order_relaxed);
+  Slot& s = ring_[n % kStalls];
+  s.at_us.store(now, std::memory_order_relaxed);
+  s.duration_us.store(us, std::memory_order_relaxed);
+  s.type.store(type, std::memory_order_relaxed);
+  s.fd.store(fd, std::memory_order_relaxed);
+  stalls_.store(n + 1, std::memory_order_release);
+  TL_WARN_RL(type, "loop stall: {} fd={} took {}us", typeName(type), fd, us);
+}
+
+std::vector<LoopProfiler::Stall> LoopProfiler::recentStalls() const {
+  uint64_t n = stalls();
+  uint64_t first = n > (uint64_t)kStalls ? n - kStalls : 0;
+  std::vector<Stall> out;
+  for (uint64_t i = first; i < n; i++) {
+    const Slot& s = ring_[i % kStalls];
+    out.push_back(Stall{s.at_us.load(std::memory_order_relaxed),
+                        s.duration_us.load(std::memory_order_relaxed),
+                        s.type.load(std::memory_order_relaxed),
+                        s.fd.load(std::memory_order_relaxed)});
+  }
+  return out;
+}
+
+}  // namespace tl
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "metrics.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+namespace tl {
+
+// Time stamp counter where there is one, else steady clock nanoseconds.
+inline uint64_t cpuTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+// Measured once, the first time it is called.
+double cpuTicksPerUs();
+
+// How long the callbacks of one dispatch loop run, per callback type, and
+// the last callbacks that ran longer than a threshold. A callback costs two
+// counter reads and a histogram update. Written by the loop thread only,
+// read from anywhere; a stall being written may read torn.
+class LoopProfiler {
+ public:
+  enum Type {
+    kHandler,
+    kListener,
+    kPost,
+    kFlush,
+    kReady,
+    kUdp,
+    kLag,
+    kTypes
+  };
+  static const char* typeName(int type);
+
+  struct Stall {
+    // system clock microseconds, when it ended.
+    int64_t at_us;
+    uint64_t duration_us;
+    int type;
+    // the connection or listener, -1 for none.
+    int fd;
+  };
+  static const int kStalls = 64;
+
+  // Times one callback, from construction to destruction.
+  class Scope {
+   public:
+    Scope(LoopProfiler& p, Type type, int fd)
+        : p_(p.threshold() ? &p : nullptr), type_(type), fd_(fd) {
+      p.callbacks_++;
+      if (p_) {
+        start_ = cpuTicks();
+      }
+    }
+    ~Scope() {
+      if (p_) {
+        p_->record(type_, fd_, cpuTicks() - start_);
+      }
+    }
+
+   private:
+    LoopProfiler* p_;
+    Type type_;
+    int fd_;
+    uint64_t start_ = 0;
+  };
+
+  LoopProfiler() : us_per_tick_(1 / cpuTicksPerUs()) {}
+
+  // Callbacks longer than "us" are stalls, 0 turns profiling off. Any thread.
+  void setThreshold(uint32_t us) {
+    threshold_us_.store(us, std::memory_order_relaxed);
+  }
+  uint32_t threshold() const {
+    return threshold_us_.load(std::memory_order_relaxed);
+  }
+
+  void record(Type type, int fd, uint64_t ticks) {
+    uint64_t us = (uint64_t)(ticks * us_per_tick_);
+    durations_[type].record(us);
+    if (us > threshold()) {
+      recordStall(type, fd, us);
+    }
+  }
+  void recordStall(Type type, int fd, uint64_t us);
+
+  const Log2Histogram& durations(int type) const { return durations_[type]; }
+  // Callbacks run so far, counted even with profiling off. Loop thread only.
+  uint64_t callbacks() const { return callbacks_; }
+  uint64_t stalls() const { return stalls_.load(std::memory_order_acquire); }
+  // The last stalls recorded, oldest first.
+  std::vector<Stall> recentStalls() const;
+
+ private:
+  struct Slot {
+    std::atomic<int64_t> at_us{0};
+    std::atomic<uint64_t> duration_us{0};
+    std::atomic<int> type{0};
+    std::atomic<int> fd{-1};
+  };
+
+  std::atomic<uint32_t> threshold_us_{10000};
+  uint64_t callbacks_ = 0;
+  double us_per_tick_;
+  Log2Histogram durations_[kTypes];
+  // stalls recorded in total, the next slot is stalls_ % kStalls.
+  std::atomic<uint64_t> stalls_{0};
+  Slot ring_[kStalls];
+};
+
+}  // namespace tl
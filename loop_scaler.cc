@@ -0,0 +1,182 @@
+#include "loop_scaler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <string>
+
+#include "connection_table.h"
+#include "spdlog/spdlog.h"
+
+namespace tl {
+
+namespace {
+
+int64_t steadyUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Run "f" in the loop of "disp" and wait for it.
+void runIn(Dispatcher* disp, const std::function<void()>& f) {
+  std::promise<void> p;
+  disp->post([&] {
+    f();
+    p.set_value();
+  });
+  p.get_future().wait();
+}
+
+}  // namespace
+
+LoopScaler::LoopScaler(std::vector<Dispatcher*> disps,
+                       std::vector<Listener*> listeners,
+                       std::function<void(Dispatcher* disp, int fd)> handle,
+                       const Options& opts)
+    : disps_(std::move(disps)),
+      listeners_(std::move(listeners)),
+      handle_(std::move(handle)),
+      opts_(opts) {
+  // the first loops listen, opened or adopted from the process replaced.
+  std::size_t n = 0;
+  while (n < listeners_.size() && listeners_[n]->fd() >= 0) {
+    n++;
+  }
+  active_ = n;
+}
+
+LoopScaler::~LoopScaler() { stop(); }
+
+void LoopScaler::start() {
+  {
+    std::unique_lock<std::mutex> lock(mu_);
+    stop_ = false;
+  }
+  thread_ = std::thread([this] { run(); });
+}
+
+void LoopScaler::stop() {
+  {
+    std::unique_lock<std::mutex> lock(mu_);
+    stop_ = true;
+  }
+  cond_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void LoopScaler::run() {
+  std::unique_lock<std::mutex> lock(mu_);
+  while (!stop_) {
+    cond_.wait_for(lock, std::chrono::milliseconds(opts_.interval_ms));
+    if (stop_) {
+      break;
+    }
+    lock.unlock();
+    tick();
+    lock.lock();
+  }
+}
+
+void LoopScaler::tick() {
+  int64_t now = steadyUs();
+  std::vector<uint64_t> cpu_us(disps_.size());
+  for (std::size_t i = 0; i < disps_.size(); i++) {
+    cpu_us[i] = disps_[i]->metrics().cpu_us.value();
+  }
+  if (sampled_us_ > 0 && now > sampled_us_) {
+    // cores used by all loops, retired ones included: their load is coming
+    // to the active ones.
+    uint64_t busy_us = 0;
+    for (std::size_t i = 0; i < disps_.size(); i++) {
+      busy_us += cpu_us[i] - cpu_us_[i];
+    }
+    double load = (double)busy_us / (now - sampled_us_);
+    std::size_t n = active_;
+    if (load / n > opts_.high && n < disps_.size()) {
+      under_ = 0;
+      if (++over_ >= opts_.up_after) {
+        over_ = 0;
+        SPDLOG_INFO("load {:.2f} over {} loops, adding one", load, n);
+        grow();
+      }
+    } else if (n > opts_.min_loops && load / (n - 1) < opts_.low) {
+      over_ = 0;
+      if (++under_ >= opts_.down_after) {
+        under_ = 0;
+        SPDLOG_INFO("load {:.2f} over {} loops, retiring one", load, n);
+        shrink();
+      }
+    } else {
+      over_ = 0;
+      under_ = 0;
+    }
+  }
+  cpu_us_.swap(cpu_us);
+  sampled_us_ = now;
+  migrate();
+}
+
+void LoopScaler::grow() {
+  std::size_t i = active_;
+  Dispatcher* disp = disps_[i];
+  Listener* ls = listeners_[i];
+  int r = 0;
+  // it joins the SO_REUSEPORT group of the others.
+  runIn(disp, [&] { r = ls->open(disp, handle_); });
+  if (r < 0) {
+    SPDLOG_ERROR("loop {} cannot listen, staying at {} loops", i, i);
+    return;
+  }
+  active_ = i + 1;
+}
+
+void LoopScaler::shrink() {
+  std::size_t i = active_ - 1;
+  Listener* ls = listeners_[i];
+  active_ = i;
+  runIn(disps_[i], [ls] { ls->close(); });
+}
+
+void LoopScaler::migrate() {
+  struct Moved {
+    int fd;
+    std::string in;
+  };
+  std::size_t active = active_;
+  if (active == 0) {
+    return;
+  }
+  for (std::size_t i = active; i < disps_.size(); i++) {
+    Dispatcher* disp = disps_[i];
+    if (disp->metrics().connections.value() == 0) {
+      continue;
+    }
+    std::vector<Moved> idle;
+    runIn(disp, [&] {
+      ConnectionTable* conns = disp->connections();
+      conns->forEach([&](Handler* h) {
+        if (h->idle()) {
+          Moved m;
+          m.fd = conns->detach(h, &m.in);
+          if (m.fd >= 0) {
+            idle.push_back(std::move(m));
+          }
+        }
+      });
+      disp->metrics().conns_migrated.add(idle.size());
+    });
+    for (auto& m : idle) {
+      Dispatcher* to = disps_[next_++ % active];
+      to->post([to, m] {
+        if (Handler* h = to->connections()->open(m.fd)) {
+          h->restore(m.in);
+        }
+      });
+    }
+  }
+}
+
+}  // namespace tl
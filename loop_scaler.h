@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "dispatcher.h"
+#include "listener.h"
+
+namespace tl {
+
+// Grows and shrinks the set of I/O loops that accept connections with their
+// CPU use, so a server on a shared host takes cores in proportion to load.
+//
+// Every loop has its thread from the start, but only the first active()
+// ones have their listener open in the SO_REUSEPORT group of the port. The
+// others are retired: no listener, their connections moved away, their
+// thread asleep in epoll.
+//
+// Every "interval_ms" it reads the CPU time of the loop threads (see
+// DispatcherMetrics::cpu_us). When the active loops average over "high",
+// the next loop opens its listener and joins the group. When the load of
+// all loops would fit one active loop less under "low", the last active
+// loop closes its listener, and its connections move to the active loops
+// as they become idle (see Handler::idle()), with their unconsumed input.
+// A connection never idle, or not in the ConnectionTable, like a proxied
+// one, is served where it is until it closes.
+//
+// Busy polling loops (Dispatcher::setBusyPoll()) look fully used to it.
+class LoopScaler {
+ public:
+  struct Options {
+    // active loops at least, and at start, 1 or more.
+    std::size_t min_loops = 1;
+    // average CPU use of the active loops to add one, and to get under
+    // with one less.
+    double high = 0.75;
+    double low = 0.5;
+    uint32_t interval_ms = 1000;
+    // intervals in a row past the mark before a change.
+    int up_after = 2;
+    int down_after = 5;
+  };
+
+  // The listener of "disps[i]" is "listeners[i]", already open for the
+  // first loops, "opts.min_loops" or more, and not for the others, which
+  // open it with "handle" as Listener::open(). Those open at the start are
+  // the active loops. Not owned.
+  LoopScaler(std::vector<Dispatcher*> disps, std::vector<Listener*> listeners,
+             std::function<void(Dispatcher* disp, int fd)> handle,
+             const Options& opts);
+  ~LoopScaler();
+  LoopScaler(const LoopScaler&) = delete;
+  LoopScaler& operator=(const LoopScaler&) = delete;
+
+  // Start sampling in a thread of its own, once the loops run.
+  void start();
+  // Stop sampling, the loops are left as they are. start() may be called
+  // again after.
+  void stop();
+
+  // From any thread.
+  std::size_t active() const { return active_.load(); }
+
+ private:
+  void run();
+  // One interval: sample, then scale and move connections.
+  void tick();
+  void grow();
+  void shrink();
+  // Move the idle connections of the retired loops to the active ones.
+  void migrate();
+
+  std::vector<Dispatcher*> disps_;
+  std::vector<Listener*> listeners_;
+  std::function<void(Dispatcher* disp, int fd)> handle_;
+  Options opts_;
+  std::atomic<std::size_t> active_;
+  // cpu_us of each loop at the last sample, and when it was taken.
+  std::vector<uint64_t> cpu_us_;
+  int64_t sampled_us_ = 0;
+  int over_ = 0;
+  int under_ = 0;
+  // where the next migrated connection goes, round robin.
+  std::size_t next_ = 0;
+  bool stop_ = false;
+  std::mutex mu_;
+  std::condition_variable cond_;
+  std::thread thread_;
+};
+
+}  // namespace tl
@@ -1,45 +1,295 @@
 
 
+#include <getopt.h>
 #include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
+#include "admin.h"
+#include "admission.h"
+#include "connection_table.h"
 #include "dispatcher.h"
 #include "event2/event.h"
 #include "event2/thread.h"
 #include "handler.h"
+#include "hot_restart.h"
+#include "kv_protocol.h"
 #include "listener.h"
+#include "log.h"
+#include "loop_scaler.h"
+#include "proxy.h"
+#include "socket_options.h"
 #include "spdlog/spdlog.h"
 #include "thread_pool.h"
+#include "udp_endpoint.h"
 
-#define MAX_IO_THREAD_COUNT 4
+// per loop.
+static const std::size_t kMaxTraceBytes = (std::size_t)1 << 30;
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+          "usage: %s [-p port] [-a admin_port] [-s stall_us] [-b spin_us]\n"
+          "          [-B busy_poll_us] [-t trace_prefix] [-k cache_mb]\n"
+          "          [-U udp_port] [-m max_conns] [-M max_buffered_mb]\n"
+          "          [-i shed_idle_ms] [-r restart_path [-H]] [-A arena_mb]\n"
+          "          [-O sockopts] [-l loops [-e min_loops]] [-K]\n"
+          "          [-u upstream_ip:port [-c]] [-L log_level]\n"
+          "  -p  listen port, default 2200\n"
+          "  -a  metrics port on 127.0.0.1, default 2299, 0 to disable\n"
+          "  -s  log loop callbacks longer than this, default 10000, 0 to\n"
+          "      disable loop profiling\n"
+          "  -b  poll up to this long without blocking when busy, default 0\n"
+          "  -B  SO_BUSY_POLL of connections, default unset\n"
+          "  -t  capture what clients send to trace_prefix.<loop>\n"
+          "  -k  serve a memcached protocol cache of cache_mb instead of echo\n"
+          "  -U  also echo UDP datagrams on this port\n"
+          "  -m  stop accepting at this many connections, resume under 90%%\n"
+          "  -M  stop accepting at this many MB in connection buffers\n"
+          "  -i  when not accepting, close connections idle this long\n"
+          "  -r  take the listeners of the server on this unix socket, if\n"
+          "      any, and hand them to the next one started with it\n"
+          "  -H  hand idle connections over too, instead of draining them\n"
+          "  -A  buffers of each loop in a huge page arena of arena_mb,\n"
+          "      reads stop while it is full\n"
+          "  -O  socket options of the listeners and connections: default,\n"
+          "      short or long, then option=value overrides, e.g.\n"
+          "      short,backlog=1024 (see socket_options.h)\n"
+          "  -l  I/O loops, default one per core\n"
+          "  -e  accept on min_loops of them, more while busy\n"
+          "  -K  send with MSG_MORE while a flush takes several sends\n"
+          "  -u  relay connections to upstream instead of echo\n"
+          "  -c  relay through user space buffers instead of splice()\n"
+          "  -L  trace, debug, info, warning, error, critical or off, default\n"
+          "      the TL_LOG_LEVEL built with; lower levels are compiled out\n",
+          prog);
+}
+
+int main(int argc, char* argv[]) {
+  int port = 2200;
+  int admin_port = 2299;
+  std::string upstream_addr;
+  int upstream_port = 0;
+  bool splice = true;
+  long stall_us = -1;
+  std::string trace_prefix;
+  uint32_t spin_us = 0;
+  int busy_poll_us = 0;
+  std::size_t cache_mb = 0;
+  int udp_port = 0;
+  tl::AdmissionControl::Limits limits;
+  std::string restart_path;
+  tl::HotRestart::Options restart_opts;
+  std::size_t arena_mb = 0;
+  tl::SocketOptions sockopts;
+  int loops = (int)std::thread::hardware_concurrency();
+  std::size_t min_loops = 0;
+  bool cork = false;
+  // calls under SPDLOG_ACTIVE_LEVEL are compiled out, start from it.
+  auto log_level = (spdlog::level::level_enum)SPDLOG_ACTIVE_LEVEL;
+  int opt;
+  while ((opt = getopt(argc, argv,
+                       "p:a:s:b:B:t:k:U:m:M:i:r:HA:O:l:e:Ku:cL:")) != -1) {
+    switch (opt) {
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'a':
+        admin_port = atoi(optarg);
+        break;
+      case 's':
+        stall_us = atol(optarg);
+        break;
+      case 'b':
+        spin_us = (uint32_t)atol(optarg);
+        break;
+      case 'B':
+        busy_poll_us = atoi(optarg);
+        break;
+      case 't':
+        trace_prefix = optarg;
+        break;
+      case 'k':
+        cache_mb = strtoul(optarg, nullptr, 10);
+        break;
+      case 'U':
+        udp_port = atoi(optarg);
+        break;
+      case 'm':
+        limits.total_conns = strtoul(optarg, nullptr, 10);
+        break;
+      case 'M':
+        limits.total_buffered = strtoul(optarg, nullptr, 10) << 20;
+        break;
+      case 'i':
+        limits.shed_idle_ms = (uint32_t)atol(optarg);
+        break;
+      case 'r':
+        restart_path = optarg;
+        break;
+      case 'H':
+        restart_opts.pass_connections = true;
+        break;
+      case 'A':
+        arena_mb = strtoul(optarg, nullptr, 10);
+        break;
+      case 'O':
+        if (tl::SocketOptions::parse(optarg, &sockopts) < 0) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'l':
+        loops = atoi(optarg);
+        break;
+      case 'e':
+        min_loops = strtoul(optarg, nullptr, 10);
+        break;
+      case 'K':
+        cork = true;
+        break;
+      case 'L':
+        log_level = spdlog::level::from_str(optarg);
+        if (log_level == spdlog::level::off &&
+            strcmp(optarg, "off") != 0) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'u': {
+        std::string u = optarg;
+        auto colon = u.rfind(':');
+        if (colon == std::string::npos) {
+          usage(argv[0]);
+          return 1;
+        }
+        upstream_addr = u.substr(0, colon);
+        upstream_port = atoi(u.c_str() + colon + 1);
+        break;
+      }
+      case 'c':
+        splice = false;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (loops <= 0) {
+    loops = 1;
+  }
+  if (min_loops > (std::size_t)loops) {
+    usage(argv[0]);
+    return 1;
+  }
 
-int main() {
   signal(SIGPIPE, SIG_IGN);
   evthread_use_pthreads();
 
+  tl::startAsyncLogging();
   spdlog::set_pattern("[%Y-%m-%dT%H:%M:%S.%e%z] [%l] [%!(%s#%#)] %v");
-  spdlog::set_level(spdlog::level::trace);
+  spdlog::set_level(log_level);
 
   SPDLOG_INFO("starting...");
 
-  tl::Dispatcher* disps = new tl::Dispatcher[MAX_IO_THREAD_COUNT];
+  tl::Dispatcher* disps = new tl::Dispatcher[loops];
+  std::vector<tl::Dispatcher*> io_disps;
+  for (int i = 0; i < loops; i++) {
+    io_disps.push_back(&disps[i]);
+  }
+
+  // the cache keys are sharded over the I/O dispatchers.
+  std::unique_ptr<tl::KvService> kv;
+  if (cache_mb > 0) {
+    kv.reset(new tl::KvService(io_disps, cache_mb << 20));
+    for (int i = 0; i < loops; i++) {
+      disps[i].connections()->setProtocol(kv->protocol(i));
+    }
+  }
+
+  std::unique_ptr<tl::AdmissionControl> admission;
+  if (limits.total_conns || limits.total_buffered) {
+    admission.reset(new tl::AdmissionControl(io_disps, limits));
+  }
+
+  // listening sockets of the process this one replaces, by loop, -1 for a
+  // loop it did not listen on.
+  std::unique_ptr<tl::HotRestart> restart;
+  std::vector<int> inherited;
+  if (!restart_path.empty()) {
+    restart.reset(new tl::HotRestart(restart_path, io_disps, restart_opts));
+    if (restart->takeover(&inherited) < 0) {
+      return 1;
+    }
+  }
+  for (std::size_t i = loops; i < inherited.size(); i++) {
+    if (inherited[i] >= 0) {
+      close(inherited[i]);
+    }
+  }
 
-  tl::ThreadPool* thread_pool(new tl::ThreadPool(MAX_IO_THREAD_COUNT));
+  // one more thread for the admin dispatcher.
+  tl::ThreadPool* thread_pool(new tl::ThreadPool(loops + 1));
 
-  std::unique_ptr<tl::Listener> ls[4];
+  std::vector<std::unique_ptr<tl::Listener> > ls(loops);
+  std::vector<std::unique_ptr<tl::Proxy> > proxies(loops);
+  std::vector<std::unique_ptr<tl::UdpEndpoint> > udps(loops);
+  // a loop's own proxy, if relaying.
+  std::function<void(tl::Dispatcher*, int)> on_accept =
+      [disps, &proxies](tl::Dispatcher* d, int fd) {
+        if (tl::Proxy* proxy = proxies[d - disps].get()) {
+          proxy->accept(fd);
+        } else {
+          d->connections()->open(fd);
+        }
+      };
 
-  for (int i = 0; i < MAX_IO_THREAD_COUNT; i++) {
+  for (int i = 0; i < loops; i++) {
     SPDLOG_INFO("staring thread {}", i);
-    ls[i].reset(new tl::Listener("0.0.0.0", 2200));
-    ls[i]->open(&disps[i], [](tl::Dispatcher* d, int fd) {
-      tl::Handler* h = nullptr;
-      try {
-        h = new tl::Handler(d, fd);
-      } catch (...) {
-        if (h) delete h;
-      }
-    });
+    if (stall_us >= 0) {
+      disps[i].profiler().setThreshold((uint32_t)stall_us);
+    }
+    disps[i].setBusyPoll(spin_us);
+    disps[i].connections()->setBusyPoll(busy_poll_us);
+    disps[i].connections()->setQuickAck(sockopts.quickack > 0);
+    disps[i].connections()->setCork(cork);
+    if (arena_mb) {
+      tl::Arena::Options arena_opts;
+      arena_opts.budget = arena_mb << 20;
+      disps[i].setArena(arena_opts);
+    }
+    if (!trace_prefix.empty() &&
+        disps[i].startCapture(trace_prefix + "." + std::to_string(i),
+                              kMaxTraceBytes) < 0) {
+      return 1;
+    }
+    ls[i].reset(new tl::Listener("0.0.0.0", port));
+    ls[i]->setAdmission(admission.get());
+    ls[i]->setSocketOptions(sockopts);
+    if (!upstream_addr.empty()) {
+      proxies[i].reset(
+          new tl::Proxy(&disps[i], upstream_addr, upstream_port, splice));
+    }
+    if ((std::size_t)i < inherited.size() && inherited[i] >= 0) {
+      ls[i]->adopt(&disps[i], inherited[i], on_accept);
+    } else if (min_loops == 0 || (std::size_t)i < min_loops) {
+      ls[i]->open(&disps[i], on_accept);
+    }
+    if (udp_port > 0) {
+      udps[i].reset(new tl::UdpEndpoint("0.0.0.0", udp_port,
+                                        tl::UdpEndpoint::Options()));
+      udps[i]->open(&disps[i], [](tl::UdpEndpoint* ep,
+                                  const tl::Datagram* dgrams, int n) {
+        for (int j = 0; j < n; j++) {
+          ep->send(dgrams[j].data, dgrams[j].len, *dgrams[j].peer);
+        }
+      });
+    }
     thread_pool->post(
         [](tl::Dispatcher* disp) {
           SPDLOG_TRACE("dispatch()");
@@ -48,9 +298,60 @@ int main() {
         &disps[i]);
   }
 
+  // metrics are served on a dispatcher of their own.
+  tl::AdminProtocol admin(io_disps);
+  tl::Dispatcher admin_disp;
+  tl::Listener admin_ls("127.0.0.1", admin_port);
+  if (admin_port > 0) {
+    admin_disp.connections()->setProtocol(&admin);
+    admin_ls.open(&admin_disp, [](tl::Dispatcher* d, int fd) {
+      d->connections()->open(fd);
+    });
+    thread_pool->post([](tl::Dispatcher* disp) { disp->dispatch(); },
+                      &admin_disp);
+  }
+
+  // the loops past min_loops accept while the load needs them.
+  std::unique_ptr<tl::LoopScaler> scaler;
+  if (min_loops > 0) {
+    std::vector<tl::Listener*> listeners;
+    for (auto& l : ls) {
+      listeners.push_back(l.get());
+    }
+    tl::LoopScaler::Options scaler_opts;
+    scaler_opts.min_loops = min_loops;
+    scaler.reset(
+        new tl::LoopScaler(io_disps, listeners, on_accept, scaler_opts));
+    scaler->start();
+  }
+
+  if (restart) {
+    std::vector<tl::Listener*> listeners;
+    for (auto& l : ls) {
+      listeners.push_back(l.get());
+    }
+    restart->setScaler(scaler.get());
+    // after the hand over, exit.
+    restart->serve(listeners, [disps, loops, &admin_disp] {
+      for (int i = 0; i < loops; i++) {
+        disps[i].stop();
+      }
+      admin_disp.stop();
+    });
+  }
+
   // wait join
   delete thread_pool;
+  restart.reset();
+  scaler.reset();
 
+  for (auto& p : proxies) {
+    p.reset();
+  }
+  for (auto& u : udps) {
+    u.reset();
+  }
   delete[] disps;
+  tl::stopAsyncLogging();
   return 0;
 }
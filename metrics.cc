@@ -0,0 +1,205 @@
+#include "metrics.h"
+
+#include "dispatcher.h"
+#include "spdlog/fmt/fmt.h"
+
+namespace tl {
+
+namespace {
+
+struct CounterInfo {
+  // Prometheus name, the text dump uses it without "tl_" and "_total".
+  const char* name;
+  const char* type;
+  const char* help;
+  Counter DispatcherMetrics::*field;
+};
+
+const CounterInfo kCounters[] = {
+    {"tl_accepts_total", "counter", "Accepted connections.",
+     &DispatcherMetrics::accepts},
+    {"tl_connections_opened_total", "counter", "Connections opened.",
+     &DispatcherMetrics::conns_opened},
+    {"tl_connections_closed_total", "counter", "Connections closed.",
+     &DispatcherMetrics::conns_closed},
+    {"tl_connections", "gauge", "Open connections.",
+     &DispatcherMetrics::connections},
+    {"tl_buffered_bytes", "gauge",
+     "Bytes in the read and write buffers of connections.",
+     &DispatcherMetrics::buffered_bytes},
+    {"tl_read_bytes_total", "counter", "Bytes read from connections.",
+     &DispatcherMetrics::bytes_read},
+    {"tl_written_bytes_total", "counter", "Bytes written to connections.",
+     &DispatcherMetrics::bytes_written},
+    {"tl_timeouts_total", "counter", "Connections closed idle.",
+     &DispatcherMetrics::timeouts},
+    {"tl_errors_total", "counter", "Connections closed on an I/O error.",
+     &DispatcherMetrics::errors},
+    {"tl_datagrams_read_total", "counter", "UDP datagrams received.",
+     &DispatcherMetrics::datagrams_read},
+    {"tl_datagrams_written_total", "counter", "UDP datagrams sent.",
+     &DispatcherMetrics::datagrams_written},
+    {"tl_datagrams_dropped_total", "counter",
+     "UDP datagrams dropped, too long or the socket buffer full.",
+     &DispatcherMetrics::datagrams_dropped},
+    {"tl_accept_pauses_total", "counter",
+     "Times the listener stopped accepting.",
+     &DispatcherMetrics::accept_pauses},
+    {"tl_accept_paused", "gauge", "1 while the listener is not accepting.",
+     &DispatcherMetrics::accept_paused},
+    {"tl_shed_total", "counter",
+     "Idle connections closed to get under a limit.",
+     &DispatcherMetrics::shed},
+    {"tl_arena_bytes", "gauge", "Bytes of the arena in use.",
+     &DispatcherMetrics::arena_bytes},
+    {"tl_arena_overflow_bytes", "gauge",
+     "Bytes in use from the heap, the arena being full.",
+     &DispatcherMetrics::arena_overflow_bytes},
+    {"tl_arena_resident_bytes", "gauge",
+     "Bytes of arena spans in use or retained.",
+     &DispatcherMetrics::arena_resident_bytes},
+    {"tl_arena_releases_total", "counter",
+     "Empty arena spans returned to the OS.",
+     &DispatcherMetrics::arena_releases},
+    {"tl_budget_waits_total", "counter",
+     "Reads put off with the arena over its budget.",
+     &DispatcherMetrics::budget_waits},
+    {"tl_listening", "gauge", "1 while a listener of the loop is open.",
+     &DispatcherMetrics::listening},
+    {"tl_connections_migrated_total", "counter",
+     "Connections moved to another loop after the listener closed.",
+     &DispatcherMetrics::conns_migrated},
+    {"tl_flushes_total", "counter",
+     "Deferred flushes of connection write buffers.",
+     &DispatcherMetrics::flushes},
+    {"tl_posts_total", "counter", "post() callbacks run.",
+     &DispatcherMetrics::posts},
+    {"tl_post_queue_depth", "gauge",
+     "post() callbacks found queued at the last wake-up.",
+     &DispatcherMetrics::post_queue_depth},
+    {"tl_busy_poll_spins_total", "counter",
+     "Loop iterations polled without blocking.", &DispatcherMetrics::spins},
+    {"tl_busy_poll_sleeps_total", "counter",
+     "Loop iterations blocked in epoll, busy poll mode only.",
+     &DispatcherMetrics::sleeps},
+    {"tl_loop_cpu_microseconds_total", "counter",
+     "CPU time of the loop thread.", &DispatcherMetrics::cpu_us},
+};
+
+const char* kLagName = "tl_loop_lag_microseconds";
+const char* kCallbackName = "tl_callback_duration_microseconds";
+
+// Prometheus buckets of "h", labels "labels" prepended.
+std::string formatHistogram(const char* name, const std::string& labels,
+                            const Log2Histogram& h) {
+  std::string out;
+  uint64_t cumulative = 0;
+  for (int b = 0; b < Log2Histogram::kBuckets; b++) {
+    cumulative += h.bucket(b);
+    std::string le = b + 1 < Log2Histogram::kBuckets
+                         ? std::to_string(Log2Histogram::bound(b))
+                         : "+Inf";
+    out += fmt::format("{}_bucket{{{},le=\"{}\"}} {}\n", name, labels, le,
+                       cumulative);
+  }
+  out += fmt::format("{}_sum{{{}}} {}\n", name, labels, h.sum());
+  out += fmt::format("{}_count{{{}}} {}\n", name, labels, cumulative);
+  return out;
+}
+
+std::string shortName(const char* name) {
+  std::string s(name + 3);
+  const std::string total = "_total";
+  if (s.size() > total.size() &&
+      s.compare(s.size() - total.size(), total.size(), total) == 0) {
+    s.resize(s.size() - total.size());
+  }
+  return s;
+}
+
+}  // namespace
+
+std::string formatPrometheus(const std::vector<Dispatcher*>& disps) {
+  std::string out;
+  for (const auto& c : kCounters) {
+    out += fmt::format("# HELP {} {}\n# TYPE {} {}\n", c.name, c.help, c.name,
+                       c.type);
+    for (std::size_t i = 0; i < disps.size(); i++) {
+      out += fmt::format("{}{{loop=\"{}\"}} {}\n", c.name, i,
+                         (disps[i]->metrics().*c.field).value());
+    }
+  }
+
+  out += fmt::format(
+      "# HELP {} How late the loop ran a periodic timer.\n"
+      "# TYPE {} histogram\n",
+      kLagName, kLagName);
+  for (std::size_t i = 0; i < disps.size(); i++) {
+    out += formatHistogram(kLagName, fmt::format("loop=\"{}\"", i),
+                           disps[i]->metrics().loop_lag_us);
+  }
+
+  out += fmt::format(
+      "# HELP {} How long loop callbacks ran.\n"
+      "# TYPE {} histogram\n",
+      kCallbackName, kCallbackName);
+  for (std::size_t i = 0; i < disps.size(); i++) {
+    const LoopProfiler& p = disps[i]->profiler();
+    // lag is not a callback, its stalls only go to the ring.
+    for (int t = 0; t < LoopProfiler::kLag; t++) {
+      std::string labels = fmt::format("loop=\"{}\",type=\"{}\"", i,
+                                       LoopProfiler::typeName(t));
+      out += formatHistogram(kCallbackName, labels, p.durations(t));
+    }
+  }
+
+  out +=
+      "# HELP tl_stalls_total Callbacks or loop lags over the stall "
+      "threshold.\n# TYPE tl_stalls_total counter\n";
+  for (std::size_t i = 0; i < disps.size(); i++) {
+    out += fmt::format("tl_stalls_total{{loop=\"{}\"}} {}\n", i,
+                       disps[i]->profiler().stalls());
+  }
+  return out;
+}
+
+std::string formatText(const std::vector<Dispatcher*>& disps) {
+  std::string out;
+  for (const auto& c : kCounters) {
+    uint64_t total = 0;
+    for (Dispatcher* d : disps) {
+      total += (d->metrics().*c.field).value();
+    }
+    out += fmt::format("{} {}\n", shortName(c.name), total);
+  }
+  for (std::size_t i = 0; i < disps.size(); i++) {
+    const DispatcherMetrics& m = disps[i]->metrics();
+    // bound of the highest non-empty bucket.
+    uint64_t lag = 0;
+    for (int b = 0; b < Log2Histogram::kBuckets; b++) {
+      if (m.loop_lag_us.bucket(b)) {
+        lag = Log2Histogram::bound(b);
+      }
+    }
+    out += fmt::format(
+        "loop {}: connections {} read_bytes {} written_bytes {} posts {} "
+        "max_lag_us <= {} stalls {}\n",
+        i, m.connections.value(), m.bytes_read.value(),
+        m.bytes_written.value(), m.posts.value(), lag,
+        disps[i]->profiler().stalls());
+  }
+  return out;
+}
+
+std::string formatStalls(const std::vector<Dispatcher*>& disps) {
+  std::string out;
+  for (std::size_t i = 0; i < disps.size(); i++) {
+    for (const auto& s : disps[i]->profiler().recentStalls()) {
+      out += fmt::format("loop {} at_us {} {} fd {} took_us {}\n", i, s.at_us,
+                         LoopProfiler::typeName(s.type), s.fd, s.duration_us);
+    }
+  }
+  return out;
+}
+
+}  // namespace tl
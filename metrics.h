@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace tl {
+
+class Dispatcher;
+
+// A value written by one thread and read by any. add() is a plain load and
+// store, no locked instruction, so it costs what a bare uint64_t would.
+// Readers see a recent value, never a torn one.
+class Counter {
+ public:
+  void add(uint64_t n = 1) {
+    v_.store(v_.load(std::memory_order_relaxed) + n,
+             std::memory_order_relaxed);
+  }
+  void set(uint64_t v) { v_.store(v, std::memory_order_relaxed); }
+  uint64_t value() const { return v_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint64_t> v_{0};
+};
+
+// Single writer histogram with power of two buckets: bucket i counts values
+// <= 2^i, the last one everything above.
+class Log2Histogram {
+ public:
+  static const int kBuckets = 24;
+
+  void record(uint64_t v) {
+    int i = v <= 1 ? 0 : 64 - __builtin_clzll(v - 1);
+    buckets_[i < kBuckets ? i : kBuckets - 1].add();
+    sum_.add(v);
+  }
+
+  static uint64_t bound(int i) { return 1ULL << i; }
+  uint64_t bucket(int i) const { return buckets_[i].value(); }
+  uint64_t sum() const { return sum_.value(); }
+
+ private:
+  Counter buckets_[kBuckets];
+  Counter sum_;
+};
+
+// Counters of one dispatcher, updated only by its loop thread. Aligned so
+// they do not share a cache line with fields other threads write, like the
+// post() queue.
+struct alignas(64) DispatcherMetrics {
+  Counter accepts;
+  Counter conns_opened;
+  Counter conns_closed;
+  // open connections now, and the bytes buffered by them.
+  Counter connections;
+  Counter buffered_bytes;
+  Counter bytes_read;
+  Counter bytes_written;
+  Counter timeouts;
+  // connections closed on a read or write error.
+  Counter errors;
+  // UDP endpoints, dropped for being too long or a full socket buffer.
+  Counter datagrams_read;
+  Counter datagrams_written;
+  Counter datagrams_dropped;
+  // admission control: times the listener stopped accepting, 1 while it is
+  // stopped, and idle connections closed to make room.
+  Counter accept_pauses;
+  Counter accept_paused;
+  Counter shed;
+  // 1 while a listener of the loop is open, and connections moved to other
+  // loops after it closed (see LoopScaler).
+  Counter listening;
+  Counter conns_migrated;
+  // deferred flushes of the connections' write buffers.
+  Counter flushes;
+  // post() callbacks run, and how many the last wake-up found queued.
+  Counter posts;
+  Counter post_queue_depth;
+  // Dispatcher::setArena(): bytes in use, of them from the heap once it is
+  // full, bytes of spans mapped, spans given back to the OS, and reads put
+  // off over the budget.
+  Counter arena_bytes;
+  Counter arena_overflow_bytes;
+  Counter arena_resident_bytes;
+  Counter arena_releases;
+  Counter budget_waits;
+  // busy poll: loop iterations polled without blocking, and waits in epoll.
+  Counter spins;
+  Counter sleeps;
+  // CPU time of the loop thread in microseconds, updated by the lag probe.
+  Counter cpu_us;
+  // how late the loop ran a periodic timer, in microseconds.
+  Log2Histogram loop_lag_us;
+};
+
+// Text dumps of the metrics of "disps", read while their loops run.
+// Prometheus exposition format, one series per dispatcher labeled "loop".
+std::string formatPrometheus(const std::vector<Dispatcher*>& disps);
+// Totals, then one line per dispatcher.
+std::string formatText(const std::vector<Dispatcher*>& disps);
+// The recent loop stalls of each dispatcher, one per line.
+std::string formatStalls(const std::vector<Dispatcher*>& disps);
+
+}  // namespace tl
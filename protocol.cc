@@ -0,0 +1,16 @@
+#include "protocol.h"
+
+namespace tl {
+
+int EchoProtocol::onRead(Handler*, buffer& in, buffer& out) {
+  while (in.size()) {
+    const void* buf;
+    std::size_t len;
+    in.dataChunk(buf, len);
+    out.push(buf, len);
+    in.drain(len);
+  }
+  return 0;
+}
+
+}  // namespace tl
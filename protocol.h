@@ -0,0 +1,94 @@
+#pragma once
+
+#include <utility>
+
+#include "buffer.h"
+#include "codec.h"
+
+namespace tl {
+
+class Handler;
+
+// What a Handler does with the bytes it reads. One instance can be shared by
+// all connections of a dispatcher, per connection state lives in Handler.
+// It must outlive the dispatchers whose connections use it.
+class Protocol {
+ public:
+  virtual ~Protocol() {}
+  // Called once the connection is in the ConnectionTable. Return -1 to close
+  // it.
+  virtual int onOpen(Handler*) { return 0; }
+  // Called before the connection is destroyed, however it is closed.
+  virtual void onClose(Handler*) {}
+  // Called after data is read into "in". Consume it and append responses to
+  // "out". Return -1 to close the connection.
+  virtual int onRead(Handler* h, buffer& in, buffer& out) = 0;
+  // Called after the connection wrote what it could, Handler::pendingWrite()
+  // tells what is left. Do not close "h" here.
+  virtual void onWritten(Handler*) {}
+  // Whether "h" waits on work done elsewhere, like a request run on another
+  // loop. Such a connection is not handed over at a hot restart.
+  virtual bool busy(Handler*) { return false; }
+};
+
+// Send back whatever is read.
+class EchoProtocol : public Protocol {
+ public:
+  int onRead(Handler* h, buffer& in, buffer& out) override;
+};
+
+// Split the stream into frames with "Codec" and call
+//   int App::onMessage(Handler* h, const Frame& f, const BufferView& payload,
+//                      buffer& out)
+// for each one. "payload" is a view into the read buffer, valid only during
+// the call. Return -1 from onMessage() to close the connection.
+template <class Codec, class App>
+class FramedProtocol : public Protocol {
+ public:
+  FramedProtocol() {}
+  explicit FramedProtocol(App app) : app_(std::move(app)) {}
+
+  int onRead(Handler* h, buffer& in, buffer& out) override;
+
+  App& app() { return app_; }
+
+ private:
+  App app_;
+};
+
+// Reply each frame with a frame of the same payload.
+template <class Codec>
+struct EchoApp {
+  int onMessage(Handler*, const Frame& f, const BufferView& payload,
+                buffer& out) {
+    encode<Codec>(out, payload, f.type, f.flags);
+    return 0;
+  }
+};
+
+}  // namespace tl
+
+#include "handler.h"
+
+namespace tl {
+
+template <class Codec, class App>
+int FramedProtocol<Codec, App>::onRead(Handler* h, buffer& in, buffer& out) {
+  Frame f;
+  for (;;) {
+    int r = Codec::decode(in, h->codecState(), f);
+    if (r == kDecodeMore) {
+      return 0;
+    }
+    if (r == kDecodeError) {
+      return -1;
+    }
+    if (app_.onMessage(h, f, BufferView(&in, f.header_len, f.payload_len),
+                       out) < 0) {
+      return -1;
+    }
+    in.drain(f.size());
+  }
+}
+
+}  // namespace tl
@@ -0,0 +1,274 @@
+#include "proxy.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+#include "log.h"
+#include "spdlog/spdlog.h"
+
+namespace tl {
+
+// seconds a pair may stay idle.
+static const int kIdleTimeout = 60;
+
+static bool wouldBlock() {
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+extern "C" void proxy_event_cb(evutil_socket_t, short what, void* ptr) {
+  auto p = (ProxyHandler*)ptr;
+  int r = p->handleEvent(what);
+  if (r < 0) {
+    SPDLOG_DEBUG("proxy error, errno={} {}", errno, strerror(errno));
+  }
+  if (r != 0) {
+    p->close();
+  }
+}
+
+ProxyHandler::ProxyHandler(Proxy* proxy, int client_fd, int upstream_fd) {
+  proxy_ = proxy;
+  up_.src = client_fd;
+  up_.dst = upstream_fd;
+  down_.src = upstream_fd;
+  down_.dst = client_fd;
+  if (evutil_make_socket_nonblocking(client_fd) < 0 ||
+      (proxy->splice() && (proxy->acquirePipe(up_.pipe) < 0 ||
+                           proxy->acquirePipe(down_.pipe) < 0))) {
+    SPDLOG_ERROR("proxy setup errno={} {}", errno, strerror(errno));
+    proxy->releasePipe(up_.pipe, true);
+    proxy->releasePipe(down_.pipe, true);
+    ::close(client_fd);
+    ::close(upstream_fd);
+    throw std::runtime_error("proxy setup");
+  }
+
+  event_assign(&client_ev_, proxy->dispatcher()->ev_base(), client_fd, 0,
+               proxy_event_cb, this);
+  event_assign(&upstream_ev_, proxy->dispatcher()->ev_base(), upstream_fd, 0,
+               proxy_event_cb, this);
+  arm(&client_ev_, client_fd, EV_READ);
+  arm(&upstream_ev_, upstream_fd, EV_READ);
+}
+
+ProxyHandler::~ProxyHandler() {
+  event_del(&client_ev_);
+  event_del(&upstream_ev_);
+  ::close(up_.src);
+  ::close(down_.src);
+  for (int fd : {up_.pipe[0], up_.pipe[1], down_.pipe[0], down_.pipe[1]}) {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+}
+
+void ProxyHandler::close() { proxy_->close(this); }
+
+void ProxyHandler::arm(struct event* ev, int fd, short what) {
+  event_del(ev);
+  if (what == 0) {
+    return;
+  }
+  struct timeval tv;
+  tv.tv_sec = kIdleTimeout;
+  tv.tv_usec = 0;
+  event_assign(ev, proxy_->dispatcher()->ev_base(), fd, what, proxy_event_cb,
+               this);
+  event_add(ev, &tv);
+}
+
+int ProxyHandler::handleEvent(short what) {
+  if (what & EV_TIMEOUT) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  if (proxy_->splice()) {
+    if (pumpSplice(up_) < 0 || pumpSplice(down_) < 0) {
+      return -1;
+    }
+  } else {
+    if (pumpCopy(up_) < 0 || pumpCopy(down_) < 0) {
+      return -1;
+    }
+  }
+  if (up_.shut && down_.shut) {
+    return 1;  // both sides closed
+  }
+
+  arm(&client_ev_, up_.src,
+      (up_.wantRead() ? EV_READ : 0) | (down_.pending ? EV_WRITE : 0));
+  arm(&upstream_ev_, down_.src,
+      (down_.wantRead() ? EV_READ : 0) | (up_.pending ? EV_WRITE : 0));
+  return 0;
+}
+
+int ProxyHandler::pumpSplice(Flow& f) {
+  const unsigned int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+  for (;;) {
+    bool progress = false;
+    if (f.wantRead()) {
+      ssize_t n = splice(f.src, nullptr, f.pipe[1], nullptr,
+                         kWindow - f.pending, flags);
+      if (n > 0) {
+        f.pending += n;
+        progress = true;
+      } else if (n == 0) {
+        f.eof = true;
+        progress = true;
+      } else if (wouldBlock()) {
+        // either src is empty or the pipe is out of slots, assume the
+        // latter while it has data, it is drained before src is read again.
+        f.full = f.pending > 0;
+      } else {
+        return -1;
+      }
+    }
+    if (f.pending > 0) {
+      ssize_t n =
+          splice(f.pipe[0], nullptr, f.dst, nullptr, f.pending, flags);
+      if (n > 0) {
+        f.pending -= n;
+        f.full = false;
+        progress = true;
+      } else if (n < 0 && !wouldBlock()) {
+        return -1;
+      }
+    }
+    if (!progress) {
+      break;
+    }
+  }
+
+  if (f.eof && f.pending == 0 && !f.shut) {
+    shutdown(f.dst, SHUT_WR);
+    f.shut = true;
+  }
+  return 0;
+}
+
+int ProxyHandler::pumpCopy(Flow& f) {
+  for (;;) {
+    bool progress = false;
+    if (f.wantRead()) {
+      void* buf;
+      std::size_t len;
+      f.buf.spaceChunk(buf, len);
+      if (len > kWindow - f.pending) {
+        len = kWindow - f.pending;
+      }
+      ssize_t n = recv(f.src, buf, len, 0);
+      if (n > 0) {
+        f.buf.spaceHaveSeted(n);
+        f.pending += n;
+        progress = true;
+      } else if (n == 0) {
+        f.eof = true;
+        progress = true;
+      } else if (!wouldBlock()) {
+        return -1;
+      }
+    }
+    if (f.pending > 0) {
+      struct iovec iov[16];
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = f.buf.peek(iov, 16);
+      ssize_t n = sendmsg(f.dst, &msg, MSG_NOSIGNAL);
+      if (n > 0) {
+        f.buf.drain(n);
+        f.pending -= n;
+        progress = true;
+      } else if (n < 0 && !wouldBlock()) {
+        return -1;
+      }
+    }
+    if (!progress) {
+      break;
+    }
+  }
+
+  if (f.eof && f.pending == 0 && !f.shut) {
+    shutdown(f.dst, SHUT_WR);
+    f.shut = true;
+  }
+  return 0;
+}
+
+Proxy::Proxy(Dispatcher* disp, const std::string& upstream_addr,
+             int upstream_port, bool splice)
+    : disp_(disp),
+      connector_(disp),
+      addr_(upstream_addr),
+      port_(upstream_port),
+      splice_(splice) {}
+
+Proxy::~Proxy() {
+  // closes the accepted sockets still waiting for their upstream.
+  connector_.cancel();
+  for (auto& p : pipes_) {
+    ::close(p.first);
+    ::close(p.second);
+  }
+}
+
+void Proxy::accept(int fd) {
+  int r = connector_.connect(addr_, port_, [this, fd](int upstream_fd) {
+    if (upstream_fd < 0) {
+      if (errno != ECANCELED) {
+        TL_ERROR_RL(errno, "connect upstream {}:{} errno={} {}", addr_, port_,
+                    errno, strerror(errno));
+      }
+      ::close(fd);
+      return;
+    }
+    try {
+      slab_.create(this, fd, upstream_fd);
+    } catch (const std::exception& e) {
+      SPDLOG_ERROR("fd={}, create proxy failed: {}", fd, e.what());
+    }
+  });
+  if (r < 0) {
+    TL_ERROR_RL(errno, "connect upstream {}:{} errno={} {}", addr_, port_,
+                errno, strerror(errno));
+    ::close(fd);
+  }
+}
+
+void Proxy::close(ProxyHandler* p) {
+  releasePipe(p->up_.pipe, p->up_.pending == 0);
+  releasePipe(p->down_.pipe, p->down_.pending == 0);
+  slab_.destroy(p);
+}
+
+int Proxy::acquirePipe(int p[2]) {
+  if (!pipes_.empty()) {
+    p[0] = pipes_.back().first;
+    p[1] = pipes_.back().second;
+    pipes_.pop_back();
+    return 0;
+  }
+  return pipe2(p, O_NONBLOCK | O_CLOEXEC);
+}
+
+void Proxy::releasePipe(int p[2], bool empty) {
+  if (p[0] < 0) {
+    return;
+  }
+  if (empty) {
+    pipes_.emplace_back(p[0], p[1]);
+  } else {
+    ::close(p[0]);
+    ::close(p[1]);
+  }
+  p[0] = p[1] = -1;
+}
+
+}  // namespace tl
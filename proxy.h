@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "buffer.h"
+#include "connector.h"
+#include "dispatcher.h"
+#include "event2/event.h"
+#include "event2/event_struct.h"
+#include "event2/util.h"
+#include "slab.h"
+
+namespace tl {
+
+class Proxy;
+
+extern "C" void proxy_event_cb(evutil_socket_t fd, short what, void* ptr);
+
+// Relay bytes between an accepted connection and its upstream connection.
+// In splice mode, bytes move socket -> pipe -> socket with splice() and never
+// enter user space. Otherwise they go through a tl::buffer per direction.
+// Each direction has at most kWindow bytes in flight: reading its source stops
+// until the destination takes them. EOF is relayed as shutdown(SHUT_WR), the
+// pair closes when both directions are done.
+class ProxyHandler {
+ public:
+  ProxyHandler(Proxy* proxy, int client_fd, int upstream_fd);
+  ~ProxyHandler();
+
+  // Move what can be moved in both directions, then wait for what's needed.
+  int handleEvent(short what);
+
+  // Close both sockets and release this handler, "this" is invalid after.
+  void close();
+
+ private:
+  friend class Proxy;
+
+  static const std::size_t kWindow = 64 << 10;
+
+  // One direction.
+  struct Flow {
+    int src = -1;
+    int dst = -1;
+    // splice mode, pipe[0] read end, pipe[1] write end.
+    int pipe[2] = {-1, -1};
+    // copy mode.
+    buffer buf;
+    // bytes read from src not written to dst yet.
+    std::size_t pending = 0;
+    // the pipe took no more bytes, do not wait to read src until it drains.
+    bool full = false;
+    // src reached EOF, and dst is shut down for writing after it.
+    bool eof = false;
+    bool shut = false;
+
+    bool wantRead() const { return !eof && !full && pending < kWindow; }
+  };
+
+  int pumpSplice(Flow& f);
+  int pumpCopy(Flow& f);
+  void arm(struct event* ev, int fd, short what);
+
+  Proxy* proxy_;
+  // client -> upstream, and upstream -> client.
+  Flow up_;
+  Flow down_;
+  struct event client_ev_;
+  struct event upstream_ev_;
+};
+
+// Relay connections accepted by a dispatcher to "upstream_addr:port".
+// Only use it inside the dispatch loop of its dispatcher, and destroy it
+// after the loop exits.
+class Proxy {
+ public:
+  Proxy(Dispatcher* disp, const std::string& upstream_addr, int upstream_port,
+        bool splice = true);
+  ~Proxy();
+  Proxy(const Proxy&) = delete;
+  Proxy& operator=(const Proxy&) = delete;
+
+  // Connect to the upstream and relay accepted socket "fd" to it. "fd" is
+  // closed if the upstream cannot be reached.
+  void accept(int fd);
+
+  // Relayed connection pairs.
+  std::size_t size() const { return slab_.size(); }
+  bool splice() const { return splice_; }
+  Dispatcher* dispatcher() { return disp_; }
+
+ private:
+  friend class ProxyHandler;
+
+  void close(ProxyHandler* p);
+  // Get an empty pipe from the pool or a new one.
+  int acquirePipe(int p[2]);
+  // Put "p" back to the pool if it is empty, else close it.
+  void releasePipe(int p[2], bool empty);
+
+  Dispatcher* disp_;
+  Connector connector_;
+  std::string addr_;
+  int port_;
+  bool splice_;
+  // empty pipes to reuse.
+  std::vector<std::pair<int, int> > pipes_;
+  Slab<ProxyHandler> slab_;
+};
+
+}  // namespace tl
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "chunk_allocator.h"
+
+namespace tl {
+
+// Object pool of T. Slots are allocated in blocks of "kBlockSize" that are
+// kept until the slab itself is destroyed, so create()/destroy() churn does no
+// heap allocation once the slab has grown to the working set, and a T never
+// moves while it is alive.
+//
+// Every slot carries a generation number bumped by destroy(). A Handle packs
+// (generation, index), so get() on a handle of a destroyed object returns
+// nullptr instead of whatever object now lives in the slot.
+template <class T, std::size_t kBlockSize = 256>
+class Slab {
+ public:
+  using Handle = uint64_t;
+  // Never returned by handle(), generations start from 1.
+  static constexpr Handle kInvalidHandle = 0;
+
+  Slab() {}
+  ~Slab();
+  Slab(const Slab&) = delete;
+  Slab& operator=(const Slab&) = delete;
+
+  // Construct a T in a free slot. Exceptions thrown by T's constructor are
+  // propagated after the slot is put back to the free list.
+  template <class... Args>
+  T* create(Args&&... args);
+  // Destruct "obj" and recycle its slot. "obj" must come from create().
+  void destroy(T* obj);
+
+  Handle handle(const T* obj) const;
+  // Return nullptr if the object of "h" has been destroyed.
+  T* get(Handle h) const;
+
+  // Number of live objects.
+  std::size_t size() const { return size_; }
+  // Number of slots allocated so far.
+  std::size_t capacity() const { return blocks_.size() * kBlockSize; }
+
+  // Allocate blocks from "alloc" instead of operator new. Only before the
+  // first create().
+  void setAllocator(ChunkAllocator* alloc) { alloc_ = alloc; }
+
+ private:
+  static constexpr uint32_t kNoSlot = UINT32_MAX;
+
+  struct Slot {
+    // must be the first member, T* and Slot* are converted to each other.
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    uint32_t index = 0;
+    uint32_t generation = 1;
+    uint32_t next_free = kNoSlot;
+    bool used = false;
+  };
+
+  Slot* slot(uint32_t index) const {
+    return &blocks_[index / kBlockSize][index % kBlockSize];
+  }
+  static Slot* slotOf(const T* obj) {
+    return reinterpret_cast<Slot*>(const_cast<T*>(obj));
+  }
+  void grow();
+
+  ChunkAllocator* alloc_ = nullptr;
+  std::vector<Slot*> blocks_;
+  uint32_t free_head_ = kNoSlot;
+  std::size_t size_ = 0;
+};
+
+template <class T, std::size_t kBlockSize>
+Slab<T, kBlockSize>::~Slab() {
+  for (auto& block : blocks_) {
+    for (std::size_t i = 0; i < kBlockSize; i++) {
+      if (block[i].used) {
+        reinterpret_cast<T*>(&block[i].storage)->~T();
+      }
+    }
+    if (alloc_) {
+      alloc_->deallocate(block, sizeof(Slot) * kBlockSize);
+    } else {
+      ::operator delete(block, std::align_val_t(alignof(Slot)));
+    }
+  }
+}
+
+template <class T, std::size_t kBlockSize>
+void Slab<T, kBlockSize>::grow() {
+  uint32_t base = (uint32_t)capacity();
+  std::size_t bytes = sizeof(Slot) * kBlockSize;
+  blocks_.reserve(blocks_.size() + 1);
+  void* mem = alloc_ ? alloc_->allocate(bytes)
+                     : ::operator new(bytes, std::align_val_t(alignof(Slot)));
+  Slot* block = static_cast<Slot*>(mem);
+  // link new slots in index order, so low indexes are reused first.
+  for (std::size_t i = 0; i < kBlockSize; i++) {
+    new (&block[i]) Slot();
+    block[i].index = base + (uint32_t)i;
+    block[i].next_free =
+        (i + 1 < kBlockSize) ? base + (uint32_t)i + 1 : free_head_;
+  }
+  free_head_ = base;
+  blocks_.push_back(block);
+}
+
+template <class T, std::size_t kBlockSize>
+template <class... Args>
+T* Slab<T, kBlockSize>::create(Args&&... args) {
+  if (free_head_ == kNoSlot) {
+    grow();
+  }
+  Slot* s = slot(free_head_);
+  free_head_ = s->next_free;
+  try {
+    new (&s->storage) T(std::forward<Args>(args)...);
+  } catch (...) {
+    s->next_free = free_head_;
+    free_head_ = s->index;
+    throw;
+  }
+  s->used = true;
+  size_++;
+  return reinterpret_cast<T*>(&s->storage);
+}
+
+template <class T, std::size_t kBlockSize>
+void Slab<T, kBlockSize>::destroy(T* obj) {
+  Slot* s = slotOf(obj);
+  obj->~T();
+  s->used = false;
+  if (++s->generation == 0) {
+    s->generation = 1;
+  }
+  s->next_free = free_head_;
+  free_head_ = s->index;
+  size_--;
+}
+
+template <class T, std::size_t kBlockSize>
+typename Slab<T, kBlockSize>::Handle Slab<T, kBlockSize>::handle(
+    const T* obj) const {
+  const Slot* s = slotOf(obj);
+  return ((Handle)s->generation << 32) | s->index;
+}
+
+template <class T, std::size_t kBlockSize>
+T* Slab<T, kBlockSize>::get(Handle h) const {
+  uint32_t index = (uint32_t)h;
+  uint32_t generation = (uint32_t)(h >> 32);
+  if (index >= capacity()) {
+    return nullptr;
+  }
+  Slot* s = slot(index);
+  if (!s->used || s->generation != generation) {
+    return nullptr;
+  }
+  return reinterpret_cast<T*>(&s->storage);
+}
+
+}  // namespace tl
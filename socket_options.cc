@@ -0,0 +1,107 @@
+#include "socket_options.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "spdlog/spdlog.h"
+
+namespace tl {
+
+namespace {
+
+struct Field {
+  const char* name;
+  int SocketOptions::*field;
+  int level;
+  int opt;
+};
+
+// option=value names, and how each is set, 0 level for none.
+const Field kFields[] = {
+    {"backlog", &SocketOptions::backlog, 0, 0},
+    {"defer_accept_s", &SocketOptions::defer_accept_s, IPPROTO_TCP,
+     TCP_DEFER_ACCEPT},
+    {"fastopen", &SocketOptions::fastopen, IPPROTO_TCP, TCP_FASTOPEN},
+    {"nodelay", &SocketOptions::nodelay, IPPROTO_TCP, TCP_NODELAY},
+    {"quickack", &SocketOptions::quickack, 0, 0},
+    {"rcvbuf", &SocketOptions::rcvbuf, SOL_SOCKET, SO_RCVBUF},
+    {"sndbuf", &SocketOptions::sndbuf, SOL_SOCKET, SO_SNDBUF},
+    {"notsent_lowat", &SocketOptions::notsent_lowat, IPPROTO_TCP,
+     TCP_NOTSENT_LOWAT},
+};
+
+}  // namespace
+
+int SocketOptions::parse(const std::string& spec, SocketOptions* opts) {
+  std::size_t end = spec.find(',');
+  std::string name = spec.substr(0, end);
+  SocketOptions o;
+  if (name == "short") {
+    // a connection per request: room for connect bursts, the request in
+    // the SYN or in the first read, no delayed ACK or Nagle wait.
+    o.backlog = 4096;
+    o.defer_accept_s = 1;
+    o.fastopen = 256;
+    o.nodelay = 1;
+    o.quickack = 1;
+  } else if (name == "long") {
+    // persistent connections: little unsent data in the kernel, so a slow
+    // reader is held back by the Handler's backpressure.
+    o.nodelay = 1;
+    o.notsent_lowat = 128 << 10;
+  } else if (name != "default") {
+    SPDLOG_ERROR("unknown socket option profile {}", name);
+    return -1;
+  }
+  while (end != std::string::npos) {
+    std::size_t start = end + 1;
+    end = spec.find(',', start);
+    std::string kv = spec.substr(start, end - start);
+    std::size_t eq = kv.find('=');
+    const Field* f = nullptr;
+    for (const Field& field : kFields) {
+      if (kv.compare(0, eq, field.name) == 0) {
+        f = &field;
+      }
+    }
+    char* rest = nullptr;
+    long v = 0;
+    if (eq != std::string::npos) {
+      v = strtol(kv.c_str() + eq + 1, &rest, 10);
+    }
+    if (f == nullptr || rest == nullptr || *rest != '\0' ||
+        rest == kv.c_str() + eq + 1) {
+      SPDLOG_ERROR("bad socket option {}", kv);
+      return -1;
+    }
+    o.*(f->field) = (int)v;
+  }
+  *opts = o;
+  return 0;
+}
+
+int SocketOptions::applyListen(int fd) const {
+  for (const Field& f : kFields) {
+    int v = this->*(f.field);
+    if (f.level == 0 || v < 0) {
+      continue;
+    }
+    if (setsockopt(fd, f.level, f.opt, &v, sizeof(v)) < 0) {
+      SPDLOG_ERROR("setsockopt {}={} errno={} {}", f.name, v, errno,
+                   strerror(errno));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int setQuickAck(int fd) {
+  int one = 1;
+  return setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+}
+
+}  // namespace tl
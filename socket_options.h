@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+
+namespace tl {
+
+// TCP options of a listener and the connections it accepts, -1 leaves an
+// option at the kernel default. Options accepted sockets inherit are set
+// once on the listening socket, not after every accept(): all of them but
+// TCP_QUICKACK, which the kernel clears by itself and Handler sets again
+// after each read.
+struct SocketOptions {
+  // listen() backlog, capped by net.core.somaxconn.
+  int backlog = 512;
+  // TCP_DEFER_ACCEPT: hold a connection in the kernel, up to this many
+  // seconds, until the client sends something, so accept() and the first
+  // read happen in one wakeup.
+  int defer_accept_s = -1;
+  // TCP_FASTOPEN queue length, data in the SYN is accepted when bit 2 of
+  // net.ipv4.tcp_fastopen is set.
+  int fastopen = -1;
+  // TCP_NODELAY, 1 to send small responses without waiting for an ACK.
+  int nodelay = -1;
+  // TCP_QUICKACK, 1 to ACK requests at once instead of delaying the ACK.
+  int quickack = -1;
+  // SO_RCVBUF and SO_SNDBUF bytes, turning off their autotuning.
+  int rcvbuf = -1;
+  int sndbuf = -1;
+  // TCP_NOTSENT_LOWAT: send() stops once this many bytes are queued in the
+  // socket and not sent yet. The rest stays in the Handler's write buffer,
+  // where pendingWrite() sees it, so read backpressure, the admission
+  // limits and the arena budget apply to it instead of the kernel queue.
+  int notsent_lowat = -1;
+
+  // Parse "name[,option=value...]" into "opts": a profile of "default",
+  // "short" (connection per request) or "long" (persistent, streaming),
+  // then options named like the fields, e.g. "long,sndbuf=262144". Return
+  // -1 if "spec" is invalid.
+  static int parse(const std::string& spec, SocketOptions* opts);
+
+  // Set the options on listening socket "fd", before listen(). Return -1 if
+  // one is refused.
+  int applyListen(int fd) const;
+};
+
+// Set TCP_QUICKACK on connected socket "fd", return -1 on error.
+int setQuickAck(int fd);
+
+}  // namespace tl
@@ -0,0 +1,150 @@
+#include "admission.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "connection_table.h"
+#include "dispatcher.h"
+#include "gtest/gtest.h"
+#include "test_util.h"
+
+namespace {
+
+using tl::test::openPair;
+using tl::test::runUntil;
+
+// Whether the local end of "peer" is closed.
+bool closed(int peer) {
+  char c;
+  return recv(peer, &c, 1, MSG_DONTWAIT) == 0;
+}
+
+}  // namespace
+
+TEST(admission, admit_limits_and_resume) {
+  tl::Dispatcher d0;
+  tl::Dispatcher d1;
+  tl::DispatcherMetrics& m0 = d0.metrics();
+  tl::DispatcherMetrics& m1 = d1.metrics();
+  tl::AdmissionControl::Limits limits;
+  limits.conns = 10;
+  limits.buffered = 1000;
+  limits.total_conns = 15;
+  limits.resume = 0.8;
+  tl::AdmissionControl ac({&d0, &d1}, limits);
+
+  // per dispatcher: stop at the limit, resume under 80% of it.
+  m0.connections.set(9);
+  ASSERT_TRUE(ac.admit(&d0, false));
+  ASSERT_FALSE(ac.admit(&d0, true));
+  m0.connections.set(10);
+  ASSERT_FALSE(ac.admit(&d0, false));
+  m0.connections.set(8);
+  ASSERT_FALSE(ac.admit(&d0, true));
+  m0.connections.set(7);
+  ASSERT_TRUE(ac.admit(&d0, true));
+
+  m0.buffered_bytes.set(1000);
+  ASSERT_FALSE(ac.admit(&d0, false));
+  m0.buffered_bytes.set(800);
+  ASSERT_TRUE(ac.admit(&d0, false));
+  ASSERT_FALSE(ac.admit(&d0, true));
+  m0.buffered_bytes.set(799);
+  ASSERT_TRUE(ac.admit(&d0, true));
+
+  // over all dispatchers, each under its own limit.
+  m1.connections.set(8);
+  ASSERT_FALSE(ac.admit(&d0, false));
+  ASSERT_FALSE(ac.admit(&d1, false));
+  m1.connections.set(5);
+  ASSERT_TRUE(ac.admit(&d0, false));
+  ASSERT_FALSE(ac.admit(&d0, true));
+  m1.connections.set(4);
+  ASSERT_TRUE(ac.admit(&d0, true));
+
+  // no limits.
+  tl::AdmissionControl none({&d0, &d1}, tl::AdmissionControl::Limits());
+  m0.connections.set(1 << 20);
+  m0.buffered_bytes.set(1 << 30);
+  ASSERT_TRUE(none.admit(&d0, false));
+  ASSERT_TRUE(none.admit(&d0, true));
+
+  m0.connections.set(0);
+  m0.buffered_bytes.set(0);
+  m1.connections.set(0);
+}
+
+TEST(admission, shed_oldest_idle_first) {
+  tl::Dispatcher disp;
+  tl::AdmissionControl::Limits limits;
+  limits.conns = 4;
+  limits.resume = 0.75;
+  limits.shed_idle_ms = 1;
+  tl::AdmissionControl ac({&disp}, limits);
+
+  // opened in this order, "a" active again last.
+  std::vector<int> peers;
+  for (int i = 0; i < 4; i++) {
+    int peer = openPair(&disp);
+    ASSERT_GE(peer, 0);
+    peers.push_back(peer);
+    usleep(2000);
+  }
+  int a = peers[0];
+  ASSERT_EQ(write(a, "ping", 4), 4);
+  ASSERT_TRUE(runUntil(&disp, [&] {
+    return disp.metrics().bytes_read.value() == 4;
+  }));
+  usleep(2000);
+  ASSERT_FALSE(ac.admit(&disp, false));
+
+  // under 3 connections after two: the oldest idle ones, not "a".
+  ASSERT_EQ(ac.shed(&disp), 2);
+  ASSERT_EQ(disp.metrics().shed.value(), 2);
+  ASSERT_EQ(disp.metrics().connections.value(), 2);
+  ASSERT_TRUE(ac.admit(&disp, true));
+  ASSERT_FALSE(closed(a));
+  ASSERT_TRUE(closed(peers[1]));
+  ASSERT_TRUE(closed(peers[2]));
+  ASSERT_FALSE(closed(peers[3]));
+
+  // nothing more once admitted.
+  ASSERT_EQ(ac.shed(&disp), 0);
+  for (int peer : peers) {
+    close(peer);
+  }
+}
+
+TEST(admission, shed_skips_pending_output) {
+  tl::Dispatcher disp;
+  tl::AdmissionControl::Limits limits;
+  limits.conns = 2;
+  limits.resume = 0.5;
+  limits.shed_idle_ms = 1;
+  tl::AdmissionControl ac({&disp}, limits);
+
+  // the oldest has output its peer does not read.
+  tl::Handler* h = nullptr;
+  int busy = openPair(&disp, nullptr, &h);
+  ASSERT_GE(busy, 0);
+  usleep(2000);
+  int idle = openPair(&disp, nullptr);
+  ASSERT_GE(idle, 0);
+  std::string data(4 << 20, 'o');
+  h->write(data.data(), data.size());
+  ASSERT_TRUE(runUntil(&disp, [&] { return h->pendingWrite() > 0; }));
+  usleep(2000);
+  event_base_loop(disp.ev_base(), EVLOOP_NONBLOCK);
+
+  ASSERT_EQ(ac.shed(&disp), 1);
+  ASSERT_FALSE(closed(busy));
+  ASSERT_TRUE(closed(idle));
+  // not even when it is all there is to shed.
+  ASSERT_EQ(ac.shed(&disp), 0);
+  ASSERT_FALSE(closed(busy));
+  close(busy);
+  close(idle);
+}
@@ -0,0 +1,130 @@
+#include "arena.h"
+
+#include <cstring>
+#include <set>
+#include <vector>
+
+#include "buffer.h"
+#include "gtest/gtest.h"
+#include "slab.h"
+
+namespace {
+
+tl::Arena::Options options(std::size_t budget, std::size_t retain) {
+  tl::Arena::Options opts;
+  opts.budget = budget;
+  opts.hugetlb = false;
+  opts.retain = retain;
+  return opts;
+}
+
+}  // namespace
+
+TEST(arena, size_classes) {
+  tl::Arena a(options(8 << 20, 0));
+  ASSERT_NE(a.backing(), tl::Arena::kNone);
+
+  void *p = a.allocate(100);
+  void *q = a.allocate(4096);
+  void *r = a.allocate(5000);
+  ASSERT_EQ(a.used(), 4096 + 4096 + 8192);
+  ASSERT_EQ(a.overflow(), 0);
+  // blocks are aligned to their class.
+  ASSERT_EQ((uintptr_t)p % 4096, 0);
+  ASSERT_EQ((uintptr_t)r % 8192, 0);
+  memset(r, 1, 5000);
+
+  a.deallocate(q, 4096);
+  // the freed block is reused first.
+  ASSERT_EQ(a.allocate(4000), q);
+
+  a.deallocate(p, 100);
+  a.deallocate(q, 4000);
+  a.deallocate(r, 5000);
+  ASSERT_EQ(a.used(), 0);
+}
+
+TEST(arena, release_empty_spans) {
+  // keep one empty span mapped.
+  tl::Arena a(options(8 << 20, tl::Arena::kSpanSize));
+  std::vector<void *> blocks;
+  // three spans of 64 KB blocks.
+  for (int i = 0; i < 3 * 32; i++) {
+    blocks.push_back(a.allocate(64 << 10));
+  }
+  ASSERT_EQ(a.resident(), 3 * tl::Arena::kSpanSize);
+  for (void *p : blocks) {
+    a.deallocate(p, 64 << 10);
+  }
+  ASSERT_EQ(a.used(), 0);
+  ASSERT_EQ(a.resident(), tl::Arena::kSpanSize);
+  ASSERT_EQ(a.releases(), 2);
+
+  // released spans are used again.
+  std::set<void *> again;
+  for (int i = 0; i < 3 * 32; i++) {
+    again.insert(a.allocate(64 << 10));
+  }
+  ASSERT_EQ(again, std::set<void *>(blocks.begin(), blocks.end()));
+  for (void *p : again) {
+    a.deallocate(p, 64 << 10);
+  }
+}
+
+TEST(arena, overflow_and_budget) {
+  tl::Arena a(options(4 << 20, 0));
+  void *big = a.allocate(3 << 20);
+  ASSERT_EQ(a.overflow(), 3 << 20);
+  ASSERT_FALSE(a.overBudget());
+
+  void *x = a.allocate(2 << 20);
+  void *y = a.allocate(2 << 20);
+  ASSERT_TRUE(a.overBudget());
+  // the region is full, so the heap.
+  void *z = a.allocate(4096);
+  ASSERT_EQ(a.overflow(), (3 << 20) + 4096);
+
+  a.deallocate(big, 3 << 20);
+  a.deallocate(z, 4096);
+  ASSERT_EQ(a.overflow(), 0);
+  ASSERT_TRUE(a.overBudget());
+  a.deallocate(x, 2 << 20);
+  ASSERT_FALSE(a.overBudget());
+  a.deallocate(y, 2 << 20);
+  ASSERT_EQ(a.used(), 0);
+}
+
+TEST(arena, buffer_chunks) {
+  tl::Arena a(options(8 << 20, 0));
+  {
+    tl::buffer b;
+    b.allocator(&a);
+    std::string s(10000, 'x');
+    ASSERT_EQ(b.push(s.data(), s.size()), s.size());
+    ASSERT_EQ(a.used(), 16384);
+    b.push(s.data(), 100);
+    ASSERT_EQ(a.used(), 16384 + 4096);
+
+    // chunks go back to the arena they came from.
+    tl::buffer heap;
+    heap.push(s.data(), 10);
+    heap.swap(b);
+    b.drain(b.size());
+    ASSERT_EQ(a.used(), 16384 + 4096);
+    heap.drain(heap.size());
+    ASSERT_EQ(a.used(), 0);
+  }
+}
+
+TEST(arena, slab_blocks) {
+  tl::Arena a(options(8 << 20, 0));
+  {
+    tl::Slab<std::string, 64> s;
+    s.setAllocator(&a);
+    std::string *p = s.create("hello");
+    ASSERT_GT(a.used(), 0);
+    ASSERT_EQ(*p, "hello");
+    s.destroy(p);
+  }
+  ASSERT_EQ(a.used(), 0);
+}
@@ -172,6 +172,54 @@ TEST(buffer, space) {
   ASSERT_EQ(b[2], '2');
 }
 
+TEST(buffer, peek) {
+  std::string data = "0123456789";
+  tl::buffer b;
+  b.default_chunk_size(4);
+  b.push(data.data(), data.size());
+  b.drain(1);
+
+  struct iovec iov[8];
+  std::size_t n = b.peek(iov, 8);
+  std::string got;
+  for (std::size_t i = 0; i < n; i++) {
+    got.append((const char *)iov[i].iov_base, iov[i].iov_len);
+  }
+  ASSERT_EQ(got, data.substr(1));
+
+  ASSERT_EQ(b.peek(iov, 1), 1);
+  ASSERT_EQ(iov[0].iov_base, &b[0]);
+}
+
+TEST(buffer, pin) {
+  std::string data = "0123456789";
+  tl::buffer b;
+  b.default_chunk_size(4);
+  b.push(data.data(), 4);
+  b.push(data.data() + 4, 4);
+  b.push(data.data() + 8, 2);
+
+  // pins the first two chunks.
+  b.pin(5, 1);
+  b.drain(4);
+  ASSERT_EQ(b.pinnedChunks(), 1);
+  b.pin(2, 2);
+  b.drain(4);
+  ASSERT_EQ(b.pinnedChunks(), 2);
+  ASSERT_EQ(b.size(), 2);
+  ASSERT_EQ(b[0], '8');
+
+  b.unpin(1);
+  ASSERT_EQ(b.pinnedChunks(), 1);
+  b.unpin(2);
+  ASSERT_EQ(b.pinnedChunks(), 0);
+
+  // the last chunk was unpinned and is freed when drained.
+  b.drain(2);
+  ASSERT_EQ(b.pinnedChunks(), 0);
+  ASSERT_EQ(b.size(), 0);
+}
+
 TEST(buffer, push_drain) {
   srand((unsigned)time(NULL));
   std::vector<unsigned char> in, out;
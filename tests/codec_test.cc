@@ -0,0 +1,117 @@
+#include "codec.h"
+
+#include <string>
+
+#include "buffer.h"
+#include "gtest/gtest.h"
+
+using Line = tl::DelimiterCodec<16, '\r', '\n'>;
+using Len16 = tl::LengthPrefixCodec<uint16_t, true, 64>;
+using Bin = tl::BinaryHeaderCodec<0x544c, 64>;
+
+// push "data" byte by byte, so frames span chunks.
+static void pushBytes(tl::buffer &b, const std::string &data) {
+  for (std::size_t i = 0; i < data.size(); i++) {
+    b.push(data.data() + i, 1);
+  }
+}
+
+TEST(codec, view) {
+  tl::buffer b;
+  b.default_chunk_size(3);
+  pushBytes(b, "0123456789");
+
+  tl::BufferView v(&b, 2, 6);
+  ASSERT_EQ(v.size(), 6);
+  ASSERT_EQ(v[0], '2');
+  ASSERT_EQ(v.toString(), "234567");
+  ASSERT_TRUE(v.equals("234567", 6));
+  ASSERT_FALSE(v.equals("234568", 6));
+  ASSERT_EQ(v.sub(1, 3).toString(), "345");
+  ASSERT_EQ(v.sub(4, 100).toString(), "67");
+
+  int segments = 0;
+  v.forEachSegment([&](const unsigned char *, std::size_t) { segments++; });
+  ASSERT_GT(segments, 1);
+}
+
+TEST(codec, delimiter) {
+  tl::buffer b;
+  b.default_chunk_size(2);
+  tl::CodecState st;
+  tl::Frame f;
+
+  pushBytes(b, "get a\r");
+  ASSERT_EQ(Line::decode(b, st, f), tl::kDecodeMore);
+  pushBytes(b, "\nset\rb\r\n");
+  ASSERT_EQ(Line::decode(b, st, f), tl::kDecodeFrame);
+  ASSERT_EQ(f.header_len, 0);
+  ASSERT_EQ(f.payload_len, 5);
+  ASSERT_EQ(f.trailer_len, 2);
+  ASSERT_EQ(tl::BufferView(&b, 0, f.payload_len).toString(), "get a");
+  b.drain(f.size());
+
+  ASSERT_EQ(Line::decode(b, st, f), tl::kDecodeFrame);
+  ASSERT_EQ(tl::BufferView(&b, 0, f.payload_len).toString(), "set\rb");
+  b.drain(f.size());
+  ASSERT_EQ(b.size(), 0);
+
+  // too long without delimiter.
+  pushBytes(b, std::string(32, 'x'));
+  ASSERT_EQ(Line::decode(b, st, f), tl::kDecodeError);
+}
+
+TEST(codec, length_prefix) {
+  tl::buffer b;
+  b.default_chunk_size(3);
+  tl::CodecState st;
+  tl::Frame f;
+
+  tl::buffer out;
+  tl::encode<Len16>(out, "hello", 5);
+  tl::encode<Len16>(out, "", 0);
+  ASSERT_EQ(out.size(), 9);
+  ASSERT_EQ(out[0], 0);
+  ASSERT_EQ(out[1], 5);
+
+  std::string wire = tl::BufferView(&out, 0, out.size()).toString();
+  pushBytes(b, wire.substr(0, 4));
+  ASSERT_EQ(Len16::decode(b, st, f), tl::kDecodeMore);
+  pushBytes(b, wire.substr(4));
+  ASSERT_EQ(Len16::decode(b, st, f), tl::kDecodeFrame);
+  ASSERT_EQ(tl::BufferView(&b, f.header_len, f.payload_len).toString(),
+            "hello");
+  b.drain(f.size());
+  ASSERT_EQ(Len16::decode(b, st, f), tl::kDecodeFrame);
+  ASSERT_EQ(f.payload_len, 0);
+  b.drain(f.size());
+
+  pushBytes(b, std::string("\x01\x00", 2));
+  ASSERT_EQ(Len16::decode(b, st, f), tl::kDecodeError);
+}
+
+TEST(codec, binary_header) {
+  tl::buffer in;
+  in.default_chunk_size(2);
+  tl::buffer src;
+  src.default_chunk_size(4);
+  pushBytes(src, "payload");
+
+  // encode a chunk-spanning view.
+  tl::buffer out;
+  tl::encode<Bin>(out, tl::BufferView(&src, 0, src.size()), 7, 1);
+  ASSERT_EQ(out.size(), Bin::kHeaderLen + 7);
+
+  pushBytes(in, tl::BufferView(&out, 0, out.size()).toString());
+  tl::CodecState st;
+  tl::Frame f;
+  ASSERT_EQ(Bin::decode(in, st, f), tl::kDecodeFrame);
+  ASSERT_EQ(f.type, 7);
+  ASSERT_EQ(f.flags, 1);
+  ASSERT_EQ(tl::BufferView(&in, f.header_len, f.payload_len).toString(),
+            "payload");
+  in.drain(f.size());
+
+  pushBytes(in, std::string(8, 'x'));
+  ASSERT_EQ(Bin::decode(in, st, f), tl::kDecodeError);
+}
@@ -0,0 +1,312 @@
+#include "connection_table.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "chunk_allocator.h"
+#include "dispatcher.h"
+#include "event2/event.h"
+#include "gtest/gtest.h"
+#include "protocol.h"
+
+namespace {
+
+// Open the local end of a socketpair in "disp", return the peer end, and
+// the handler in "h" if not nullptr.
+int openPair(tl::Dispatcher* disp, tl::Protocol* proto = nullptr,
+             tl::Handler** h = nullptr) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    return -1;
+  }
+  tl::Handler* local = disp->connections()->open(sv[0], proto);
+  if (local == nullptr) {
+    close(sv[1]);
+    return -1;
+  }
+  if (h) {
+    *h = local;
+  }
+  return sv[1];
+}
+
+std::string readAll(int fd) {
+  std::string s;
+  char buf[4096];
+  ssize_t n;
+  while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+    s.append(buf, n);
+  }
+  return s;
+}
+
+// Connect a TCP socket with a small receive buffer to 127.0.0.1, return it
+// and the accepted end in "server".
+int connectPair(int* server) {
+  int ls = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(sa);
+  if (ls < 0 || bind(ls, (struct sockaddr*)&sa, sizeof(sa)) < 0 ||
+      listen(ls, 1) < 0 || getsockname(ls, (struct sockaddr*)&sa, &len) < 0) {
+    return -1;
+  }
+  int c = socket(AF_INET, SOCK_STREAM, 0);
+  int rcvbuf = 4096;
+  setsockopt(c, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  if (connect(c, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+    return -1;
+  }
+  *server = accept(ls, nullptr, nullptr);
+  close(ls);
+  return c;
+}
+
+// Fills freed memory with 'X', so data sent from it after the free shows.
+class PoisonAllocator : public tl::ChunkAllocator {
+ public:
+  ~PoisonAllocator() {
+    for (void* p : freed_) {
+      free(p);
+    }
+  }
+  void* allocate(std::size_t len) override { return malloc(len); }
+  void deallocate(void* p, std::size_t len) override {
+    memset(p, 'X', len);
+    freed_.push_back(p);
+  }
+
+ private:
+  std::vector<void*> freed_;
+};
+
+// Consumes what it reads, logging the size of each read per connection.
+class SinkProtocol : public tl::Protocol {
+ public:
+  int onRead(tl::Handler* h, tl::buffer& in, tl::buffer&) override {
+    reads.emplace_back(h, in.size());
+    in.drain(in.size());
+    return 0;
+  }
+  std::size_t total(tl::Handler* h) const {
+    std::size_t n = 0;
+    for (auto& r : reads) {
+      n += r.first == h ? r.second : 0;
+    }
+    return n;
+  }
+
+  std::vector<std::pair<tl::Handler*, std::size_t>> reads;
+};
+
+// Run the loop of "disp" until "done" or about 2 seconds.
+bool runUntil(tl::Dispatcher* disp, const std::function<bool()>& done) {
+  for (int i = 0; i < 2000; i++) {
+    if (done()) {
+      return true;
+    }
+    event_base_loop(disp->ev_base(), EVLOOP_NONBLOCK);
+    usleep(1000);
+  }
+  return done();
+}
+
+}  // namespace
+
+TEST(connection_table, one_flush_per_iteration) {
+  tl::Dispatcher disp;
+  std::vector<int> peers;
+  for (int i = 0; i < 3; i++) {
+    int peer = openPair(&disp);
+    ASSERT_GE(peer, 0);
+    ASSERT_EQ(write(peer, "ping", 4), 4);
+    peers.push_back(peer);
+  }
+
+  // the three reads queue their echoes, one flush sends them all.
+  event_base_loop(disp.ev_base(), EVLOOP_ONCE);
+  ASSERT_EQ(disp.metrics().bytes_read.value(), 12);
+  ASSERT_EQ(disp.metrics().flushes.value(), 1);
+  ASSERT_EQ(disp.metrics().bytes_written.value(), 12);
+  for (int peer : peers) {
+    ASSERT_EQ(readAll(peer), "ping");
+    close(peer);
+  }
+}
+
+TEST(connection_table, flush_while_backlogged) {
+  SinkProtocol sink;
+  tl::Dispatcher disp;
+  disp.connections()->setReadBudget(4096);
+  tl::Handler* bulk_h = nullptr;
+  int bulk = openPair(&disp, &sink, &bulk_h);
+  int echo = openPair(&disp);
+  ASSERT_GE(bulk, 0);
+  ASSERT_GE(echo, 0);
+  std::string data(64 << 10, 'b');
+  ASSERT_EQ(write(bulk, data.data(), data.size()), (ssize_t)data.size());
+  event_base_loop(disp.ev_base(), EVLOOP_ONCE);
+
+  // the ready list serves the bulk sender every iteration meanwhile.
+  ASSERT_EQ(write(echo, "ping", 4), 4);
+  for (int i = 0; i < 3; i++) {
+    event_base_loop(disp.ev_base(), EVLOOP_ONCE);
+  }
+  ASSERT_LT(sink.total(bulk_h), data.size());
+  ASSERT_EQ(readAll(echo), "ping");
+  close(bulk);
+  close(echo);
+}
+
+TEST(connection_table, close_lingers_for_zero_copy_sends) {
+  PoisonAllocator alloc;
+  tl::Dispatcher disp;
+  tl::ConnectionTable* conns = disp.connections();
+  conns->setAllocator(&alloc);
+  conns->setZeroCopy(1);
+  int server = -1;
+  int peer = connectPair(&server);
+  ASSERT_GE(peer, 0);
+  tl::Handler* h = conns->open(server);
+  ASSERT_NE(h, nullptr);
+
+  std::string data(1 << 20, 0);
+  for (std::size_t i = 0; i < data.size(); i++) {
+    data[i] = 'a' + i % 26;
+  }
+  h->write(data.data(), data.size());
+  event_base_loop(disp.ev_base(), EVLOOP_ONCE);
+  if (conns->zeroCopySends() == 0) {
+    GTEST_SKIP() << "no MSG_ZEROCOPY";
+  }
+  // the peer reads nothing yet: sends wait in the socket.
+  ASSERT_GT(h->zeroCopyInflight(), 0);
+  h->close();
+  ASSERT_EQ(conns->lingering(), 1);
+  ASSERT_EQ(disp.metrics().connections.value(), 0);
+
+  // all the kernel sends come from live chunks, then the socket closes.
+  std::string got;
+  bool eof = false;
+  for (int i = 0; i < 10000 && (!eof || conns->lingering()); i++) {
+    event_base_loop(disp.ev_base(), EVLOOP_NONBLOCK);
+    char buf[65536];
+    ssize_t n = recv(peer, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n > 0) {
+      got.append(buf, n);
+    } else if (n == 0) {
+      eof = true;
+    } else {
+      usleep(1000);
+    }
+  }
+  ASSERT_TRUE(eof);
+  ASSERT_EQ(conns->lingering(), 0);
+  ASSERT_GT(got.size(), 0);
+  ASSERT_TRUE(got == data.substr(0, got.size()));
+  close(peer);
+}
+
+TEST(connection_table, protocol_close_is_no_error) {
+  class CloseProtocol : public tl::Protocol {
+   public:
+    int onRead(tl::Handler*, tl::buffer&, tl::buffer&) override {
+      // a stale errno, as left by a failed call before.
+      errno = EINVAL;
+      return -1;
+    }
+  } proto;
+  tl::Dispatcher disp;
+  int peer = openPair(&disp, &proto);
+  ASSERT_GE(peer, 0);
+  ASSERT_EQ(write(peer, "quit", 4), 4);
+  ASSERT_TRUE(runUntil(&disp, [&] {
+    return disp.metrics().connections.value() == 0;
+  }));
+  ASSERT_EQ(disp.metrics().errors.value(), 0);
+  close(peer);
+}
+
+TEST(connection_table, read_budget_round_robin) {
+  SinkProtocol sink;
+  tl::Dispatcher disp;
+  tl::ConnectionTable* conns = disp.connections();
+  conns->setReadBudget(4096);
+  tl::Handler* bulk_h = nullptr;
+  tl::Handler* small_h = nullptr;
+  int bulk = openPair(&disp, &sink, &bulk_h);
+  int small = openPair(&disp, &sink, &small_h);
+  ASSERT_GE(bulk, 0);
+  ASSERT_GE(small, 0);
+
+  std::string data(32 << 10, 'b');
+  ASSERT_EQ(write(bulk, data.data(), data.size()), (ssize_t)data.size());
+  ASSERT_EQ(write(small, "ping", 4), 4);
+  ASSERT_TRUE(runUntil(&disp, [&] {
+    return sink.total(bulk_h) == data.size() && sink.total(small_h) == 4;
+  }));
+  // the bulk sender reads a budget per turn, the small request is served
+  // before its second turn.
+  ASSERT_GE(sink.reads.size(), 9);
+  for (std::size_t i = 0; i < sink.reads.size(); i++) {
+    if (sink.reads[i].first == small_h) {
+      ASSERT_LE(i, 1);
+    } else {
+      ASSERT_LE(sink.reads[i].second, 4096);
+    }
+  }
+  close(bulk);
+  close(small);
+}
+
+TEST(connection_table, rate_limit_refills_tokens) {
+  SinkProtocol sink;
+  tl::Dispatcher disp;
+  tl::ConnectionTable* conns = disp.connections();
+  conns->setReadBudget(0);
+  conns->setRateLimit(100000, 10000);
+  tl::Handler* h = nullptr;
+  int peer = openPair(&disp, &sink, &h);
+  ASSERT_GE(peer, 0);
+
+  // the burst at once, the rest at 100 KB/s.
+  std::string data(30000, 'r');
+  ASSERT_EQ(write(peer, data.data(), data.size()), (ssize_t)data.size());
+  auto start = std::chrono::steady_clock::now();
+  ASSERT_TRUE(runUntil(&disp, [&] { return sink.total(h) > 0; }));
+  ASSERT_LE(sink.total(h), 10000);
+  ASSERT_TRUE(runUntil(&disp, [&] { return sink.total(h) == data.size(); }));
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  ASSERT_GE(ms, 150);
+  close(peer);
+}
+
+TEST(connection_table, rate_limit_zero_burst) {
+  SinkProtocol sink;
+  tl::Dispatcher disp;
+  tl::ConnectionTable* conns = disp.connections();
+  // one second of the rate, not a connection that never gets tokens.
+  conns->setRateLimit(100000, 0);
+  ASSERT_EQ(conns->rateBurst(), 100000);
+  tl::Handler* h = nullptr;
+  int peer = openPair(&disp, &sink, &h);
+  ASSERT_GE(peer, 0);
+  ASSERT_EQ(write(peer, "ping", 4), 4);
+  ASSERT_TRUE(runUntil(&disp, [&] { return sink.total(h) == 4; }));
+  close(peer);
+}
@@ -0,0 +1,102 @@
+#include "connector.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <memory>
+
+#include "dispatcher.h"
+#include "gtest/gtest.h"
+#include "proxy.h"
+#include "test_util.h"
+
+namespace {
+
+using tl::test::runUntil;
+
+// A listening socket on 127.0.0.1, its port in "port".
+int listenLocal(int* port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(sa);
+  if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0 || listen(fd, 16) < 0 ||
+      getsockname(fd, (struct sockaddr*)&sa, &len) < 0) {
+    close(fd);
+    return -1;
+  }
+  *port = ntohs(sa.sin_port);
+  return fd;
+}
+
+}  // namespace
+
+TEST(connector, connect) {
+  tl::Dispatcher disp;
+  int port;
+  int ls = listenLocal(&port);
+  ASSERT_GE(ls, 0);
+  tl::Connector c(&disp);
+  int got = -2;
+  ASSERT_EQ(c.connect("127.0.0.1", port, [&](int fd) { got = fd; }), 0);
+  ASSERT_TRUE(runUntil(&disp, [&] { return got != -2; }));
+  ASSERT_GE(got, 0);
+  close(got);
+  close(ls);
+}
+
+// The connects never run their event: ASan reports a leak if they are not
+// freed.
+TEST(connector, destroy_and_cancel_pending) {
+  tl::Dispatcher disp;
+  int port;
+  int ls = listenLocal(&port);
+  ASSERT_GE(ls, 0);
+  int called = 0;
+  {
+    tl::Connector c(&disp);
+    ASSERT_EQ(c.connect("127.0.0.1", port, [&](int) { called++; }), 0);
+  }
+  ASSERT_EQ(called, 0);
+
+  tl::Connector c(&disp);
+  int got = -2;
+  int err = 0;
+  ASSERT_EQ(c.connect("127.0.0.1", port,
+                      [&](int fd) {
+                        got = fd;
+                        err = errno;
+                      }),
+            0);
+  c.cancel();
+  ASSERT_EQ(got, -1);
+  ASSERT_EQ(err, ECANCELED);
+  // nothing left to fire.
+  got = -2;
+  event_base_loop(disp.ev_base(), EVLOOP_NONBLOCK);
+  ASSERT_EQ(got, -2);
+  close(ls);
+}
+
+TEST(connector, proxy_closes_clients_waiting_for_upstream) {
+  tl::Dispatcher disp;
+  int port;
+  int ls = listenLocal(&port);
+  ASSERT_GE(ls, 0);
+  int sv[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  std::unique_ptr<tl::Proxy> proxy(new tl::Proxy(&disp, "127.0.0.1", port));
+  proxy->accept(sv[0]);
+  proxy.reset();
+  char c;
+  ASSERT_EQ(recv(sv[1], &c, 1, MSG_DONTWAIT), 0);
+  event_base_loop(disp.ev_base(), EVLOOP_NONBLOCK);
+  close(sv[1]);
+  close(ls);
+}
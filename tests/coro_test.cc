@@ -0,0 +1,208 @@
+#include "coro.h"
+
+#include <unistd.h>
+
+#include <chrono>
+#include <stdexcept>
+#include <string>
+
+#include "dispatcher.h"
+#include "gtest/gtest.h"
+#include "test_util.h"
+
+namespace {
+
+using tl::test::openPair;
+using tl::test::readAll;
+using tl::test::runFor;
+using tl::test::runUntil;
+
+// Counts its destructions, to see a frame go.
+struct Guard {
+  explicit Guard(int* n) : n(n) {}
+  ~Guard() { (*n)++; }
+  int* n;
+};
+
+}  // namespace
+
+TEST(coro, read_n_across_reads) {
+  tl::CoroProtocol proto([](tl::Conn& c) -> tl::Task {
+    for (;;) {
+      tl::BufferView in = co_await c.read(5);
+      std::string s = "[" + in.toString() + "]";
+      co_await c.write(s);
+    }
+  });
+  tl::Dispatcher disp;
+  int peer = openPair(&disp, &proto);
+  ASSERT_GE(peer, 0);
+
+  std::string out;
+  ASSERT_EQ(write(peer, "ab", 2), 2);
+  runFor(&disp, 20);
+  readAll(peer, &out);
+  ASSERT_EQ(out, "");
+  // 5 bytes out of two reads, the rest left for the next one.
+  ASSERT_EQ(write(peer, "cdefg", 5), 5);
+  ASSERT_TRUE(runUntil(&disp, [&] { return !readAll(peer, &out) &&
+                                           out.size() >= 7; }));
+  ASSERT_EQ(out, "[abcde]");
+  ASSERT_EQ(write(peer, "hijklmn", 7), 7);
+  ASSERT_TRUE(runUntil(&disp, [&] { return !readAll(peer, &out) &&
+                                           out.size() >= 14; }));
+  runFor(&disp, 20);
+  readAll(peer, &out);
+  ASSERT_EQ(out, "[abcde][fghij]");
+  close(peer);
+}
+
+TEST(coro, read_until_split_delimiter) {
+  tl::CoroProtocol proto([](tl::Conn& c) -> tl::Task {
+    for (;;) {
+      tl::BufferView line = co_await c.readUntil("\r\n", 16);
+      if (line.size() == 0) {
+        co_await c.write("too long\r\n");
+        co_return;
+      }
+      co_await c.write(line);
+    }
+  });
+  tl::Dispatcher disp;
+  int peer = openPair(&disp, &proto);
+  ASSERT_GE(peer, 0);
+
+  // the delimiter split over two reads.
+  std::string out;
+  ASSERT_EQ(write(peer, "hel", 3), 3);
+  runFor(&disp, 20);
+  ASSERT_EQ(write(peer, "lo\r", 3), 3);
+  runFor(&disp, 20);
+  readAll(peer, &out);
+  ASSERT_EQ(out, "");
+  ASSERT_EQ(write(peer, "\nab\r\n", 5), 5);
+  ASSERT_TRUE(runUntil(&disp, [&] { return !readAll(peer, &out) &&
+                                           out.size() >= 11; }));
+  ASSERT_EQ(out, "hello\r\nab\r\n");
+
+  // 16 bytes without it: the empty view, then the close.
+  out.clear();
+  std::string long_line(20, 'x');
+  ASSERT_EQ(write(peer, long_line.data(), long_line.size()),
+            (ssize_t)long_line.size());
+  ASSERT_TRUE(runUntil(&disp, [&] { return readAll(peer, &out); }));
+  ASSERT_EQ(out, "too long\r\n");
+  ASSERT_EQ(disp.metrics().connections.value(), 0);
+  close(peer);
+}
+
+TEST(coro, write_waits_above_high_water) {
+  int written = 0;
+  std::string chunk(tl::Conn::kHighWater, 'w');
+  tl::CoroProtocol proto([&](tl::Conn& c) -> tl::Task {
+    for (int i = 0; i < 3; i++) {
+      co_await c.write(chunk);
+      written++;
+    }
+  });
+  tl::Dispatcher disp;
+  tl::Handler* h = nullptr;
+  int peer = openPair(&disp, &proto, &h);
+  ASSERT_GE(peer, 0);
+
+  // the peer reads nothing: the first write fits, the second waits.
+  ASSERT_EQ(written, 1);
+  runFor(&disp, 20);
+  ASSERT_EQ(written, 1);
+  ASSERT_GT(h->pendingWrite(), tl::Conn::kHighWater);
+
+  // all of it once the peer reads, then the close.
+  std::string out;
+  ASSERT_TRUE(runUntil(&disp, [&] { return readAll(peer, &out); }));
+  ASSERT_EQ(written, 3);
+  ASSERT_EQ(out.size(), 3 * chunk.size());
+  ASSERT_EQ(disp.metrics().connections.value(), 0);
+  close(peer);
+}
+
+TEST(coro, sleep) {
+  tl::CoroProtocol proto([](tl::Conn& c) -> tl::Task {
+    tl::BufferView in = co_await c.read();
+    (void)in;
+    co_await c.sleep(std::chrono::milliseconds(50));
+    co_await c.write("late");
+  });
+  tl::Dispatcher disp;
+  int peer = openPair(&disp, &proto);
+  ASSERT_GE(peer, 0);
+
+  ASSERT_EQ(write(peer, "go", 2), 2);
+  auto start = std::chrono::steady_clock::now();
+  std::string out;
+  ASSERT_TRUE(runUntil(&disp, [&] { return readAll(peer, &out); }));
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  ASSERT_EQ(out, "late");
+  ASSERT_GE(ms, 50);
+  close(peer);
+}
+
+TEST(coro, exception_closes) {
+  int destroyed = 0;
+  tl::CoroProtocol proto([&](tl::Conn& c) -> tl::Task {
+    Guard g(&destroyed);
+    tl::BufferView in = co_await c.read();
+    (void)in;
+    throw std::runtime_error("bad request");
+  });
+  tl::Dispatcher disp;
+  int peer = openPair(&disp, &proto);
+  ASSERT_GE(peer, 0);
+
+  ASSERT_EQ(write(peer, "x", 1), 1);
+  std::string out;
+  ASSERT_TRUE(runUntil(&disp, [&] { return readAll(peer, &out); }));
+  ASSERT_EQ(destroyed, 1);
+  ASSERT_EQ(disp.metrics().connections.value(), 0);
+  ASSERT_EQ(disp.metrics().errors.value(), 1);
+  close(peer);
+}
+
+TEST(coro, peer_close_destroys_suspended_frames) {
+  int destroyed = 0;
+  // a frame waiting in a Task it awaits, and one asleep; ASan reports
+  // them if they leak.
+  auto inner = [&](tl::Conn& c) -> tl::Task {
+    Guard g(&destroyed);
+    std::string held(1024, 'h');
+    tl::BufferView in = co_await c.read(100);
+    (void)in;
+  };
+  tl::CoroProtocol proto([&](tl::Conn& c) -> tl::Task {
+    Guard g(&destroyed);
+    tl::BufferView in = co_await c.read();
+    if (in.toString() == "sleep") {
+      co_await c.sleep(std::chrono::seconds(10));
+    } else {
+      co_await inner(c);
+    }
+  });
+  tl::Dispatcher disp;
+  int reader = openPair(&disp, &proto);
+  int sleeper = openPair(&disp, &proto);
+  ASSERT_GE(reader, 0);
+  ASSERT_GE(sleeper, 0);
+  ASSERT_EQ(write(reader, "read", 4), 4);
+  ASSERT_EQ(write(sleeper, "sleep", 5), 5);
+  runFor(&disp, 20);
+  ASSERT_EQ(destroyed, 0);
+
+  close(reader);
+  close(sleeper);
+  ASSERT_TRUE(runUntil(&disp, [&] {
+    return disp.metrics().connections.value() == 0;
+  }));
+  ASSERT_EQ(destroyed, 3);
+  ASSERT_EQ(disp.metrics().errors.value(), 0);
+}
@@ -0,0 +1,117 @@
+#include "handler.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "connection_table.h"
+#include "dispatcher.h"
+#include "event2/event.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+// A regular file holding "data", unlinked, open for reading.
+int tempFile(const std::string& data) {
+  char path[] = "/tmp/handler_test.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    return -1;
+  }
+  unlink(path);
+  if (write(fd, data.data(), data.size()) != (ssize_t)data.size()) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+std::string pattern(std::size_t len, char first) {
+  std::string s(len, 0);
+  for (std::size_t i = 0; i < len; i++) {
+    s[i] = first + i % 13;
+  }
+  return s;
+}
+
+bool isOpen(int fd) { return fcntl(fd, F_GETFD) != -1; }
+
+}  // namespace
+
+TEST(handler, send_file_in_order) {
+  tl::Dispatcher disp;
+  int sv[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  // a small socket buffer, so every part goes out in pieces.
+  int sndbuf = 16384;
+  setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  tl::Handler* h = disp.connections()->open(sv[0]);
+  ASSERT_NE(h, nullptr);
+  int peer = sv[1];
+
+  std::string file = pattern(1 << 20, 'a');
+  int file_fd = tempFile(file);
+  ASSERT_GE(file_fd, 0);
+  int kept_fd = tempFile("0123456789");
+  ASSERT_GE(kept_fd, 0);
+  int p[2];
+  ASSERT_EQ(pipe(p), 0);
+  std::string piped = pattern(60000, 'A');
+  ASSERT_EQ(write(p[1], piped.data(), piped.size()), (ssize_t)piped.size());
+
+  std::string head = pattern(100000, 'n');
+  std::string mid = pattern(50000, 'N');
+  h->write(head.data(), head.size());
+  ASSERT_EQ(h->sendFile(file_fd, 1000, file.size() - 2000), 0);
+  h->write(mid.data(), mid.size());
+  ASSERT_EQ(h->sendFile(p[0], 0, piped.size()), 0);
+  ASSERT_EQ(h->sendFile(kept_fd, 2, 5, false), 0);
+  h->write("tail", 4);
+  // neither a file nor a pipe.
+  ASSERT_EQ(h->sendFile(peer, 0, 1), -1);
+
+  std::string want = head + file.substr(1000, file.size() - 2000) + mid +
+                     piped + "23456" + "tail";
+  ASSERT_EQ(h->pendingWrite(), want.size());
+  // the first flush fills the socket and stops part way.
+  event_base_loop(disp.ev_base(), EVLOOP_NONBLOCK);
+  ASSERT_GT(h->pendingWrite(), 0);
+  ASSERT_LT(h->pendingWrite(), want.size());
+  std::string got;
+  for (int i = 0; i < 10000 && got.size() < want.size(); i++) {
+    event_base_loop(disp.ev_base(), EVLOOP_NONBLOCK);
+    char buf[65536];
+    ssize_t n = recv(peer, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n > 0) {
+      got.append(buf, n);
+    }
+  }
+  ASSERT_EQ(got.size(), want.size());
+  ASSERT_TRUE(got == want);
+  ASSERT_EQ(h->pendingWrite(), 0);
+  // owned ones are closed once sent.
+  ASSERT_FALSE(isOpen(file_fd));
+  ASSERT_FALSE(isOpen(p[0]));
+  ASSERT_TRUE(isOpen(kept_fd));
+  close(kept_fd);
+  close(p[1]);
+  close(peer);
+}
+
+TEST(handler, send_file_closed_with_connection) {
+  tl::Dispatcher disp;
+  int sv[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  tl::Handler* h = disp.connections()->open(sv[0]);
+  ASSERT_NE(h, nullptr);
+  int file_fd = tempFile("data");
+  ASSERT_GE(file_fd, 0);
+  ASSERT_EQ(h->sendFile(file_fd, 0, 4), 0);
+  // never sent: still closed with the connection.
+  h->close();
+  ASSERT_FALSE(isOpen(file_fd));
+  close(sv[1]);
+}
@@ -0,0 +1,52 @@
+#include "histogram.h"
+
+#include "gtest/gtest.h"
+
+TEST(histogram, empty) {
+  tl::Histogram h;
+  ASSERT_EQ(h.count(), 0);
+  ASSERT_EQ(h.min(), 0);
+  ASSERT_EQ(h.max(), 0);
+  ASSERT_EQ(h.percentile(99), 0);
+}
+
+TEST(histogram, exact_small_values) {
+  tl::Histogram h;
+  for (uint64_t v = 1; v <= 100; v++) {
+    h.record(v);
+  }
+  ASSERT_EQ(h.count(), 100);
+  ASSERT_EQ(h.min(), 1);
+  ASSERT_EQ(h.max(), 100);
+  ASSERT_EQ(h.percentile(50), 50);
+  ASSERT_EQ(h.percentile(99), 99);
+  ASSERT_EQ(h.percentile(100), 100);
+  ASSERT_DOUBLE_EQ(h.mean(), 50.5);
+}
+
+TEST(histogram, relative_error) {
+  tl::Histogram h;
+  for (uint64_t v = 1000; v < 100000000; v = v * 3 / 2) {
+    h.reset();
+    h.record(v);
+    h.record(v * 2);
+    uint64_t p = h.percentile(50);
+    ASSERT_GE(p, v);
+    ASSERT_LE(p - v, v >> tl::Histogram::kSubBits);
+  }
+}
+
+TEST(histogram, merge) {
+  tl::Histogram a, b;
+  a.record(10, 90);
+  b.record(1000000, 10);
+  a.merge(b);
+  ASSERT_EQ(a.count(), 100);
+  ASSERT_EQ(a.percentile(90), 10);
+  ASSERT_GE(a.percentile(91), 1000000);
+  ASSERT_EQ(a.max(), 1000000);
+
+  uint64_t n = 0;
+  a.forEachBucket([&n](uint64_t, uint64_t c) { n += c; });
+  ASSERT_EQ(n, 100);
+}
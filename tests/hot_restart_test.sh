@@ -0,0 +1,71 @@
+#!/bin/bash
+# Restart the echo server twice under load with "-r" and check that no client
+# saw a failed connect or lost its connection: one loadgen reconnects every 50
+# responses, the other keeps its connections, passed over with "-H". Then
+# again with admission limits ("-m"), whose resume timer must not wake the
+# listeners of the old server, and with a loop scaler ("-e") that has loops
+# without a listener.
+#
+#   tests/hot_restart_test.sh BUILD_DIR
+#
+# PORT can be set in the environment.
+
+set -e
+
+build=${1:?usage: $0 BUILD_DIR}
+port=${PORT:-2295}
+tmp=$(mktemp -d)
+sock=$tmp/restart.sock
+pids=()
+trap 'kill "${pids[@]}" 2>/dev/null || true; rm -rf "$tmp"' EXIT
+
+start() {
+  # shellcheck disable=SC2086
+  "$build/multithread-libevent-example" -p "$port" -a 0 -r "$sock" -H \
+    $server_args >>"$tmp/server.log" 2>&1 &
+  pids+=($!)
+  server=$!
+}
+
+status=0
+for server_args in "" "-m 1000" "-l 4 -e 1"; do
+  echo "server args: ${server_args:-none}"
+  start
+  sleep 0.5
+  "$build/benchmarks/loadgen" -p "$port" -c 8 -t 1 -d 1 -n 50 -D 4 -w 0.5 \
+    >"$tmp/reconnect" &
+  reconnect=$!
+  "$build/benchmarks/loadgen" -p "$port" -c 8 -t 1 -d 4 -D 4 -w 0.5 \
+    >"$tmp/persistent" &
+  persistent=$!
+
+  for _ in 1 2; do
+    sleep 1.5
+    old=$server
+    start
+    # the old server exits once it has handed everything over.
+    wait "$old"
+  done
+  wait "$reconnect" "$persistent"
+  kill "$server"
+  wait "$server" 2>/dev/null || true
+
+  for f in reconnect persistent; do
+    line=$(cat "$tmp/$f")
+    echo "$f: $line"
+    case " $line " in
+      *" failed=0 closed=0 "*) ;;
+      *) status=1 ;;
+    esac
+    case " $line " in
+      *" msgs=0 "* | *" reconnect_failed="[1-9]*) status=1 ;;
+    esac
+  done
+done
+if [ $status -ne 0 ]; then
+  echo "FAIL"
+  tail -20 "$tmp/server.log"
+else
+  echo "PASS"
+fi
+exit $status
@@ -0,0 +1,325 @@
+#include "kv_protocol.h"
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "codec.h"
+#include "dispatcher.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+// Two dispatchers running their loops, sharing a KvService.
+class KvProtocolTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    for (int i = 0; i < 2; i++) {
+      disps_.emplace_back(new tl::Dispatcher());
+    }
+    svc_.reset(new tl::KvService({disps_[0].get(), disps_[1].get()},
+                                 64 << 20));
+    for (auto& d : disps_) {
+      tl::Dispatcher* disp = d.get();
+      threads_.emplace_back([disp] { disp->dispatch(); });
+    }
+  }
+  void TearDown() override {
+    for (std::size_t i = 0; i < disps_.size(); i++) {
+      disps_[i]->stop();
+      threads_[i].join();
+    }
+    // the protocols outlive the connections.
+    disps_.clear();
+    svc_.reset();
+  }
+
+  // A client of a connection served by shard 0.
+  int connect() {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+      return -1;
+    }
+    struct timeval tv = {2, 0};
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    runIn(0, [&] {
+      disps_[0]->connections()->open(sv[0], svc_->protocol(0));
+    });
+    return sv[1];
+  }
+
+  void runIn(std::size_t shard, const std::function<void()>& f) {
+    std::promise<void> p;
+    disps_[shard]->post([&] {
+      f();
+      p.set_value();
+    });
+    p.get_future().wait();
+  }
+
+  // A key of "shard", distinct for each "i".
+  std::string key(std::size_t shard, int i) {
+    for (int n = 0;; n++) {
+      std::string k = "k" + std::to_string(i) + "_" + std::to_string(n);
+      if (svc_->shardOf(k) == shard) {
+        return k;
+      }
+    }
+  }
+
+  std::vector<std::unique_ptr<tl::Dispatcher>> disps_;
+  std::unique_ptr<tl::KvService> svc_;
+  std::vector<std::thread> threads_;
+};
+
+void send(int fd, const std::string& s) {
+  ASSERT_EQ(write(fd, s.data(), s.size()), (ssize_t)s.size());
+}
+
+// Read exactly "n" bytes, less on a timeout.
+std::string receive(int fd, std::size_t n) {
+  std::string s;
+  char buf[4096];
+  while (s.size() < n) {
+    std::size_t want = n - s.size() < sizeof(buf) ? n - s.size() : sizeof(buf);
+    ssize_t r = read(fd, buf, want);
+    if (r <= 0) {
+      break;
+    }
+    s.append(buf, r);
+  }
+  return s;
+}
+
+std::string binary(uint8_t opcode, const std::string& key,
+                   const std::string& value, uint32_t opaque) {
+  std::string extras = opcode == 0x01 ? std::string(8, '\0') : "";
+  unsigned char hdr[24] = {0};
+  hdr[0] = 0x80;
+  hdr[1] = opcode;
+  tl::storeInt<uint16_t, true>(hdr + 2, (uint16_t)key.size());
+  hdr[4] = (unsigned char)extras.size();
+  tl::storeInt<uint32_t, true>(
+      hdr + 8, (uint32_t)(extras.size() + key.size() + value.size()));
+  tl::storeInt<uint32_t, true>(hdr + 12, opaque);
+  return std::string((const char*)hdr, sizeof(hdr)) + extras + key + value;
+}
+
+struct BinaryResponse {
+  uint8_t opcode;
+  uint16_t status;
+  uint32_t opaque;
+  std::string value;
+};
+
+BinaryResponse readBinary(int fd) {
+  BinaryResponse r = {0, 0xffff, 0, ""};
+  std::string hdr = receive(fd, 24);
+  if (hdr.size() != 24 || (uint8_t)hdr[0] != 0x81) {
+    return r;
+  }
+  auto p = (const unsigned char*)hdr.data();
+  r.opcode = p[1];
+  r.status = tl::loadInt<uint16_t, true>(p + 6);
+  r.opaque = tl::loadInt<uint32_t, true>(p + 12);
+  std::string body = receive(fd, tl::loadInt<uint32_t, true>(p + 8));
+  r.value = body.substr(p[4]);
+  return r;
+}
+
+}  // namespace
+
+TEST_F(KvProtocolTest, pipelined_across_shards_in_order) {
+  int c = connect();
+  ASSERT_GE(c, 0);
+  std::string a = key(0, 0);
+  std::string b = key(1, 1);
+  // b lives on the other shard: the responses after its requests wait.
+  send(c, "set " + b + " 0 0 2\r\nvb\r\nset " + a + " 5 0 2\r\nva\r\n" +
+              "get " + b + "\r\nget " + a + "\r\ndelete " + b +
+              "\r\nget " + b + "\r\ndelete " + a + "\r\n");
+  std::string want = "STORED\r\nSTORED\r\nVALUE " + b +
+                     " 0 2\r\nvb\r\nEND\r\nVALUE " + a +
+                     " 5 2\r\nva\r\nEND\r\nDELETED\r\nEND\r\nDELETED\r\n";
+  ASSERT_EQ(receive(c, want.size()), want);
+  close(c);
+}
+
+TEST_F(KvProtocolTest, multi_key_get) {
+  int c = connect();
+  ASSERT_GE(c, 0);
+  std::vector<std::string> keys = {key(1, 0), key(0, 1), key(1, 2),
+                                   key(0, 3)};
+  std::string sets;
+  for (std::size_t i = 0; i < keys.size(); i++) {
+    sets += "set " + keys[i] + " 0 0 1 noreply\r\n" + std::to_string(i) +
+            "\r\n";
+  }
+  send(c, sets + "get " + keys[0] + " missing " + keys[1] + " " + keys[2] +
+              " " + keys[3] + "\r\n");
+  std::string want;
+  for (std::size_t i = 0; i < keys.size(); i++) {
+    want += "VALUE " + keys[i] + " 0 1\r\n" + std::to_string(i) + "\r\n";
+  }
+  want += "END\r\n";
+  ASSERT_EQ(receive(c, want.size()), want);
+  close(c);
+}
+
+TEST_F(KvProtocolTest, binary_opcodes) {
+  int c = connect();
+  ASSERT_GE(c, 0);
+  std::string a = key(0, 0);
+  std::string b = key(1, 1);
+  send(c, binary(0x01, b, "vb", 1) + binary(0x00, b, "", 2) +
+              binary(0x00, a, "", 3) + binary(0x04, b, "", 4) +
+              binary(0x04, b, "", 5) + binary(0x0a, "", "", 6));
+  BinaryResponse r = readBinary(c);
+  ASSERT_EQ(r.opcode, 0x01);
+  ASSERT_EQ(r.status, 0);
+  ASSERT_EQ(r.opaque, 1);
+  r = readBinary(c);
+  ASSERT_EQ(r.opcode, 0x00);
+  ASSERT_EQ(r.status, 0);
+  ASSERT_EQ(r.opaque, 2);
+  ASSERT_EQ(r.value, "vb");
+  r = readBinary(c);
+  ASSERT_EQ(r.status, 0x0001);
+  ASSERT_EQ(r.opaque, 3);
+  r = readBinary(c);
+  ASSERT_EQ(r.opcode, 0x04);
+  ASSERT_EQ(r.status, 0);
+  r = readBinary(c);
+  ASSERT_EQ(r.status, 0x0001);
+  ASSERT_EQ(r.opaque, 5);
+  r = readBinary(c);
+  ASSERT_EQ(r.opcode, 0x0a);
+  ASSERT_EQ(r.status, 0x0081);
+  ASSERT_EQ(r.opaque, 6);
+  close(c);
+}
+
+TEST_F(KvProtocolTest, close_with_forwarded_request) {
+  // hold the other shard, so the request stays in flight.
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  disps_[1]->post([released] { released.wait(); });
+
+  int c = connect();
+  ASSERT_GE(c, 0);
+  send(c, "get " + key(1, 0) + "\r\n");
+  bool busy = false;
+  while (!busy) {
+    runIn(0, [&] {
+      tl::ConnectionTable* conns = disps_[0]->connections();
+      conns->forEach(
+          [&](tl::Handler* h) { busy = svc_->protocol(0)->busy(h); });
+    });
+  }
+  close(c);
+  std::size_t open = 1;
+  while (open) {
+    runIn(0, [&] { open = disps_[0]->connections()->size(); });
+  }
+  // the response comes back to a closed connection.
+  release.set_value();
+  runIn(1, [] {});
+  runIn(0, [] {});
+
+  c = connect();
+  ASSERT_GE(c, 0);
+  send(c, "set " + key(1, 0) + " 0 0 1\r\nx\r\n");
+  ASSERT_EQ(receive(c, 8), "STORED\r\n");
+  close(c);
+}
+
+TEST_F(KvProtocolTest, set_too_large_skips_the_value) {
+  int c = connect();
+  ASSERT_GE(c, 0);
+  std::size_t len = tl::KvStore::kMaxItem + 1;
+  send(c, "set big 0 0 " + std::to_string(len) + "\r\n");
+  // the value in pieces, then the next request.
+  std::string value(len, 'v');
+  for (std::size_t at = 0; at < len; at += 65536) {
+    send(c, value.substr(at, 65536));
+  }
+  send(c, "\r\nget big\r\nset k 0 0 x\r\n");
+  std::string want =
+      "SERVER_ERROR object too large for cache\r\nEND\r\n"
+      "CLIENT_ERROR bad command line format\r\n";
+  ASSERT_EQ(receive(c, want.size()), want);
+  close(c);
+}
+
+TEST_F(KvProtocolTest, binary_set_too_large_skips_the_value) {
+  int c = connect();
+  ASSERT_GE(c, 0);
+  std::string set = binary(0x01, "big", "", 1);
+  // announce a value over the limit, then send it in pieces.
+  std::size_t len = tl::KvStore::kMaxItem + 1;
+  tl::storeInt<uint32_t, true>((unsigned char*)&set[8],
+                               (uint32_t)(8 + 3 + len));
+  send(c, set);
+  std::string value(len, 'v');
+  for (std::size_t at = 0; at < len; at += 65536) {
+    send(c, value.substr(at, 65536));
+  }
+  send(c, binary(0x00, "big", "", 2));
+  BinaryResponse r = readBinary(c);
+  ASSERT_EQ(r.opcode, 0x01);
+  ASSERT_EQ(r.status, 0x0003);
+  ASSERT_EQ(r.opaque, 1);
+  r = readBinary(c);
+  ASSERT_EQ(r.opcode, 0x00);
+  ASSERT_EQ(r.status, 0x0001);
+  ASSERT_EQ(r.opaque, 2);
+  close(c);
+}
+
+TEST_F(KvProtocolTest, stops_reading_at_max_pending) {
+  // hold the other shard, so the forwarded requests queue up.
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  disps_[1]->post([released] { released.wait(); });
+
+  int c = connect();
+  ASSERT_GE(c, 0);
+  // two responses each, the value and END.
+  const std::size_t n = tl::KvProtocol::kMaxPending;
+  std::string get = "get " + key(1, 0) + "\r\n";
+  std::string gets;
+  for (std::size_t i = 0; i < n; i++) {
+    gets += get;
+  }
+  send(c, gets);
+  tl::Handler* h = nullptr;
+  std::size_t read = 0;
+  while (read < gets.size()) {
+    runIn(0, [&] {
+      disps_[0]->connections()->forEach([&](tl::Handler* x) { h = x; });
+      read = disps_[0]->metrics().bytes_read.value();
+    });
+  }
+  // half of them parsed, the rest left unread.
+  std::size_t left = 0;
+  runIn(0, [&] { left = h->pendingRead(); });
+  ASSERT_EQ(left, gets.size() / 2);
+  send(c, gets);
+  usleep(20000);
+  runIn(0, [&] { read = disps_[0]->metrics().bytes_read.value(); });
+  ASSERT_EQ(read, gets.size());
+
+  release.set_value();
+  std::string want;
+  for (std::size_t i = 0; i < 2 * n; i++) {
+    want += "END\r\n";
+  }
+  ASSERT_EQ(receive(c, want.size()), want);
+  close(c);
+}
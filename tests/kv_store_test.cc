@@ -0,0 +1,77 @@
+#include "kv_store.h"
+
+#include <string>
+
+#include "buffer.h"
+#include "codec.h"
+#include "gtest/gtest.h"
+
+TEST(kv_store, set_get_del) {
+  tl::KvStore s(1 << 20);
+  ASSERT_EQ(s.get("a"), nullptr);
+  ASSERT_TRUE(s.set("a", std::string_view("one"), 7));
+  const tl::KvStore::Item *item = s.get("a");
+  ASSERT_NE(item, nullptr);
+  ASSERT_EQ(item->value(), "one");
+  ASSERT_EQ(item->flags, 7);
+
+  ASSERT_TRUE(s.set("a", std::string_view("three"), 0));
+  ASSERT_EQ(s.get("a")->value(), "three");
+  ASSERT_EQ(s.items(), 1);
+
+  ASSERT_TRUE(s.del("a"));
+  ASSERT_FALSE(s.del("a"));
+  ASSERT_EQ(s.get("a"), nullptr);
+  ASSERT_EQ(s.items(), 0);
+  ASSERT_EQ(s.hits(), 2);
+  ASSERT_EQ(s.misses(), 2);
+}
+
+TEST(kv_store, set_from_buffer) {
+  tl::buffer in;
+  std::string v(10000, 'v');
+  in.push(v.data(), v.size());
+  tl::KvStore s(1 << 20);
+  ASSERT_TRUE(s.set("k", tl::BufferView(&in, 0, in.size()), 0));
+  ASSERT_EQ(s.get("k")->value(), v);
+}
+
+TEST(kv_store, grow_and_delete_keep_keys) {
+  tl::KvStore s(64 << 20);
+  for (int i = 0; i < 10000; i++) {
+    std::string k = "key" + std::to_string(i);
+    ASSERT_TRUE(s.set(k, std::string_view(k), 0));
+  }
+  // deletes shift probe chains back, every other key must stay reachable.
+  for (int i = 0; i < 10000; i += 2) {
+    ASSERT_TRUE(s.del("key" + std::to_string(i)));
+  }
+  for (int i = 0; i < 10000; i++) {
+    std::string k = "key" + std::to_string(i);
+    const tl::KvStore::Item *item = s.get(k);
+    if (i % 2) {
+      ASSERT_NE(item, nullptr) << k;
+      ASSERT_EQ(item->value(), k);
+    } else {
+      ASSERT_EQ(item, nullptr) << k;
+    }
+  }
+}
+
+TEST(kv_store, evicts_under_cap) {
+  tl::KvStore s(64 << 10);
+  std::string v(1000, 'x');
+  ASSERT_TRUE(s.set("hot", std::string_view(v), 0));
+  for (int i = 0; i < 1000; i++) {
+    s.get("hot");
+    ASSERT_TRUE(s.set("k" + std::to_string(i), std::string_view(v), 0));
+    ASSERT_LE(s.bytes(), 64u << 10);
+  }
+  ASSERT_GT(s.evictions(), 0);
+  // read between every set, CLOCK spares it.
+  ASSERT_NE(s.get("hot"), nullptr);
+  ASSERT_NE(s.get("k999"), nullptr);
+
+  // too large for the cap.
+  ASSERT_FALSE(s.set("big", std::string_view(std::string(128 << 10, 'x')), 0));
+}
@@ -0,0 +1,217 @@
+#include "loop_scaler.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "codec.h"
+#include "connection_table.h"
+#include "dispatcher.h"
+#include "gtest/gtest.h"
+#include "listener.h"
+#include "protocol.h"
+#include "test_util.h"
+
+namespace {
+
+// Echoes whole lines, leaving a partial one in the read buffer.
+class LineProtocol : public tl::Protocol {
+ public:
+  int onRead(tl::Handler*, tl::buffer& in, tl::buffer& out) override {
+    std::size_t size = in.size();
+    for (std::size_t i = 0; i < size; i++) {
+      if (in[i] == '\n') {
+        std::string line = tl::BufferView(&in, 0, i + 1).toString();
+        out.push(line.data(), line.size());
+        in.drain(i + 1);
+        return 0;
+      }
+    }
+    return 0;
+  }
+};
+
+int connectTo(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sa.sin_port = htons(port);
+  struct timeval tv = {2, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+using tl::test::waitFor;
+
+void spin(std::chrono::milliseconds d) {
+  auto end = std::chrono::steady_clock::now() + d;
+  while (std::chrono::steady_clock::now() < end) {
+  }
+}
+
+}  // namespace
+
+// Four loops, the first one listening, scaled on short intervals and low
+// thresholds.
+TEST(loop_scaler, grow_shrink_and_migrate) {
+  const std::size_t n = 4;
+  // the protocols outlive the connections.
+  std::vector<LineProtocol> protos(n);
+  std::vector<std::unique_ptr<tl::Dispatcher>> disps;
+  std::vector<std::unique_ptr<tl::Listener>> ls;
+  std::vector<tl::Dispatcher*> dp;
+  std::vector<tl::Listener*> lp;
+  auto handle = [](tl::Dispatcher* d, int fd) { d->connections()->open(fd); };
+  for (std::size_t i = 0; i < n; i++) {
+    disps.emplace_back(new tl::Dispatcher());
+    disps[i]->connections()->setProtocol(&protos[i]);
+    dp.push_back(disps[i].get());
+  }
+  ls.emplace_back(new tl::Listener("127.0.0.1", 0));
+  ASSERT_EQ(ls[0]->open(dp[0], handle), 0);
+  struct sockaddr_in sa;
+  socklen_t len = sizeof(sa);
+  ASSERT_EQ(getsockname(ls[0]->fd(), (struct sockaddr*)&sa, &len), 0);
+  int port = ntohs(sa.sin_port);
+  for (std::size_t i = 1; i < n; i++) {
+    ls.emplace_back(new tl::Listener("127.0.0.1", port));
+  }
+  for (auto& l : ls) {
+    lp.push_back(l.get());
+  }
+  std::vector<std::thread> threads;
+  for (tl::Dispatcher* d : dp) {
+    threads.emplace_back([d] { d->dispatch(); });
+  }
+
+  tl::LoopScaler::Options opts;
+  opts.high = 0.05;
+  opts.low = 0.02;
+  opts.interval_ms = 100;
+  opts.up_after = 1;
+  opts.down_after = 2;
+  tl::LoopScaler scaler(dp, lp, handle, opts);
+  ASSERT_EQ(scaler.active(), 1);
+  scaler.start();
+
+  // load on the first loop adds loops.
+  std::atomic<bool> loaded{true};
+  std::thread load([&] {
+    while (loaded) {
+      dp[0]->post([] { spin(std::chrono::milliseconds(20)); });
+      usleep(20000);
+    }
+  });
+  bool grown = waitFor([&] { return scaler.active() >= 2; }, 5000);
+  loaded = false;
+  load.join();
+  ASSERT_TRUE(grown);
+
+  // connections over the loops of the group, each with a partial line.
+  std::vector<int> clients;
+  auto others = [&] {
+    uint64_t c = 0;
+    for (std::size_t i = 1; i < n; i++) {
+      c += dp[i]->metrics().connections.value();
+    }
+    return c;
+  };
+  for (int i = 0; i < 64 && (clients.size() < 8 || others() == 0); i++) {
+    int fd = connectTo(port);
+    ASSERT_GE(fd, 0);
+    std::string s = "line " + std::to_string(i);
+    ASSERT_EQ(write(fd, s.data(), s.size()), (ssize_t)s.size());
+    clients.push_back(fd);
+    waitFor([&] {
+      uint64_t c = 0;
+      for (tl::Dispatcher* d : dp) {
+        c += d->metrics().connections.value();
+      }
+      return c == clients.size();
+    }, 2000);
+  }
+  ASSERT_GT(others(), 0);
+
+  // idle, back to one loop, all the connections moved to it.
+  ASSERT_TRUE(waitFor([&] { return scaler.active() == 1; }, 10000));
+  ASSERT_TRUE(waitFor([&] {
+    return dp[0]->metrics().connections.value() == clients.size();
+  }, 2000));
+  uint64_t migrated = 0;
+  for (tl::Dispatcher* d : dp) {
+    migrated += d->metrics().conns_migrated.value();
+  }
+  ASSERT_GT(migrated, 0);
+
+  // their partial lines came with them.
+  for (std::size_t i = 0; i < clients.size(); i++) {
+    ASSERT_EQ(write(clients[i], "\n", 1), 1);
+    std::string want = "line " + std::to_string(i) + "\n";
+    std::string got;
+    char buf[256];
+    while (got.size() < want.size()) {
+      ssize_t r = read(clients[i], buf, sizeof(buf));
+      if (r <= 0) {
+        break;
+      }
+      got.append(buf, r);
+    }
+    ASSERT_EQ(got, want);
+    close(clients[i]);
+  }
+
+  scaler.stop();
+  for (std::size_t i = 0; i < n; i++) {
+    dp[i]->stop();
+    threads[i].join();
+  }
+}
+
+TEST(loop_scaler, starts_at_the_loops_listening) {
+  std::vector<std::unique_ptr<tl::Dispatcher>> disps;
+  std::vector<std::unique_ptr<tl::Listener>> ls;
+  std::vector<tl::Dispatcher*> dp;
+  std::vector<tl::Listener*> lp;
+  auto handle = [](tl::Dispatcher* d, int fd) { d->connections()->open(fd); };
+  for (int i = 0; i < 3; i++) {
+    disps.emplace_back(new tl::Dispatcher());
+    dp.push_back(disps.back().get());
+  }
+  ls.emplace_back(new tl::Listener("127.0.0.1", 0));
+  ASSERT_EQ(ls[0]->open(dp[0], handle), 0);
+  // open once only, the socket stays as it is.
+  int fd = ls[0]->fd();
+  ASSERT_EQ(ls[0]->open(dp[0], handle), -1);
+  ASSERT_EQ(ls[0]->fd(), fd);
+  struct sockaddr_in sa;
+  socklen_t len = sizeof(sa);
+  ASSERT_EQ(getsockname(fd, (struct sockaddr*)&sa, &len), 0);
+  for (int i = 1; i < 3; i++) {
+    ls.emplace_back(new tl::Listener("127.0.0.1", ntohs(sa.sin_port)));
+  }
+  // two listening, e.g. adopted at a hot restart, over min_loops.
+  ASSERT_EQ(ls[1]->open(dp[1], handle), 0);
+  for (auto& l : ls) {
+    lp.push_back(l.get());
+  }
+  tl::LoopScaler::Options opts;
+  opts.min_loops = 1;
+  tl::LoopScaler scaler(dp, lp, handle, opts);
+  ASSERT_EQ(scaler.active(), 2);
+}
@@ -0,0 +1,102 @@
+#include "slab.h"
+
+#include <set>
+#include <stdexcept>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+struct Obj {
+  Obj(int v, int *alive) : v(v), alive(alive) {
+    if (v < 0) {
+      throw std::runtime_error("negative");
+    }
+    ++*alive;
+  }
+  ~Obj() { --*alive; }
+  int v;
+  int *alive;
+};
+
+}  // namespace
+
+TEST(slab, create_destroy) {
+  int alive = 0;
+  tl::Slab<Obj, 4> s;
+  ASSERT_EQ(s.size(), 0);
+  ASSERT_EQ(s.capacity(), 0);
+
+  Obj *a = s.create(1, &alive);
+  Obj *b = s.create(2, &alive);
+  ASSERT_EQ(alive, 2);
+  ASSERT_EQ(s.size(), 2);
+  ASSERT_EQ(s.capacity(), 4);
+  ASSERT_EQ(a->v, 1);
+  ASSERT_EQ(b->v, 2);
+
+  s.destroy(a);
+  ASSERT_EQ(alive, 1);
+  ASSERT_EQ(s.size(), 1);
+
+  // the freed slot is reused.
+  Obj *c = s.create(3, &alive);
+  ASSERT_EQ(c, a);
+  ASSERT_EQ(s.capacity(), 4);
+}
+
+TEST(slab, handle) {
+  int alive = 0;
+  tl::Slab<Obj, 4> s;
+  Obj *a = s.create(1, &alive);
+  auto ha = s.handle(a);
+  ASSERT_NE(ha, tl::Slab<Obj>::kInvalidHandle);
+  ASSERT_EQ(s.get(ha), a);
+
+  s.destroy(a);
+  ASSERT_EQ(s.get(ha), nullptr);
+
+  // same slot, new generation.
+  Obj *b = s.create(2, &alive);
+  ASSERT_EQ(b, a);
+  ASSERT_EQ(s.get(ha), nullptr);
+  ASSERT_EQ(s.get(s.handle(b)), b);
+
+  ASSERT_EQ(s.get(tl::Slab<Obj>::kInvalidHandle), nullptr);
+  ASSERT_EQ(s.get(1000), nullptr);
+}
+
+TEST(slab, grow_keeps_pointers) {
+  int alive = 0;
+  {
+    tl::Slab<Obj, 4> s;
+    std::vector<Obj *> objs;
+    for (int i = 0; i < 100; i++) {
+      objs.push_back(s.create(i, &alive));
+    }
+    ASSERT_EQ(s.size(), 100);
+    std::set<Obj *> uniq(objs.begin(), objs.end());
+    ASSERT_EQ(uniq.size(), 100);
+    for (int i = 0; i < 100; i++) {
+      ASSERT_EQ(objs[i]->v, i);
+      ASSERT_EQ(s.get(s.handle(objs[i])), objs[i]);
+    }
+    for (int i = 0; i < 100; i += 2) {
+      s.destroy(objs[i]);
+    }
+    ASSERT_EQ(alive, 50);
+  }
+  // the slab destroys what is left.
+  ASSERT_EQ(alive, 0);
+}
+
+TEST(slab, constructor_throws) {
+  int alive = 0;
+  tl::Slab<Obj, 4> s;
+  ASSERT_THROW(s.create(-1, &alive), std::runtime_error);
+  ASSERT_EQ(s.size(), 0);
+  Obj *a = s.create(1, &alive);
+  ASSERT_EQ(s.size(), 1);
+  ASSERT_EQ(a->v, 1);
+}
@@ -0,0 +1,81 @@
+#include "socket_options.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+int getInt(int fd, int level, int opt) {
+  int v = -1;
+  socklen_t len = sizeof(v);
+  if (getsockopt(fd, level, opt, &v, &len) < 0) {
+    return -1;
+  }
+  return v;
+}
+
+}  // namespace
+
+TEST(socket_options, parse) {
+  tl::SocketOptions o;
+  ASSERT_EQ(tl::SocketOptions::parse("default", &o), 0);
+  ASSERT_EQ(o.backlog, 512);
+  ASSERT_EQ(o.nodelay, -1);
+
+  ASSERT_EQ(tl::SocketOptions::parse("short", &o), 0);
+  ASSERT_EQ(o.defer_accept_s, 1);
+  ASSERT_GT(o.fastopen, 0);
+  ASSERT_EQ(o.quickack, 1);
+
+  ASSERT_EQ(tl::SocketOptions::parse("long,sndbuf=262144,nodelay=-1", &o), 0);
+  ASSERT_EQ(o.sndbuf, 262144);
+  ASSERT_EQ(o.nodelay, -1);
+  ASSERT_EQ(o.notsent_lowat, 128 << 10);
+
+  // a bad spec leaves the options alone.
+  ASSERT_EQ(tl::SocketOptions::parse("fast", &o), -1);
+  ASSERT_EQ(tl::SocketOptions::parse("long,nodelay", &o), -1);
+  ASSERT_EQ(tl::SocketOptions::parse("long,nodelay=x", &o), -1);
+  ASSERT_EQ(tl::SocketOptions::parse("long,cork=1", &o), -1);
+  ASSERT_EQ(o.sndbuf, 262144);
+}
+
+TEST(socket_options, inherited_by_accepted_sockets) {
+  tl::SocketOptions o;
+  ASSERT_EQ(tl::SocketOptions::parse("long,rcvbuf=65536,defer_accept_s=1",
+                                     &o),
+            0);
+  int ls = socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_GE(ls, 0);
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ASSERT_EQ(bind(ls, (struct sockaddr*)&sa, sizeof(sa)), 0);
+  ASSERT_EQ(o.applyListen(ls), 0);
+  ASSERT_EQ(listen(ls, o.backlog), 0);
+  ASSERT_GT(getInt(ls, IPPROTO_TCP, TCP_DEFER_ACCEPT), 0);
+  socklen_t len = sizeof(sa);
+  ASSERT_EQ(getsockname(ls, (struct sockaddr*)&sa, &len), 0);
+
+  int c = socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_EQ(connect(c, (struct sockaddr*)&sa, sizeof(sa)), 0);
+  // deferred until the client sends something.
+  ASSERT_EQ(write(c, "x", 1), 1);
+  int s = accept(ls, nullptr, nullptr);
+  ASSERT_GE(s, 0);
+  ASSERT_EQ(getInt(s, IPPROTO_TCP, TCP_NODELAY), 1);
+  ASSERT_EQ(getInt(s, IPPROTO_TCP, TCP_NOTSENT_LOWAT), 128 << 10);
+  // the kernel doubles it for its bookkeeping.
+  ASSERT_EQ(getInt(s, SOL_SOCKET, SO_RCVBUF), 2 * 65536);
+  ASSERT_EQ(tl::setQuickAck(s), 0);
+  close(s);
+  close(c);
+  close(ls);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <functional>
+#include <string>
+
+#include "connection_table.h"
+#include "dispatcher.h"
+#include "event2/event.h"
+
+// Helpers for tests that run Dispatcher loops.
+namespace tl {
+namespace test {
+
+// Open the local end of a socketpair in "disp", return the peer end, and
+// the handler in "h" if not nullptr.
+inline int openPair(Dispatcher* disp, Protocol* proto = nullptr,
+                    Handler** h = nullptr) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    return -1;
+  }
+  Handler* local = disp->connections()->open(sv[0], proto);
+  if (local == nullptr) {
+    close(sv[1]);
+    return -1;
+  }
+  if (h) {
+    *h = local;
+  }
+  return sv[1];
+}
+
+// Append what "fd" has to "s", return true at end of file.
+inline bool readAll(int fd, std::string* s) {
+  char buf[65536];
+  ssize_t n;
+  while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+    s->append(buf, n);
+  }
+  return n == 0;
+}
+
+// Wait for "done" up to about "ms" milliseconds, with the loops running in
+// threads of their own.
+inline bool waitFor(const std::function<bool()>& done, int ms) {
+  for (int i = 0; i < ms; i++) {
+    if (done()) {
+      return true;
+    }
+    usleep(1000);
+  }
+  return done();
+}
+
+// Run the loop of "disp" until "done" or about 2 seconds.
+inline bool runUntil(Dispatcher* disp, const std::function<bool()>& done) {
+  for (int i = 0; i < 2000; i++) {
+    if (done()) {
+      return true;
+    }
+    event_base_loop(disp->ev_base(), EVLOOP_NONBLOCK);
+    usleep(1000);
+  }
+  return done();
+}
+
+// Run the loop of "disp" for about "ms" milliseconds.
+inline void runFor(Dispatcher* disp, int ms) {
+  for (int i = 0; i < ms; i++) {
+    event_base_loop(disp->ev_base(), EVLOOP_NONBLOCK);
+    usleep(1000);
+  }
+}
+
+}  // namespace test
+}  // namespace tl
@@ -0,0 +1,117 @@
+#include "trace.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+std::string tempPath() {
+  char path[] = "/tmp/trace_test.XXXXXX";
+  int fd = mkstemp(path);
+  close(fd);
+  return path;
+}
+
+}  // namespace
+
+TEST(trace, round_trip) {
+  std::string path = tempPath();
+  tl::TraceWriter w;
+  ASSERT_EQ(w.open(path, 64 << 20), 0);
+  w.record(tl::kTraceOpen, 7, nullptr, 0);
+  w.record(tl::kTraceData, 7, "hello", 5);
+  w.record(tl::kTraceData, 8, "", 0);
+  w.record(tl::kTraceClose, 7, nullptr, 0);
+  w.close();
+
+  tl::TraceReader r;
+  ASSERT_EQ(r.open(path), 0);
+  ASSERT_GT(r.header().start_ns, 0);
+  tl::TraceRecord rec;
+  const char* data;
+  std::vector<tl::TraceRecord> recs;
+  std::vector<std::string> datas;
+  while (r.next(&rec, &data)) {
+    recs.push_back(rec);
+    datas.emplace_back(data, rec.len);
+  }
+  ASSERT_EQ(recs.size(), 4);
+  ASSERT_EQ(recs[0].type, tl::kTraceOpen);
+  ASSERT_EQ(recs[1].type, tl::kTraceData);
+  ASSERT_EQ(recs[1].conn, 7);
+  ASSERT_EQ(datas[1], "hello");
+  ASSERT_EQ(recs[2].conn, 8);
+  ASSERT_EQ(recs[2].len, 0);
+  ASSERT_EQ(recs[3].type, tl::kTraceClose);
+  for (std::size_t i = 1; i < recs.size(); i++) {
+    ASSERT_GE(recs[i].ts_ns, recs[i - 1].ts_ns);
+  }
+  unlink(path.c_str());
+}
+
+TEST(trace, grows_off_the_loop) {
+  std::string path = tempPath();
+  tl::TraceWriter w;
+  ASSERT_EQ(w.open(path, 64 << 20), 0);
+  ASSERT_EQ(w.capacity(), 16u << 20);
+  std::string data(1 << 20, 'd');
+  // the first 16 MB hold 15 of them, then record() drops until the thread
+  // has grown the file.
+  int written = 0;
+  while (w.dropped() == 0) {
+    w.record(tl::kTraceData, 1, data.data(), data.size());
+    written++;
+  }
+  ASSERT_EQ(written, 16);
+  w.reserve();
+  for (int i = 0; i < 2000 && w.capacity() == 16u << 20; i++) {
+    usleep(1000);
+  }
+  ASSERT_EQ(w.capacity(), 32u << 20);
+  w.record(tl::kTraceData, 2, data.data(), data.size());
+  ASSERT_EQ(w.dropped(), 1);
+  ASSERT_GT(w.size(), 16u << 20);
+  w.close();
+
+  tl::TraceReader r;
+  ASSERT_EQ(r.open(path), 0);
+  tl::TraceRecord rec;
+  const char* p;
+  int n = 0;
+  while (r.next(&rec, &p)) {
+    ASSERT_EQ(rec.len, data.size());
+    ASSERT_EQ(rec.conn, n < 15 ? 1 : 2);
+    n++;
+  }
+  ASSERT_EQ(n, 16);
+  unlink(path.c_str());
+}
+
+TEST(trace, stops_at_max_bytes) {
+  std::string path = tempPath();
+  tl::TraceWriter w;
+  ASSERT_EQ(w.open(path, 20 << 20), 0);
+  std::string data(1 << 20, 'd');
+  while (w.dropped() == 0) {
+    w.record(tl::kTraceData, 1, data.data(), data.size());
+  }
+  // grown to "max_bytes", not double: 4 more fit.
+  w.reserve();
+  for (int i = 0; i < 2000 && w.capacity() == 16u << 20; i++) {
+    usleep(1000);
+  }
+  ASSERT_EQ(w.capacity(), 20u << 20);
+  for (int i = 0; i < 5; i++) {
+    w.record(tl::kTraceData, 1, data.data(), data.size());
+  }
+  ASSERT_EQ(w.dropped(), 2);
+  w.reserve();
+  ASSERT_EQ(w.capacity(), 20u << 20);
+  w.close();
+  unlink(path.c_str());
+}
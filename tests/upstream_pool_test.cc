@@ -0,0 +1,208 @@
+#include "upstream_pool.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "codec.h"
+#include "dispatcher.h"
+#include "event2/event.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+using LineCodec = tl::DelimiterCodec<4096, '\n'>;
+
+// A listening socket on 127.0.0.1, its connections served by the test
+// between loop iterations.
+struct Upstream {
+  explicit Upstream(int backlog = 16) {
+    ls = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(sa);
+    bind(ls, (struct sockaddr*)&sa, sizeof(sa));
+    listen(ls, backlog);
+    getsockname(ls, (struct sockaddr*)&sa, &len);
+    port = ntohs(sa.sin_port);
+  }
+  ~Upstream() {
+    for (int c : conns) {
+      close(c);
+    }
+    close(ls);
+  }
+  // Accept what is queued, return the number of connections.
+  std::size_t acceptAll() {
+    int c;
+    while ((c = accept4(ls, nullptr, nullptr, SOCK_NONBLOCK)) >= 0) {
+      conns.push_back(c);
+    }
+    return conns.size();
+  }
+  // Append what connection "i" sent to "in", return its size.
+  std::size_t read(std::size_t i, std::string* in) {
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(conns[i], buf, sizeof(buf), 0)) > 0) {
+      in->append(buf, n);
+    }
+    return in->size();
+  }
+
+  int ls;
+  int port;
+  std::vector<int> conns;
+};
+
+struct Response {
+  int err;
+  std::string payload;
+};
+
+tl::UpstreamCallback collect(std::vector<Response>* out) {
+  return [out](int err, const tl::Frame&, const tl::BufferView& payload) {
+    out->push_back(Response{err, payload.toString()});
+  };
+}
+
+// Run the loop of "disp" until "done" or about 2 seconds.
+bool runUntil(tl::Dispatcher* disp, const std::function<bool()>& done) {
+  for (int i = 0; i < 2000; i++) {
+    if (done()) {
+      return true;
+    }
+    event_base_loop(disp->ev_base(), EVLOOP_NONBLOCK);
+    usleep(1000);
+  }
+  return done();
+}
+
+}  // namespace
+
+TEST(upstream_pool, pipelined_responses_in_order) {
+  tl::Dispatcher disp;
+  Upstream up;
+  tl::UpstreamOptions opts;
+  opts.max_connections = 1;
+  tl::UpstreamPool pool(&disp, "127.0.0.1", up.port, &LineCodec::decode,
+                        opts);
+  pool.start();
+  ASSERT_TRUE(runUntil(&disp, [&] {
+    return pool.connections() == 1 && up.acceptAll() == 1;
+  }));
+
+  std::vector<Response> got;
+  pool.request<LineCodec>("a", 1, collect(&got));
+  pool.request<LineCodec>("b", 1, collect(&got));
+  pool.request("c\n", 2, collect(&got));
+  // all three on the one connection, before any response.
+  std::string in;
+  ASSERT_TRUE(runUntil(&disp, [&] { return up.read(0, &in) >= 6; }));
+  ASSERT_EQ(in, "a\nb\nc\n");
+  ASSERT_EQ(write(up.conns[0], "A\nB\n", 4), 4);
+  ASSERT_TRUE(runUntil(&disp, [&] { return got.size() == 2; }));
+  ASSERT_EQ(write(up.conns[0], "C\n", 2), 2);
+  ASSERT_TRUE(runUntil(&disp, [&] { return got.size() == 3; }));
+  ASSERT_EQ(got[0].err, 0);
+  ASSERT_EQ(got[0].payload, "A");
+  ASSERT_EQ(got[1].payload, "B");
+  ASSERT_EQ(got[2].err, 0);
+  ASSERT_EQ(got[2].payload, "C");
+  ASSERT_EQ(pool.connections(), 1);
+}
+
+TEST(upstream_pool, request_timeout) {
+  tl::Dispatcher disp;
+  Upstream up;
+  tl::UpstreamOptions opts;
+  opts.max_connections = 1;
+  opts.request_timeout_ms = 50;
+  tl::UpstreamPool pool(&disp, "127.0.0.1", up.port, &LineCodec::decode,
+                        opts);
+  pool.start();
+  ASSERT_TRUE(runUntil(&disp, [&] { return pool.connections() == 1; }));
+
+  // the upstream never answers: both fail, the second lost with the first.
+  std::vector<Response> got;
+  pool.request<LineCodec>("a", 1, collect(&got));
+  pool.request<LineCodec>("b", 1, collect(&got));
+  ASSERT_TRUE(runUntil(&disp, [&] { return got.size() == 2; }));
+  ASSERT_EQ(got[0].err, ETIMEDOUT);
+  ASSERT_EQ(got[1].err, ETIMEDOUT);
+  ASSERT_EQ(pool.connections(), 0);
+}
+
+TEST(upstream_pool, connect_timeout) {
+  tl::Dispatcher disp;
+  // a full accept queue: the kernel drops the SYNs of the pool.
+  Upstream up(0);
+  std::vector<int> fillers;
+  for (int i = 0; i < 4; i++) {
+    int c = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = htons(up.port);
+    connect(c, (struct sockaddr*)&sa, sizeof(sa));
+    fillers.push_back(c);
+  }
+  usleep(50000);
+
+  tl::UpstreamOptions opts;
+  opts.warm_connections = 0;
+  opts.connect_timeout_ms = 50;
+  tl::UpstreamPool pool(&disp, "127.0.0.1", up.port, &LineCodec::decode,
+                        opts);
+  std::vector<Response> got;
+  pool.request<LineCodec>("a", 1, collect(&got));
+  ASSERT_EQ(pool.queued(), 1);
+  ASSERT_EQ(pool.connecting(), 1);
+  ASSERT_TRUE(runUntil(&disp, [&] { return got.size() == 1; }));
+  ASSERT_EQ(got[0].err, ETIMEDOUT);
+  ASSERT_EQ(pool.queued(), 0);
+  ASSERT_EQ(pool.connections(), 0);
+  for (int c : fillers) {
+    close(c);
+  }
+}
+
+TEST(upstream_pool, reconnect_after_upstream_closes) {
+  tl::Dispatcher disp;
+  Upstream up;
+  tl::UpstreamOptions opts;
+  opts.retry_ms = 10;
+  tl::UpstreamPool pool(&disp, "127.0.0.1", up.port, &LineCodec::decode,
+                        opts);
+  pool.start();
+  ASSERT_TRUE(runUntil(&disp, [&] {
+    return pool.connections() == 1 && up.acceptAll() == 1;
+  }));
+
+  // an idle connection closed by the upstream is replaced.
+  close(up.conns[0]);
+  up.conns[0] = -1;
+  ASSERT_TRUE(runUntil(&disp, [&] {
+    return up.acceptAll() == 2 && pool.connections() == 1;
+  }));
+
+  std::vector<Response> got;
+  pool.request<LineCodec>("a", 1, collect(&got));
+  std::string in;
+  ASSERT_TRUE(runUntil(&disp, [&] { return up.read(1, &in) >= 2; }));
+  ASSERT_EQ(in, "a\n");
+  ASSERT_EQ(write(up.conns[1], "A\n", 2), 2);
+  ASSERT_TRUE(runUntil(&disp, [&] { return got.size() == 1; }));
+  ASSERT_EQ(got[0].err, 0);
+  ASSERT_EQ(got[0].payload, "A");
+}
@@ -0,0 +1,214 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "log.h"
+#include "spdlog/spdlog.h"
+
+namespace tl {
+
+static const char kTraceMagic[8] = {'T', 'L', 'T', 'R', 'A', 'C', 'E', '1'};
+static const uint32_t kTraceVersion = 1;
+// first allocated size of the file, doubled as it fills.
+static const std::size_t kTraceChunk = 16 << 20;
+
+static int64_t steadyNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static std::size_t padded(std::size_t len) {
+  return (len + 7) & ~(std::size_t)7;
+}
+
+int TraceWriter::open(const std::string& path, std::size_t max_bytes) {
+  close();
+  if (max_bytes < sizeof(TraceFileHeader)) {
+    errno = EFBIG;
+    return -1;
+  }
+  fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    SPDLOG_ERROR("open {} errno={} {}", path, errno, strerror(errno));
+    return -1;
+  }
+  max_bytes_ = max_bytes;
+  used_ = 0;
+  dropped_ = 0;
+  // address space only, the pages past the allocated size are not touched.
+  void* p = mmap(nullptr, max_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_,
+                 0);
+  if (p == MAP_FAILED) {
+    SPDLOG_ERROR("map {} errno={} {}", path, errno, strerror(errno));
+    close();
+    return -1;
+  }
+  map_ = (char*)p;
+  mapped_ = max_bytes;
+  if (allocate(std::min(kTraceChunk, max_bytes)) < 0) {
+    SPDLOG_ERROR("fallocate {} errno={} {}", path, errno, strerror(errno));
+    close();
+    return -1;
+  }
+  TraceFileHeader* h = (TraceFileHeader*)map_;
+  memcpy(h->magic, kTraceMagic, sizeof(kTraceMagic));
+  h->version = kTraceVersion;
+  h->reserved = 0;
+  h->start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::system_clock::now().time_since_epoch())
+                    .count();
+  start_ns_ = steadyNs();
+  used_ = sizeof(TraceFileHeader);
+  stop_ = false;
+  grow_ = false;
+  thread_ = std::thread([this] { run(); });
+  return 0;
+}
+
+void TraceWriter::close() {
+  if (thread_.joinable()) {
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      stop_ = true;
+    }
+    cond_.notify_all();
+    thread_.join();
+  }
+  if (map_) {
+    munmap(map_, mapped_);
+    map_ = nullptr;
+    mapped_ = 0;
+  }
+  if (fd_ >= 0) {
+    if (ftruncate(fd_, used_) < 0) {
+      SPDLOG_ERROR("trace ftruncate errno={} {}", errno, strerror(errno));
+    }
+    ::close(fd_);
+    fd_ = -1;
+  }
+  allocated_ = 0;
+}
+
+int TraceWriter::allocate(std::size_t size) {
+  std::size_t allocated = allocated_.load();
+  // allocate the blocks now, a store to a hole with the disk full would
+  // SIGBUS instead.
+  int err = posix_fallocate(fd_, allocated, size - allocated);
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  allocated_.store(size, std::memory_order_release);
+  return 0;
+}
+
+void TraceWriter::run() {
+  std::unique_lock<std::mutex> lock(mu_);
+  for (;;) {
+    cond_.wait(lock, [this] { return grow_ || stop_; });
+    if (stop_) {
+      return;
+    }
+    grow_ = false;
+    lock.unlock();
+    std::size_t size = std::min(allocated_.load() * 2, max_bytes_);
+    if (allocate(size) < 0) {
+      TL_WARN_RL(errno, "trace grow errno={} {}", errno, strerror(errno));
+    }
+    lock.lock();
+  }
+}
+
+void TraceWriter::record(TraceType type, uint64_t conn, const void* data,
+                         std::size_t len) {
+  if (map_ == nullptr) {
+    return;
+  }
+  std::size_t need = used_ + sizeof(TraceRecord) + padded(len);
+  if (need > allocated_.load(std::memory_order_acquire)) {
+    dropped_++;
+    return;
+  }
+  TraceRecord* r = (TraceRecord*)(map_ + used_);
+  r->ts_ns = steadyNs() - start_ns_;
+  r->conn = conn;
+  r->len = (uint32_t)len;
+  r->type = type;
+  r->reserved = 0;
+  if (len) {
+    memcpy(r + 1, data, len);
+  }
+  used_ = need;
+}
+
+void TraceWriter::reserve() {
+  std::size_t allocated = allocated_.load(std::memory_order_relaxed);
+  if (map_ == nullptr || used_ < allocated / 2 || allocated >= max_bytes_) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock(mu_);
+    grow_ = true;
+  }
+  cond_.notify_one();
+}
+
+TraceReader::~TraceReader() {
+  if (map_) {
+    munmap((void*)map_, size_);
+  }
+}
+
+int TraceReader::open(const std::string& path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 ||
+      (std::size_t)st.st_size < sizeof(TraceFileHeader)) {
+    ::close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) {
+    return -1;
+  }
+  map_ = (const char*)p;
+  size_ = st.st_size;
+  pos_ = sizeof(TraceFileHeader);
+  if (memcmp(header().magic, kTraceMagic, sizeof(kTraceMagic)) != 0 ||
+      header().version != kTraceVersion) {
+    errno = EINVAL;
+    return -1;
+  }
+  madvise(p, size_, MADV_SEQUENTIAL);
+  return 0;
+}
+
+bool TraceReader::next(TraceRecord* rec, const char** data) {
+  if (pos_ + sizeof(TraceRecord) > size_) {
+    return false;
+  }
+  memcpy(rec, map_ + pos_, sizeof(TraceRecord));
+  std::size_t end = pos_ + sizeof(TraceRecord) + padded(rec->len);
+  if (rec->type == 0 || end > size_) {
+    return false;  // cut short
+  }
+  *data = map_ + pos_ + sizeof(TraceRecord);
+  pos_ = end;
+  return true;
+}
+
+}  // namespace tl
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace tl {
+
+// Trace file: a TraceFileHeader, then TraceRecords, each followed by "len"
+// bytes of data and padding to a multiple of 8.
+struct TraceFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  // system clock nanoseconds when the capture started.
+  int64_t start_ns;
+};
+
+enum TraceType : uint16_t {
+  kTraceOpen = 1,
+  kTraceData = 2,
+  kTraceClose = 3,
+};
+
+struct TraceRecord {
+  // steady clock nanoseconds since the capture started.
+  int64_t ts_ns;
+  // the connection, unique within the file.
+  uint64_t conn;
+  uint32_t len;
+  uint16_t type;
+  uint16_t reserved;
+};
+
+// Appends records to a memory mapped trace file. A record is a memcpy into
+// the mapping, the kernel writes the pages back in the background. All of
+// "max_bytes" is mapped at open(), but the file is allocated a doubling
+// chunk at a time by fallocate() in a thread of the writer's own: the loop
+// never waits for the disk, record() drops what does not fit yet. Not
+// thread safe, one writer per dispatch loop.
+class TraceWriter {
+ public:
+  TraceWriter() = default;
+  ~TraceWriter() { close(); }
+  TraceWriter(const TraceWriter&) = delete;
+  TraceWriter& operator=(const TraceWriter&) = delete;
+
+  // Create "path", records past "max_bytes" of file are dropped.
+  int open(const std::string& path, std::size_t max_bytes);
+  // Cut the file to what was written and unmap it.
+  void close();
+
+  void record(TraceType type, uint64_t conn, const void* data,
+              std::size_t len);
+  // Once half of the file is used, ask the thread to grow it, and return
+  // without waiting. The dispatcher calls it from its lag probe.
+  void reserve();
+
+  // Bytes of the file used, allocated, and records dropped.
+  std::size_t size() const { return used_; }
+  std::size_t capacity() const { return allocated_.load(); }
+  uint64_t dropped() const { return dropped_; }
+
+ private:
+  // Allocate the file up to "size".
+  int allocate(std::size_t size);
+  void run();
+
+  int fd_ = -1;
+  char* map_ = nullptr;
+  std::size_t mapped_ = 0;
+  // records fit up to it, raised by the thread.
+  std::atomic<std::size_t> allocated_{0};
+  std::size_t used_ = 0;
+  std::size_t max_bytes_ = 0;
+  int64_t start_ns_ = 0;
+  uint64_t dropped_ = 0;
+  bool grow_ = false;
+  bool stop_ = false;
+  std::mutex mu_;
+  std::condition_variable cond_;
+  std::thread thread_;
+};
+
+// Reads a trace file through a read only mapping.
+class TraceReader {
+ public:
+  TraceReader() = default;
+  ~TraceReader();
+  TraceReader(const TraceReader&) = delete;
+  TraceReader& operator=(const TraceReader&) = delete;
+
+  // Return -1 if "path" cannot be mapped or is not a trace file.
+  int open(const std::string& path);
+
+  // The next record and its data, false at the end. "data" points into the
+  // mapping, valid while the reader lives.
+  bool next(TraceRecord* rec, const char** data);
+
+  const TraceFileHeader& header() const {
+    return *(const TraceFileHeader*)map_;
+  }
+
+ private:
+  const char* map_ = nullptr;
+  std::size_t size_ = 0;
+  std::size_t pos_ = 0;
+};
+
+}  // namespace tl
@@ -0,0 +1,296 @@
+#include "udp_endpoint.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/udp.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "spdlog/spdlog.h"
+
+namespace tl {
+
+namespace {
+
+// datagrams received per callback, the rest waits for the next iteration.
+const int kMaxDatagrams = 1024;
+// what one GSO send may carry.
+const std::size_t kMaxSegments = 64;
+const std::size_t kMaxGsoBytes = 65000;
+// a GRO buffer holds up to a full IP packet.
+const std::size_t kGroSlot = 65535;
+// control buffer of a message, for one int or uint16_t.
+const std::size_t kCtrlWords = (CMSG_SPACE(sizeof(int)) + 7) / 8;
+
+bool samePeer(const sockaddr_in& a, const sockaddr_in& b) {
+  return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+}  // namespace
+
+extern "C" void udp_event_cb(evutil_socket_t fd, short, void* ptr) {
+  UdpEndpoint* ep = (UdpEndpoint*)ptr;
+  LoopProfiler::Scope prof(ep->dispatcher()->profiler(), LoopProfiler::kUdp,
+                           fd);
+  ep->handleRead();
+}
+
+UdpEndpoint::UdpEndpoint(const std::string& addr, int port,
+                         const Options& opts)
+    : addr_(addr), port_(port), opts_(opts) {
+  if (opts_.batch < 1) {
+    opts_.batch = 1;
+  }
+}
+
+UdpEndpoint::~UdpEndpoint() {
+  if (disp_) {
+    event_del(&ev_);
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+int UdpEndpoint::open(Dispatcher* disp, Handle handle) {
+  struct sockaddr_in sa;
+  socklen_t slen = sizeof(sa);
+  int one = 1;
+  handle_ = handle;
+
+  fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd_ < 0) {
+    SPDLOG_ERROR("socket() failed, errno={}, {}", errno, strerror(errno));
+    return -1;
+  }
+  if (setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+      setsockopt(fd_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+    SPDLOG_ERROR("setsockopt, errno={}, {}", errno, strerror(errno));
+    return -1;
+  }
+  if (evutil_make_socket_nonblocking(fd_) < 0) {
+    SPDLOG_ERROR("evutil_make_socket_nonblocking errno={}, {}", errno,
+                 strerror(errno));
+    return -1;
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = inet_addr(addr_.c_str());
+  sa.sin_port = htons((unsigned short)port_);
+  if (bind(fd_, (struct sockaddr*)&sa, slen) < 0) {
+    SPDLOG_ERROR("bind() errno={}, {}", errno, strerror(errno));
+    return -1;
+  }
+  if (getsockname(fd_, (struct sockaddr*)&sa, &slen) == 0) {
+    port_ = ntohs(sa.sin_port);
+  }
+
+  if (opts_.gro &&
+      setsockopt(fd_, SOL_UDP, UDP_GRO, &one, sizeof(one)) < 0) {
+    SPDLOG_WARN("UDP_GRO not supported, errno={}, {}", errno,
+                strerror(errno));
+    opts_.gro = false;
+  }
+  int seg = 0;
+  socklen_t seglen = sizeof(seg);
+  if (opts_.gso &&
+      getsockopt(fd_, SOL_UDP, UDP_SEGMENT, &seg, &seglen) < 0) {
+    SPDLOG_WARN("UDP_SEGMENT not supported, errno={}, {}", errno,
+                strerror(errno));
+    opts_.gso = false;
+  }
+
+  std::size_t batch = opts_.batch;
+  slot_size_ = opts_.gro ? kGroSlot : opts_.max_datagram;
+  pool_.resize(batch * slot_size_);
+  rmsgs_.resize(batch);
+  riovs_.resize(batch);
+  rpeers_.resize(batch);
+  rctrl_.resize(batch * kCtrlWords);
+  for (std::size_t i = 0; i < batch; i++) {
+    riovs_[i] = iovec{pool_.data() + i * slot_size_, slot_size_};
+    msghdr& h = rmsgs_[i].msg_hdr;
+    memset(&h, 0, sizeof(h));
+    h.msg_name = &rpeers_[i];
+    h.msg_iov = &riovs_[i];
+    h.msg_iovlen = 1;
+    h.msg_control = rctrl_.data() + i * kCtrlWords;
+  }
+  smsgs_.reserve(batch);
+  sctrl_.resize(batch * kCtrlWords);
+
+  SPDLOG_INFO("udp {}:{}", addr_, port_);
+  disp_ = disp;
+  event_assign(&ev_, disp->ev_base(), fd_, EV_READ | EV_PERSIST, udp_event_cb,
+               this);
+  event_add(&ev_, nullptr);
+  return 0;
+}
+
+void UdpEndpoint::send(const void* data, std::size_t len,
+                       const sockaddr_in& peer) {
+  std::size_t offset = out_.size();
+  out_.insert(out_.end(), (const unsigned char*)data,
+              (const unsigned char*)data + len);
+  pending_.push_back(Pending{offset, len, peer});
+}
+
+void UdpEndpoint::handleRead() {
+  DispatcherMetrics& m = disp_->metrics();
+  int batch = opts_.batch;
+  for (int budget = kMaxDatagrams; budget > 0;) {
+    for (int i = 0; i < batch; i++) {
+      // recvmmsg() overwrites them.
+      msghdr& h = rmsgs_[i].msg_hdr;
+      h.msg_namelen = sizeof(sockaddr_in);
+      h.msg_controllen = opts_.gro ? kCtrlWords * 8 : 0;
+      h.msg_flags = 0;
+    }
+    int n = recvmmsg(fd_, rmsgs_.data(), batch, MSG_DONTWAIT, nullptr);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        TL_ERROR_RL(errno, "fd={}, recvmmsg errno={} {}", fd_, errno,
+                    strerror(errno));
+      }
+      break;
+    }
+    budget -= n;
+
+    dgrams_.clear();
+    for (int i = 0; i < n; i++) {
+      msghdr& h = rmsgs_[i].msg_hdr;
+      std::size_t len = rmsgs_[i].msg_len;
+      m.bytes_read.add(len);
+      if (h.msg_flags & MSG_TRUNC) {
+        m.datagrams_dropped.add();
+        continue;
+      }
+      // a GRO buffer is datagrams of "seg" bytes, the last maybe shorter.
+      std::size_t seg = len;
+      for (cmsghdr* c = CMSG_FIRSTHDR(&h); c; c = CMSG_NXTHDR(&h, c)) {
+        if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO) {
+          int s;
+          memcpy(&s, CMSG_DATA(c), sizeof(s));
+          seg = s;
+        }
+      }
+      if (seg == 0) {
+        seg = 1;
+      }
+      const unsigned char* p = pool_.data() + i * slot_size_;
+      std::size_t off = 0;
+      do {
+        std::size_t l = len - off < seg ? len - off : seg;
+        if (l > opts_.max_datagram) {
+          m.datagrams_dropped.add();
+        } else {
+          dgrams_.push_back(Datagram{p + off, l, &rpeers_[i]});
+        }
+        off += seg;
+      } while (off < len);
+    }
+    m.datagrams_read.add(dgrams_.size());
+    if (!dgrams_.empty()) {
+      handle_(this, dgrams_.data(), (int)dgrams_.size());
+    }
+    flush();
+    if (n < batch) {
+      break;
+    }
+  }
+}
+
+std::size_t UdpEndpoint::packSend(std::size_t i) {
+  const Pending& first = pending_[i];
+  std::size_t k = smsgs_.size();
+  smsgs_.emplace_back();
+  msghdr& h = smsgs_.back().msg_hdr;
+  memset(&h, 0, sizeof(h));
+  h.msg_name = (void*)&first.peer;
+  h.msg_namelen = sizeof(first.peer);
+  h.msg_iov = siovs_.data() + siovs_.size();
+
+  std::size_t j = i;
+  std::size_t bytes = 0;
+  // segments all have the size of the first, but the last may be shorter.
+  do {
+    const Pending& p = pending_[j];
+    siovs_.push_back(iovec{out_.data() + p.offset, p.len});
+    bytes += p.len;
+    j++;
+  } while (opts_.gso && first.len > 0 && j < pending_.size() &&
+           j - i < kMaxSegments && pending_[j - 1].len == first.len &&
+           pending_[j].len <= first.len &&
+           bytes + pending_[j].len <= kMaxGsoBytes &&
+           samePeer(pending_[j].peer, first.peer));
+  h.msg_iovlen = j - i;
+
+  if (j - i > 1) {
+    h.msg_control = sctrl_.data() + k * kCtrlWords;
+    h.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+    cmsghdr* c = CMSG_FIRSTHDR(&h);
+    c->cmsg_level = SOL_UDP;
+    c->cmsg_type = UDP_SEGMENT;
+    c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t size = (uint16_t)first.len;
+    memcpy(CMSG_DATA(c), &size, sizeof(size));
+  }
+  return j;
+}
+
+void UdpEndpoint::flush() {
+  DispatcherMetrics& m = disp_->metrics();
+  // packSend() points into siovs_, it must not grow while a batch is sent.
+  siovs_.reserve(pending_.size());
+  std::size_t i = 0;
+  while (i < pending_.size()) {
+    smsgs_.clear();
+    siovs_.clear();
+    sfirst_.clear();
+    while (i < pending_.size() && smsgs_.size() < (std::size_t)opts_.batch) {
+      sfirst_.push_back(i);
+      i = packSend(i);
+    }
+    sfirst_.push_back(i);
+
+    std::size_t done = 0;
+    while (done < smsgs_.size()) {
+      int r = sendmmsg(fd_, &smsgs_[done], smsgs_.size() - done, MSG_DONTWAIT);
+      if (r > 0) {
+        for (std::size_t k = done; k < done + r; k++) {
+          m.datagrams_written.add(sfirst_[k + 1] - sfirst_[k]);
+          m.bytes_written.add(smsgs_[k].msg_len);
+        }
+        done += r;
+        continue;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // the socket buffer is full, drop the rest like the network would.
+        m.datagrams_dropped.add(pending_.size() - sfirst_[done]);
+        i = pending_.size();
+        break;
+      }
+      if (opts_.gso && smsgs_[done].msg_hdr.msg_controllen) {
+        // the device can not segment, send them one by one from here.
+        SPDLOG_WARN("fd={}, UDP GSO send failed, errno={} {}, turned off",
+                    fd_, errno, strerror(errno));
+        opts_.gso = false;
+        i = sfirst_[done];
+        break;
+      }
+      TL_ERROR_RL(errno, "fd={}, sendmmsg errno={} {}", fd_, errno,
+                  strerror(errno));
+      m.datagrams_dropped.add(sfirst_[done + 1] - sfirst_[done]);
+      done++;
+    }
+  }
+  pending_.clear();
+  out_.clear();
+}
+
+}  // namespace tl
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "dispatcher.h"
+#include "event2/event.h"
+#include "event2/event_struct.h"
+#include "event2/util.h"
+
+namespace tl {
+
+// A datagram received, valid until the batch handler returns.
+struct Datagram {
+  const unsigned char* data;
+  std::size_t len;
+  const sockaddr_in* peer;
+};
+
+// A UDP socket served by one dispatcher. It is bound with SO_REUSEPORT, so
+// each dispatcher can open one on the same port and the kernel spreads peers
+// over them.
+//
+// A readable socket is drained with recvmmsg(), "batch" datagrams a call into
+// buffers allocated once, and the datagrams of each call are handed to the
+// handler together. Replies it queues with send() go out with sendmmsg() when
+// it returns. With "gro" the kernel may coalesce datagrams of one peer into
+// one buffer, split again for the handler; with "gso" runs of replies to one
+// peer go out as one UDP_SEGMENT send. Both are turned off where the kernel
+// does not support them.
+class UdpEndpoint {
+ public:
+  struct Options {
+    // datagrams per system call, 1 for a call per datagram.
+    int batch = 64;
+    // longer datagrams are dropped.
+    std::size_t max_datagram = 2048;
+    bool gro = false;
+    bool gso = false;
+  };
+  using Handle =
+      std::function<void(UdpEndpoint* ep, const Datagram* dgrams, int n)>;
+
+  UdpEndpoint(const std::string& addr, int port, const Options& opts);
+  ~UdpEndpoint();
+  UdpEndpoint(const UdpEndpoint&) = delete;
+  UdpEndpoint& operator=(const UdpEndpoint&) = delete;
+
+  int open(Dispatcher* disp, Handle handle);
+
+  // Queue a copy of "data" to "peer". Sent when the handler returns, call
+  // flush() to send it from anywhere else in the loop.
+  void send(const void* data, std::size_t len, const sockaddr_in& peer);
+  // Send the queue. What the socket does not take now is dropped.
+  void flush();
+
+  // Receive and handle what is ready, up to a budget.
+  void handleRead();
+
+  Dispatcher* dispatcher() { return disp_; }
+  int fd() const { return fd_; }
+  // The bound port, the one chosen when opened with port 0.
+  int port() const { return port_; }
+  bool gro() const { return opts_.gro; }
+  bool gso() const { return opts_.gso; }
+
+ private:
+  struct Pending {
+    std::size_t offset;
+    std::size_t len;
+    sockaddr_in peer;
+  };
+
+  // Append a message for pending_[i] to the send arrays, with the replies
+  // after it that can go as its GSO segments. Return the index after them.
+  std::size_t packSend(std::size_t i);
+
+  std::string addr_;
+  int port_;
+  Options opts_;
+  int fd_ = -1;
+  struct event ev_;
+  Dispatcher* disp_ = nullptr;
+  Handle handle_;
+
+  // receive side, "batch" slots each.
+  std::size_t slot_size_;
+  std::vector<unsigned char> pool_;
+  std::vector<mmsghdr> rmsgs_;
+  std::vector<iovec> riovs_;
+  std::vector<sockaddr_in> rpeers_;
+  std::vector<uint64_t> rctrl_;
+  std::vector<Datagram> dgrams_;
+
+  // send side.
+  std::vector<unsigned char> out_;
+  std::vector<Pending> pending_;
+  std::vector<mmsghdr> smsgs_;
+  std::vector<iovec> siovs_;
+  std::vector<uint64_t> sctrl_;
+  // first pending_ index of each smsgs_ entry.
+  std::vector<std::size_t> sfirst_;
+};
+
+}  // namespace tl
@@ -0,0 +1,335 @@
+#include "upstream_pool.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "spdlog/spdlog.h"
+
+namespace tl {
+
+static const std::size_t kMaxIov = 64;
+
+extern "C" void upstream_event_cb(evutil_socket_t, short what, void* ptr) {
+  auto c = (UpstreamConn*)ptr;
+  if (c->handleEvent(what) < 0) {
+    int err = errno;
+    SPDLOG_DEBUG("upstream fd={}, errno={} {}", c->fd_, err, strerror(err));
+    c->pool_->close(c, err);
+  }
+}
+
+extern "C" void upstream_timer_cb(evutil_socket_t, short, void* ptr) {
+  ((UpstreamPool*)ptr)->handleTimer();
+}
+
+UpstreamConn::UpstreamConn(UpstreamPool* pool, int fd)
+    : pool_(pool), fd_(fd) {
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+  event_assign(&ev_, pool->dispatcher()->ev_base(), fd, 0, upstream_event_cb,
+               this);
+  arm();
+}
+
+UpstreamConn::~UpstreamConn() {
+  event_del(&ev_);
+  ::close(fd_);
+}
+
+void UpstreamConn::arm() {
+  short what = EV_READ | (out_.size() ? EV_WRITE : 0);
+  event_del(&ev_);
+  event_assign(&ev_, pool_->dispatcher()->ev_base(), fd_, what,
+               upstream_event_cb, this);
+  if (inflight_.empty()) {
+    event_add(&ev_, nullptr);  // idle keepalive connection
+    return;
+  }
+  int64_t wait = inflight_.front().deadline_us - pool_->nowUs();
+  if (wait < 0) {
+    wait = 0;
+  }
+  struct timeval tv;
+  tv.tv_sec = wait / 1000000;
+  tv.tv_usec = wait % 1000000;
+  event_add(&ev_, &tv);
+}
+
+int UpstreamConn::handleEvent(short what) {
+  if (what & EV_TIMEOUT) {
+    // responses come in order, the ones after it are lost with it.
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  if ((what & EV_READ) && handleRead() < 0) {
+    return -1;
+  }
+  if (out_.size() && handleWrite() < 0) {
+    return -1;
+  }
+  arm();
+  return 0;
+}
+
+int UpstreamConn::handleRead() {
+  for (;;) {
+    void* buf;
+    std::size_t len;
+    in_.spaceChunk(buf, len);
+    ssize_t n = recv(fd_, buf, len, 0);
+    if (n == 0) {
+      errno = ECONNRESET;
+      return -1;
+    }
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        break;
+      }
+      return -1;
+    }
+    in_.spaceHaveSeted(n);
+    if (n < (ssize_t)len) {
+      break;
+    }
+  }
+
+  Frame f;
+  for (;;) {
+    int r = pool_->decode_(in_, codec_state_, f);
+    if (r == kDecodeMore) {
+      break;
+    }
+    if (r == kDecodeError || inflight_.empty()) {
+      errno = EPROTO;
+      return -1;
+    }
+    UpstreamCallback cb = std::move(inflight_.front().cb);
+    inflight_.pop_front();
+    cb(0, f, BufferView(&in_, f.header_len, f.payload_len));
+    in_.drain(f.size());
+  }
+  // room for queued requests now.
+  pool_->drainQueue();
+  return 0;
+}
+
+int UpstreamConn::handleWrite() {
+  struct iovec iov[kMaxIov];
+  while (out_.size()) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = out_.peek(iov, kMaxIov);
+    ssize_t n = sendmsg(fd_, &msg, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        break;
+      }
+      return -1;
+    }
+    out_.drain(n);
+  }
+  return 0;
+}
+
+UpstreamPool::UpstreamPool(Dispatcher* disp, const std::string& addr,
+                           int port, Decode decode,
+                           const UpstreamOptions& opts)
+    : disp_(disp),
+      connector_(disp),
+      addr_(addr),
+      port_(port),
+      decode_(decode),
+      opts_(opts) {
+  evtimer_assign(&timer_, disp->ev_base(), upstream_timer_cb, this);
+}
+
+UpstreamPool::~UpstreamPool() {
+  event_del(&timer_);
+  for (UpstreamConn* c : conns_) {
+    slab_.destroy(c);
+  }
+}
+
+void UpstreamPool::start() {
+  handleTimer();
+}
+
+int64_t UpstreamPool::nowUs() {
+  struct timeval tv;
+  event_base_gettimeofday_cached(disp_->ev_base(), &tv);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+void UpstreamPool::request(const void* data, std::size_t len,
+                           UpstreamCallback cb) {
+  UpstreamConn* c = queued_.empty() ? pick() : nullptr;
+  if (c != nullptr) {
+    c->out_.push(data, len);
+    submit(c, std::move(cb), nowUs() + opts_.request_timeout_ms * 1000LL);
+    return;
+  }
+  enqueue(std::string((const char*)data, len), std::move(cb));
+}
+
+UpstreamConn* UpstreamPool::pick() {
+  UpstreamConn* best = nullptr;
+  for (UpstreamConn* c : conns_) {
+    if (c->inflight() < opts_.max_pipeline &&
+        (best == nullptr || c->inflight() < best->inflight())) {
+      best = c;
+    }
+  }
+  // every connection is busy, open one more for the requests to come.
+  if ((best == nullptr || best->inflight() > 0) && connecting_ == 0 &&
+      conns_.size() < opts_.max_connections && nowUs() >= retry_at_us_) {
+    connect();
+  }
+  return best;
+}
+
+void UpstreamPool::submit(UpstreamConn* c, UpstreamCallback cb,
+                          int64_t deadline_us) {
+  c->inflight_.push_back(UpstreamConn::Inflight{std::move(cb), deadline_us});
+  // written when the socket polls writable, so the requests made in one
+  // loop iteration go out with one sendmsg().
+  if (c->inflight_.size() == 1 ||
+      !event_pending(&c->ev_, EV_WRITE, nullptr)) {
+    c->arm();
+  }
+}
+
+void UpstreamPool::enqueue(std::string data, UpstreamCallback cb) {
+  queued_.push_back(Queued{std::move(data), std::move(cb),
+                           nowUs() + opts_.request_timeout_ms * 1000LL});
+  pick();
+  armTimer();
+}
+
+void UpstreamPool::drainQueue() {
+  while (!queued_.empty()) {
+    UpstreamConn* c = pick();
+    if (c == nullptr) {
+      break;
+    }
+    Queued q = std::move(queued_.front());
+    queued_.pop_front();
+    c->out_.push(q.data.data(), q.data.size());
+    submit(c, std::move(q.cb), q.deadline_us);
+  }
+  armTimer();
+}
+
+void UpstreamPool::connect() {
+  connecting_++;
+  int r = connector_.connect(
+      addr_, port_, [this](int fd) { onConnect(fd); },
+      opts_.connect_timeout_ms);
+  if (r < 0) {
+    // fail queued requests from the timer, not inside request().
+    connecting_--;
+    connect_error_ = errno;
+    retry_at_us_ = nowUs() + opts_.retry_ms * 1000LL;
+    struct timeval tv = {0, 0};
+    evtimer_add(&timer_, &tv);
+  }
+}
+
+void UpstreamPool::onConnect(int fd) {
+  connecting_--;
+  if (fd < 0) {
+    // logging may change errno.
+    int err = errno;
+    TL_ERROR_RL(err, "connect upstream {}:{} errno={} {}", addr_, port_, err,
+                strerror(err));
+    connect_error_ = err;
+    retry_at_us_ = nowUs() + opts_.retry_ms * 1000LL;
+    handleTimer();
+    return;
+  }
+  connect_error_ = 0;
+  conns_.push_back(slab_.create(this, fd));
+  drainQueue();
+}
+
+void UpstreamPool::close(UpstreamConn* c, int err) {
+  for (std::size_t i = 0; i < conns_.size(); i++) {
+    if (conns_[i] == c) {
+      conns_[i] = conns_.back();
+      conns_.pop_back();
+      break;
+    }
+  }
+  std::deque<UpstreamConn::Inflight> failed;
+  failed.swap(c->inflight_);
+  slab_.destroy(c);
+  if (err != ECONNRESET || !failed.empty()) {
+    retry_at_us_ = nowUs() + opts_.retry_ms * 1000LL;
+  }
+
+  Frame f;
+  for (auto& r : failed) {
+    r.cb(err, f, BufferView(nullptr, 0, 0));
+  }
+  handleTimer();
+}
+
+void UpstreamPool::handleTimer() {
+  int64_t now = nowUs();
+  if (now >= retry_at_us_) {
+    std::size_t want = opts_.warm_connections;
+    if (want == 0 && !queued_.empty()) {
+      want = 1;
+    }
+    while (conns_.size() + connecting_ < want) {
+      std::size_t before = connecting_;
+      connect();
+      if (connecting_ == before) {
+        break;  // could not start
+      }
+    }
+  }
+
+  Frame f;
+  // nothing will take them, give up now rather than at the deadline.
+  bool fail_all = conns_.empty() && connecting_ == 0 && connect_error_ != 0;
+  while (!queued_.empty() &&
+         (fail_all || queued_.front().deadline_us <= now)) {
+    Queued q = std::move(queued_.front());
+    queued_.pop_front();
+    q.cb(fail_all ? connect_error_ : ETIMEDOUT, f, BufferView(nullptr, 0, 0));
+  }
+  armTimer();
+}
+
+void UpstreamPool::armTimer() {
+  int64_t at = INT64_MAX;
+  if (!queued_.empty()) {
+    at = queued_.front().deadline_us;
+  }
+  if (conns_.size() + connecting_ < opts_.warm_connections &&
+      retry_at_us_ < at) {
+    at = retry_at_us_;
+  }
+  if (at == INT64_MAX) {
+    event_del(&timer_);
+    return;
+  }
+  int64_t wait = at - nowUs();
+  if (wait < 0) {
+    wait = 0;
+  }
+  struct timeval tv;
+  tv.tv_sec = wait / 1000000;
+  tv.tv_usec = wait % 1000000;
+  evtimer_add(&timer_, &tv);
+}
+
+}  // namespace tl
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "buffer.h"
+#include "codec.h"
+#include "connector.h"
+#include "dispatcher.h"
+#include "event2/event.h"
+#include "event2/event_struct.h"
+#include "event2/util.h"
+#include "slab.h"
+
+namespace tl {
+
+class UpstreamPool;
+
+extern "C" void upstream_event_cb(evutil_socket_t fd, short what, void* ptr);
+extern "C" void upstream_timer_cb(evutil_socket_t fd, short what, void* ptr);
+
+// Called once per request inside the dispatch loop, with err 0 and the
+// response frame, or with an errno value (ETIMEDOUT, ECONNRESET, ...) and an
+// empty payload. "payload" is valid only during the call.
+using UpstreamCallback =
+    std::function<void(int err, const Frame& f, const BufferView& payload)>;
+
+struct UpstreamOptions {
+  // connections open at most, and kept open while idle.
+  std::size_t max_connections = 4;
+  std::size_t warm_connections = 1;
+  // requests in flight on one connection.
+  std::size_t max_pipeline = 32;
+  int connect_timeout_ms = 1000;
+  // from request() to the response, including time queued for a connection.
+  int request_timeout_ms = 5000;
+  // delay before reconnecting after a connection failed.
+  int retry_ms = 1000;
+};
+
+// One keepalive connection of a pool. Requests are written back to back and
+// responses are matched to them in order.
+class UpstreamConn {
+ public:
+  UpstreamConn(UpstreamPool* pool, int fd);
+  ~UpstreamConn();
+
+  int handleEvent(short what);
+  std::size_t inflight() const { return inflight_.size(); }
+
+ private:
+  friend class UpstreamPool;
+  friend void upstream_event_cb(evutil_socket_t, short, void*);
+
+  struct Inflight {
+    UpstreamCallback cb;
+    int64_t deadline_us;
+  };
+
+  int handleRead();
+  int handleWrite();
+  // Wait for responses and for the socket to take queued requests, until the
+  // oldest request times out.
+  void arm();
+
+  UpstreamPool* pool_;
+  int fd_;
+  struct event ev_;
+  buffer in_;
+  buffer out_;
+  CodecState codec_state_;
+  std::deque<Inflight> inflight_;
+};
+
+// Persistent, pipelined connections from one dispatcher to a request/response
+// server at "addr:port". Responses are split with "decode", one of the
+// Codec::decode functions in codec.h, e.g. &LengthPrefixCodec<>::decode.
+//
+// Everything runs in the dispatcher's loop and nothing is locked: give each
+// dispatcher its own pool, only use it inside that loop, and destroy it after
+// the loop exits.
+class UpstreamPool {
+ public:
+  using Decode = int (*)(buffer& in, CodecState& st, Frame& f);
+
+  UpstreamPool(Dispatcher* disp, const std::string& addr, int port,
+               Decode decode, const UpstreamOptions& opts = UpstreamOptions());
+  ~UpstreamPool();
+  UpstreamPool(const UpstreamPool&) = delete;
+  UpstreamPool& operator=(const UpstreamPool&) = delete;
+
+  // Open the warm connections.
+  void start();
+
+  // Send a request already framed for the server. "cb" is always called
+  // later, never from inside request(). If every connection has
+  // max_pipeline requests in flight, the request waits for one.
+  void request(const void* data, std::size_t len, UpstreamCallback cb);
+  // Frame "payload" with "Codec" and send it.
+  template <class Codec>
+  void request(const void* payload, std::size_t len, UpstreamCallback cb,
+               uint8_t type = 0, uint8_t flags = 0);
+
+  // Open connections, connects in progress, and requests waiting for a
+  // connection.
+  std::size_t connections() const { return conns_.size(); }
+  std::size_t connecting() const { return connecting_; }
+  std::size_t queued() const { return queued_.size(); }
+
+  Dispatcher* dispatcher() { return disp_; }
+
+ private:
+  friend class UpstreamConn;
+  friend void upstream_event_cb(evutil_socket_t, short, void*);
+  friend void upstream_timer_cb(evutil_socket_t, short, void*);
+
+  struct Queued {
+    std::string data;
+    UpstreamCallback cb;
+    int64_t deadline_us;
+  };
+
+  int64_t nowUs();
+  // Connection with the fewest requests in flight and room for one more, or
+  // nullptr. May start a new connection for the load to come.
+  UpstreamConn* pick();
+  void submit(UpstreamConn* c, UpstreamCallback cb, int64_t deadline_us);
+  void enqueue(std::string data, UpstreamCallback cb);
+  // Move queued requests to connections with room.
+  void drainQueue();
+  void connect();
+  void onConnect(int fd);
+  // Close "c" and fail its requests with "err".
+  void close(UpstreamConn* c, int err);
+  // Expire queued requests and reopen warm connections.
+  void handleTimer();
+  void armTimer();
+
+  Dispatcher* disp_;
+  Connector connector_;
+  std::string addr_;
+  int port_;
+  Decode decode_;
+  UpstreamOptions opts_;
+  std::vector<UpstreamConn*> conns_;
+  std::size_t connecting_ = 0;
+  std::deque<Queued> queued_;
+  // no reconnect before it, after a failure.
+  int64_t retry_at_us_ = 0;
+  // errno of the last failed connect, 0 once one succeeds.
+  int connect_error_ = 0;
+  struct event timer_;
+  // encode() target when no connection has room.
+  buffer scratch_;
+  Slab<UpstreamConn> slab_;
+};
+
+template <class Codec>
+void UpstreamPool::request(const void* payload, std::size_t len,
+                           UpstreamCallback cb, uint8_t type, uint8_t flags) {
+  UpstreamConn* c = queued_.empty() ? pick() : nullptr;
+  if (c != nullptr) {
+    encode<Codec>(c->out_, payload, len, type, flags);
+    submit(c, std::move(cb), nowUs() + opts_.request_timeout_ms * 1000LL);
+    return;
+  }
+  encode<Codec>(scratch_, payload, len, type, flags);
+  std::string data;
+  data.reserve(scratch_.size());
+  scratch_.forEachSegment(0, scratch_.size(),
+                          [&data](const unsigned char* p, std::size_t n) {
+                            data.append((const char*)p, n);
+                          });
+  scratch_.drain(scratch_.size());
+  enqueue(std::move(data), std::move(cb));
+}
+
+}  // namespace tl